@@ -0,0 +1,590 @@
+#include "apu.h"
+#include <string.h>
+#include <stddef.h>
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define APU_IDLE UINT64_MAX
+
+static const uchar apu_length_table[32] = {
+    10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14,
+    12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
+};
+
+static const uchar apu_duty_table[4][8] = {
+    { 0, 1, 0, 0, 0, 0, 0, 0 },
+    { 0, 1, 1, 0, 0, 0, 0, 0 },
+    { 0, 1, 1, 1, 1, 0, 0, 0 },
+    { 1, 0, 0, 1, 1, 1, 1, 1 }
+};
+
+static const uchar apu_triangle_table[32] = {
+    15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+};
+
+static const ushort apu_noise_periods[16] = {
+    4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068
+};
+
+static const ushort apu_dmc_periods[16] = {
+    428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54
+};
+
+// Frame counter steps, in CPU cycles from the start of the sequence.
+static const ushort apu_frame_steps[2][5] = {
+    { 7457, 14913, 22371, 29829, 0 },
+    { 7457, 14913, 22371, 29829, 37281 }
+};
+static const ushort apu_frame_period[2] = { 29830, 37282 };
+
+static float apu_pulse_mix[31];
+static float apu_tnd_mix[203];
+static float apu_blip_kernel[APU_BLIP_PHASES][APU_BLIP_TAPS];
+static pthread_once_t apu_tables_once = PTHREAD_ONCE_INIT;
+
+// The mixer lookup tables from the nonlinear DAC formulas, and the
+// Blackman-windowed sinc impulse of a band-limited step at each phase,
+// normalized so every step settles at exactly its delta.
+static void apu_build_tables(void)
+{
+    for (int i = 1; i < 31; i++) apu_pulse_mix[i] = (float)(95.52 / (8128.0 / i + 100.0));
+    for (int i = 1; i < 203; i++) apu_tnd_mix[i] = (float)(163.67 / (24329.0 / i + 100.0));
+
+    const double cutoff = 0.9;
+    for (int phase = 0; phase < APU_BLIP_PHASES; phase++) {
+	double sum = 0.0;
+	double taps[APU_BLIP_TAPS];
+	for (int k = 0; k < APU_BLIP_TAPS; k++) {
+	    double x = k - APU_BLIP_TAPS / 2 + 1 - (double)phase / APU_BLIP_PHASES;
+	    double sinc = x == 0.0 ? 1.0 : sin(M_PI * cutoff * x) / (M_PI * cutoff * x);
+	    double w = (x + APU_BLIP_TAPS / 2) / APU_BLIP_TAPS;
+	    double window = 0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w);
+	    taps[k] = sinc * window;
+	    sum = sum + taps[k];
+	}
+	for (int k = 0; k < APU_BLIP_TAPS; k++) apu_blip_kernel[phase][k] = (float)(taps[k] / sum);
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+/* Band-limited output                                                    */
+/* ---------------------------------------------------------------------- */
+
+static void apu_blip_add(APU* apu, uint64_t cycle, float delta)
+{
+    APU_BLIP* blip = &apu->blip;
+    uint64_t fixed = (cycle - blip->start) * blip->factor + blip->offset;
+    float* out = &blip->buffer[fixed >> 32];
+    const float* kernel = apu_blip_kernel[(fixed >> (32 - 5)) & (APU_BLIP_PHASES - 1)];
+    for (int k = 0; k < APU_BLIP_TAPS; k++) out[k] = out[k] + delta * kernel[k];
+}
+
+// Integrates the finished samples, removes the DC offset of the mixer like
+// the console's output stage does, and hands them to the sink.
+static void apu_blip_flush(APU* apu, uint64_t cycle)
+{
+    APU_BLIP* blip = &apu->blip;
+    blip->offset = blip->offset + (cycle - blip->start) * blip->factor;
+    blip->start = cycle;
+    size_t count = (size_t)(blip->offset >> 32);
+    if (count == 0) return;
+
+    int16_t samples[APU_BLIP_SIZE];
+    float integrator = blip->integrator;
+    float high_pass = blip->high_pass;
+    float last_input = blip->last_input;
+    for (size_t i = 0; i < count; i++) {
+	integrator = integrator + blip->buffer[i];
+	high_pass = integrator - last_input + 0.996f * high_pass;
+	last_input = integrator;
+	float value = high_pass * 32767.0f;
+	if (value > 32767.0f) value = 32767.0f;
+	if (value < -32768.0f) value = -32768.0f;
+	samples[i] = (int16_t)value;
+    }
+    // Silence decays the filter towards denormals, which are very slow to
+    // compute with; far below one 16 bit step it is zero anyway.
+    if (fabsf(high_pass) < 1e-9f) high_pass = 0.0f;
+    blip->integrator = integrator;
+    blip->high_pass = high_pass;
+    blip->last_input = last_input;
+    if (apu->sink != NULL) audio_sink_push(apu->sink, samples, count);
+    apu->samples = apu->samples + count;
+
+    // Deltas only ever land below count + APU_BLIP_TAPS.
+    memmove(blip->buffer, blip->buffer + count, APU_BLIP_TAPS * sizeof(float));
+    memset(blip->buffer + APU_BLIP_TAPS, 0, count * sizeof(float));
+    blip->offset = blip->offset - ((uint64_t)count << 32);
+}
+
+/* ---------------------------------------------------------------------- */
+/* Channels                                                               */
+/* ---------------------------------------------------------------------- */
+
+static uchar apu_envelope_volume(const APU_ENVELOPE* envelope)
+{
+    return envelope->constant ? envelope->period : envelope->decay;
+}
+
+static void apu_envelope_clock(APU_ENVELOPE* envelope)
+{
+    if (envelope->start) {
+	envelope->start = false;
+	envelope->decay = 15;
+	envelope->divider = envelope->period;
+	return;
+    }
+    if (envelope->divider > 0) {
+	envelope->divider = envelope->divider - 1;
+	return;
+    }
+    envelope->divider = envelope->period;
+    if (envelope->decay > 0) {
+	envelope->decay = envelope->decay - 1;
+    } else if (envelope->loop) {
+	envelope->decay = 15;
+    }
+}
+
+static int apu_sweep_target(const APU_PULSE* pulse)
+{
+    int change = pulse->timer >> pulse->sweep_shift;
+    if (!pulse->sweep_negate) return pulse->timer + change;
+    return pulse->timer - change - (pulse->ones_complement ? 1 : 0);
+}
+
+static bool apu_pulse_active(const APU_PULSE* pulse)
+{
+    return pulse->length > 0 && pulse->timer >= 8 && apu_sweep_target(pulse) <= 0x7FF;
+}
+
+static uchar apu_pulse_output(const APU_PULSE* pulse)
+{
+    if (!apu_pulse_active(pulse) || !apu_duty_table[pulse->duty][pulse->step]) return 0;
+    return apu_envelope_volume(&pulse->envelope);
+}
+
+static void apu_pulse_sweep(APU_PULSE* pulse)
+{
+    int target = apu_sweep_target(pulse);
+    if (pulse->sweep_divider == 0 && pulse->sweep_enabled && pulse->sweep_shift > 0
+	&& pulse->timer >= 8 && target <= 0x7FF) {
+	pulse->timer = (ushort)target;
+    }
+    if (pulse->sweep_divider == 0 || pulse->sweep_reload) {
+	pulse->sweep_divider = pulse->sweep_period;
+	pulse->sweep_reload = false;
+    } else {
+	pulse->sweep_divider = pulse->sweep_divider - 1;
+    }
+}
+
+static bool apu_triangle_active(const APU_TRIANGLE* triangle)
+{
+    // Ultrasonic periods are silenced instead of clocked 900k times a second.
+    return triangle->length > 0 && triangle->linear > 0 && triangle->timer >= 2;
+}
+
+static uchar apu_noise_output(const APU_NOISE* noise)
+{
+    if (noise->length == 0 || (noise->shift & 1)) return 0;
+    return apu_envelope_volume(&noise->envelope);
+}
+
+static void apu_dmc_restart(APU_DMC* dmc)
+{
+    dmc->addr = dmc->sample_addr;
+    dmc->remaining = dmc->sample_length;
+}
+
+// The memory reader refills the one byte sample buffer. The CPU stall of
+// the fetch is not modelled.
+static void apu_dmc_fetch(APU* apu)
+{
+    APU_DMC* dmc = &apu->dmc;
+    if (dmc->buffer_full || dmc->remaining == 0) return;
+    dmc->buffer = cpu_read_memory(apu->cpu, dmc->addr);
+    dmc->buffer_full = true;
+    dmc->addr = dmc->addr == 0xFFFF ? 0x8000 : dmc->addr + 1;
+    dmc->remaining = dmc->remaining - 1;
+    if (dmc->remaining == 0) {
+	if (dmc->loop) {
+	    apu_dmc_restart(dmc);
+	} else if (dmc->irq_enabled) {
+	    apu->dmc_irq = true;
+	}
+    }
+}
+
+static void apu_dmc_clock(APU* apu)
+{
+    APU_DMC* dmc = &apu->dmc;
+    if (!dmc->silence) {
+	if (dmc->shift & 1) {
+	    if (dmc->level <= 125) dmc->level = dmc->level + 2;
+	} else {
+	    if (dmc->level >= 2) dmc->level = dmc->level - 2;
+	}
+    }
+    dmc->shift = dmc->shift >> 1;
+    dmc->bits = dmc->bits - 1;
+    if (dmc->bits == 0) {
+	dmc->bits = 8;
+	dmc->silence = !dmc->buffer_full;
+	if (dmc->buffer_full) {
+	    dmc->shift = dmc->buffer;
+	    dmc->buffer_full = false;
+	    apu_dmc_fetch(apu);
+	}
+    }
+}
+
+static bool apu_dmc_active(const APU_DMC* dmc)
+{
+    return !dmc->silence || dmc->buffer_full || dmc->remaining > 0;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Scheduling                                                             */
+/* ---------------------------------------------------------------------- */
+
+// Channels whose output cannot change are taken off the timeline; this
+// puts back the ones a register write or frame counter step woke up.
+static void apu_arm(APU* apu)
+{
+    for (int i = 0; i < 2; i++) {
+	APU_PULSE* pulse = &apu->pulse[i];
+	if (pulse->next == APU_IDLE && apu_pulse_active(pulse)) pulse->next = apu->now + (pulse->timer + 1) * 2;
+    }
+    if (apu->triangle.next == APU_IDLE && apu_triangle_active(&apu->triangle)) {
+	apu->triangle.next = apu->now + apu->triangle.timer + 1;
+    }
+    if (apu->noise.next == APU_IDLE && apu->noise.length > 0) apu->noise.next = apu->now + apu->noise.period;
+    if (apu->dmc.next == APU_IDLE && apu_dmc_active(&apu->dmc)) apu->dmc.next = apu->now + apu->dmc.period;
+}
+
+static void apu_mix(APU* apu)
+{
+    int pulse = apu_pulse_output(&apu->pulse[0]) + apu_pulse_output(&apu->pulse[1]);
+    int tnd = 3 * apu_triangle_table[apu->triangle.step] + 2 * apu_noise_output(&apu->noise) + apu->dmc.level;
+    float output = apu_pulse_mix[pulse] + apu_tnd_mix[tnd];
+    if (output != apu->output) {
+	apu_blip_add(apu, apu->now, output - apu->output);
+	apu->output = output;
+    }
+}
+
+static void apu_quarter_frame(APU* apu)
+{
+    apu_envelope_clock(&apu->pulse[0].envelope);
+    apu_envelope_clock(&apu->pulse[1].envelope);
+    apu_envelope_clock(&apu->noise.envelope);
+    APU_TRIANGLE* triangle = &apu->triangle;
+    if (triangle->linear_reload) {
+	triangle->linear = triangle->linear_period;
+    } else if (triangle->linear > 0) {
+	triangle->linear = triangle->linear - 1;
+    }
+    if (!triangle->control) triangle->linear_reload = false;
+}
+
+static void apu_half_frame(APU* apu)
+{
+    for (int i = 0; i < 2; i++) {
+	APU_PULSE* pulse = &apu->pulse[i];
+	if (!pulse->envelope.loop && pulse->length > 0) pulse->length = pulse->length - 1;
+	apu_pulse_sweep(pulse);
+    }
+    if (!apu->triangle.control && apu->triangle.length > 0) apu->triangle.length = apu->triangle.length - 1;
+    if (!apu->noise.envelope.loop && apu->noise.length > 0) apu->noise.length = apu->noise.length - 1;
+}
+
+static void apu_frame_clock(APU* apu)
+{
+    int mode = apu->five_step ? 1 : 0;
+    int step = apu->frame_step;
+    if (step != 3 || !apu->five_step) apu_quarter_frame(apu);
+    if (step == 1 || (step == 3 && !apu->five_step) || step == 4) apu_half_frame(apu);
+    if (step == 3 && !apu->five_step && !apu->irq_inhibit) apu->frame_irq = true;
+
+    uint64_t base = apu->frame_next - apu_frame_steps[mode][step];
+    step = step + 1;
+    if (step == (apu->five_step ? 5 : 4)) {
+	step = 0;
+	base = base + apu_frame_period[mode];
+    }
+    apu->frame_step = step;
+    apu->frame_next = base + apu_frame_steps[mode][step];
+    apu_arm(apu);
+}
+
+// Jumps from event to event up to `target`: the frame counter and the
+// timers of the channels that can currently change their output.
+static void apu_run(APU* apu, uint64_t target)
+{
+    while (1) {
+	uint64_t next = apu->frame_next;
+	if (apu->pulse[0].next < next) next = apu->pulse[0].next;
+	if (apu->pulse[1].next < next) next = apu->pulse[1].next;
+	if (apu->triangle.next < next) next = apu->triangle.next;
+	if (apu->noise.next < next) next = apu->noise.next;
+	if (apu->dmc.next < next) next = apu->dmc.next;
+	if (next > target) break;
+	apu->now = next;
+
+	for (int i = 0; i < 2; i++) {
+	    APU_PULSE* pulse = &apu->pulse[i];
+	    if (pulse->next != next) continue;
+	    pulse->step = (pulse->step + 1) & 0x07;
+	    pulse->next = apu_pulse_active(pulse) ? next + (pulse->timer + 1) * 2 : APU_IDLE;
+	}
+	APU_TRIANGLE* triangle = &apu->triangle;
+	if (triangle->next == next) {
+	    triangle->step = (triangle->step + 1) & 0x1F;
+	    triangle->next = apu_triangle_active(triangle) ? next + triangle->timer + 1 : APU_IDLE;
+	}
+	APU_NOISE* noise = &apu->noise;
+	if (noise->next == next) {
+	    ushort feedback = (noise->shift ^ (noise->shift >> (noise->mode ? 6 : 1))) & 1;
+	    noise->shift = (ushort)((noise->shift >> 1) | (feedback << 14));
+	    noise->next = noise->length > 0 ? next + noise->period : APU_IDLE;
+	}
+	if (apu->dmc.next == next) {
+	    apu_dmc_clock(apu);
+	    apu->dmc.next = apu_dmc_active(&apu->dmc) ? next + apu->dmc.period : APU_IDLE;
+	}
+	if (apu->frame_next == next) apu_frame_clock(apu);
+	apu_mix(apu);
+    }
+    apu->now = target;
+}
+
+void apu_sync(APU* apu)
+{
+    uint64_t target = apu->cpu->cycles;
+    // Keep each stretch well inside the sample buffer.
+    uint64_t chunk = (uint64_t)(APU_BLIP_SIZE / 2) * APU_CPU_CLOCK / apu->sample_rate;
+    while (apu->now < target) {
+	uint64_t end = target - apu->now > chunk ? apu->now + chunk : target;
+	apu_run(apu, end);
+	apu_blip_flush(apu, end);
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+/* Registers                                                              */
+/* ---------------------------------------------------------------------- */
+
+static void apu_write_envelope(APU_ENVELOPE* envelope, uchar data)
+{
+    envelope->loop = (data & 0x20) != 0;
+    envelope->constant = (data & 0x10) != 0;
+    envelope->period = data & 0x0F;
+}
+
+static void apu_write_pulse(APU* apu, APU_PULSE* pulse, int channel, int reg, uchar data)
+{
+    switch (reg) {
+    case 0: {
+	pulse->duty = data >> 6;
+	apu_write_envelope(&pulse->envelope, data);
+    } break;
+    case 1: {
+	pulse->sweep_enabled = (data & 0x80) != 0;
+	pulse->sweep_period = (data >> 4) & 0x07;
+	pulse->sweep_negate = (data & 0x08) != 0;
+	pulse->sweep_shift = data & 0x07;
+	pulse->sweep_reload = true;
+    } break;
+    case 2: {
+	pulse->timer = (ushort)((pulse->timer & 0x0700) | data);
+    } break;
+    case 3: {
+	pulse->timer = (ushort)((pulse->timer & 0x00FF) | ((data & 0x07) << 8));
+	if (apu->enabled & (1 << channel)) pulse->length = apu_length_table[data >> 3];
+	pulse->step = 0;
+	pulse->envelope.start = true;
+    } break;
+    }
+}
+
+void apu_write_register(APU* apu, ushort addr, uchar data)
+{
+    apu_sync(apu);
+    switch (addr) {
+    case 0x4000: case 0x4001: case 0x4002: case 0x4003: {
+	apu_write_pulse(apu, &apu->pulse[0], 0, addr & 0x03, data);
+    } break;
+    case 0x4004: case 0x4005: case 0x4006: case 0x4007: {
+	apu_write_pulse(apu, &apu->pulse[1], 1, addr & 0x03, data);
+    } break;
+    case 0x4008: {
+	apu->triangle.control = (data & 0x80) != 0;
+	apu->triangle.linear_period = data & 0x7F;
+    } break;
+    case 0x400A: {
+	apu->triangle.timer = (ushort)((apu->triangle.timer & 0x0700) | data);
+    } break;
+    case 0x400B: {
+	apu->triangle.timer = (ushort)((apu->triangle.timer & 0x00FF) | ((data & 0x07) << 8));
+	if (apu->enabled & 0x04) apu->triangle.length = apu_length_table[data >> 3];
+	apu->triangle.linear_reload = true;
+    } break;
+    case 0x400C: {
+	apu_write_envelope(&apu->noise.envelope, data);
+    } break;
+    case 0x400E: {
+	apu->noise.mode = (data & 0x80) != 0;
+	apu->noise.period = apu_noise_periods[data & 0x0F];
+    } break;
+    case 0x400F: {
+	if (apu->enabled & 0x08) apu->noise.length = apu_length_table[data >> 3];
+	apu->noise.envelope.start = true;
+    } break;
+    case 0x4010: {
+	apu->dmc.irq_enabled = (data & 0x80) != 0;
+	if (!apu->dmc.irq_enabled) apu->dmc_irq = false;
+	apu->dmc.loop = (data & 0x40) != 0;
+	apu->dmc.period = apu_dmc_periods[data & 0x0F];
+    } break;
+    case 0x4011: {
+	apu->dmc.level = data & 0x7F;
+    } break;
+    case 0x4012: {
+	apu->dmc.sample_addr = (ushort)(0xC000 + data * 64);
+    } break;
+    case 0x4013: {
+	apu->dmc.sample_length = (ushort)(data * 16 + 1);
+    } break;
+    case 0x4015: {
+	apu->enabled = data & 0x1F;
+	if (!(data & 0x01)) apu->pulse[0].length = 0;
+	if (!(data & 0x02)) apu->pulse[1].length = 0;
+	if (!(data & 0x04)) apu->triangle.length = 0;
+	if (!(data & 0x08)) apu->noise.length = 0;
+	if (!(data & 0x10)) {
+	    apu->dmc.remaining = 0;
+	} else if (apu->dmc.remaining == 0) {
+	    apu_dmc_restart(&apu->dmc);
+	    apu_dmc_fetch(apu);
+	}
+	apu->dmc_irq = false;
+    } break;
+    case 0x4017: {
+	apu->five_step = (data & 0x80) != 0;
+	apu->irq_inhibit = (data & 0x40) != 0;
+	if (apu->irq_inhibit) apu->frame_irq = false;
+	apu->frame_step = 0;
+	apu->frame_next = apu->now + apu_frame_steps[apu->five_step ? 1 : 0][0];
+	if (apu->five_step) {
+	    apu_quarter_frame(apu);
+	    apu_half_frame(apu);
+	}
+    } break;
+    default: {
+    } break;
+    }
+    apu_arm(apu);
+    apu_mix(apu);
+}
+
+uchar apu_read_status(APU* apu)
+{
+    apu_sync(apu);
+    uchar status = 0;
+    if (apu->pulse[0].length > 0) status = status | 0x01;
+    if (apu->pulse[1].length > 0) status = status | 0x02;
+    if (apu->triangle.length > 0) status = status | 0x04;
+    if (apu->noise.length > 0) status = status | 0x08;
+    if (apu->dmc.remaining > 0) status = status | 0x10;
+    if (apu->frame_irq) status = status | 0x40;
+    if (apu->dmc_irq) status = status | 0x80;
+    apu->frame_irq = false;
+    return status;
+}
+
+bool apu_irq(APU* apu)
+{
+    return apu->frame_irq || apu->dmc_irq;
+}
+
+uint64_t apu_next_irq(APU* apu)
+{
+    uint64_t next = UINT64_MAX;
+    if (!apu->five_step && !apu->irq_inhibit) {
+	next = apu->frame_next - apu_frame_steps[0][apu->frame_step] + apu_frame_steps[0][3];
+    }
+    APU_DMC* dmc = &apu->dmc;
+    if (dmc->irq_enabled && !dmc->loop && dmc->remaining > 0) {
+	// The last byte is fetched when the shift register empties after
+	// the current byte and the remaining - 1 before it.
+	uint64_t dmc_irq = apu->now;
+	if (dmc->buffer_full && dmc->next != APU_IDLE) {
+	    dmc_irq = dmc->next + ((uint64_t)dmc->bits - 1 + ((uint64_t)dmc->remaining - 1) * 8) * dmc->period;
+	}
+	if (dmc_irq < next) next = dmc_irq;
+    }
+    return next;
+}
+
+void apu_init(APU* apu, CPU* cpu, uint32_t sample_rate)
+{
+    pthread_once(&apu_tables_once, apu_build_tables);
+    memset(apu, 0, sizeof(APU));
+    apu->cpu = cpu;
+    apu->sample_rate = sample_rate;
+    apu->blip.factor = (uint64_t)(((double)sample_rate / APU_CPU_CLOCK) * 4294967296.0 + 0.5);
+    apu_reset(apu);
+}
+
+#define APU_STATE SAVESTATE_TAG('A', 'P', 'U', ' ')
+#define APU_STATE_SIZE (offsetof(APU, blip) + offsetof(APU_BLIP, buffer))
+
+bool apu_save_state(APU* apu, SAVESTATE* state)
+{
+    apu_sync(apu);
+    return savestate_put(state, APU_STATE, apu, APU_STATE_SIZE);
+}
+
+bool apu_load_state(APU* apu, const SAVESTATE* state)
+{
+    const void* data = savestate_find(state, APU_STATE, APU_STATE_SIZE);
+    if (data == NULL) return false;
+    CPU* cpu = apu->cpu;
+    memcpy(apu, data, APU_STATE_SIZE);
+    apu->cpu = cpu;
+    memset(apu->blip.buffer, 0, sizeof(apu->blip.buffer));
+    return true;
+}
+
+void apu_reset(APU* apu)
+{
+    AUDIO_SINK* sink = apu->sink;
+    uint64_t factor = apu->blip.factor;
+    uint32_t sample_rate = apu->sample_rate;
+    CPU* cpu = apu->cpu;
+    memset(apu, 0, sizeof(APU));
+    apu->cpu = cpu;
+    apu->sink = sink;
+    apu->sample_rate = sample_rate;
+    apu->blip.factor = factor;
+
+    apu->now = cpu->cycles;
+    apu->blip.start = cpu->cycles;
+    apu->pulse[0].ones_complement = true;
+    apu->pulse[0].next = APU_IDLE;
+    apu->pulse[1].next = APU_IDLE;
+    apu->triangle.next = APU_IDLE;
+    apu->noise.next = APU_IDLE;
+    apu->noise.shift = 1;
+    apu->noise.period = apu_noise_periods[0];
+    apu->dmc.next = APU_IDLE;
+    apu->dmc.period = apu_dmc_periods[0];
+    apu->dmc.bits = 8;
+    apu->dmc.silence = true;
+    apu->frame_next = apu->now + apu_frame_steps[0][0];
+}
@@ -0,0 +1,141 @@
+#ifndef APU_H_
+#define APU_H_
+
+#include "cpu.h"
+#include "audio.h"
+#include "savestate.h"
+
+#define APU_CPU_CLOCK 1789773
+#define APU_BLIP_PHASES 32
+#define APU_BLIP_TAPS 16
+// Output samples buffered between syncs; a sync never spans more.
+#define APU_BLIP_SIZE 4096
+
+typedef struct APU_ENVELOPE {
+    bool start;
+    bool loop;
+    bool constant;
+    uchar period;           // also the constant volume
+    uchar divider;
+    uchar decay;
+} APU_ENVELOPE;
+
+typedef struct APU_PULSE {
+    APU_ENVELOPE envelope;
+    uchar duty;
+    uchar step;
+    ushort timer;
+    uchar length;
+    bool sweep_enabled;
+    bool sweep_negate;
+    bool sweep_reload;
+    uchar sweep_period;
+    uchar sweep_shift;
+    uchar sweep_divider;
+    bool ones_complement;   // pulse 1 negates with -c - 1
+    uint64_t next;          // cycle of the next timer clock, UINT64_MAX when idle
+} APU_PULSE;
+
+typedef struct APU_TRIANGLE {
+    bool control;
+    uchar linear_period;
+    uchar linear;
+    bool linear_reload;
+    ushort timer;
+    uchar length;
+    uchar step;
+    uint64_t next;
+} APU_TRIANGLE;
+
+typedef struct APU_NOISE {
+    APU_ENVELOPE envelope;
+    bool mode;
+    ushort period;
+    ushort shift;
+    uchar length;
+    uint64_t next;
+} APU_NOISE;
+
+typedef struct APU_DMC {
+    bool irq_enabled;
+    bool loop;
+    ushort period;
+    uchar level;
+    ushort sample_addr;
+    ushort sample_length;
+    ushort addr;
+    ushort remaining;
+    uchar buffer;
+    bool buffer_full;
+    uchar shift;
+    uchar bits;
+    bool silence;
+    uint64_t next;
+} APU_DMC;
+
+// Band-limited synthesis buffer: every change of the mixed output is
+// added as a windowed-sinc step, so the square edges of the channels do not
+// alias when the 1.79 MHz output is resampled.
+typedef struct APU_BLIP {
+    uint64_t factor;        // output samples per CPU cycle, 32.32 fixed point
+    uint64_t offset;        // position of `start` in samples, 32.32
+    uint64_t start;         // CPU cycle the buffer begins at
+    float integrator;
+    float high_pass;
+    float last_input;
+    float buffer[APU_BLIP_SIZE + APU_BLIP_TAPS];
+} APU_BLIP;
+
+// The APU only runs when it has to: register accesses and apu_sync catch
+// it up to the CPU's cycle counter by jumping from one timer or frame
+// counter event to the next, never cycle by cycle.
+typedef struct APU {
+    CPU* cpu;
+    uint64_t now;
+    uint32_t sample_rate;
+    APU_PULSE pulse[2];
+    APU_TRIANGLE triangle;
+    APU_NOISE noise;
+    APU_DMC dmc;
+    uchar enabled;          // $4015 channel enables
+
+    bool five_step;
+    bool irq_inhibit;
+    bool frame_irq;
+    bool dmc_irq;
+    int frame_step;
+    uint64_t frame_next;
+
+    float output;           // current mixer output, 0..1
+    APU_BLIP blip;
+    AUDIO_SINK* sink;       // NULL drops the samples
+    uint64_t samples;       // samples produced so far
+} APU;
+
+void apu_init(APU* apu, CPU* cpu, uint32_t sample_rate);
+
+void apu_reset(APU* apu);
+
+// Runs up to the CPU's cycle counter and hands the finished samples to the
+// sink.
+void apu_sync(APU* apu);
+
+// $4000-$4013, $4015 and $4017.
+void apu_write_register(APU* apu, ushort addr, uchar data);
+
+// $4015.
+uchar apu_read_status(APU* apu);
+
+// Everything but the samples still waiting in the synthesis buffer, which
+// apu_save_state first hands to the sink and apu_load_state drops.
+bool apu_save_state(APU* apu, SAVESTATE* state);
+
+bool apu_load_state(APU* apu, const SAVESTATE* state);
+
+bool apu_irq(APU* apu);
+
+// Earliest cycle the frame counter or the DMC can raise an IRQ if nothing
+// is written in between, UINT64_MAX when neither will.
+uint64_t apu_next_irq(APU* apu);
+
+#endif // APU_H_
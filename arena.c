@@ -0,0 +1,49 @@
+#include "arena.h"
+#include <string.h>
+
+CPU_ARENA* cpu_arena_create(size_t capacity)
+{
+    CPU_ARENA* arena = malloc(sizeof(CPU_ARENA));
+    if (arena == NULL) return NULL;
+    memset(arena, 0, sizeof(CPU_ARENA));
+    if (capacity == 0) capacity = 1;
+    arena->capacity = capacity;
+    arena->cpus = aligned_alloc(64, sizeof(CPU) * capacity);
+    arena->memory = calloc(capacity, MEMORY_SIZE);
+    arena->released = malloc(sizeof(CPU*) * capacity);
+    if (arena->cpus == NULL || arena->memory == NULL || arena->released == NULL) {
+	cpu_arena_destroy(arena);
+	return NULL;
+    }
+    return arena;
+}
+
+void cpu_arena_destroy(CPU_ARENA* arena)
+{
+    if (arena == NULL) return;
+    free(arena->cpus);
+    free(arena->memory);
+    free(arena->released);
+    free(arena);
+}
+
+CPU* cpu_arena_acquire(CPU_ARENA* arena)
+{
+    if (arena->released_count > 0) {
+	arena->released_count = arena->released_count - 1;
+	return arena->released[arena->released_count];
+    }
+    if (arena->used == arena->capacity) return NULL;
+
+    CPU* cpu = &arena->cpus[arena->used];
+    cpu_init(cpu, arena->memory + arena->used * MEMORY_SIZE);
+    arena->used = arena->used + 1;
+    return cpu;
+}
+
+void cpu_arena_release(CPU_ARENA* arena, CPU* cpu)
+{
+    arena->pages_cleared = arena->pages_cleared + (uint64_t)cpu_recycle(cpu);
+    arena->released[arena->released_count] = cpu;
+    arena->released_count = arena->released_count + 1;
+}
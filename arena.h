@@ -0,0 +1,32 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include "cpu.h"
+
+// A fixed pool of CPUs for jobs that create and drop many short-lived
+// instances. The CPUs and their memory are allocated once, up front; the
+// memory comes zeroed from the OS, so a CPU that is never handed out costs
+// no more than its address space. A released CPU is recycled right away,
+// zeroing only the pages it wrote, and handed out again before a fresh one.
+// Not thread safe: give each thread its own arena.
+typedef struct CPU_ARENA {
+    CPU* cpus;
+    uchar* memory;           // capacity * MEMORY_SIZE bytes of page storage
+    CPU** released;          // recycled CPUs, reused last in first out
+    size_t released_count;
+    size_t used;             // CPUs handed out at least once
+    size_t capacity;
+    uint64_t pages_cleared;  // pages zeroed by recycling so far
+} CPU_ARENA;
+
+CPU_ARENA* cpu_arena_create(size_t capacity);
+
+void cpu_arena_destroy(CPU_ARENA* arena);
+
+// A CPU in its power-on state, or NULL when all of them are out.
+CPU* cpu_arena_acquire(CPU_ARENA* arena);
+
+// Detach and destroy anything attached to the CPU first.
+void cpu_arena_release(CPU_ARENA* arena, CPU* cpu);
+
+#endif // ARENA_H_
@@ -0,0 +1,151 @@
+#include "audio.h"
+#include <string.h>
+#include <time.h>
+
+#define AUDIO_CHUNK 1024
+
+bool audio_ring_init(AUDIO_RING* ring, uint64_t capacity)
+{
+    uint64_t rounded = 1;
+    while (rounded < capacity) rounded = rounded << 1;
+    ring->samples = malloc(rounded * sizeof(int16_t));
+    if (ring->samples == NULL) return false;
+    ring->capacity = rounded;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->dropped, 0);
+    return true;
+}
+
+void audio_ring_free(AUDIO_RING* ring)
+{
+    free(ring->samples);
+    ring->samples = NULL;
+}
+
+size_t audio_ring_push(AUDIO_RING* ring, const int16_t* samples, size_t count)
+{
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint64_t space = ring->capacity - (head - tail);
+    size_t pushed = count < space ? count : (size_t)space;
+    for (size_t i = 0; i < pushed; i++) {
+	ring->samples[(head + i) & (ring->capacity - 1)] = samples[i];
+    }
+    atomic_store_explicit(&ring->head, head + pushed, memory_order_release);
+    if (pushed < count) atomic_fetch_add_explicit(&ring->dropped, count - pushed, memory_order_relaxed);
+    return pushed;
+}
+
+size_t audio_ring_pop(AUDIO_RING* ring, int16_t* samples, size_t count)
+{
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t popped = count < head - tail ? count : (size_t)(head - tail);
+    for (size_t i = 0; i < popped; i++) {
+	samples[i] = ring->samples[(tail + i) & (ring->capacity - 1)];
+    }
+    atomic_store_explicit(&ring->tail, tail + popped, memory_order_release);
+    return popped;
+}
+
+static void audio_put_u32(uint8_t* out, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) out[i] = (uint8_t)(value >> (i * 8));
+}
+
+static void audio_put_u16(uint8_t* out, uint16_t value)
+{
+    out[0] = (uint8_t)value;
+    out[1] = (uint8_t)(value >> 8);
+}
+
+// 44 byte canonical PCM header; the sizes are patched in on close.
+static bool audio_write_wav_header(AUDIO_SINK* sink, uint32_t data_size)
+{
+    uint8_t header[44];
+    memcpy(header, "RIFF", 4);
+    audio_put_u32(header + 4, 36 + data_size);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    audio_put_u32(header + 16, 16);
+    audio_put_u16(header + 20, 1);
+    audio_put_u16(header + 22, 1);
+    audio_put_u32(header + 24, sink->sample_rate);
+    audio_put_u32(header + 28, sink->sample_rate * 2);
+    audio_put_u16(header + 32, 2);
+    audio_put_u16(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    audio_put_u32(header + 40, data_size);
+    return fwrite(header, sizeof(header), 1, sink->file) == 1;
+}
+
+static void audio_write_samples(AUDIO_SINK* sink, const int16_t* samples, size_t count)
+{
+    uint8_t bytes[AUDIO_CHUNK * 2];
+    for (size_t i = 0; i < count; i++) audio_put_u16(bytes + i * 2, (uint16_t)samples[i]);
+    sink->written = sink->written + fwrite(bytes, 2, count, sink->file);
+}
+
+static void* audio_writer(void* arg)
+{
+    AUDIO_SINK* sink = arg;
+    int16_t chunk[AUDIO_CHUNK];
+    while (1) {
+	bool running = atomic_load_explicit(&sink->running, memory_order_acquire);
+	size_t count = audio_ring_pop(&sink->ring, chunk, AUDIO_CHUNK);
+	if (count > 0) {
+	    audio_write_samples(sink, chunk, count);
+	    continue;
+	}
+	if (!running) break;
+	struct timespec pause = { .tv_sec = 0, .tv_nsec = 1000000 };
+	nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+AUDIO_SINK* audio_sink_open(const char* path, AUDIO_FORMAT format, uint32_t sample_rate, uint64_t ring_capacity)
+{
+    AUDIO_SINK* sink = malloc(sizeof(AUDIO_SINK));
+    if (sink == NULL) return NULL;
+    memset(sink, 0, sizeof(AUDIO_SINK));
+    sink->format = format;
+    sink->sample_rate = sample_rate;
+    if (!audio_ring_init(&sink->ring, ring_capacity)) {
+	free(sink);
+	return NULL;
+    }
+    sink->file = fopen(path, "wb");
+    if (sink->file == NULL) goto fail;
+    if (format == AUDIO_FORMAT_WAV && !audio_write_wav_header(sink, 0)) goto fail;
+    atomic_init(&sink->running, true);
+    if (pthread_create(&sink->thread, NULL, audio_writer, sink) != 0) goto fail;
+    return sink;
+
+fail:
+    if (sink->file != NULL) fclose(sink->file);
+    audio_ring_free(&sink->ring);
+    free(sink);
+    return NULL;
+}
+
+void audio_sink_push(AUDIO_SINK* sink, const int16_t* samples, size_t count)
+{
+    audio_ring_push(&sink->ring, samples, count);
+}
+
+bool audio_sink_close(AUDIO_SINK* sink)
+{
+    if (sink == NULL) return false;
+    atomic_store_explicit(&sink->running, false, memory_order_release);
+    pthread_join(sink->thread, NULL);
+
+    bool ok = true;
+    if (sink->format == AUDIO_FORMAT_WAV) {
+	ok = fseek(sink->file, 0, SEEK_SET) == 0 && audio_write_wav_header(sink, (uint32_t)(sink->written * 2));
+    }
+    ok = fclose(sink->file) == 0 && ok;
+    audio_ring_free(&sink->ring);
+    free(sink);
+    return ok;
+}
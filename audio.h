@@ -0,0 +1,54 @@
+#ifndef AUDIO_H_
+#define AUDIO_H_
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// Single producer, single consumer ring of 16 bit samples. The emulation
+// thread only ever pushes and the writer thread only ever pops, so the two
+// indexes are the whole synchronization; neither side takes a lock.
+typedef struct AUDIO_RING {
+    int16_t* samples;
+    uint64_t capacity;           // power of two
+    _Atomic uint64_t head;       // written by the producer
+    _Atomic uint64_t tail;       // written by the consumer
+    _Atomic uint64_t dropped;    // samples lost to a full ring
+} AUDIO_RING;
+
+bool audio_ring_init(AUDIO_RING* ring, uint64_t capacity);
+
+void audio_ring_free(AUDIO_RING* ring);
+
+// Never blocks: whatever does not fit is dropped and counted.
+size_t audio_ring_push(AUDIO_RING* ring, const int16_t* samples, size_t count);
+
+size_t audio_ring_pop(AUDIO_RING* ring, int16_t* samples, size_t count);
+
+typedef enum {
+    AUDIO_FORMAT_WAV,
+    AUDIO_FORMAT_RAW     // headerless signed 16 bit little endian mono
+} AUDIO_FORMAT;
+
+// Streams pushed samples to a file from its own writer thread.
+typedef struct AUDIO_SINK {
+    AUDIO_RING ring;
+    FILE* file;
+    AUDIO_FORMAT format;
+    uint32_t sample_rate;
+    uint64_t written;            // samples on disk, writer thread only
+    _Atomic bool running;
+    pthread_t thread;
+} AUDIO_SINK;
+
+AUDIO_SINK* audio_sink_open(const char* path, AUDIO_FORMAT format, uint32_t sample_rate, uint64_t ring_capacity);
+
+void audio_sink_push(AUDIO_SINK* sink, const int16_t* samples, size_t count);
+
+// Drains the ring, finishes the WAV header and closes the file.
+bool audio_sink_close(AUDIO_SINK* sink);
+
+#endif // AUDIO_H_
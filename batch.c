@@ -0,0 +1,354 @@
+#include "cpu.h"
+#include "arena.h"
+#include "block.h"
+#include "idle.h"
+#include "nes.h"
+#include "pool.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define BATCH_PATH_SIZE 512
+#define BATCH_DEFAULT_FRAMES 60
+
+typedef struct BATCH_OPTIONS {
+    int threads;
+    const char* out_path;        // NULL writes to stdout
+    bool idle;
+    bool blocks;
+    uint64_t max_cycles;         // raw programs only
+} BATCH_OPTIONS;
+
+// One manifest line: `path [frames] [max_cycles]`. Files ending in .nes
+// boot as a console and run `frames` frames; anything else is a raw
+// program loaded at $8000 that runs until BRK or `max_cycles`.
+typedef struct BATCH_JOB {
+    char path[BATCH_PATH_SIZE];
+    int frames;
+    uint64_t max_cycles;
+    uchar* image;                // raw programs: $8000-$FFFF, one per distinct path
+    bool owns_image;
+    bool too_long;               // the program runs into the reset vector
+} BATCH_JOB;
+
+typedef struct BATCH_RESULT {
+    const char* status;          // "ok", "halted" or "error:<why>"
+    int frames;
+    uint64_t cycles;
+    ushort pc;
+    uchar reg_a;
+    uchar reg_x;
+    uchar reg_y;
+    uchar reg_sp;
+    uchar status_flags;
+    uint64_t memory_hash;        // FNV-1a of RAM, 2 KB for a console, 64 KB otherwise
+    double seconds;
+    int worker;
+} BATCH_RESULT;
+
+typedef struct BATCH {
+    const BATCH_OPTIONS* options;
+    BATCH_JOB* jobs;
+    BATCH_RESULT* results;
+    CPU_ARENA** arenas;          // one per worker, raw programs recycle its CPU
+} BATCH;
+
+static double batch_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static uint64_t batch_hash_memory(CPU* cpu, size_t size)
+{
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (size_t i = 0; i < size; i++) {
+	hash = (hash ^ cpu_peek_memory(cpu, (ushort)i)) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+static void batch_store_cpu(BATCH_RESULT* result, CPU* cpu, size_t memory_size)
+{
+    result->pc = cpu->pc;
+    result->reg_a = cpu->reg_a;
+    result->reg_x = cpu->reg_x;
+    result->reg_y = cpu->reg_y;
+    result->reg_sp = cpu->reg_sp;
+    result->status_flags = cpu_get_status(cpu);
+    result->memory_hash = batch_hash_memory(cpu, memory_size);
+}
+
+static bool batch_has_suffix(const char* path, const char* suffix)
+{
+    size_t length = strlen(path);
+    size_t suffix_length = strlen(suffix);
+    return length >= suffix_length && strcmp(path + length - suffix_length, suffix) == 0;
+}
+
+static void batch_run_nes(BATCH* batch, const BATCH_JOB* job, BATCH_RESULT* result)
+{
+    ROM_ERROR error = ROM_OK;
+    NES* nes = nes_open(job->path, &error);
+    if (nes == NULL) {
+	fprintf(stderr, "ERROR: %s: %s\n", job->path, rom_error_string(error));
+	result->status = "error:rom";
+	return;
+    }
+    if (batch->options->idle) nes_set_idle_skip(nes, true);
+    if (batch->options->blocks) nes->cpu.blocks = block_cache_create();
+
+    uint64_t start = nes->cpu.cycles;
+    result->status = "ok";
+    while (result->frames < job->frames) {
+	if (!nes_run_frame(nes)) {
+	    result->status = "halted";
+	    break;
+	}
+	result->frames = result->frames + 1;
+    }
+    result->cycles = nes->cpu.cycles - start;
+    batch_store_cpu(result, &nes->cpu, 0x800);
+
+    if (nes->cpu.blocks != NULL) block_cache_destroy(nes->cpu.blocks);
+    nes->cpu.blocks = NULL;
+    nes_destroy(nes);
+}
+
+static void batch_run_program(BATCH* batch, const BATCH_JOB* job, BATCH_RESULT* result, int worker)
+{
+    if (job->image == NULL) {
+	result->status = job->too_long ? "error:size" : "error:open";
+	return;
+    }
+
+    CPU_ARENA* arena = batch->arenas[worker];
+    CPU* cpu = cpu_arena_acquire(arena);
+    if (cpu == NULL) {
+	result->status = "error:memory";
+	return;
+    }
+    if (batch->options->blocks) cpu->blocks = block_cache_create();
+    if (batch->options->idle) cpu->idle = idle_create();
+    cpu_map_image(cpu, job->image);
+    cpu_reset(cpu);
+
+    result->cycles = cpu_run_for_cycles(cpu, job->max_cycles);
+    result->status = cpu->halted ? "halted" : "ok";
+    batch_store_cpu(result, cpu, MEMORY_SIZE);
+
+    if (cpu->blocks != NULL) block_cache_destroy(cpu->blocks);
+    if (cpu->idle != NULL) idle_destroy(cpu->idle);
+    cpu_arena_release(arena, cpu);
+}
+
+static void batch_run_job(void* ctx, size_t index, int worker)
+{
+    BATCH* batch = ctx;
+    const BATCH_JOB* job = &batch->jobs[index];
+    BATCH_RESULT* result = &batch->results[index];
+    double start = batch_now();
+    if (batch_has_suffix(job->path, ".nes")) {
+	batch_run_nes(batch, job, result);
+    } else {
+	batch_run_program(batch, job, result, worker);
+    }
+    result->seconds = batch_now() - start;
+    result->worker = worker;
+}
+
+// Reads every raw program once. Jobs running the same file share its
+// image, and each CPU only copies the pages it writes.
+static void batch_load_images(BATCH_JOB* jobs, int count)
+{
+    for (int i = 0; i < count; i++) {
+	BATCH_JOB* job = &jobs[i];
+	if (batch_has_suffix(job->path, ".nes")) continue;
+	for (int j = 0; j < i && job->image == NULL; j++) {
+	    if (jobs[j].owns_image && strcmp(jobs[j].path, job->path) == 0) job->image = jobs[j].image;
+	}
+	if (job->image != NULL) continue;
+
+	FILE* file = fopen(job->path, "rb");
+	if (file == NULL) continue;
+	uchar program[CPU_IMAGE_SIZE];
+	size_t length = fread(program, 1, sizeof(program), file);
+	fclose(file);
+	job->image = malloc(CPU_IMAGE_SIZE);
+	if (job->image == NULL) continue;
+	if (!cpu_build_image(job->image, program, length)) {
+	    free(job->image);
+	    job->image = NULL;
+	    job->too_long = true;
+	    continue;
+	}
+	job->owns_image = true;
+    }
+}
+
+static void batch_free_images(BATCH_JOB* jobs, int count)
+{
+    for (int i = 0; i < count; i++) {
+	if (jobs[i].owns_image) free(jobs[i].image);
+    }
+}
+
+// Returns the number of jobs read, or -1 if the manifest could not be read.
+static int batch_read_manifest(const char* path, const BATCH_OPTIONS* options, BATCH_JOB** jobs)
+{
+    FILE* file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (file == NULL) return -1;
+
+    int count = 0;
+    int capacity = 0;
+    char line[BATCH_PATH_SIZE + 64];
+    while (fgets(line, sizeof(line), file) != NULL) {
+	char job_path[BATCH_PATH_SIZE];
+	int frames = BATCH_DEFAULT_FRAMES;
+	unsigned long long max_cycles = options->max_cycles;
+	char* text = line;
+	while (*text == ' ' || *text == '\t') text++;
+	if (*text == '#' || *text == '\n' || *text == '\0') continue;
+	if (sscanf(text, "%511s %d %llu", job_path, &frames, &max_cycles) < 1) continue;
+
+	if (count == capacity) {
+	    capacity = capacity > 0 ? capacity * 2 : 64;
+	    BATCH_JOB* grown = realloc(*jobs, sizeof(BATCH_JOB) * (size_t)capacity);
+	    if (grown == NULL) break;
+	    *jobs = grown;
+	}
+	BATCH_JOB* job = &(*jobs)[count];
+	snprintf(job->path, sizeof(job->path), "%s", job_path);
+	job->frames = frames;
+	job->max_cycles = max_cycles;
+	job->image = NULL;
+	job->owns_image = false;
+	job->too_long = false;
+	count = count + 1;
+    }
+    if (file != stdin) fclose(file);
+    return count;
+}
+
+static void batch_write_results(FILE* file, const BATCH_JOB* jobs, const BATCH_RESULT* results, int count)
+{
+    fprintf(file, "# job path status frames cycles pc a x y sp p memory_hash ms\n");
+    for (int i = 0; i < count; i++) {
+	const BATCH_RESULT* result = &results[i];
+	fprintf(file, "%d %s %s %d %llu %04X %02X %02X %02X %02X %02X %016llx %.3f\n", i, jobs[i].path,
+		result->status, result->frames, (unsigned long long)result->cycles, result->pc,
+		result->reg_a, result->reg_x, result->reg_y, result->reg_sp, result->status_flags,
+		(unsigned long long)result->memory_hash, result->seconds * 1000.0);
+    }
+}
+
+static void batch_usage(void)
+{
+    fprintf(stderr,
+	    "usage: quick_nes_batch [--threads N] [--out FILE] [--idle] [--blocks]\n"
+	    "                       [--max-cycles N] MANIFEST\n"
+	    "MANIFEST lists one job per line: PATH [FRAMES] [MAX_CYCLES], - reads stdin\n");
+}
+
+int main(int argc, char** argv)
+{
+    BATCH_OPTIONS options = {
+	.threads = pool_default_workers(),
+	.out_path = NULL,
+	.idle = false,
+	.blocks = false,
+	.max_cycles = 100000000
+    };
+    const char* manifest_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+	bool has_value = i + 1 < argc;
+	if (strcmp(argv[i], "--threads") == 0 && has_value) {
+	    options.threads = atoi(argv[++i]);
+	} else if (strcmp(argv[i], "--out") == 0 && has_value) {
+	    options.out_path = argv[++i];
+	} else if (strcmp(argv[i], "--idle") == 0) {
+	    options.idle = true;
+	} else if (strcmp(argv[i], "--blocks") == 0) {
+	    options.blocks = true;
+	} else if (strcmp(argv[i], "--max-cycles") == 0 && has_value) {
+	    options.max_cycles = strtoull(argv[++i], NULL, 0);
+	} else if (manifest_path == NULL && (argv[i][0] != '-' || strcmp(argv[i], "-") == 0)) {
+	    manifest_path = argv[i];
+	} else {
+	    batch_usage();
+	    return 2;
+	}
+    }
+    if (manifest_path == NULL) {
+	batch_usage();
+	return 2;
+    }
+
+    BATCH_JOB* jobs = NULL;
+    int count = batch_read_manifest(manifest_path, &options, &jobs);
+    if (count < 0) {
+	fprintf(stderr, "ERROR: could not read %s\n", manifest_path);
+	return 2;
+    }
+    BATCH_RESULT* results = calloc(count > 0 ? (size_t)count : 1, sizeof(BATCH_RESULT));
+    if (results == NULL) {
+	free(jobs);
+	return 2;
+    }
+    for (int i = 0; i < count; i++) results[i].status = "error:skipped";
+    batch_load_images(jobs, count);
+
+    if (options.threads < 1) options.threads = 1;
+    CPU_ARENA** arenas = calloc((size_t)options.threads, sizeof(CPU_ARENA*));
+    bool ready = arenas != NULL;
+    for (int i = 0; ready && i < options.threads; i++) {
+	arenas[i] = cpu_arena_create(1);
+	ready = arenas[i] != NULL;
+    }
+
+    BATCH batch = { .options = &options, .jobs = jobs, .results = results, .arenas = arenas };
+    POOL_STATS stats;
+    double start = batch_now();
+    ready = ready && pool_run(options.threads, (size_t)count, batch_run_job, &batch, &stats);
+    double elapsed = batch_now() - start;
+    for (int i = 0; arenas != NULL && i < options.threads; i++) cpu_arena_destroy(arenas[i]);
+    free(arenas);
+    if (!ready) {
+	fprintf(stderr, "ERROR: could not start the worker pool\n");
+	batch_free_images(jobs, count);
+	free(results);
+	free(jobs);
+	return 2;
+    }
+
+    FILE* out = options.out_path != NULL ? fopen(options.out_path, "w") : stdout;
+    if (out == NULL) {
+	fprintf(stderr, "ERROR: could not write %s\n", options.out_path);
+	batch_free_images(jobs, count);
+	free(results);
+	free(jobs);
+	return 2;
+    }
+    batch_write_results(out, jobs, results, count);
+    if (out != stdout) fclose(out);
+
+    // Wall time adds up across workers; with perfect scaling job_seconds
+    // is close to threads * elapsed.
+    double job_seconds = 0.0;
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+	job_seconds = job_seconds + results[i].seconds;
+	if (strcmp(results[i].status, "ok") != 0 && strcmp(results[i].status, "halted") != 0) failed = failed + 1;
+    }
+    fprintf(stderr, "%d jobs on %d threads in %.3f s (%.3f job-seconds, %.2fx), %llu stolen, %llu..%llu per worker\n",
+	    count, stats.workers, elapsed, job_seconds, elapsed > 0.0 ? job_seconds / elapsed : 0.0,
+	    (unsigned long long)stats.steals, (unsigned long long)stats.min_executed,
+	    (unsigned long long)stats.max_executed);
+
+    batch_free_images(jobs, count);
+    free(results);
+    free(jobs);
+    return failed > 0 ? 1 : 0;
+}
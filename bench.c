@@ -0,0 +1,364 @@
+#include "cpu.h"
+#include "block.h"
+#include "profile.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_MAX_KERNELS 32
+#define BENCH_NAME_SIZE 64
+
+typedef struct BENCH_KERNEL {
+    const char* name;
+    const uchar* program;
+    size_t program_length;
+    void (*setup)(CPU* cpu);
+} BENCH_KERNEL;
+
+typedef struct BENCH_RESULT {
+    char name[BENCH_NAME_SIZE];
+    uint64_t instructions;
+    uint64_t cycles;
+    double seconds;
+    double instructions_per_second;
+    double cycles_per_second;
+    double ns_per_instruction;
+} BENCH_RESULT;
+
+typedef struct BENCH_OPTIONS {
+    double seconds;
+    uint64_t max_cycles;
+    bool blocks;
+    const char* out_path;
+    const char* compare_path;
+    double threshold;
+    uint64_t profile_period;   // 0 disables the profiling pass
+} BENCH_OPTIONS;
+
+// ADC/AND/ASL on A inside an INX/INY double loop (65536 iterations).
+static const uchar bench_alu_program[] = {
+    0x69, 0x01,       // 8000: ADC #$01
+    0x29, 0x7F,       // 8002: AND #$7F
+    0x0A,             // 8004: ASL A
+    0xE8,             // 8005: INX
+    0xD0, 0xF8,       // 8006: BNE $8000
+    0xC8,             // 8008: INY
+    0xD0, 0xF5,       // 8009: BNE $8000
+    0x00
+};
+
+// Four conditional branches per INX, mixing taken and not taken.
+static const uchar bench_branch_program[] = {
+    0xE8,             // 8000: INX
+    0x30, 0x02,       // 8001: BMI $8005
+    0x10, 0x00,       // 8003: BPL $8005
+    0x90, 0x00,       // 8005: BCC $8007
+    0xD0, 0xF7,       // 8007: BNE $8000
+    0xC8,             // 8009: INY
+    0xD0, 0xF4,       // 800A: BNE $8000
+    0x00
+};
+
+// (zp),Y reads through two pointers, one of which crosses a page.
+static const uchar bench_memory_program[] = {
+    0xB1, 0x10,       // 8000: LDA ($10),Y
+    0x71, 0x12,       // 8002: ADC ($12),Y
+    0x31, 0x10,       // 8004: AND ($10),Y
+    0xC8,             // 8006: INY
+    0xD0, 0xF7,       // 8007: BNE $8000
+    0xE8,             // 8009: INX
+    0xD0, 0xF4,       // 800A: BNE $8000
+    0x00
+};
+
+static void bench_memory_setup(CPU* cpu)
+{
+    cpu_write_memory_ushort(cpu, 0x10, 0x02F0);
+    cpu_write_memory_ushort(cpu, 0x12, 0x0400);
+    for (int i = 0; i < 0x300; i++) {
+	cpu_write_memory(cpu, (ushort)(0x0200 + i), (uchar)(i * 7));
+    }
+}
+
+static const BENCH_KERNEL bench_builtin_kernels[] = {
+    { "alu", bench_alu_program, sizeof(bench_alu_program), NULL },
+    { "branch", bench_branch_program, sizeof(bench_branch_program), NULL },
+    { "memory", bench_memory_program, sizeof(bench_memory_program), bench_memory_setup },
+};
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void bench_prepare(CPU* cpu, const BENCH_KERNEL* kernel, bool blocks)
+{
+    cpu_free_memory(cpu);
+    *cpu = make_cpu();
+    if (blocks) cpu->blocks = block_cache_create();
+    if (kernel->setup != NULL) kernel->setup(cpu);
+    cpu_load(cpu, (uchar*)kernel->program, kernel->program_length);
+    cpu_reset(cpu);
+}
+
+// Puts the kernel back where bench_prepare left it: the pages the last
+// pass wrote are zeroed and the setup and program redone, so every pass
+// runs the same instruction stream. The block cache is kept but cleared.
+static void bench_restart(CPU* cpu, const BENCH_KERNEL* kernel)
+{
+    BLOCK_CACHE* blocks = cpu->blocks;
+    cpu_recycle(cpu);
+    cpu->blocks = blocks;
+    if (kernel->setup != NULL) kernel->setup(cpu);
+    cpu_load(cpu, (uchar*)kernel->program, kernel->program_length);
+    cpu_reset(cpu);
+}
+
+// One untimed pass stepping a single instruction at a time counts the
+// instructions in a pass; `cycles` is what the pass takes, which every
+// timed pass has to match.
+static uint64_t bench_count_instructions(CPU* cpu, uint64_t max_cycles, uint64_t* cycles)
+{
+    uint64_t instructions = 0;
+    uint64_t start = cpu->cycles;
+    while (!cpu->halted && cpu->cycles - start < max_cycles) {
+	cpu_run_for_cycles(cpu, 1);
+	instructions = instructions + 1;
+    }
+    *cycles = cpu->cycles - start;
+    return instructions;
+}
+
+// One untimed pass under the profiler: the report goes to stdout and the
+// collapsed stacks to <kernel>.folded.
+static void bench_profile_kernel(CPU* cpu, const BENCH_KERNEL* kernel, const BENCH_OPTIONS* options)
+{
+    bench_prepare(cpu, kernel, options->blocks);
+    cpu->profiler = profiler_create(options->profile_period);
+    if (cpu->profiler == NULL) return;
+    cpu_run_for_cycles(cpu, options->max_cycles);
+
+    printf("profile of %s\n", kernel->name);
+    profiler_write_report(cpu->profiler, stdout, 10);
+    char path[BENCH_NAME_SIZE + 16];
+    snprintf(path, sizeof(path), "%s.folded", kernel->name);
+    FILE* file = fopen(path, "w");
+    if (file != NULL) {
+	profiler_write_collapsed(cpu->profiler, file);
+	fclose(file);
+    }
+    profiler_destroy(cpu->profiler);
+    cpu->profiler = NULL;
+    if (cpu->blocks != NULL) block_cache_destroy(cpu->blocks);
+    cpu->blocks = NULL;
+}
+
+static bool bench_run_kernel(const BENCH_KERNEL* kernel, const BENCH_OPTIONS* options, BENCH_RESULT* result)
+{
+    static CPU cpu;
+
+    bench_prepare(&cpu, kernel, false);
+    uint64_t cycles_per_pass;
+    uint64_t instructions_per_pass = bench_count_instructions(&cpu, options->max_cycles, &cycles_per_pass);
+    if (options->profile_period != 0) bench_profile_kernel(&cpu, kernel, options);
+
+    // Only the runs are timed, not the restarts between them.
+    bench_prepare(&cpu, kernel, options->blocks);
+    uint64_t instructions = 0;
+    uint64_t cycles = 0;
+    double elapsed = 0.0;
+    bool same = true;
+    do {
+	bench_restart(&cpu, kernel);
+	uint64_t pass_start = cpu.cycles;
+	double start = bench_now();
+	cpu_run_for_cycles(&cpu, options->max_cycles);
+	elapsed = elapsed + (bench_now() - start);
+	same = cpu.cycles - pass_start == cycles_per_pass;
+	cycles = cycles + (cpu.cycles - pass_start);
+	instructions = instructions + instructions_per_pass;
+    } while (same && elapsed < options->seconds);
+
+    if (cpu.blocks != NULL) {
+	block_cache_print_stats(cpu.blocks, stdout);
+	block_cache_destroy(cpu.blocks);
+	cpu.blocks = NULL;
+    }
+    if (!same) {
+	fprintf(stderr, "ERROR: %s ran a different pass than the one counted, skipped\n", kernel->name);
+	return false;
+    }
+
+    snprintf(result->name, sizeof(result->name), "%s", kernel->name);
+    result->instructions = instructions;
+    result->cycles = cycles;
+    result->seconds = elapsed;
+    result->instructions_per_second = (double)instructions / elapsed;
+    result->cycles_per_second = (double)cycles / elapsed;
+    result->ns_per_instruction = elapsed * 1e9 / (double)instructions;
+    return instructions != 0;
+}
+
+static uchar* bench_read_file(const char* path, size_t* length)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+    uchar* data = malloc(0x8000);
+    if (data != NULL) *length = fread(data, 1, 0x8000, file);
+    fclose(file);
+    return data;
+}
+
+static bool bench_write_results(const char* path, BENCH_RESULT* results, int count)
+{
+    FILE* file = fopen(path, "w");
+    if (file == NULL) return false;
+    fprintf(file, "# kernel instructions cycles seconds instructions_per_second cycles_per_second ns_per_instruction\n");
+    for (int i = 0; i < count; i++) {
+	fprintf(file, "%s %llu %llu %.6f %.0f %.0f %.3f\n", results[i].name,
+		(unsigned long long)results[i].instructions, (unsigned long long)results[i].cycles,
+		results[i].seconds, results[i].instructions_per_second,
+		results[i].cycles_per_second, results[i].ns_per_instruction);
+    }
+    fclose(file);
+    return true;
+}
+
+static int bench_read_results(const char* path, BENCH_RESULT* results, int capacity)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL) return -1;
+    char line[256];
+    int count = 0;
+    while (count < capacity && fgets(line, sizeof(line), file) != NULL) {
+	if (line[0] == '#') continue;
+	BENCH_RESULT* result = &results[count];
+	unsigned long long instructions, cycles;
+	if (sscanf(line, "%63s %llu %llu %lf %lf %lf %lf", result->name, &instructions, &cycles,
+		   &result->seconds, &result->instructions_per_second,
+		   &result->cycles_per_second, &result->ns_per_instruction) != 7) continue;
+	result->instructions = instructions;
+	result->cycles = cycles;
+	count = count + 1;
+    }
+    fclose(file);
+    return count;
+}
+
+// Returns the number of kernels that lost more than `threshold` percent of
+// their instruction throughput against the baseline.
+static int bench_compare(BENCH_RESULT* results, int count, BENCH_RESULT* baseline, int baseline_count, double threshold)
+{
+    int regressions = 0;
+    for (int i = 0; i < count; i++) {
+	for (int j = 0; j < baseline_count; j++) {
+	    if (strcmp(results[i].name, baseline[j].name) != 0) continue;
+	    double change = 100.0 * (results[i].instructions_per_second - baseline[j].instructions_per_second)
+		/ baseline[j].instructions_per_second;
+	    bool regressed = change < -threshold;
+	    printf("%-16s %+7.2f%% %s\n", results[i].name, change, regressed ? "REGRESSION" : "ok");
+	    if (regressed) regressions = regressions + 1;
+	}
+    }
+    return regressions;
+}
+
+static void bench_usage(void)
+{
+    fprintf(stderr,
+	    "usage: quick_nes_bench [--seconds S] [--blocks] [--load FILE.bin]... [--max-cycles N]\n"
+	    "                       [--out FILE] [--compare BASELINE] [--threshold PERCENT]\n"
+	    "                       [--profile SAMPLE_PERIOD]\n");
+}
+
+int main(int argc, char** argv)
+{
+    BENCH_OPTIONS options = {
+	.seconds = 0.5,
+	.max_cycles = 100000000,
+	.blocks = false,
+	.out_path = "bench_results.txt",
+	.compare_path = NULL,
+	.threshold = 5.0,
+	.profile_period = 0
+    };
+    BENCH_KERNEL kernels[BENCH_MAX_KERNELS];
+    int kernel_count = 0;
+    uchar* loaded[BENCH_MAX_KERNELS];
+    int loaded_count = 0;
+
+    for (size_t i = 0; i < sizeof(bench_builtin_kernels) / sizeof(bench_builtin_kernels[0]); i++) {
+	kernels[kernel_count] = bench_builtin_kernels[i];
+	kernel_count = kernel_count + 1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+	bool has_value = i + 1 < argc;
+	if (strcmp(argv[i], "--seconds") == 0 && has_value) {
+	    options.seconds = atof(argv[++i]);
+	} else if (strcmp(argv[i], "--max-cycles") == 0 && has_value) {
+	    options.max_cycles = strtoull(argv[++i], NULL, 0);
+	} else if (strcmp(argv[i], "--blocks") == 0) {
+	    options.blocks = true;
+	} else if (strcmp(argv[i], "--out") == 0 && has_value) {
+	    options.out_path = argv[++i];
+	} else if (strcmp(argv[i], "--compare") == 0 && has_value) {
+	    options.compare_path = argv[++i];
+	} else if (strcmp(argv[i], "--threshold") == 0 && has_value) {
+	    options.threshold = atof(argv[++i]);
+	} else if (strcmp(argv[i], "--profile") == 0 && has_value) {
+	    options.profile_period = strtoull(argv[++i], NULL, 0);
+	} else if (strcmp(argv[i], "--load") == 0 && has_value && kernel_count < BENCH_MAX_KERNELS) {
+	    const char* path = argv[++i];
+	    size_t length = 0;
+	    uchar* program = bench_read_file(path, &length);
+	    if (program == NULL) {
+		fprintf(stderr, "ERROR: could not read %s\n", path);
+		return 2;
+	    }
+	    if (length > CPU_PROGRAM_MAX) {
+		fprintf(stderr, "ERROR: %s is longer than %d bytes\n", path, CPU_PROGRAM_MAX);
+		free(program);
+		return 2;
+	    }
+	    loaded[loaded_count] = program;
+	    loaded_count = loaded_count + 1;
+	    kernels[kernel_count] = (BENCH_KERNEL){ path, program, length, NULL };
+	    kernel_count = kernel_count + 1;
+	} else {
+	    bench_usage();
+	    return 2;
+	}
+    }
+
+    BENCH_RESULT results[BENCH_MAX_KERNELS];
+    int result_count = 0;
+    printf("%-16s %14s %14s %10s\n", "kernel", "instr/s", "cycles/s", "ns/instr");
+    for (int i = 0; i < kernel_count; i++) {
+	BENCH_RESULT* result = &results[result_count];
+	if (!bench_run_kernel(&kernels[i], &options, result)) continue;
+	result_count = result_count + 1;
+	printf("%-16s %14.0f %14.0f %10.3f\n", result->name, result->instructions_per_second,
+	       result->cycles_per_second, result->ns_per_instruction);
+    }
+
+    for (int i = 0; i < loaded_count; i++) free(loaded[i]);
+
+    if (!bench_write_results(options.out_path, results, result_count)) {
+	fprintf(stderr, "ERROR: could not write %s\n", options.out_path);
+	return 2;
+    }
+
+    if (options.compare_path != NULL) {
+	BENCH_RESULT baseline[BENCH_MAX_KERNELS];
+	int baseline_count = bench_read_results(options.compare_path, baseline, BENCH_MAX_KERNELS);
+	if (baseline_count < 0) {
+	    fprintf(stderr, "ERROR: could not read baseline %s\n", options.compare_path);
+	    return 2;
+	}
+	if (bench_compare(results, result_count, baseline, baseline_count, options.threshold) > 0) return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,188 @@
+#include "block.h"
+#include <stdio.h>
+#include <string.h>
+
+BLOCK_CACHE* block_cache_create(void)
+{
+    BLOCK_CACHE* cache = malloc(sizeof(BLOCK_CACHE));
+    if (cache == NULL) return NULL;
+    memset(cache, 0, sizeof(BLOCK_CACHE));
+    return cache;
+}
+
+void block_cache_destroy(BLOCK_CACHE* cache)
+{
+    free(cache);
+}
+
+static void block_evict(BLOCK_CACHE* cache, BLOCK* block)
+{
+    if (!block->valid) return;
+    block->valid = false;
+    cache->page_blocks[block->first_page] = cache->page_blocks[block->first_page] - 1;
+    if (block->last_page != block->first_page) {
+	cache->page_blocks[block->last_page] = cache->page_blocks[block->last_page] - 1;
+    }
+}
+
+void block_cache_clear(BLOCK_CACHE* cache)
+{
+    for (int i = 0; i < BLOCK_CACHE_SLOTS; i++) {
+	block_evict(cache, &cache->slot[i]);
+    }
+    cache->generation = cache->generation + 1;
+}
+
+void block_cache_invalidate_page(BLOCK_CACHE* cache, uchar page)
+{
+    if (cache->page_blocks[page] == 0) return;
+
+    for (int i = 0; i < BLOCK_CACHE_SLOTS && cache->page_blocks[page] != 0; i++) {
+	BLOCK* block = &cache->slot[i];
+	if (!block->valid) continue;
+	if (block->first_page != page && block->last_page != page) continue;
+	block_evict(cache, block);
+	cache->invalidations = cache->invalidations + 1;
+    }
+    cache->generation = cache->generation + 1;
+}
+
+void block_cache_invalidate_write(BLOCK_CACHE* cache, CPU* cpu, uchar page)
+{
+    BUS* bus = &cpu->bus;
+    if (bus->page[page].write != NULL || bus->page[page].read_only) return;
+    block_cache_invalidate_page(cache, page);
+    // bus_init maps every page to storage of its own.
+    if (!bus->remapped) return;
+    const uchar* storage = bus_storage(bus, cpu->memory, page);
+    for (int other = 0; other < BUS_PAGE_COUNT; other++) {
+	if (cache->page_blocks[other] == 0 || other == page) continue;
+	if (bus_storage(bus, cpu->memory, (uchar)other) == storage) block_cache_invalidate_page(cache, (uchar)other);
+    }
+}
+
+// Sends writes to `page`, and to every page mirroring its storage, through
+// cpu_write_memory's slow path.
+static void block_protect_page(CPU* cpu, uchar page)
+{
+    BUS* bus = &cpu->bus;
+    bus->write_fast[page] = NULL;
+    if (!bus->remapped) return;
+    const uchar* storage = bus_storage(bus, cpu->memory, page);
+    for (int other = 0; other < BUS_PAGE_COUNT; other++) {
+	if (bus_storage(bus, cpu->memory, (uchar)other) == storage) bus->write_fast[other] = NULL;
+    }
+}
+
+static bool block_ends_block(const INSTRUCTION_SET* instruction_set)
+{
+    if (instruction_set->handler == NULL) return true;
+    switch (instruction_set->instruction) {
+    case INSTRUCTION_BCC:
+    case INSTRUCTION_BCS:
+    case INSTRUCTION_BEQ:
+    case INSTRUCTION_BMI:
+    case INSTRUCTION_BNE:
+    case INSTRUCTION_BPL:
+    case INSTRUCTION_BVC:
+    case INSTRUCTION_BVS:
+    case INSTRUCTION_JSR:
+    case INSTRUCTION_RTS:
+    case INSTRUCTION_RTI:
+    case INSTRUCTION_JMP: {
+	return true;
+    } break;
+    default: {
+    } break;
+    }
+    return false;
+}
+
+static bool block_cacheable_page(CPU* cpu, uchar page)
+{
+    return cpu->bus.page[page].read == NULL;
+}
+
+static const BLOCK* block_compile(BLOCK_CACHE* cache, CPU* cpu, BLOCK* block,
+				  void* const* labels, const void* end_label)
+{
+    ushort pc = cpu->pc;
+    uchar page = pc >> 8;
+    uchar last_page = page;
+
+    block_evict(cache, block);
+    block->count = 0;
+
+    while (block->count < BLOCK_MAX_OPS) {
+	// Fills the read cache that `storage` is taken from below, without
+	// the decode showing up as a data read in a code/data log.
+	uchar op_code = bus_read_slow(&cpu->bus, cpu->memory, pc);
+	const INSTRUCTION_SET* instruction_set = cpu_get_instruction_set(op_code);
+	int bytes = instruction_set->handler == NULL ? 1 : instruction_set->bytes;
+	ushort next_pc = (ushort)(pc + bytes);
+	uchar end_page = (ushort)(pc + bytes - 1) >> 8;
+
+	// Operands spilling onto a third page, or onto a page that is not
+	// plain memory, end the block before this instruction.
+	if (end_page != page && (end_page != (uchar)(page + 1) || !block_cacheable_page(cpu, end_page))) break;
+
+	MICRO_OP* op = &block->ops[block->count];
+	op->label = labels != NULL ? labels[op_code] : NULL;
+	op->handler = instruction_set->handler;
+	op->mode = instruction_set->mode;
+	op->operand = cpu_read_operand(cpu, instruction_set->mode, (ushort)(pc + 1));
+	op->next_pc = next_pc;
+	op->cycles = instruction_set->cycles;
+	op->page_penalty = instruction_set->page_penalty;
+	block->count = block->count + 1;
+	if (end_page != page) last_page = end_page;
+
+	pc = next_pc;
+	if (block_ends_block(instruction_set)) break;
+	if ((pc >> 8) != page) break;
+    }
+
+    if (block->count == 0) {
+	cache->uncacheable = cache->uncacheable + 1;
+	return NULL;
+    }
+
+    block->ops[block->count] = (MICRO_OP){ .label = end_label };
+    block->start_pc = cpu->pc;
+    block->first_page = page;
+    block->last_page = last_page;
+    block->storage[0] = cpu->bus.read_fast[page];
+    block->storage[1] = cpu->bus.read_fast[last_page];
+    block->valid = true;
+
+    // Writes to code pages, through any mirror, must reach
+    // cpu_write_memory's slow path so the blocks decoded from them can be
+    // dropped.
+    cache->page_blocks[page] = cache->page_blocks[page] + 1;
+    block_protect_page(cpu, page);
+    if (last_page != page) {
+	cache->page_blocks[last_page] = cache->page_blocks[last_page] + 1;
+	block_protect_page(cpu, last_page);
+    }
+
+    cache->misses = cache->misses + 1;
+    return block;
+}
+
+const BLOCK* block_miss(BLOCK_CACHE* cache, CPU* cpu, void* const* labels, const void* end_label)
+{
+    if (!block_cacheable_page(cpu, cpu->pc >> 8)) {
+	cache->uncacheable = cache->uncacheable + 1;
+	return NULL;
+    }
+    return block_compile(cache, cpu, &cache->slot[block_slot(cpu->pc)], labels, end_label);
+}
+
+void block_cache_print_stats(BLOCK_CACHE* cache, FILE* out)
+{
+    uint64_t lookups = cache->hits + cache->misses;
+    double hit_rate = lookups == 0 ? 0.0 : 100.0 * (double)cache->hits / (double)lookups;
+    fprintf(out, "block cache: %llu hits, %llu misses (%.2f%% hit rate), %llu invalidations, %llu uncacheable\n",
+	    (unsigned long long)cache->hits, (unsigned long long)cache->misses, hit_rate,
+	    (unsigned long long)cache->invalidations, (unsigned long long)cache->uncacheable);
+}
@@ -0,0 +1,89 @@
+#ifndef BLOCK_H_
+#define BLOCK_H_
+
+#include "cpu.h"
+#include <stdio.h>
+
+#define BLOCK_MAX_OPS 32
+#define BLOCK_CACHE_SLOTS 1024
+
+// One predecoded instruction. `operand` is the raw operand already read
+// from memory, so executing it only has to resolve the indexed part of the
+// address against the current registers.
+typedef struct MICRO_OP {
+    const void* label;           // threaded-code target (computed goto builds)
+    INSTRUCTION_HANDLER handler; // NULL stops execution like BRK
+    ADDRESS_MODE mode;
+    ushort operand;
+    ushort next_pc;
+    uchar cycles;
+    bool page_penalty;
+} MICRO_OP;
+
+// A straight-line run of instructions ending at a branch, BRK, the end of
+// its page or BLOCK_MAX_OPS. ops[count] is a sentinel whose label leaves
+// the block. `storage` remembers which memory the code was decoded from, so
+// a remapped (bank switched) page simply misses.
+typedef struct BLOCK {
+    bool valid;
+    ushort start_pc;
+    uchar first_page;
+    uchar last_page;
+    const uchar* storage[2];
+    int count;
+    MICRO_OP ops[BLOCK_MAX_OPS + 1];
+} BLOCK;
+
+typedef struct BLOCK_CACHE {
+    BLOCK slot[BLOCK_CACHE_SLOTS];
+    ushort page_blocks[BUS_PAGE_COUNT]; // valid blocks decoded from each page
+    uint64_t generation;                // bumped on every invalidation
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;
+    uint64_t uncacheable;               // lookups at pcs that cannot be cached
+} BLOCK_CACHE;
+
+BLOCK_CACHE* block_cache_create(void);
+
+void block_cache_destroy(BLOCK_CACHE* cache);
+
+void block_cache_clear(BLOCK_CACHE* cache);
+
+// Drops every block decoded from `page`.
+void block_cache_invalidate_page(BLOCK_CACHE* cache, uchar page);
+
+// Drops every block decoded from the storage a write to `page` lands in,
+// whichever mirror of it the code ran from. Called by cpu_write_memory
+// when a write misses the write cache.
+void block_cache_invalidate_write(BLOCK_CACHE* cache, CPU* cpu, uchar page);
+
+// Decodes the block starting at cpu->pc into its slot, or returns NULL if
+// the code there cannot be cached (it lives behind an I/O callback).
+// `labels` maps opcodes to threaded-code targets and `end_label` is used for
+// the sentinel; both are NULL for the portable interpreter.
+const BLOCK* block_miss(BLOCK_CACHE* cache, CPU* cpu, void* const* labels, const void* end_label);
+
+static inline int block_slot(ushort pc)
+{
+    return (pc ^ (pc >> 10)) & (BLOCK_CACHE_SLOTS - 1);
+}
+
+// Returns the block starting at cpu->pc, decoding it on a miss.
+static inline const BLOCK* block_lookup(BLOCK_CACHE* cache, CPU* cpu, void* const* labels, const void* end_label)
+{
+    ushort pc = cpu->pc;
+    BLOCK* block = &cache->slot[block_slot(pc)];
+
+    if (block->valid && block->start_pc == pc
+	&& block->storage[0] == cpu->bus.read_fast[block->first_page]
+	&& block->storage[1] == cpu->bus.read_fast[block->last_page]) {
+	cache->hits = cache->hits + 1;
+	return block;
+    }
+    return block_miss(cache, cpu, labels, end_label);
+}
+
+void block_cache_print_stats(BLOCK_CACHE* cache, FILE* out);
+
+#endif // BLOCK_H_
@@ -0,0 +1,190 @@
+#include "bus.h"
+#include <string.h>
+
+void bus_init(BUS* bus)
+{
+    memset(bus, 0, sizeof(*bus));
+    for (int i = 0; i < BUS_PAGE_COUNT; i++) {
+	bus->page[i].offset = (ushort)(i * BUS_PAGE_SIZE);
+    }
+    // Nothing is known about memory hashed before.
+    bus_mark_unhashed(bus, NULL);
+}
+
+void bus_flush(BUS* bus)
+{
+    memset(bus->read_fast, 0, sizeof(bus->read_fast));
+    memset(bus->write_fast, 0, sizeof(bus->write_fast));
+}
+
+static void bus_clear_page(BUS* bus, int page)
+{
+    bus->remapped = true;
+    bus->read_fast[page] = NULL;
+    bus->write_fast[page] = NULL;
+    bus->page[page] = (BUS_PAGE){};
+}
+
+void bus_map_ram(BUS* bus, uchar first_page, int page_count, ushort offset)
+{
+    for (int i = 0; i < page_count && first_page + i < BUS_PAGE_COUNT; i++) {
+	bus_clear_page(bus, first_page + i);
+	bus->page[first_page + i].offset = (ushort)(offset + i * BUS_PAGE_SIZE);
+    }
+}
+
+void bus_map_host(BUS* bus, uchar first_page, int page_count, uchar* host, bool read_only)
+{
+    for (int i = 0; i < page_count && first_page + i < BUS_PAGE_COUNT; i++) {
+	bus_clear_page(bus, first_page + i);
+	bus->page[first_page + i].host = host + i * BUS_PAGE_SIZE;
+	bus->page[first_page + i].read_only = read_only;
+    }
+}
+
+void bus_map_shared(BUS* bus, uchar first_page, int page_count, const uchar* shared)
+{
+    for (int i = 0; i < page_count && first_page + i < BUS_PAGE_COUNT; i++) {
+	bus_clear_page(bus, first_page + i);
+	BUS_PAGE* page = &bus->page[first_page + i];
+	page->host = (uchar*)shared + i * BUS_PAGE_SIZE;
+	page->offset = (ushort)((first_page + i) * BUS_PAGE_SIZE);
+	page->copy_on_write = true;
+	page->shared = page->host;
+    }
+}
+
+void bus_set_shared(BUS* bus, uchar* memory, uchar page, bool shared)
+{
+    BUS_PAGE* entry = &bus->page[page];
+    if (entry->shared == NULL || entry->copy_on_write == shared) return;
+    if (shared) {
+	entry->host = (uchar*)entry->shared;
+    } else {
+	memcpy(memory + entry->offset, entry->shared, BUS_PAGE_SIZE);
+	bus_mark_dirty(bus, entry->offset, BUS_PAGE_SIZE);
+	entry->host = NULL;
+    }
+    entry->copy_on_write = shared;
+    bus->read_fast[page] = NULL;
+    bus->write_fast[page] = NULL;
+}
+
+void bus_remap_host(BUS* bus, uchar first_page, int page_count, uchar* host)
+{
+    bus->remapped = true;
+    for (int i = 0; i < page_count && first_page + i < BUS_PAGE_COUNT; i++) {
+	bus->page[first_page + i].host = host + i * BUS_PAGE_SIZE;
+	bus->read_fast[first_page + i] = NULL;
+	bus->write_fast[first_page + i] = NULL;
+    }
+}
+
+void bus_map_io(BUS* bus, uchar first_page, int page_count,
+		BUS_READ_CALLBACK read, BUS_WRITE_CALLBACK write, void* ctx)
+{
+    bus->remapped = true;
+    for (int i = 0; i < page_count && first_page + i < BUS_PAGE_COUNT; i++) {
+	BUS_PAGE* page = &bus->page[first_page + i];
+	page->read = read;
+	page->write = write;
+	page->ctx = ctx;
+	bus->read_fast[first_page + i] = NULL;
+	bus->write_fast[first_page + i] = NULL;
+    }
+}
+
+void bus_mark_dirty(BUS* bus, size_t offset, size_t length)
+{
+    if (length == 0) return;
+    size_t last = (offset + length - 1) / BUS_PAGE_SIZE;
+    for (size_t page = offset / BUS_PAGE_SIZE; page <= last && page < BUS_PAGE_COUNT; page++) {
+	bus->dirty[page / 64] = bus->dirty[page / 64] | (1ull << (page % 64));
+	bus->changed[page / 64] = bus->changed[page / 64] | (1ull << (page % 64));
+	bus->unhashed[page / 64] = bus->unhashed[page / 64] | (1ull << (page % 64));
+    }
+}
+
+void bus_take_changed(BUS* bus, uint64_t* pages)
+{
+    memcpy(pages, bus->changed, sizeof(bus->changed));
+    memset(bus->changed, 0, sizeof(bus->changed));
+    memset(bus->write_fast, 0, sizeof(bus->write_fast));
+}
+
+void bus_take_unhashed(BUS* bus, uint64_t* pages)
+{
+    memcpy(pages, bus->unhashed, sizeof(bus->unhashed));
+    memset(bus->unhashed, 0, sizeof(bus->unhashed));
+    memset(bus->write_fast, 0, sizeof(bus->write_fast));
+}
+
+void bus_mark_unhashed(BUS* bus, const uint64_t* pages)
+{
+    for (int word = 0; word < BUS_PAGE_COUNT / 64; word++) {
+	bus->unhashed[word] = bus->unhashed[word] | (pages != NULL ? pages[word] : ~0ull);
+    }
+}
+
+int bus_clean_dirty(BUS* bus, uchar* memory)
+{
+    int cleaned = 0;
+    for (int word = 0; word < BUS_PAGE_COUNT / 64; word++) {
+	uint64_t bits = bus->dirty[word];
+	while (bits != 0) {
+	    int page = word * 64 + __builtin_ctzll(bits);
+	    bits = bits & (bits - 1);
+	    memset(memory + page * BUS_PAGE_SIZE, 0, BUS_PAGE_SIZE);
+	    cleaned = cleaned + 1;
+	}
+	bus->unhashed[word] = bus->unhashed[word] | bus->dirty[word];
+	bus->dirty[word] = 0;
+    }
+    // The next write to any page has to mark it again, and no savestate
+    // matches the zeroed memory.
+    memset(bus->write_fast, 0, sizeof(bus->write_fast));
+    memset(bus->changed, 0, sizeof(bus->changed));
+    bus->snapshot = 0;
+    return cleaned;
+}
+
+void bus_mirror_nes_ram(BUS* bus)
+{
+    for (int mirror = 0; mirror < 4; mirror++) {
+	bus_map_ram(bus, (uchar)(mirror * 8), 8, 0x0000);
+    }
+}
+
+uchar bus_peek(BUS* bus, uchar* memory, ushort addr)
+{
+    return bus_storage(bus, memory, (uchar)(addr >> 8))[addr & 0xFF];
+}
+
+uchar bus_read_slow(BUS* bus, uchar* memory, ushort addr)
+{
+    BUS_PAGE* page = &bus->page[addr >> 8];
+    if (page->read != NULL) return page->read(page->ctx, addr);
+
+    uchar* storage = bus_storage(bus, memory, (uchar)(addr >> 8));
+    bus->read_fast[addr >> 8] = storage;
+    return storage[addr & 0xFF];
+}
+
+void bus_write_slow(BUS* bus, uchar* memory, ushort addr, uchar data)
+{
+    BUS_PAGE* page = &bus->page[addr >> 8];
+    if (page->write != NULL) {
+	page->write(page->ctx, addr, data);
+	return;
+    }
+    if (page->read_only) return;
+    if (page->copy_on_write) bus_set_shared(bus, memory, (uchar)(addr >> 8), false);
+
+    uchar* storage = page->host;
+    if (storage == NULL) {
+	storage = memory + page->offset;
+	bus_mark_dirty(bus, page->offset, BUS_PAGE_SIZE);
+    }
+    bus->write_fast[addr >> 8] = storage;
+    storage[addr & 0xFF] = data;
+}
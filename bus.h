@@ -0,0 +1,118 @@
+#ifndef BUS_H_
+#define BUS_H_
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define uchar unsigned char
+#define ushort unsigned short
+#define BUS_PAGE_COUNT 256
+#define BUS_PAGE_SIZE 256
+
+#if defined(__GNUC__)
+#define bus_likely(x) __builtin_expect(!!(x), 1)
+#else
+#define bus_likely(x) (x)
+#endif
+
+typedef uchar (*BUS_READ_CALLBACK)(void* ctx, ushort addr);
+typedef void (*BUS_WRITE_CALLBACK)(void* ctx, ushort addr, uchar data);
+
+// Where a 256 byte page of the CPU address space goes. Storage is either
+// `host` or, when that is NULL, the CPU's own memory at `offset`.
+// A callback takes over its direction of access from the storage.
+// A copy-on-write page reads from `shared` until the first write copies it
+// to memory at `offset` and the page switches over.
+typedef struct BUS_PAGE {
+    uchar* host;
+    ushort offset;
+    bool read_only;
+    bool copy_on_write;      // still reading `shared`
+    const uchar* shared;
+    BUS_READ_CALLBACK read;
+    BUS_WRITE_CALLBACK write;
+    void* ctx;
+} BUS_PAGE;
+
+// read_fast/write_fast cache the storage of plain memory pages so the
+// common access is one indexed load. A NULL entry sends the access through
+// bus_read_slow/bus_write_slow, which calls the page's callback or fills the
+// cache in. Because they may point into the owning CPU's memory, the caches
+// must be dropped with bus_flush whenever that memory moves.
+//
+// Filling a write cache entry for the CPU's own memory marks the storage
+// page in `dirty`, `changed` and `unhashed`, so every page that was
+// written has its bits set until bus_clean_dirty, or for the other two
+// bus_take_changed and bus_take_unhashed, clears them and drops the cache
+// entries again.
+typedef struct BUS {
+    uchar* read_fast[BUS_PAGE_COUNT];
+    uchar* write_fast[BUS_PAGE_COUNT];
+    BUS_PAGE page[BUS_PAGE_COUNT];
+    uint64_t dirty[BUS_PAGE_COUNT / 64];    // since the CPU was last recycled
+    uint64_t changed[BUS_PAGE_COUNT / 64];  // since the last savestate
+    uint64_t unhashed[BUS_PAGE_COUNT / 64]; // since the last state hash, see statehash.h
+    uint64_t snapshot; // generation of the savestate memory matches, 0 for none
+    bool remapped;     // the page table differs from bus_init's
+} BUS;
+
+void bus_init(BUS* bus);
+
+void bus_flush(BUS* bus);
+
+void bus_map_ram(BUS* bus, uchar first_page, int page_count, ushort offset);
+
+void bus_map_host(BUS* bus, uchar first_page, int page_count, uchar* host, bool read_only);
+
+// Points already mapped host pages at new storage, keeping their callbacks
+// and protection. This is how mappers switch banks without copying.
+void bus_remap_host(BUS* bus, uchar first_page, int page_count, uchar* host);
+
+// Shares `shared` between every bus mapped onto it, copy-on-write into
+// the CPU's memory at the same addresses. The shared pages are never
+// written and must outlive the mapping.
+void bus_map_shared(BUS* bus, uchar first_page, int page_count, const uchar* shared);
+
+// Switches a copy-on-write page between reading `shared` and its private
+// copy in memory. Making it private copies the shared page first.
+void bus_set_shared(BUS* bus, uchar* memory, uchar page, bool shared);
+
+// A NULL callback leaves that direction on the page's storage.
+void bus_map_io(BUS* bus, uchar first_page, int page_count,
+		BUS_READ_CALLBACK read, BUS_WRITE_CALLBACK write, void* ctx);
+
+// Marks the storage pages under memory[offset, offset + length) as written.
+void bus_mark_dirty(BUS* bus, size_t offset, size_t length);
+
+// Moves the `changed` bits to `pages` and starts tracking afresh.
+void bus_take_changed(BUS* bus, uint64_t* pages);
+
+// Moves the `unhashed` bits to `pages` and starts tracking afresh.
+void bus_take_unhashed(BUS* bus, uint64_t* pages);
+
+// Flags storage pages whose contents changed behind the bus's back, NULL
+// for all of them, for the next state hash.
+void bus_mark_unhashed(BUS* bus, const uint64_t* pages);
+
+// Zeroes every dirty storage page of `memory` and forgets that it was
+// written. Returns the number of pages cleared.
+int bus_clean_dirty(BUS* bus, uchar* memory);
+
+// $0000-$1FFF as four mirrors of the 2 KB of internal NES RAM.
+void bus_mirror_nes_ram(BUS* bus);
+
+// The storage behind a page: its host memory, or `memory` at its offset.
+static inline uchar* bus_storage(BUS* bus, uchar* memory, uchar page)
+{
+    return bus->page[page].host != NULL ? bus->page[page].host : memory + bus->page[page].offset;
+}
+
+// Reads a page's storage, ignoring its read callback.
+uchar bus_peek(BUS* bus, uchar* memory, ushort addr);
+
+uchar bus_read_slow(BUS* bus, uchar* memory, ushort addr);
+
+void bus_write_slow(BUS* bus, uchar* memory, ushort addr, uchar data);
+
+#endif // BUS_H_
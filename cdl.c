@@ -0,0 +1,56 @@
+#include "cdl.h"
+#include <string.h>
+
+CDL* cdl_create(void)
+{
+    return calloc(1, sizeof(CDL));
+}
+
+void cdl_destroy(CDL* cdl)
+{
+    free(cdl);
+}
+
+void cdl_clear(CDL* cdl)
+{
+    memset(cdl->bits, 0, sizeof(cdl->bits));
+}
+
+int cdl_count(const CDL* cdl, CDL_KIND kind)
+{
+    int count = 0;
+    for (int word = 0; word < CDL_WORDS; word++) count = count + __builtin_popcountll(cdl->bits[kind][word]);
+    return count;
+}
+
+bool cdl_save(const CDL* cdl, const char* path)
+{
+    uchar* bytes = calloc(1, MEMORY_SIZE);
+    if (bytes == NULL) return false;
+    for (int kind = 0; kind < CDL_KIND_COUNT; kind++) {
+	for (int addr = 0; addr < MEMORY_SIZE; addr++) {
+	    if (cdl_test(cdl, (CDL_KIND)kind, (ushort)addr)) bytes[addr] = bytes[addr] | (uchar)(1 << kind);
+	}
+    }
+    FILE* file = fopen(path, "wb");
+    bool saved = file != NULL && fwrite(bytes, 1, MEMORY_SIZE, file) == MEMORY_SIZE;
+    if (file != NULL && fclose(file) != 0) saved = false;
+    free(bytes);
+    return saved;
+}
+
+bool cdl_load(CDL* cdl, const char* path)
+{
+    uchar* bytes = malloc(MEMORY_SIZE);
+    if (bytes == NULL) return false;
+    FILE* file = fopen(path, "rb");
+    bool loaded = file != NULL && fread(bytes, 1, MEMORY_SIZE, file) == MEMORY_SIZE;
+    if (file != NULL) fclose(file);
+    for (int addr = 0; loaded && addr < MEMORY_SIZE; addr++) {
+	for (int kind = 0; kind < CDL_KIND_COUNT; kind++) {
+	    if (bytes[addr] & (1 << kind)) cdl_mark(cdl, (CDL_KIND)kind, (ushort)addr);
+	}
+    }
+    free(bytes);
+    return loaded;
+}
@@ -0,0 +1,59 @@
+#ifndef CDL_H_
+#define CDL_H_
+
+#include "cpu.h"
+#include <stdio.h>
+
+#define CDL_WORDS (MEMORY_SIZE / 64)
+
+// What the CPU did with a byte of its address space. A byte can be more
+// than one: an immediate operand is also read as data (the instruction
+// reads it through its operand address), and code that a program patches
+// is also written. Other operand bytes are only ever CDL_OPERAND.
+typedef enum {
+    CDL_OPCODE,
+    CDL_OPERAND,
+    CDL_READ,
+    CDL_WRITE,
+    CDL_KIND_COUNT
+} CDL_KIND;
+
+// Code/data log: one bit per address per kind, set while cpu_run executes
+// with the log attached as cpu->cdl. Marking is a single OR, and the bits
+// only ever accumulate until cdl_clear.
+typedef struct CDL {
+    uint64_t bits[CDL_KIND_COUNT][CDL_WORDS];
+} CDL;
+
+CDL* cdl_create(void);
+
+void cdl_destroy(CDL* cdl);
+
+void cdl_clear(CDL* cdl);
+
+static inline void cdl_mark(CDL* cdl, CDL_KIND kind, ushort addr)
+{
+    cdl->bits[kind][addr >> 6] |= 1ull << (addr & 63);
+}
+
+static inline bool cdl_test(const CDL* cdl, CDL_KIND kind, ushort addr)
+{
+    return (cdl->bits[kind][addr >> 6] >> (addr & 63)) & 1;
+}
+
+// The opcode at `pc` and the `bytes` - 1 operand bytes after it.
+static inline void cdl_mark_instruction(CDL* cdl, ushort pc, int bytes)
+{
+    cdl_mark(cdl, CDL_OPCODE, pc);
+    for (int i = 1; i < bytes; i++) cdl_mark(cdl, CDL_OPERAND, (ushort)(pc + i));
+}
+
+// Addresses with a bit of `kind` set.
+int cdl_count(const CDL* cdl, CDL_KIND kind);
+
+// CDL files hold one byte per address, bit n set for CDL_KIND n. Loading
+// ORs the file into what is already logged, so sessions accumulate.
+bool cdl_save(const CDL* cdl, const char* path);
+bool cdl_load(CDL* cdl, const char* path);
+
+#endif // CDL_H_
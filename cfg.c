@@ -0,0 +1,392 @@
+#include "cfg.h"
+#include <string.h>
+
+#define CFG_MAX_ROUNDS 8
+
+typedef struct CFG_WORK {
+    CPU* cpu;
+    const CDL* cdl;
+    CFG* cfg;
+    uint64_t decoded[CDL_WORDS]; // instruction starts
+    uint64_t leader[CDL_WORDS];  // block starts
+    ushort pending[MEMORY_SIZE];
+    int depth;
+} CFG_WORK;
+
+static inline bool cfg_bit(const uint64_t* bits, ushort addr)
+{
+    return (bits[addr >> 6] >> (addr & 63)) & 1;
+}
+
+static inline void cfg_set_bit(uint64_t* bits, ushort addr)
+{
+    bits[addr >> 6] |= 1ull << (addr & 63);
+}
+
+static ushort cfg_peek_word(CPU* cpu, ushort addr)
+{
+    return (ushort)(cpu_peek_memory(cpu, addr) | cpu_peek_memory(cpu, (ushort)(addr + 1)) << 8);
+}
+
+// How an instruction leaves its block, CFG_END_FALLTHROUGH for one that
+// does not.
+static CFG_END cfg_flow(const INSTRUCTION_SET* set)
+{
+    if (set->handler == NULL) return CFG_END_STOP;
+    if (set->mode == ADDRESS_RELATIVE) return CFG_END_BRANCH;
+    switch (set->instruction) {
+    case INSTRUCTION_JMP: return set->op_code == 0x6C ? CFG_END_INDIRECT : CFG_END_JUMP;
+    case INSTRUCTION_JSR: return CFG_END_CALL;
+    case INSTRUCTION_RTS:
+    case INSTRUCTION_RTI: return CFG_END_RETURN;
+    default: return CFG_END_FALLTHROUGH;
+    }
+}
+
+// The flow targets of the instruction at `addr`; the fall through comes
+// second for branches and calls.
+static int cfg_targets(CPU* cpu, ushort addr, const INSTRUCTION_SET* set, ushort* targets)
+{
+    ushort next = (ushort)(addr + set->bytes);
+    switch (cfg_flow(set)) {
+    case CFG_END_BRANCH:
+	targets[0] = (ushort)(next + (signed char)cpu_peek_memory(cpu, (ushort)(addr + 1)));
+	targets[1] = next;
+	return 2;
+    case CFG_END_JUMP:
+	targets[0] = cfg_peek_word(cpu, (ushort)(addr + 1));
+	return 1;
+    case CFG_END_CALL:
+	targets[0] = cfg_peek_word(cpu, (ushort)(addr + 1));
+	targets[1] = next;
+	return 2;
+    default:
+	return 0;
+    }
+}
+
+static void cfg_push(CFG_WORK* work, ushort addr)
+{
+    if (cfg_bit(work->leader, addr)) return;
+    cfg_set_bit(work->leader, addr);
+    if (!cfg_bit(work->decoded, addr)) work->pending[work->depth++] = addr;
+}
+
+// Decodes from every pending leader until each stream ends or runs into
+// code already decoded, which then starts a block of its own. Every
+// address is pushed at most once, so `pending` cannot overflow.
+static void cfg_discover(CFG_WORK* work)
+{
+    CPU* cpu = work->cpu;
+    while (work->depth > 0) {
+	ushort addr = work->pending[--work->depth];
+	if (cfg_bit(work->decoded, addr)) continue;
+	while (1) {
+	    if (cfg_bit(work->decoded, addr)) {
+		cfg_set_bit(work->leader, addr);
+		break;
+	    }
+	    cfg_set_bit(work->decoded, addr);
+	    const INSTRUCTION_SET* set = cpu_get_instruction_set(cpu_peek_memory(cpu, addr));
+	    int bytes = set->handler != NULL ? set->bytes : 1;
+	    for (int i = 0; i < bytes; i++) cfg_set_bit(work->cfg->code, (ushort)(addr + i));
+	    CFG_END end = cfg_flow(set);
+	    if (end != CFG_END_FALLTHROUGH) {
+		ushort targets[2];
+		int count = cfg_targets(cpu, addr, set, targets);
+		for (int i = 0; i < count; i++) cfg_push(work, targets[i]);
+		break;
+	    }
+	    addr = (ushort)(addr + bytes);
+	}
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+/* Jump tables                                                            */
+/* ---------------------------------------------------------------------- */
+
+static bool cfg_page_has_code(const CFG_WORK* work, int page)
+{
+    for (int word = page * 4; word < page * 4 + 4; word++) {
+	if (work->cfg->code[word] != 0 || work->cdl->bits[CDL_OPCODE][word] != 0) return true;
+    }
+    return false;
+}
+
+// A table entry has to land on an implemented opcode in a plain page that
+// already holds code.
+static bool cfg_plausible_target(const CFG_WORK* work, ushort target)
+{
+    const BUS_PAGE* page = &work->cpu->bus.page[target >> 8];
+    if (page->read != NULL) return false;
+    if (cpu_get_instruction_set(cpu_peek_memory(work->cpu, target))->handler == NULL) return false;
+    return cfg_page_has_code(work, target >> 8);
+}
+
+// Both bytes of a word at `addr` could belong to a table: not code, and
+// never written.
+static bool cfg_table_bytes(const CFG_WORK* work, ushort addr)
+{
+    for (int i = 0; i < 2; i++) {
+	ushort at = (ushort)(addr + i);
+	if (cfg_bit(work->cfg->code, at) || cdl_test(work->cdl, CDL_WRITE, at)) return false;
+    }
+    return true;
+}
+
+static bool cfg_table_entry(const CFG_WORK* work, ushort addr, bool rts)
+{
+    if (!cfg_table_bytes(work, addr)) return false;
+    return cfg_plausible_target(work, (ushort)(cfg_peek_word(work->cpu, addr) + rts));
+}
+
+static bool cfg_in_table(const CFG* cfg, ushort addr)
+{
+    for (int i = 0; i < cfg->table_count; i++) {
+	const CFG_TABLE* table = &cfg->tables[i];
+	if ((ushort)(addr - table->addr) < table->entries * 2) return true;
+    }
+    return false;
+}
+
+// Starts from each word the log saw read and grows the table both ways
+// while the neighbouring words look like entries of the same kind.
+// Returns how many new tables were found; their targets become leaders.
+static int cfg_find_tables(CFG_WORK* work)
+{
+    CFG* cfg = work->cfg;
+    int found = 0;
+    for (int addr = 0; addr < MEMORY_SIZE - 1 && cfg->table_count < CFG_MAX_TABLES; addr++) {
+	if (!cdl_test(work->cdl, CDL_READ, (ushort)addr) || !cdl_test(work->cdl, CDL_READ, (ushort)(addr + 1))) continue;
+	if (cfg_in_table(cfg, (ushort)addr) || cfg_in_table(cfg, (ushort)(addr + 1))) continue;
+	bool rts;
+	if (cfg_table_entry(work, (ushort)addr, false)) rts = false;
+	else if (cfg_table_entry(work, (ushort)addr, true)) rts = true;
+	else continue;
+
+	int first = addr;
+	while (first >= 2 && !cfg_in_table(cfg, (ushort)(first - 1)) && cfg_table_entry(work, (ushort)(first - 2), rts)) first = first - 2;
+	int end = addr + 2;
+	while (end < MEMORY_SIZE - 1 && !cfg_in_table(cfg, (ushort)end) && cfg_table_entry(work, (ushort)end, rts)) end = end + 2;
+
+	CFG_TABLE* table = &cfg->tables[cfg->table_count++];
+	table->addr = (ushort)first;
+	table->entries = (end - first) / 2;
+	table->rts = rts;
+	for (int entry = first; entry < end; entry = entry + 2) {
+	    cfg_push(work, (ushort)(cfg_peek_word(work->cpu, (ushort)entry) + rts));
+	}
+	found = found + 1;
+	addr = end - 1;
+    }
+    return found;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Blocks                                                                 */
+/* ---------------------------------------------------------------------- */
+
+// Decodes one block from its leader. The walk is the one cfg_discover
+// made from there, so it ends at a flow instruction or the next leader.
+static void cfg_build_block(CFG_WORK* work, ushort start, CFG_BLOCK* block)
+{
+    CPU* cpu = work->cpu;
+    memset(block, 0, sizeof(CFG_BLOCK));
+    block->start = start;
+    ushort addr = start;
+    while (1) {
+	const INSTRUCTION_SET* set = cpu_get_instruction_set(cpu_peek_memory(cpu, addr));
+	int bytes = set->handler != NULL ? set->bytes : 1;
+	block->last = addr;
+	block->instructions = block->instructions + 1;
+	block->length = block->length + bytes;
+	ushort next = (ushort)(addr + bytes);
+	block->end = cfg_flow(set);
+	if (block->end != CFG_END_FALLTHROUGH) {
+	    block->successor_count = cfg_targets(cpu, addr, set, block->successors);
+	    break;
+	}
+	if (cfg_bit(work->leader, next) || block->length >= MEMORY_SIZE) {
+	    block->successors[0] = next;
+	    block->successor_count = 1;
+	    break;
+	}
+	addr = next;
+    }
+
+    if (work->cdl == NULL) return;
+    block->executed = cdl_test(work->cdl, CDL_OPCODE, start);
+    for (int i = 0; i < block->length; i++) {
+	if (cdl_test(work->cdl, CDL_WRITE, (ushort)(start + i))) block->modified = true;
+    }
+}
+
+static void cfg_build_blocks(CFG_WORK* work)
+{
+    CFG* cfg = work->cfg;
+    int count = 0;
+    for (int word = 0; word < CDL_WORDS; word++) count = count + __builtin_popcountll(work->leader[word]);
+    cfg->blocks = calloc((size_t)(count > 0 ? count : 1), sizeof(CFG_BLOCK));
+    if (cfg->blocks == NULL) return;
+    for (int word = 0; word < CDL_WORDS; word++) {
+	uint64_t bits = work->leader[word];
+	while (bits != 0) {
+	    ushort start = (ushort)(word * 64 + __builtin_ctzll(bits));
+	    bits = bits & (bits - 1);
+	    CFG_BLOCK* block = &cfg->blocks[cfg->block_count++];
+	    cfg_build_block(work, start, block);
+	    cfg->instruction_count = cfg->instruction_count + block->instructions;
+	}
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+/* Self-modifying code and safe pages                                     */
+/* ---------------------------------------------------------------------- */
+
+static void cfg_find_modified(CFG_WORK* work)
+{
+    CFG* cfg = work->cfg;
+    int run_start = -1;
+    for (int addr = 0; addr <= MEMORY_SIZE; addr++) {
+	bool modified = addr < MEMORY_SIZE && cfg_bit(cfg->code, (ushort)addr) && cdl_test(work->cdl, CDL_WRITE, (ushort)addr);
+	if (modified && run_start < 0) run_start = addr;
+	if (modified || run_start < 0) continue;
+	if (cfg->modified_count < CFG_MAX_REGIONS) {
+	    cfg->modified[cfg->modified_count].start = (ushort)run_start;
+	    cfg->modified[cfg->modified_count].length = addr - run_start;
+	    cfg->modified_count = cfg->modified_count + 1;
+	}
+	run_start = -1;
+    }
+}
+
+static void cfg_find_safe(CFG_WORK* work)
+{
+    CFG* cfg = work->cfg;
+    for (int page = 0; page < BUS_PAGE_COUNT; page++) {
+	const BUS_PAGE* bus_page = &work->cpu->bus.page[page];
+	bool code = false;
+	bool written = false;
+	for (int word = page * 4; word < page * 4 + 4; word++) {
+	    code = code || cfg->code[word] != 0;
+	    written = written || (work->cdl != NULL && work->cdl->bits[CDL_WRITE][word] != 0);
+	}
+	if (!code || written || bus_page->read != NULL || bus_page->write != NULL) continue;
+	if (bus_page->read_only || work->cdl != NULL) cfg->safe[page / 64] |= 1ull << (page % 64);
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+/* Analysis                                                               */
+/* ---------------------------------------------------------------------- */
+
+CFG* cfg_analyze(CPU* cpu, const CDL* cdl)
+{
+    CFG* cfg = calloc(1, sizeof(CFG));
+    CFG_WORK* work = calloc(1, sizeof(CFG_WORK));
+    if (cfg == NULL || work == NULL) {
+	free(cfg);
+	free(work);
+	return NULL;
+    }
+    work->cpu = cpu;
+    work->cdl = cdl;
+    work->cfg = cfg;
+
+    static const ushort vectors[] = { 0xFFFC, 0xFFFA, 0xFFFE };
+    for (int i = 0; i < 3; i++) {
+	// Unset vectors point at $0000, which is never code here.
+	ushort target = cfg_peek_word(cpu, vectors[i]);
+	if (target != 0) cfg_push(work, target);
+    }
+    cfg_discover(work);
+    // Opcodes the log saw run but nothing decoded so far reaches were
+    // entered some way the walk cannot follow (an indirect jump, a return
+    // through a pushed address), so each starts a block.
+    if (cdl != NULL) {
+	for (int word = 0; word < CDL_WORDS; word++) {
+	    uint64_t bits = cdl->bits[CDL_OPCODE][word];
+	    while (bits != 0) {
+		ushort addr = (ushort)(word * 64 + __builtin_ctzll(bits));
+		bits = bits & (bits - 1);
+		if (cfg_bit(work->decoded, addr)) continue;
+		cfg_push(work, addr);
+		cfg_discover(work);
+	    }
+	}
+    }
+    // Table targets decode into more code, which can push a neighbouring
+    // word out of being a candidate, so look again until nothing changes.
+    for (int round = 0; cdl != NULL && round < CFG_MAX_ROUNDS && cfg_find_tables(work) > 0; round++) cfg_discover(work);
+
+    cfg_build_blocks(work);
+    if (cdl != NULL) cfg_find_modified(work);
+    cfg_find_safe(work);
+    free(work);
+    if (cfg->blocks == NULL) {
+	free(cfg);
+	return NULL;
+    }
+    return cfg;
+}
+
+void cfg_destroy(CFG* cfg)
+{
+    if (cfg == NULL) return;
+    free(cfg->blocks);
+    free(cfg);
+}
+
+const CFG_BLOCK* cfg_find_block(const CFG* cfg, ushort addr)
+{
+    int low = 0;
+    int high = cfg->block_count;
+    while (low < high) {
+	int middle = (low + high) / 2;
+	if (cfg->blocks[middle].start <= addr) low = middle + 1;
+	else high = middle;
+    }
+    if (low == 0) return NULL;
+    const CFG_BLOCK* block = &cfg->blocks[low - 1];
+    return addr - block->start < block->length ? block : NULL;
+}
+
+bool cfg_is_code(const CFG* cfg, ushort addr)
+{
+    return cfg_bit(cfg->code, addr);
+}
+
+bool cfg_is_safe(const CFG* cfg, ushort addr)
+{
+    return cfg_is_code(cfg, addr) && ((cfg->safe[addr >> 14] >> ((addr >> 8) & 63)) & 1);
+}
+
+void cfg_print(const CFG* cfg, FILE* out)
+{
+    static const char* ends[] = { "falls through", "branch", "jump", "call", "return", "indirect", "stop" };
+    fprintf(out, "%d blocks, %d instructions, %d jump tables, %d self-modified regions\n",
+	    cfg->block_count, cfg->instruction_count, cfg->table_count, cfg->modified_count);
+    for (int i = 0; i < cfg->block_count; i++) {
+	const CFG_BLOCK* block = &cfg->blocks[i];
+	fprintf(out, "  %04X-%04X %3d ins  %-13s", block->start, (ushort)(block->start + block->length - 1),
+		block->instructions, ends[block->end]);
+	for (int s = 0; s < block->successor_count; s++) fprintf(out, " %04X", block->successors[s]);
+	if (!block->executed) fprintf(out, "  (not run)");
+	if (block->modified) fprintf(out, "  (modified)");
+	fprintf(out, "\n");
+    }
+    for (int i = 0; i < cfg->table_count; i++) {
+	const CFG_TABLE* table = &cfg->tables[i];
+	fprintf(out, "  table %04X: %d entries%s\n", table->addr, table->entries, table->rts ? ", RTS style" : "");
+    }
+    for (int i = 0; i < cfg->modified_count; i++) {
+	fprintf(out, "  modified %04X-%04X\n", cfg->modified[i].start, (ushort)(cfg->modified[i].start + cfg->modified[i].length - 1));
+    }
+    fprintf(out, "  safe pages:");
+    for (int page = 0; page < BUS_PAGE_COUNT; page++) {
+	if ((cfg->safe[page / 64] >> (page % 64)) & 1) fprintf(out, " %02X", page);
+    }
+    fprintf(out, "\n");
+}
@@ -0,0 +1,87 @@
+#ifndef CFG_H_
+#define CFG_H_
+
+#include "cpu.h"
+#include "cdl.h"
+#include <stdio.h>
+
+#define CFG_MAX_TABLES 64
+#define CFG_MAX_REGIONS 64
+
+typedef enum {
+    CFG_END_FALLTHROUGH,         // runs into the next block
+    CFG_END_BRANCH,              // taken and not taken
+    CFG_END_JUMP,                // JMP absolute
+    CFG_END_CALL,                // JSR: the subroutine, then the return address
+    CFG_END_RETURN,              // RTS, RTI
+    CFG_END_INDIRECT,            // JMP indirect, targets only known from tables
+    CFG_END_STOP                 // BRK or an opcode the CPU does not implement
+} CFG_END;
+
+// A straight run of instructions entered only at `start`.
+typedef struct CFG_BLOCK {
+    ushort start;
+    ushort last;                 // address of the final instruction
+    int length;                  // bytes
+    int instructions;
+    CFG_END end;
+    int successor_count;
+    ushort successors[2];
+    bool executed;               // the log saw it run
+    bool modified;               // the log saw one of its bytes written
+} CFG_BLOCK;
+
+// A run of little endian words pointing at code.
+typedef struct CFG_TABLE {
+    ushort addr;
+    int entries;
+    bool rts;                    // entries hold target - 1, for a push and RTS
+} CFG_TABLE;
+
+// Code bytes the program wrote.
+typedef struct CFG_REGION {
+    ushort start;
+    int length;
+} CFG_REGION;
+
+// Control-flow graph of whatever is mapped into the CPU's address space,
+// decoded from the reset, NMI and IRQ vectors, every opcode a code/data
+// log saw run, and the targets of any jump tables found through it.
+//
+// Jump tables are found by heuristic: words the program read as data,
+// never wrote, and that point at plausible code in pages that hold code.
+// Split tables (low and high bytes apart) are not recognised.
+//
+// A page is safe to translate ahead of time when it holds code, has no
+// I/O callbacks, and either is read-only or the log never saw it written.
+// Everything holds for the banks mapped at analysis time; a mapper that
+// switches banks needs an analysis per bank.
+typedef struct CFG {
+    CFG_BLOCK* blocks;           // sorted by start
+    int block_count;
+    int instruction_count;
+    CFG_TABLE tables[CFG_MAX_TABLES];
+    int table_count;
+    CFG_REGION modified[CFG_MAX_REGIONS];
+    int modified_count;          // more regions than fit are dropped
+    uint64_t code[CDL_WORDS];    // bytes decoded as part of an instruction
+    uint64_t safe[BUS_PAGE_COUNT / 64];
+} CFG;
+
+// `cdl` may be NULL to decode from the vectors alone; no tables are found
+// and only read-only pages can be safe then. Memory is read with
+// cpu_peek_memory, so I/O registers are not disturbed.
+CFG* cfg_analyze(CPU* cpu, const CDL* cdl);
+
+void cfg_destroy(CFG* cfg);
+
+// The block whose bytes include `addr`, or NULL.
+const CFG_BLOCK* cfg_find_block(const CFG* cfg, ushort addr);
+
+bool cfg_is_code(const CFG* cfg, ushort addr);
+
+bool cfg_is_safe(const CFG* cfg, ushort addr);
+
+void cfg_print(const CFG* cfg, FILE* out);
+
+#endif // CFG_H_
@@ -0,0 +1,287 @@
+#include "conform.h"
+#include <stddef.h>
+#include <string.h>
+
+/* ---------------------------------------------------------------------- */
+/* Parser                                                                 */
+/* ---------------------------------------------------------------------- */
+
+void conform_parser_init(CONFORM_PARSER* parser, const char* text, size_t size)
+{
+    parser->at = text;
+    parser->end = text + size;
+    parser->started = false;
+    parser->error = false;
+}
+
+static void conform_skip_space(CONFORM_PARSER* parser)
+{
+    while (parser->at < parser->end && (*parser->at == ' ' || *parser->at == '\n' || *parser->at == '\r' || *parser->at == '\t')) {
+	parser->at = parser->at + 1;
+    }
+}
+
+// Consumes `c` after any whitespace. Sets the error when it is not there.
+static bool conform_expect(CONFORM_PARSER* parser, char c)
+{
+    conform_skip_space(parser);
+    if (parser->at < parser->end && *parser->at == c) {
+	parser->at = parser->at + 1;
+	return true;
+    }
+    parser->error = true;
+    return false;
+}
+
+// Consumes `c` if it comes next.
+static bool conform_accept(CONFORM_PARSER* parser, char c)
+{
+    conform_skip_space(parser);
+    if (parser->at < parser->end && *parser->at == c) {
+	parser->at = parser->at + 1;
+	return true;
+    }
+    return false;
+}
+
+// Reads a string, truncated to fit `out`. Escapes are kept as written;
+// the vectors only use them in names.
+static bool conform_string(CONFORM_PARSER* parser, char* out, size_t out_size)
+{
+    if (!conform_expect(parser, '"')) return false;
+    size_t length = 0;
+    while (parser->at < parser->end && *parser->at != '"') {
+	if (*parser->at == '\\' && parser->at + 1 < parser->end) {
+	    if (length + 1 < out_size) out[length++] = *parser->at;
+	    parser->at = parser->at + 1;
+	}
+	if (length + 1 < out_size) out[length++] = *parser->at;
+	parser->at = parser->at + 1;
+    }
+    if (out_size > 0) out[length] = '\0';
+    return conform_expect(parser, '"');
+}
+
+static bool conform_number(CONFORM_PARSER* parser, unsigned* value)
+{
+    conform_skip_space(parser);
+    unsigned result = 0;
+    const char* start = parser->at;
+    while (parser->at < parser->end && *parser->at >= '0' && *parser->at <= '9') {
+	result = result * 10 + (unsigned)(*parser->at - '0');
+	parser->at = parser->at + 1;
+    }
+    if (parser->at == start) {
+	parser->error = true;
+	return false;
+    }
+    *value = result;
+    return true;
+}
+
+// Skips any value, nested ones included.
+static bool conform_skip_value(CONFORM_PARSER* parser)
+{
+    conform_skip_space(parser);
+    if (parser->at >= parser->end) {
+	parser->error = true;
+	return false;
+    }
+    char c = *parser->at;
+    if (c == '"') {
+	char discard[1];
+	return conform_string(parser, discard, 0);
+    }
+    if (c == '{' || c == '[') {
+	char close = c == '{' ? '}' : ']';
+	parser->at = parser->at + 1;
+	if (conform_accept(parser, close)) return true;
+	do {
+	    if (c == '{') {
+		char discard[1];
+		if (!conform_string(parser, discard, 0) || !conform_expect(parser, ':')) return false;
+	    }
+	    if (!conform_skip_value(parser)) return false;
+	} while (conform_accept(parser, ','));
+	return conform_expect(parser, close);
+    }
+    // Numbers, true, false and null.
+    while (parser->at < parser->end && *parser->at != ',' && *parser->at != '}' && *parser->at != ']'
+	   && *parser->at != ' ' && *parser->at != '\n' && *parser->at != '\r' && *parser->at != '\t') {
+	parser->at = parser->at + 1;
+    }
+    return true;
+}
+
+// [[addr, value], ...]
+static bool conform_ram(CONFORM_PARSER* parser, CONFORM_STATE* state)
+{
+    state->ram_count = 0;
+    if (!conform_expect(parser, '[')) return false;
+    if (conform_accept(parser, ']')) return true;
+    do {
+	unsigned addr;
+	unsigned value;
+	if (state->ram_count == CONFORM_RAM_MAX) {
+	    parser->error = true;
+	    return false;
+	}
+	if (!conform_expect(parser, '[') || !conform_number(parser, &addr) || !conform_expect(parser, ',')
+	    || !conform_number(parser, &value) || !conform_expect(parser, ']')) return false;
+	state->ram_addr[state->ram_count] = (ushort)addr;
+	state->ram_value[state->ram_count] = (uchar)value;
+	state->ram_count = state->ram_count + 1;
+    } while (conform_accept(parser, ','));
+    return conform_expect(parser, ']');
+}
+
+static bool conform_state(CONFORM_PARSER* parser, CONFORM_STATE* state)
+{
+    memset(state, 0, offsetof(CONFORM_STATE, ram_addr));
+    if (!conform_expect(parser, '{')) return false;
+    if (conform_accept(parser, '}')) return true;
+    do {
+	char key[8];
+	unsigned value = 0;
+	if (!conform_string(parser, key, sizeof(key)) || !conform_expect(parser, ':')) return false;
+	if (strcmp(key, "ram") == 0) {
+	    if (!conform_ram(parser, state)) return false;
+	    continue;
+	}
+	if (strcmp(key, "pc") != 0 && strcmp(key, "s") != 0 && strcmp(key, "a") != 0 && strcmp(key, "x") != 0
+	    && strcmp(key, "y") != 0 && strcmp(key, "p") != 0) {
+	    if (!conform_skip_value(parser)) return false;
+	    continue;
+	}
+	if (!conform_number(parser, &value)) return false;
+	switch (key[0]) {
+	case 'p': if (key[1] == 'c') state->pc = (ushort)value; else state->p = (uchar)value; break;
+	case 's': state->s = (uchar)value; break;
+	case 'a': state->a = (uchar)value; break;
+	case 'x': state->x = (uchar)value; break;
+	case 'y': state->y = (uchar)value; break;
+	}
+    } while (conform_accept(parser, ','));
+    return conform_expect(parser, '}');
+}
+
+// [[addr, value, "read"|"write"], ...]
+static bool conform_cycles(CONFORM_PARSER* parser, CONFORM_CASE* test)
+{
+    test->cycle_count = 0;
+    if (!conform_expect(parser, '[')) return false;
+    if (conform_accept(parser, ']')) return true;
+    do {
+	unsigned addr;
+	unsigned value;
+	char kind[8];
+	if (test->cycle_count == CONFORM_CYCLES_MAX) {
+	    parser->error = true;
+	    return false;
+	}
+	if (!conform_expect(parser, '[') || !conform_number(parser, &addr) || !conform_expect(parser, ',')
+	    || !conform_number(parser, &value) || !conform_expect(parser, ',')
+	    || !conform_string(parser, kind, sizeof(kind)) || !conform_expect(parser, ']')) return false;
+	test->cycle_addr[test->cycle_count] = (ushort)addr;
+	test->cycle_value[test->cycle_count] = (uchar)value;
+	test->cycle_write[test->cycle_count] = kind[0] == 'w';
+	test->cycle_count = test->cycle_count + 1;
+    } while (conform_accept(parser, ','));
+    return conform_expect(parser, ']');
+}
+
+bool conform_next_case(CONFORM_PARSER* parser, CONFORM_CASE* test)
+{
+    if (parser->error) return false;
+    if (!parser->started) {
+	if (!conform_expect(parser, '[')) return false;
+	parser->started = true;
+	if (conform_accept(parser, ']')) {
+	    parser->at = parser->end;
+	    return false;
+	}
+    } else {
+	if (conform_accept(parser, ']')) {
+	    parser->at = parser->end;
+	    return false;
+	}
+	if (!conform_expect(parser, ',')) return false;
+    }
+
+    test->name[0] = '\0';
+    test->initial.ram_count = 0;
+    test->final.ram_count = 0;
+    test->cycle_count = 0;
+    if (!conform_expect(parser, '{')) return false;
+    if (conform_accept(parser, '}')) return true;
+    do {
+	char key[16];
+	if (!conform_string(parser, key, sizeof(key)) || !conform_expect(parser, ':')) return false;
+	bool parsed;
+	if (strcmp(key, "name") == 0) parsed = conform_string(parser, test->name, sizeof(test->name));
+	else if (strcmp(key, "initial") == 0) parsed = conform_state(parser, &test->initial);
+	else if (strcmp(key, "final") == 0) parsed = conform_state(parser, &test->final);
+	else if (strcmp(key, "cycles") == 0) parsed = conform_cycles(parser, test);
+	else parsed = conform_skip_value(parser);
+	if (!parsed) return false;
+    } while (conform_accept(parser, ','));
+    return conform_expect(parser, '}');
+}
+
+/* ---------------------------------------------------------------------- */
+/* Runner                                                                 */
+/* ---------------------------------------------------------------------- */
+
+// B and bit 5 only exist when P is pushed.
+#define CONFORM_STATUS_MASK ((uchar)~(FLAG_B | 0b00100000))
+
+const char* conform_run_case(CPU* cpu, const CONFORM_CASE* test)
+{
+    cpu_recycle(cpu);
+    const CONFORM_STATE* initial = &test->initial;
+    for (int i = 0; i < initial->ram_count; i++) {
+	cpu->memory[initial->ram_addr[i]] = initial->ram_value[i];
+	bus_mark_dirty(&cpu->bus, initial->ram_addr[i], 1);
+    }
+    cpu->pc = initial->pc;
+    cpu->reg_sp = initial->s;
+    cpu->reg_a = initial->a;
+    cpu->reg_x = initial->x;
+    cpu->reg_y = initial->y;
+    cpu_set_status(cpu, initial->p);
+    uint64_t start = cpu->cycles;
+
+    cpu_run_for_cycles(cpu, 1);
+
+    const CONFORM_STATE* final = &test->final;
+    if (cpu->pc != final->pc) return "pc";
+    if (cpu->reg_sp != final->s) return "s";
+    if (cpu->reg_a != final->a) return "a";
+    if (cpu->reg_x != final->x) return "x";
+    if (cpu->reg_y != final->y) return "y";
+    if ((cpu->status & CONFORM_STATUS_MASK) != (final->p & CONFORM_STATUS_MASK)) return "p";
+    for (int i = 0; i < final->ram_count; i++) {
+	if (cpu_peek_memory(cpu, final->ram_addr[i]) != final->ram_value[i]) return "ram";
+    }
+    if (cpu->cycles - start != (uint64_t)test->cycle_count) return "cycles";
+    return NULL;
+}
+
+void conform_run_file(CPU* cpu, const char* text, size_t size, CONFORM_RESULT* result)
+{
+    memset(result, 0, sizeof(CONFORM_RESULT));
+    CONFORM_PARSER parser;
+    CONFORM_CASE test;
+    conform_parser_init(&parser, text, size);
+    while (conform_next_case(&parser, &test)) {
+	result->cases = result->cases + 1;
+	const char* check = conform_run_case(cpu, &test);
+	if (check == NULL) {
+	    result->passed = result->passed + 1;
+	} else if (result->first_check == NULL) {
+	    result->first_check = check;
+	    memcpy(result->first_failure, test.name, sizeof(result->first_failure));
+	}
+    }
+    result->parse_error = parser.error;
+}
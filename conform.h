@@ -0,0 +1,71 @@
+#ifndef CONFORM_H_
+#define CONFORM_H_
+
+#include "cpu.h"
+
+// Single-step test vectors: one JSON file per opcode, an array of cases
+// that each give the registers and touched RAM before and after one
+// instruction, plus the bus cycles it takes:
+//
+//   { "name": "a9 3f 12", "initial": { "pc": 32768, "s": 253, "a": 0,
+//     "x": 0, "y": 0, "p": 36, "ram": [[32768, 169], [32769, 63]] },
+//     "final": { ... }, "cycles": [[32768, 169, "read"], ...] }
+#define CONFORM_NAME_SIZE 64
+#define CONFORM_RAM_MAX 64
+#define CONFORM_CYCLES_MAX 16
+
+typedef struct CONFORM_STATE {
+    ushort pc;
+    uchar s;
+    uchar a;
+    uchar x;
+    uchar y;
+    uchar p;
+    int ram_count;
+    ushort ram_addr[CONFORM_RAM_MAX];
+    uchar ram_value[CONFORM_RAM_MAX];
+} CONFORM_STATE;
+
+typedef struct CONFORM_CASE {
+    char name[CONFORM_NAME_SIZE];
+    CONFORM_STATE initial;
+    CONFORM_STATE final;
+    int cycle_count;
+    ushort cycle_addr[CONFORM_CYCLES_MAX];
+    uchar cycle_value[CONFORM_CYCLES_MAX];
+    bool cycle_write[CONFORM_CYCLES_MAX];
+} CONFORM_CASE;
+
+// Reads cases out of a file's text one at a time, straight into a
+// caller's CONFORM_CASE; nothing is allocated. Unknown keys are skipped.
+typedef struct CONFORM_PARSER {
+    const char* at;
+    const char* end;
+    bool started;       // past the opening '['
+    bool error;
+} CONFORM_PARSER;
+
+typedef struct CONFORM_RESULT {
+    uint64_t cases;
+    uint64_t passed;
+    bool parse_error;
+    char first_failure[CONFORM_NAME_SIZE];  // name of the first failing case
+    const char* first_check;                // and what differed in it
+} CONFORM_RESULT;
+
+void conform_parser_init(CONFORM_PARSER* parser, const char* text, size_t size);
+
+// Parses the next case into `test`. Returns false at the end of the array
+// or, with parser->error set, on malformed input or a case bigger than
+// the limits above.
+bool conform_next_case(CONFORM_PARSER* parser, CONFORM_CASE* test);
+
+// Runs one case as a single-instruction step of cpu_run on `cpu`, which
+// is recycled first. Returns NULL when it passed, otherwise what differed.
+// Cycles are compared by count: the CPU does not record its bus accesses.
+const char* conform_run_case(CPU* cpu, const CONFORM_CASE* test);
+
+// Runs every case in a file's text.
+void conform_run_file(CPU* cpu, const char* text, size_t size, CONFORM_RESULT* result);
+
+#endif // CONFORM_H_
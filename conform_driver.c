@@ -0,0 +1,158 @@
+#include "conform.h"
+#include "pool.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CONFORM_PATH_SIZE 512
+
+typedef enum {
+    CONFORM_SKIPPED,             // not implemented here
+    CONFORM_MISSING,             // no file for it
+    CONFORM_PASSED,
+    CONFORM_FAILED
+} CONFORM_OUTCOME;
+
+typedef struct CONFORM_JOB {
+    CONFORM_OUTCOME outcome;
+    CONFORM_RESULT result;
+} CONFORM_JOB;
+
+typedef struct CONFORM_RUN {
+    const char* directory;
+    bool all;                    // also run opcodes this CPU stops on
+    CPU* cpus;                   // one per worker
+    CONFORM_JOB jobs[256];
+} CONFORM_RUN;
+
+static double conform_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void conform_usage(void)
+{
+    fprintf(stderr,
+	    "usage: quick_nes_conform [--threads N] [--all] DIR\n"
+	    "Runs the single-step test vectors in DIR/xx.json, one file per opcode,\n"
+	    "and prints which opcodes pass. Opcodes the CPU does not implement are\n"
+	    "skipped unless --all is given.\n");
+}
+
+// Maps the file read-only; the parser walks it in place.
+static void conform_run_opcode(void* ctx, size_t index, int worker)
+{
+    CONFORM_RUN* run = ctx;
+    CONFORM_JOB* job = &run->jobs[index];
+    job->outcome = CONFORM_SKIPPED;
+    if (!run->all && cpu_get_instruction_set((uchar)index)->handler == NULL) return;
+
+    char path[CONFORM_PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%02x.json", run->directory, (unsigned)index);
+    job->outcome = CONFORM_MISSING;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+	close(fd);
+	return;
+    }
+    const char* text = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) return;
+    madvise((void*)text, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    conform_run_file(&run->cpus[worker], text, (size_t)st.st_size, &job->result);
+    munmap((void*)text, (size_t)st.st_size);
+    bool passed = !job->result.parse_error && job->result.cases > 0 && job->result.passed == job->result.cases;
+    job->outcome = passed ? CONFORM_PASSED : CONFORM_FAILED;
+}
+
+static void conform_print(const CONFORM_RUN* run, double seconds)
+{
+    static const char marks[] = { '-', '?', '.', 'X' };
+    printf("    ");
+    for (int lo = 0; lo < 16; lo++) printf(" %X", lo);
+    printf("\n");
+    for (int hi = 0; hi < 16; hi++) {
+	printf("  %X_", hi);
+	for (int lo = 0; lo < 16; lo++) printf(" %c", marks[run->jobs[hi * 16 + lo].outcome]);
+	printf("\n");
+    }
+    printf("  . passed  X failed  - not implemented  ? no vectors\n\n");
+
+    int counts[4] = { 0 };
+    uint64_t cases = 0;
+    for (int op = 0; op < 256; op++) {
+	const CONFORM_JOB* job = &run->jobs[op];
+	counts[job->outcome] = counts[job->outcome] + 1;
+	cases = cases + job->result.cases;
+	if (job->outcome != CONFORM_FAILED) continue;
+	const CONFORM_RESULT* result = &job->result;
+	printf("%02X %s: %llu/%llu passed", op, cpu_get_instruction_set((uchar)op)->name,
+	       (unsigned long long)result->passed, (unsigned long long)result->cases);
+	if (result->first_check != NULL) printf(", first failure \"%s\" (%s)", result->first_failure, result->first_check);
+	if (result->parse_error) printf(", malformed file");
+	printf("\n");
+    }
+    printf("%d passed, %d failed, %d not implemented, %d without vectors; %llu cases in %.2fs\n",
+	   counts[CONFORM_PASSED], counts[CONFORM_FAILED], counts[CONFORM_SKIPPED], counts[CONFORM_MISSING],
+	   (unsigned long long)cases, seconds);
+}
+
+int main(int argc, char** argv)
+{
+    int threads = pool_default_workers();
+    CONFORM_RUN* run = calloc(1, sizeof(CONFORM_RUN));
+    if (run == NULL) {
+	fprintf(stderr, "ERROR: out of memory\n");
+	return 2;
+    }
+    for (int i = 1; i < argc; i++) {
+	bool has_value = i + 1 < argc;
+	if (strcmp(argv[i], "--threads") == 0 && has_value) {
+	    threads = atoi(argv[++i]);
+	} else if (strcmp(argv[i], "--all") == 0) {
+	    run->all = true;
+	} else if (run->directory == NULL && argv[i][0] != '-') {
+	    run->directory = argv[i];
+	} else {
+	    conform_usage();
+	    free(run);
+	    return 2;
+	}
+    }
+    if (run->directory == NULL || threads < 1) {
+	conform_usage();
+	free(run);
+	return 2;
+    }
+
+    run->cpus = aligned_alloc(64, sizeof(CPU) * (size_t)threads);
+    bool ready = run->cpus != NULL;
+    for (int i = 0; ready && i < threads; i++) run->cpus[i] = make_cpu();
+
+    double start = conform_now();
+    POOL_STATS stats;
+    ready = ready && pool_run(threads, 256, conform_run_opcode, run, &stats);
+    double elapsed = conform_now() - start;
+    for (int i = 0; run->cpus != NULL && i < threads; i++) cpu_free_memory(&run->cpus[i]);
+    free(run->cpus);
+    if (!ready) {
+	fprintf(stderr, "ERROR: could not start the worker pool\n");
+	free(run);
+	return 2;
+    }
+
+    conform_print(run, elapsed);
+    int failed = 0;
+    for (int op = 0; op < 256; op++) failed = failed + (run->jobs[op].outcome == CONFORM_FAILED);
+    free(run);
+    return failed > 0 ? 1 : 0;
+}
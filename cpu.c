@@ -1,4 +1,10 @@
 #include "cpu.h"
+#include "block.h"
+#include "trace.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "idle.h"
+#include "cdl.h"
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
@@ -8,18 +14,64 @@
 
 #define uchar unsigned char
 #define ushort unsigned short
-#define MEMORY_SIZE 0xFFFF
+
+// Hot helpers are forced inline into the dispatch loops so that the
+// constant addressing mode of each opcode label folds their switches away.
+#if defined(__GNUC__)
+#define CPU_HOT static inline __attribute__((always_inline))
+#else
+#define CPU_HOT static inline
+#endif
+
+static void cpu_power_on(CPU* cpu)
+{
+    cpu->reg_a = 0;
+    cpu->reg_x = 0;
+    cpu->reg_y = 0;
+    cpu->reg_sp = 0;
+    cpu->status = 0b00100000;
+    cpu->flag_n = 0;
+    cpu->flag_z = 1;
+    cpu->pc = 0;
+    cpu->cycles = 0;
+    cpu->page_crossed = false;
+    cpu->halted = false;
+    cpu->irq_line = false;
+    cpu->deadline = UINT64_MAX;
+    cpu->blocks = NULL;
+    cpu->tracer = NULL;
+    cpu->profiler = NULL;
+    cpu->scheduler = NULL;
+    cpu->idle = NULL;
+    cpu->cdl = NULL;
+}
+
+void cpu_init(CPU* cpu, uchar* memory)
+{
+    cpu_power_on(cpu);
+    cpu->memory = memory;
+    bus_init(&cpu->bus);
+}
 
 CPU make_cpu(void)
 {
-    return (CPU){
-	.reg_a = 0,
-	.status = 0b00100000,
-	.pc = 0,
-	.reg_x = 0,
-	.reg_y = 0,
-	.memory = {}
-    };
+    CPU cpu;
+    cpu_init(&cpu, calloc(1, MEMORY_SIZE));
+    return cpu;
+}
+
+void cpu_free_memory(CPU* cpu)
+{
+    free(cpu->memory);
+    cpu->memory = NULL;
+}
+
+int cpu_recycle(CPU* cpu)
+{
+    cpu_power_on(cpu);
+    int cleaned = bus_clean_dirty(&cpu->bus, cpu->memory);
+    if (cpu->bus.remapped) bus_init(&cpu->bus);
+    return cleaned;
 }
 
 ushort add_wrap_ushort(ushort a, ushort b)
@@ -33,91 +85,169 @@ ushort add_wrap_ushort(ushort a, ushort b)
 	}
 }
 
-INSTRUCTION_SET cpu_turn_op_into_instruction_set(uchar op)
-{
-    // (op_code, instruction, bytes, cycles, mode)
-    switch (op) {
-    // BRK
-    instruction_case(0x00, INSTRUCTION_BRK, 1, 7, ADDRESS_NONE);
-	// CLEAR
-    instruction_case(0x18, INSTRUCTION_CLC, 1, 2, ADDRESS_ZEROPAGE);
-	instruction_case(0xD8, INSTRUCTION_CLD, 1, 2, ADDRESS_ZEROPAGE);
-	instruction_case(0x58, INSTRUCTION_CLI, 1, 2, ADDRESS_ZEROPAGE);
-	instruction_case(0xB8, INSTRUCTION_CLV, 1, 2, ADDRESS_ZEROPAGE);	
-	// BIT
-    instruction_case(0x24, INSTRUCTION_BIT, 2, 3, ADDRESS_ZEROPAGE);
-	instruction_case(0x2C, INSTRUCTION_BIT, 3, 4, ADDRESS_ABSOLUTE);	
-	// BRANCHES
-	// TODO: Test all these branches????????
-    instruction_case(0x90, INSTRUCTION_BCC, 2, 2, ADDRESS_RELATIVE); // +1 if branch succeeds +2 if to a new page
-	instruction_case(0xB0, INSTRUCTION_BCS, 2, 2, ADDRESS_RELATIVE); // +1 if branch succeeds +2 if to a new page
-	instruction_case(0xF0, INSTRUCTION_BEQ, 2, 2, ADDRESS_RELATIVE); //	+1 if branch succeeds +2 if to a new page
-	instruction_case(0x30, INSTRUCTION_BMI, 2, 2, ADDRESS_RELATIVE); // +1 if branch succeeds +2 if to a new page
-	instruction_case(0xD0, INSTRUCTION_BNE, 2, 2, ADDRESS_RELATIVE); // +1 if branch succeeds +2 if to a new page
-	instruction_case(0x10, INSTRUCTION_BPL, 2, 2, ADDRESS_RELATIVE); //	+1 if branch succeeds +2 if to a new page
-	instruction_case(0x50, INSTRUCTION_BVC, 2, 2, ADDRESS_RELATIVE); // +1 if branch succeeds +2 if to a new page
-	instruction_case(0x70, INSTRUCTION_BVS, 2, 2, ADDRESS_RELATIVE); // +1 if branch succeeds +2 if to a new page
-    // ASL
-    instruction_case(0x0A, INSTRUCTION_ASL, 1, 2, ADDRESS_ACCUMULATOR);
-    instruction_case(0x06, INSTRUCTION_ASL, 2, 5, ADDRESS_ZEROPAGE);
-    instruction_case(0x16, INSTRUCTION_ASL, 2, 6, ADDRESS_ZEROPAGE_X);
-    instruction_case(0x0E, INSTRUCTION_ASL, 3, 6, ADDRESS_ABSOLUTE);
-    instruction_case(0x1E, INSTRUCTION_ASL, 3, 7, ADDRESS_ABSOLUTE_X);
-    // ADC
-    instruction_case(0x69, INSTRUCTION_ADC, 2, 2, ADDRESS_IMMEDIATE);
-    instruction_case(0x65, INSTRUCTION_ADC, 2, 3, ADDRESS_IMMEDIATE);
-    instruction_case(0x75, INSTRUCTION_ADC, 2, 4, ADDRESS_IMMEDIATE);
-    instruction_case(0x6D, INSTRUCTION_ADC, 3, 4, ADDRESS_IMMEDIATE);
-    instruction_case(0x7D, INSTRUCTION_ADC, 3, 4, ADDRESS_IMMEDIATE);  // cycle +1 if page is crossed
-    instruction_case(0x79, INSTRUCTION_ADC, 3, 4, ADDRESS_IMMEDIATE);  // cycle +1 if page is crossed
-    instruction_case(0x61, INSTRUCTION_ADC, 2, 6, ADDRESS_IMMEDIATE);
-    instruction_case(0x71, INSTRUCTION_ADC, 2, 5, ADDRESS_IMMEDIATE);  // cycle +1 if page is crossed  
-    // AND
-    instruction_case(0x29, INSTRUCTION_AND, 2, 2, ADDRESS_IMMEDIATE);
-    instruction_case(0x25, INSTRUCTION_AND, 2, 3, ADDRESS_ZEROPAGE);
-    instruction_case(0x35, INSTRUCTION_AND, 2, 4, ADDRESS_ZEROPAGE_X);
-    instruction_case(0x2D, INSTRUCTION_AND, 3, 4, ADDRESS_ABSOLUTE);
-    instruction_case(0x3D, INSTRUCTION_AND, 3, 4, ADDRESS_ABSOLUTE_X); // cycle +1 if page is crossed
-    instruction_case(0x39, INSTRUCTION_AND, 3, 4, ADDRESS_ABSOLUTE_Y); // cycle +1 if page is crossed
-    instruction_case(0x21, INSTRUCTION_AND, 2, 6, ADDRESS_INDIRECT_X);
-    instruction_case(0x31, INSTRUCTION_AND, 2, 5, ADDRESS_INDIRECT_Y);    
-    // LDA
-    instruction_case(0xA9, INSTRUCTION_LDA, 2, 2, ADDRESS_IMMEDIATE);
-    instruction_case(0xA5, INSTRUCTION_LDA, 2, 3, ADDRESS_ZEROPAGE);
-    instruction_case(0xB5, INSTRUCTION_LDA, 2, 4, ADDRESS_ZEROPAGE_X);
-    instruction_case(0xAD, INSTRUCTION_LDA, 3, 4, ADDRESS_ABSOLUTE);
-    instruction_case(0xBD, INSTRUCTION_LDA, 3, 4, ADDRESS_ABSOLUTE_X); // cycle +1 if page is crossed
-    instruction_case(0xB9, INSTRUCTION_LDA, 3, 4, ADDRESS_ABSOLUTE_Y); // cycle +1 if page is crossed
-    instruction_case(0xA1, INSTRUCTION_LDA, 2, 6, ADDRESS_INDIRECT_X);
-    instruction_case(0xB1, INSTRUCTION_LDA, 2, 5, ADDRESS_INDIRECT_Y); // cycle +1 if page is crossed
-    // TAX
-    instruction_case(0xAA, INSTRUCTION_TAX, 1, 2, ADDRESS_NONE);
-    // INX
-    instruction_case(0xE8, INSTRUCTION_INX, 1, 2, ADDRESS_NONE);
-    // INY
-    instruction_case(0xC8, INSTRUCTION_INY, 1, 2, ADDRESS_NONE);
-    default: {
-	assert("ERROR: OP CODE NOT IMPLEMENTED");
-	return (INSTRUCTION_SET){};
-    } break;
-    };
-    return (INSTRUCTION_SET){};
+// (op_code, instruction, handler, bytes, cycles, mode, +1 cycle on page cross)
+// BRK (0x00) and every opcode missing from this list decode to an entry
+// with a NULL handler, which stops cpu_run.
+#define CPU_OPCODES(X) \
+    /* CLEAR */ \
+    X(0x18, CLC, CLC, 1, 2, NONE, 0) \
+    X(0xD8, CLD, CLD, 1, 2, NONE, 0) \
+    X(0x58, CLI, CLI, 1, 2, NONE, 0) \
+    X(0xB8, CLV, CLV, 1, 2, NONE, 0) \
+    /* SET */ \
+    X(0x78, SEI, SEI, 1, 2, NONE, 0) \
+    /* BIT */ \
+    X(0x24, BIT, BIT, 2, 3, ZEROPAGE, 0) \
+    X(0x2C, BIT, BIT, 3, 4, ABSOLUTE, 0) \
+    /* BRANCHES: +1 if branch succeeds +2 if to a new page (see cpu_instruction_branch) */ \
+    X(0x90, BCC, BCC, 2, 2, RELATIVE, 0) \
+    X(0xB0, BCS, BCS, 2, 2, RELATIVE, 0) \
+    X(0xF0, BEQ, BEQ, 2, 2, RELATIVE, 0) \
+    X(0x30, BMI, BMI, 2, 2, RELATIVE, 0) \
+    X(0xD0, BNE, BNE, 2, 2, RELATIVE, 0) \
+    X(0x10, BPL, BPL, 2, 2, RELATIVE, 0) \
+    X(0x50, BVC, BVC, 2, 2, RELATIVE, 0) \
+    X(0x70, BVS, BVS, 2, 2, RELATIVE, 0) \
+    /* ASL */ \
+    X(0x0A, ASL, ASL_accumulator, 1, 2, ACCUMULATOR, 0) \
+    X(0x06, ASL, ASL, 2, 5, ZEROPAGE, 0) \
+    X(0x16, ASL, ASL, 2, 6, ZEROPAGE_X, 0) \
+    X(0x0E, ASL, ASL, 3, 6, ABSOLUTE, 0) \
+    X(0x1E, ASL, ASL, 3, 7, ABSOLUTE_X, 0) \
+    /* ADC */ \
+    X(0x69, ADC, ADC, 2, 2, IMMEDIATE, 0) \
+    X(0x65, ADC, ADC, 2, 3, ZEROPAGE, 0) \
+    X(0x75, ADC, ADC, 2, 4, ZEROPAGE_X, 0) \
+    X(0x6D, ADC, ADC, 3, 4, ABSOLUTE, 0) \
+    X(0x7D, ADC, ADC, 3, 4, ABSOLUTE_X, 1) \
+    X(0x79, ADC, ADC, 3, 4, ABSOLUTE_Y, 1) \
+    X(0x61, ADC, ADC, 2, 6, INDIRECT_X, 0) \
+    X(0x71, ADC, ADC, 2, 5, INDIRECT_Y, 1) \
+    /* AND */ \
+    X(0x29, AND, AND, 2, 2, IMMEDIATE, 0) \
+    X(0x25, AND, AND, 2, 3, ZEROPAGE, 0) \
+    X(0x35, AND, AND, 2, 4, ZEROPAGE_X, 0) \
+    X(0x2D, AND, AND, 3, 4, ABSOLUTE, 0) \
+    X(0x3D, AND, AND, 3, 4, ABSOLUTE_X, 1) \
+    X(0x39, AND, AND, 3, 4, ABSOLUTE_Y, 1) \
+    X(0x21, AND, AND, 2, 6, INDIRECT_X, 0) \
+    X(0x31, AND, AND, 2, 5, INDIRECT_Y, 1) \
+    /* LDA */ \
+    X(0xA9, LDA, LDA, 2, 2, IMMEDIATE, 0) \
+    X(0xA5, LDA, LDA, 2, 3, ZEROPAGE, 0) \
+    X(0xB5, LDA, LDA, 2, 4, ZEROPAGE_X, 0) \
+    X(0xAD, LDA, LDA, 3, 4, ABSOLUTE, 0) \
+    X(0xBD, LDA, LDA, 3, 4, ABSOLUTE_X, 1) \
+    X(0xB9, LDA, LDA, 3, 4, ABSOLUTE_Y, 1) \
+    X(0xA1, LDA, LDA, 2, 6, INDIRECT_X, 0) \
+    X(0xB1, LDA, LDA, 2, 5, INDIRECT_Y, 1) \
+    /* TAX, INX, INY */ \
+    X(0xAA, TAX, TAX, 1, 2, NONE, 0) \
+    X(0xE8, INX, INX, 1, 2, NONE, 0) \
+    X(0xC8, INY, INY, 1, 2, NONE, 0) \
+    /* SUBROUTINES */ \
+    X(0x20, JSR, JSR, 3, 6, ABSOLUTE, 0) \
+    X(0x60, RTS, RTS, 1, 6, NONE, 0) \
+    X(0x40, RTI, RTI, 1, 6, NONE, 0) \
+    /* JMP: the indirect form reads its pointer itself (see cpu_instruction_JMP_indirect) */ \
+    X(0x4C, JMP, JMP, 3, 3, ABSOLUTE, 0) \
+    X(0x6C, JMP, JMP_indirect, 3, 5, ABSOLUTE, 0) \
+    /* STACK */ \
+    X(0x48, PHA, PHA, 1, 3, NONE, 0) \
+    X(0x08, PHP, PHP, 1, 3, NONE, 0) \
+    X(0x68, PLA, PLA, 1, 4, NONE, 0) \
+    X(0x28, PLP, PLP, 1, 4, NONE, 0)
+
+#define opcode_entry(op, ins, fn, by, cy, mo, px) \
+    [op] = { \
+	.op_code = op, \
+	.instruction = INSTRUCTION_##ins, \
+	.name = #ins, \
+	.handler = cpu_instruction_##fn, \
+	.bytes = by, \
+	.cycles = cy, \
+	.mode = ADDRESS_##mo, \
+	.page_penalty = px \
+    },
+
+static const INSTRUCTION_SET cpu_opcode_table[256] = {
+    [0x00] = {
+	.op_code = 0x00,
+	.instruction = INSTRUCTION_BRK,
+	.name = "BRK",
+	.handler = NULL,
+	.bytes = 1,
+	.cycles = 7,
+	.mode = ADDRESS_NONE,
+	.page_penalty = 0
+    },
+    CPU_OPCODES(opcode_entry)
+};
+
+const INSTRUCTION_SET* cpu_get_instruction_set(uchar op)
+{
+    return &cpu_opcode_table[op];
+}
+
+CPU_HOT uchar cpu_bus_read(CPU* cpu, ushort addr)
+{
+    uchar* page = cpu->bus.read_fast[addr >> 8];
+    if (bus_likely(page != NULL)) return page[addr & 0xFF];
+    return bus_read_slow(&cpu->bus, cpu->memory, addr);
+}
+
+CPU_HOT void cpu_bus_write(CPU* cpu, ushort addr, uchar data)
+{
+    uchar* page = cpu->bus.write_fast[addr >> 8];
+    if (bus_likely(page != NULL)) {
+	page[addr & 0xFF] = data;
+	return;
+    }
+    if (cpu->blocks != NULL) block_cache_invalidate_write(cpu->blocks, cpu, addr >> 8);
+    bus_write_slow(&cpu->bus, cpu->memory, addr, data);
+}
+
+#if CPU_CDL
+#define cpu_log_read(cpu, addr) if (!bus_likely(cpu->cdl == NULL)) cdl_mark(cpu->cdl, CDL_READ, addr)
+#define cpu_log_write(cpu, addr) if (!bus_likely(cpu->cdl == NULL)) cdl_mark(cpu->cdl, CDL_WRITE, addr)
+#else
+#define cpu_log_read(cpu, addr)
+#define cpu_log_write(cpu, addr)
+#endif
+
+// Every data access goes through these two; the interpreters fetch
+// opcodes with cpu_bus_read, and cpu_log_code marks those.
+CPU_HOT uchar cpu_data_read(CPU* cpu, ushort addr)
+{
+    cpu_log_read(cpu, addr);
+    return cpu_bus_read(cpu, addr);
+}
+
+CPU_HOT void cpu_data_write(CPU* cpu, ushort addr, uchar data)
+{
+    cpu_log_write(cpu, addr);
+    cpu_bus_write(cpu, addr, data);
 }
 
 uchar cpu_read_memory(CPU* cpu, ushort addr)
 {
-    return cpu->memory[addr];
+    return cpu_data_read(cpu, addr);
 }
 
 void cpu_write_memory(CPU* cpu, ushort addr, uchar data)
 {
-    cpu->memory[addr] = data;
+    cpu_data_write(cpu, addr, data);
+}
+
+uchar cpu_peek_memory(CPU* cpu, ushort addr)
+{
+    return bus_peek(&cpu->bus, cpu->memory, addr);
 }
 
 ushort cpu_read_memory_ushort(CPU* cpu, ushort pos)
 {
-    ushort lo = (ushort)cpu_read_memory(cpu, pos);
-    ushort hi = (ushort)cpu_read_memory(cpu, pos + 1);
+    ushort lo = (ushort)cpu_data_read(cpu, pos);
+    ushort hi = (ushort)cpu_data_read(cpu, pos + 1);
     return (hi << 8) | (ushort)lo;
 }
 
@@ -125,8 +255,8 @@ void cpu_write_memory_ushort(CPU* cpu, ushort pos, ushort data)
 {
     uchar hi = (uchar)(data >> 8);
     uchar lo = (uchar)(data & 0xff);
-    cpu_write_memory(cpu, pos, lo);
-    cpu_write_memory(cpu, pos + 1, hi);
+    cpu_data_write(cpu, pos, lo);
+    cpu_data_write(cpu, pos + 1, hi);
 }
 
 void cpu_reset(CPU* cpu)
@@ -134,63 +264,113 @@ void cpu_reset(CPU* cpu)
     cpu->reg_a = 0;
     cpu->reg_x = 0;
     cpu->reg_y = 0;
-    cpu->status = 0b00100000;
+    cpu->reg_sp = 0xFD;
+    cpu_set_status(cpu, 0b00100000);
+    cpu->halted = false;
+    // The reset sequence itself takes 7 cycles before the first fetch.
+    cpu->cycles = cpu->cycles + 7;
 
     cpu->pc = cpu_read_memory_ushort(cpu, 0xFFFC);
 }
 
-void cpu_load(CPU* cpu, uchar *program, size_t program_length)
+bool cpu_load(CPU* cpu, uchar *program, size_t program_length)
 {
-    if (program_length + 0x8000 > MEMORY_SIZE) return;
-    memcpy(&cpu->memory[0x8000], program, program_length);    
+    if (program_length > CPU_PROGRAM_MAX) return false;
+    memcpy(&cpu->memory[0x8000], program, program_length);
+    bus_mark_dirty(&cpu->bus, 0x8000, program_length);
+    if (cpu->blocks != NULL) block_cache_clear(cpu->blocks);
     cpu_write_memory_ushort(cpu, 0xFFFC, 0x8000);
+    return true;
 }
 
-ushort cpu_get_operand_address(CPU* cpu, ADDRESS_MODE mode)
+bool cpu_build_image(uchar* image, const uchar* program, size_t program_length)
+{
+    if (program_length > CPU_PROGRAM_MAX) return false;
+    memset(image, 0, CPU_IMAGE_SIZE);
+    memcpy(image, program, program_length);
+    image[0xFFFC - 0x8000] = 0x00;
+    image[0xFFFD - 0x8000] = 0x80;
+    return true;
+}
+
+void cpu_map_image(CPU* cpu, const uchar* image)
+{
+    bus_map_shared(&cpu->bus, 0x80, 0x80, image);
+    if (cpu->blocks != NULL) block_cache_clear(cpu->blocks);
+}
+
+// Operand bytes are instruction fetches, not data: a code/data log gets
+// them from cpu_log_code, so they are read without marking.
+CPU_HOT ushort cpu_operand_read(CPU* cpu, ADDRESS_MODE mode, ushort at)
 {
     switch(mode) {
-    case ADDRESS_IMMEDIATE: {
-	return cpu->pc;
+    case ADDRESS_IMMEDIATE:
+    case ADDRESS_RELATIVE: {
+	return at;
+    } break;
+    case ADDRESS_ZEROPAGE:
+    case ADDRESS_ZEROPAGE_X:
+    case ADDRESS_ZEROPAGE_Y:
+    case ADDRESS_INDIRECT_X:
+    case ADDRESS_INDIRECT_Y: {
+	return (ushort)cpu_bus_read(cpu, at);
+    } break;
+    case ADDRESS_ABSOLUTE:
+    case ADDRESS_ABSOLUTE_X:
+    case ADDRESS_ABSOLUTE_Y: {
+	ushort lo = (ushort)cpu_bus_read(cpu, at);
+	ushort hi = (ushort)cpu_bus_read(cpu, (ushort)(at + 1));
+	return (hi << 8) | lo;
     } break;
-    case ADDRESS_ZEROPAGE: {
-	return (ushort)cpu_read_memory(cpu, cpu->pc);
+    default: {
+    } break;
+    }
+    return 0;
+}
+
+CPU_HOT ushort cpu_operand_resolve(CPU* cpu, ADDRESS_MODE mode, ushort operand)
+{
+    switch(mode) {
+    case ADDRESS_NONE:
+    case ADDRESS_ACCUMULATOR: {
+	return 0;
     } break;
+    case ADDRESS_IMMEDIATE:
+    case ADDRESS_RELATIVE:
+    case ADDRESS_ZEROPAGE:
     case ADDRESS_ABSOLUTE: {
-	return cpu_read_memory_ushort(cpu, cpu->pc);
+	return operand;
     } break;
     case ADDRESS_ZEROPAGE_X: {
-	uchar pos = cpu_read_memory(cpu, cpu->pc);
-	ushort addr = (uchar)(pos + cpu->reg_x);
+	ushort addr = (uchar)(operand + cpu->reg_x);
 	return addr;
     } break;
     case ADDRESS_ZEROPAGE_Y: {
-	uchar pos = cpu_read_memory(cpu, cpu->pc);
-	ushort addr = (uchar)(pos + cpu->reg_y);
+	ushort addr = (uchar)(operand + cpu->reg_y);
 	return addr;
     } break;
     case ADDRESS_ABSOLUTE_X: {
-	uchar base = cpu_read_memory_ushort(cpu, cpu->pc);
-	ushort addr = (uchar)(base + (ushort)cpu->reg_x);
+	ushort addr = (ushort)(operand + (ushort)cpu->reg_x);
+	cpu->page_crossed = (operand & 0xFF00) != (addr & 0xFF00);
 	return addr;
     } break;
     case ADDRESS_ABSOLUTE_Y: {
-	uchar base = cpu_read_memory_ushort(cpu, cpu->pc);
-	ushort addr = (uchar)(base + (ushort)cpu->reg_y);
+	ushort addr = (ushort)(operand + (ushort)cpu->reg_y);
+	cpu->page_crossed = (operand & 0xFF00) != (addr & 0xFF00);
 	return addr;
     } break;
     case ADDRESS_INDIRECT_X: {
-	uchar base = cpu_read_memory(cpu, cpu->pc);
-	uchar ptr = (uchar)(base + cpu->reg_x);
-	uchar lo = cpu_read_memory(cpu, (ushort)ptr);
-	uchar hi = cpu_read_memory(cpu, (ushort)((uchar)(ptr + 1)));
+	uchar ptr = (uchar)(operand + cpu->reg_x);
+	uchar lo = cpu_data_read(cpu, (ushort)ptr);
+	uchar hi = cpu_data_read(cpu, (ushort)((uchar)(ptr + 1)));
 	return ((ushort)hi << 8) | (ushort)lo;
     } break;
     case ADDRESS_INDIRECT_Y: {
-	uchar base = cpu_read_memory(cpu, cpu->pc);
-	uchar lo = cpu_read_memory(cpu, (ushort)base);
-	uchar hi = cpu_read_memory(cpu, (ushort)((uchar)(base + 1)));
+	uchar lo = cpu_data_read(cpu, operand);
+	uchar hi = cpu_data_read(cpu, (ushort)((uchar)(operand + 1)));
 	ushort deref_base = ((ushort)hi << 8) | (ushort)lo;
 	ushort deref = (ushort)(deref_base + cpu->reg_y);
+	cpu->page_crossed = (deref_base & 0xFF00) != (deref & 0xFF00);
 	return deref;
     } break;
     default: {
@@ -200,168 +380,144 @@ ushort cpu_get_operand_address(CPU* cpu, ADDRESS_MODE mode)
     return 1;
 }
 
+ushort cpu_read_operand(CPU* cpu, ADDRESS_MODE mode, ushort at)
+{
+    return cpu_operand_read(cpu, mode, at);
+}
+
+ushort cpu_resolve_operand_address(CPU* cpu, ADDRESS_MODE mode, ushort operand)
+{
+    return cpu_operand_resolve(cpu, mode, operand);
+}
+
+ushort cpu_get_operand_address(CPU* cpu, ADDRESS_MODE mode)
+{
+    return cpu_operand_resolve(cpu, mode, cpu_operand_read(cpu, mode, cpu->pc));
+}
+
+// N and Z are evaluated lazily: flag_n holds the byte whose bit 7 is N and
+// flag_z the byte that is zero when Z is set, so most instructions only store
+// their result. The N and Z bits of cpu->status are refreshed from them when
+// cpu_run returns; use cpu_get_status/cpu_set_status while it is running.
+uchar cpu_get_status(CPU* cpu)
+{
+    uchar status = cpu->status & 0b01111101;
+    if ((cpu->flag_n & 0b10000000) != 0) status = status | FLAG_NEGATIVE;
+    if (cpu->flag_z == 0) status = status | FLAG_ZERO;
+    return status;
+}
+
+void cpu_set_status(CPU* cpu, uchar status)
+{
+    cpu->status = status;
+    cpu->flag_n = status & FLAG_NEGATIVE;
+    cpu->flag_z = (status & FLAG_ZERO) == 0;
+}
+
 bool cpu_contains_flag(CPU* cpu, CPU_FLAG flag)
 {
 	switch (flag) {
-	case FLAG_OVERFLOW: {
-		if ((cpu->status & 0b01000000) == 0) return false;
-    	return true;
-	} break;
-	case FLAG_CARRY: {
-		if ((cpu->status & 0b00000001) == 0) return false;
-		return true;
-	} break;
 	case FLAG_ZERO: {
-		if ((cpu->status & 0b00000010) == 0) return false;
-		return true;
+		return cpu->flag_z == 0;
 	} break;
 	case FLAG_NEGATIVE: {
-		if ((cpu->status & 0b10000000) == 0) return false;
-		return true;
+		return (cpu->flag_n & 0b10000000) != 0;
 	} break;
 	default: {
-		assert("TODO");
+		return (cpu->status & flag) != 0;
 	} break;
-    }
-	return false;
+	}
 }
 
-void cpu_add_flag(CPU* cpu, CPU_FLAG flag)
+void cpu_set_flag(CPU* cpu, CPU_FLAG flag)
 {
-	switch (flag) {
-	case FLAG_OVERFLOW: {
-		cpu->status = cpu->status | 0b01000000;    		
-	} break;
-	case FLAG_CARRY: {
-		cpu->status = cpu->status | 0b00000001;		
-	} break;
-	case FLAG_ZERO: {
-		cpu->status = cpu->status | 0b00000010;
-	} break;
-	case FLAG_NEGATIVE: {
-		cpu->status = cpu->status | 0b10000000;
-	} break;
-	default: {
-		assert("TODO");
-	} break;
-    }
-	
+	cpu->status = cpu->status | flag;
+	if (flag == FLAG_ZERO) cpu->flag_z = 0;
+	if (flag == FLAG_NEGATIVE) cpu->flag_n = 0b10000000;
 }
 
 void cpu_remove_flag(CPU* cpu, CPU_FLAG flag)
 {
-	switch (flag) {
-	case FLAG_OVERFLOW: {
-		cpu->status = cpu->status & 0b10111111;
-	} break;
-	case FLAG_CARRY: {
-		cpu->status = cpu->status & 0b11111110;		
-	} break;
-	case FLAG_ZERO: {
-		cpu->status = cpu->status & 0b11111101;
-	} break;
-	case FLAG_NEGATIVE: {
-		cpu->status = cpu->status & 0b01111111; 
-	} break;
-	default: {
-		assert("TODO");
-	} break;
-    }
-	
+	cpu->status = cpu->status & (uchar)~flag;
+	if (flag == FLAG_ZERO) cpu->flag_z = 1;
+	if (flag == FLAG_NEGATIVE) cpu->flag_n = 0;
 }
 
 void cpu_update_zero_and_negative_flags(CPU* cpu, uchar result)
 {
-    if (result == 0) {
-		cpu_add_flag(cpu, FLAG_ZERO);
-    } else {
-		cpu_remove_flag(cpu, FLAG_ZERO);
-    };
-
-    if ((result & 0b10000000) != 0) { 
-		cpu_add_flag(cpu, FLAG_NEGATIVE);
-    } else {
-		cpu_remove_flag(cpu, FLAG_NEGATIVE);
-    }
+    cpu->flag_n = result;
+    cpu->flag_z = result;
 }
 
-void cpu_instruction_LDA(CPU* cpu, ADDRESS_MODE mode)
+void cpu_instruction_LDA(CPU* cpu, ushort addr)
 {
-    ushort addr = cpu_get_operand_address(cpu, mode);
-    uchar value = cpu_read_memory(cpu, addr);
+    uchar value = cpu_data_read(cpu, addr);
     cpu->reg_a = value;
     cpu_update_zero_and_negative_flags(cpu, cpu->reg_a);
 }
 
-void cpu_instruction_TAX(CPU* cpu)
+void cpu_instruction_TAX(CPU* cpu, ushort addr)
 {
+    (void)addr;
     cpu->reg_x = cpu->reg_a;
     cpu_update_zero_and_negative_flags(cpu, cpu->reg_x);
 }
 
-void cpu_instruction_INX(CPU* cpu)
+void cpu_instruction_INX(CPU* cpu, ushort addr)
 {
+    (void)addr;
     cpu->reg_x = cpu->reg_x + 1;
     
     cpu_update_zero_and_negative_flags(cpu, cpu->reg_x);
 }
 
-void cpu_instruction_INY(CPU* cpu)
+void cpu_instruction_INY(CPU* cpu, ushort addr)
 {
+    (void)addr;
     cpu->reg_y = cpu->reg_y + 1;
     
     cpu_update_zero_and_negative_flags(cpu, cpu->reg_y);
 }
 
-void cpu_instruction_STA(CPU* cpu, ADDRESS_MODE mode)
+void cpu_instruction_STA(CPU* cpu, ushort addr)
 {
-    ushort addr = cpu_get_operand_address(cpu, mode);
-    cpu_write_memory(cpu, addr, cpu->reg_a);
+    cpu_data_write(cpu, addr, cpu->reg_a);
 }
 
-void cpu_instruction_AND(CPU* cpu, ADDRESS_MODE mode)
+void cpu_instruction_AND(CPU* cpu, ushort addr)
 {
-    ushort addr = cpu_get_operand_address(cpu, mode);
-    ushort result = cpu->reg_a & cpu_read_memory(cpu, addr);
+    ushort result = cpu->reg_a & cpu_data_read(cpu, addr);
     cpu->reg_a = result;
     cpu_update_zero_and_negative_flags(cpu, cpu->reg_a);
 }
 
-void cpu_instruction_ADC(CPU* cpu, ADDRESS_MODE mode)
+void cpu_instruction_ADC(CPU* cpu, ushort addr)
 {
-    ushort addr = cpu_get_operand_address(cpu, mode);
-    ushort result = cpu->reg_a + cpu_read_memory(cpu, addr);
+    uchar value = cpu_data_read(cpu, addr);
+    ushort result = cpu->reg_a + value;
     if ((cpu->status & 0b00000001) != 0) result = result + 1;
 	
     if (result > 0xFF) {
-	    cpu_add_flag(cpu, FLAG_CARRY);
+	    cpu_set_flag(cpu, FLAG_CARRY);
 	} else {
 		cpu_remove_flag(cpu, FLAG_CARRY);
     }
 	
-	if ((uchar)result > 0x80) {
-		cpu_add_flag(cpu, FLAG_OVERFLOW);
+	// Signed overflow: both inputs share a sign the result does not have.
+	if ((~(cpu->reg_a ^ value) & (cpu->reg_a ^ result) & 0x80) != 0) {
+		cpu_set_flag(cpu, FLAG_OVERFLOW);
 	} else {		
 		cpu_remove_flag(cpu, FLAG_OVERFLOW);
 	}
    
-    cpu_update_zero_and_negative_flags(cpu, cpu->reg_a);
     cpu->reg_a = (uchar)result;
+    cpu_update_zero_and_negative_flags(cpu, cpu->reg_a);
 }
 
-void cpu_instruction_ASL(CPU* cpu, ADDRESS_MODE mode)
+static uchar cpu_shift_left(CPU* cpu, uchar value)
 {
-    ushort addr;
-    ushort value;
-    if (mode != ADDRESS_ACCUMULATOR) {
-	addr = cpu_get_operand_address(cpu, mode);
-	value = cpu_read_memory(cpu, addr);
-    } else {
-	value = cpu->reg_a;
-    }
-
     if ((value & 0b10000000) != 0) {
-		cpu_add_flag(cpu, FLAG_CARRY);
+		cpu_set_flag(cpu, FLAG_CARRY);
 		value = (value & 0b01111111);
 		value = value << 1;
     } else {
@@ -369,144 +525,503 @@ void cpu_instruction_ASL(CPU* cpu, ADDRESS_MODE mode)
 		value = value << 1;
     }
     cpu_update_zero_and_negative_flags(cpu, value);
+    return value;
+}
 
-    if (mode != ADDRESS_ACCUMULATOR) {
-		ushort addr = cpu_get_operand_address(cpu, mode);
-		cpu_write_memory(cpu, addr, value);
-    } else {
-		cpu->reg_a = value;
-    }    
+void cpu_instruction_ASL(CPU* cpu, ushort addr)
+{
+    cpu_data_write(cpu, addr, cpu_shift_left(cpu, cpu_data_read(cpu, addr)));
+}
+
+void cpu_instruction_ASL_accumulator(CPU* cpu, ushort addr)
+{
+    (void)addr;
+    cpu->reg_a = cpu_shift_left(cpu, cpu->reg_a);
 }
 
-void cpu_instruction_branch(CPU* cpu, bool condition)
+// By the time a handler runs cpu->pc already points at the next
+// instruction, which is what the relative offset is measured from.
+void cpu_instruction_branch(CPU* cpu, ushort addr, bool condition)
 {
 	if (condition) {
-		char jmp = cpu_read_memory(cpu, cpu->pc);
-		ushort jmp_addr = cpu->pc;
-		jmp_addr = add_wrap_ushort(jmp_addr, 1);
-		jmp_addr = add_wrap_ushort(jmp_addr, (ushort)jmp);
+		signed char jmp = (signed char)cpu_bus_read(cpu, addr);
+		ushort jmp_addr = add_wrap_ushort(cpu->pc, (ushort)jmp);
 
+		cpu->cycles = cpu->cycles + 1;
+		if ((jmp_addr & 0xFF00) != (cpu->pc & 0xFF00)) cpu->cycles = cpu->cycles + 1;
+		ushort end = cpu->pc;
 		cpu->pc = jmp_addr;
+		if (cpu->idle != NULL && jmp_addr < end) idle_loop_end(cpu->idle, cpu, jmp_addr, end);
 	}
 }
 
-void cpu_instruction_BIT(CPU* cpu, ADDRESS_MODE mode)
+void cpu_instruction_BCC(CPU* cpu, ushort addr)
 {
-	ushort addr = cpu_get_operand_address(cpu, mode);
-	if ((cpu->reg_a & cpu_read_memory(cpu, addr)) == 0) {
-		cpu_add_flag(cpu, FLAG_ZERO);
-	} else {
-		cpu_remove_flag(cpu, FLAG_ZERO);
-	}
-	if ((0b10000000 & cpu_read_memory(cpu, addr)) != 0) {
-		cpu_add_flag(cpu, FLAG_NEGATIVE);
-	} else {
-		cpu_remove_flag(cpu, FLAG_NEGATIVE);
-	}
-	if ((0b01000000 & cpu_read_memory(cpu, addr)) != 0) {
-		cpu_add_flag(cpu, FLAG_OVERFLOW);
+	cpu_instruction_branch(cpu, addr, !cpu_contains_flag(cpu, FLAG_CARRY));
+}
+
+void cpu_instruction_BCS(CPU* cpu, ushort addr)
+{
+	cpu_instruction_branch(cpu, addr, cpu_contains_flag(cpu, FLAG_CARRY));
+}
+
+void cpu_instruction_BEQ(CPU* cpu, ushort addr)
+{
+	cpu_instruction_branch(cpu, addr, cpu_contains_flag(cpu, FLAG_ZERO));
+}
+
+void cpu_instruction_BMI(CPU* cpu, ushort addr)
+{
+	cpu_instruction_branch(cpu, addr, cpu_contains_flag(cpu, FLAG_NEGATIVE));
+}
+
+void cpu_instruction_BNE(CPU* cpu, ushort addr)
+{
+	cpu_instruction_branch(cpu, addr, !cpu_contains_flag(cpu, FLAG_ZERO));
+}
+
+void cpu_instruction_BPL(CPU* cpu, ushort addr)
+{
+	cpu_instruction_branch(cpu, addr, !cpu_contains_flag(cpu, FLAG_NEGATIVE));
+}
+
+void cpu_instruction_BVC(CPU* cpu, ushort addr)
+{
+	cpu_instruction_branch(cpu, addr, !cpu_contains_flag(cpu, FLAG_OVERFLOW));
+}
+
+void cpu_instruction_BVS(CPU* cpu, ushort addr)
+{
+	cpu_instruction_branch(cpu, addr, cpu_contains_flag(cpu, FLAG_OVERFLOW));
+}
+
+void cpu_instruction_BIT(CPU* cpu, ushort addr)
+{
+	uchar value = cpu_data_read(cpu, addr);
+	cpu->flag_z = cpu->reg_a & value;
+	cpu->flag_n = value;
+	if ((0b01000000 & value) != 0) {
+		cpu_set_flag(cpu, FLAG_OVERFLOW);
 	} else {
 		cpu_remove_flag(cpu, FLAG_OVERFLOW);
 	}	
 }
 
-void cpu_run(CPU* cpu)
+void cpu_instruction_CLC(CPU* cpu, ushort addr)
+{
+	(void)addr;
+	cpu_remove_flag(cpu, FLAG_CARRY);
+}
+
+void cpu_instruction_CLD(CPU* cpu, ushort addr)
+{
+	(void)addr;
+	cpu_remove_flag(cpu, FLAG_DECIMAL);
+}
+
+// An IRQ held off by I is taken as soon as I clears: cutting the slice
+// short sends the run loop back to cpu_dispatch, which takes it.
+static void cpu_poll_irq(CPU* cpu)
+{
+	if (cpu->irq_line && !(cpu->status & FLAG_INTERRUPT_DISABLE)) cpu->deadline = cpu->cycles;
+}
+
+void cpu_instruction_CLI(CPU* cpu, ushort addr)
+{
+	(void)addr;
+	cpu_remove_flag(cpu, FLAG_INTERRUPT_DISABLE);
+	cpu_poll_irq(cpu);
+}
+
+void cpu_instruction_CLV(CPU* cpu, ushort addr)
+{
+	(void)addr;
+	cpu_remove_flag(cpu, FLAG_OVERFLOW);
+}
+
+void cpu_stack_push(CPU* cpu, uchar data)
+{
+    cpu_data_write(cpu, 0x0100 | cpu->reg_sp, data);
+    cpu->reg_sp = cpu->reg_sp - 1;
+}
+
+uchar cpu_stack_pop(CPU* cpu)
+{
+    cpu->reg_sp = cpu->reg_sp + 1;
+    return cpu_data_read(cpu, 0x0100 | cpu->reg_sp);
+}
+
+void cpu_stack_push_ushort(CPU* cpu, ushort data)
+{
+    cpu_stack_push(cpu, (uchar)(data >> 8));
+    cpu_stack_push(cpu, (uchar)(data & 0xff));
+}
+
+ushort cpu_stack_pop_ushort(CPU* cpu)
+{
+    ushort lo = (ushort)cpu_stack_pop(cpu);
+    ushort hi = (ushort)cpu_stack_pop(cpu);
+    return (hi << 8) | lo;
+}
+
+// JSR pushes the address of its own last byte, RTS returns one past it.
+void cpu_instruction_JSR(CPU* cpu, ushort addr)
+{
+    cpu_stack_push_ushort(cpu, cpu->pc - 1);
+    cpu->pc = addr;
+}
+
+void cpu_instruction_RTS(CPU* cpu, ushort addr)
+{
+    (void)addr;
+    cpu->pc = cpu_stack_pop_ushort(cpu) + 1;
+}
+
+// B and bit 5 only exist on the stack copy of the status register.
+static void cpu_pull_status(CPU* cpu)
+{
+    cpu_set_status(cpu, (cpu_stack_pop(cpu) & ~FLAG_B) | 0b00100000);
+}
+
+void cpu_instruction_JMP(CPU* cpu, ushort addr)
+{
+    ushort end = cpu->pc;
+    cpu->pc = addr;
+    if (cpu->idle != NULL && addr < end) idle_loop_end(cpu->idle, cpu, addr, end);
+}
+
+// The pointer's high byte is fetched without carrying into the page, so
+// JMP ($10FF) reads $10FF and $1000.
+void cpu_instruction_JMP_indirect(CPU* cpu, ushort addr)
+{
+    ushort lo = cpu_data_read(cpu, addr);
+    ushort hi = cpu_data_read(cpu, (addr & 0xFF00) | ((addr + 1) & 0x00FF));
+    cpu->pc = (hi << 8) | lo;
+}
+
+void cpu_instruction_RTI(CPU* cpu, ushort addr)
+{
+    (void)addr;
+    cpu_pull_status(cpu);
+    cpu->pc = cpu_stack_pop_ushort(cpu);
+    cpu_poll_irq(cpu);
+}
+
+void cpu_instruction_SEI(CPU* cpu, ushort addr)
+{
+    (void)addr;
+    cpu_set_flag(cpu, FLAG_INTERRUPT_DISABLE);
+}
+
+void cpu_instruction_PHA(CPU* cpu, ushort addr)
+{
+    (void)addr;
+    cpu_stack_push(cpu, cpu->reg_a);
+}
+
+void cpu_instruction_PHP(CPU* cpu, ushort addr)
+{
+    (void)addr;
+    cpu_stack_push(cpu, cpu_get_status(cpu) | FLAG_B | 0b00100000);
+}
+
+void cpu_instruction_PLA(CPU* cpu, ushort addr)
+{
+    (void)addr;
+    cpu->reg_a = cpu_stack_pop(cpu);
+    cpu_update_zero_and_negative_flags(cpu, cpu->reg_a);
+}
+
+void cpu_instruction_PLP(CPU* cpu, ushort addr)
+{
+    (void)addr;
+    cpu_pull_status(cpu);
+    cpu_poll_irq(cpu);
+}
+
+static void cpu_interrupt(CPU* cpu, ushort vector)
+{
+    cpu_stack_push_ushort(cpu, cpu->pc);
+    cpu_stack_push(cpu, (cpu_get_status(cpu) & ~FLAG_B) | 0b00100000);
+    cpu_set_flag(cpu, FLAG_INTERRUPT_DISABLE);
+    cpu->pc = cpu_read_memory_ushort(cpu, vector);
+    cpu->cycles = cpu->cycles + 7;
+}
+
+void cpu_nmi(CPU* cpu)
+{
+    cpu_interrupt(cpu, 0xFFFA);
+}
+
+bool cpu_irq(CPU* cpu)
+{
+    if (cpu->status & FLAG_INTERRUPT_DISABLE) return false;
+    cpu_interrupt(cpu, 0xFFFE);
+    return true;
+}
+
+void cpu_set_irq_line(CPU* cpu, bool level)
+{
+    cpu->irq_line = level;
+    cpu_poll_irq(cpu);
+}
+
+#if CPU_TRACE
+#define cpu_trace(cpu) if (cpu->tracer != NULL) tracer_record(cpu->tracer, cpu)
+#else
+#define cpu_trace(cpu)
+#endif
+
+#if CPU_PROFILE
+#define cpu_profile(cpu) if (cpu->profiler != NULL) profiler_record(cpu->profiler, cpu)
+#else
+#define cpu_profile(cpu)
+#endif
+
+#if CPU_CDL
+#define cpu_log_code(cpu, bytes) if (cpu->cdl != NULL) cdl_mark_instruction(cpu->cdl, cpu->pc, bytes)
+#else
+#define cpu_log_code(cpu, bytes)
+#endif
+
+static bool cpu_execute(CPU* cpu);
+
+// Runs a single instruction with the plain interpreter, for code the block
+// cache does not hold. Anything that pulled the deadline in meanwhile is
+// kept.
+static bool cpu_execute_one(CPU* cpu)
+{
+    uint64_t deadline = cpu->deadline;
+    cpu->deadline = 0;
+    bool stopped = cpu_execute(cpu);
+    if (cpu->deadline != 0 && cpu->deadline < deadline) deadline = cpu->deadline;
+    if (cpu->scheduler != NULL && scheduler_next(cpu->scheduler) < deadline) deadline = scheduler_next(cpu->scheduler);
+    cpu->deadline = deadline;
+    return stopped;
+}
+
+#if defined(__GNUC__) && !defined(CPU_NO_COMPUTED_GOTO)
+
+// Threaded dispatch: every opcode gets its own label with the addressing
+// mode baked in as a constant, and each label ends in its own indirect jump
+// to the next opcode, so there is one (well predicted) branch per instruction.
+#define opcode_label_entry(op, ins, fn, by, cy, mo, px) [op] = &&op_##op,
+
+#define opcode_label(op, ins, fn, by, cy, mo, px) \
+    op_##op: { \
+	cpu_trace(cpu); \
+	cpu_profile(cpu); \
+	cpu_log_code(cpu, by); \
+	cpu->pc = cpu->pc + 1; \
+	ushort addr = cpu_operand_resolve(cpu, ADDRESS_##mo, cpu_operand_read(cpu, ADDRESS_##mo, cpu->pc)); \
+	cpu->pc = cpu->pc + by - 1; \
+	cpu->cycles = cpu->cycles + cy; \
+	if (px && cpu->page_crossed) cpu->cycles = cpu->cycles + 1; \
+	cpu_instruction_##fn(cpu, addr); \
+	if (cpu->cycles >= cpu->deadline) return false; \
+	goto *dispatch[cpu_bus_read(cpu, cpu->pc)]; \
+    }
+
+// Same as opcode_label, but the operand and the next pc come predecoded
+// from the current MICRO_OP and the next target is the following op.
+#define block_label(op, ins, fn, by, cy, mo, px) \
+    block_op_##op: { \
+	cpu_trace(cpu); \
+	cpu_profile(cpu); \
+	cpu_log_code(cpu, (ushort)(micro_op->next_pc - cpu->pc)); \
+	ushort addr = cpu_operand_resolve(cpu, ADDRESS_##mo, micro_op->operand); \
+	cpu->pc = micro_op->next_pc; \
+	cpu->cycles = cpu->cycles + cy; \
+	if (px && cpu->page_crossed) cpu->cycles = cpu->cycles + 1; \
+	cpu_instruction_##fn(cpu, addr); \
+	if (cpu->cycles >= cpu->deadline) return false; \
+	if (cache->generation != generation) goto next_block; \
+	micro_op = micro_op + 1; \
+	goto *micro_op->label; \
+    }
+
+#define block_label_entry(op, ins, fn, by, cy, mo, px) [op] = &&block_op_##op,
+
+// Both interpreters return true when they stopped on BRK and false when
+// they reached the deadline.
+static bool cpu_execute(CPU* cpu)
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+    static void* const dispatch[256] = {
+	[0 ... 255] = &&op_stop,
+	CPU_OPCODES(opcode_label_entry)
+    };
+#pragma GCC diagnostic pop
+
+    goto *dispatch[cpu_bus_read(cpu, cpu->pc)];
+
+    CPU_OPCODES(opcode_label)
+
+op_stop:
+    cpu_trace(cpu);
+    cpu_profile(cpu);
+    cpu_log_code(cpu, 1);
+    cpu->pc = cpu->pc + 1;
+    cpu->cycles = cpu->cycles + 7;
+    cpu->halted = true;
+    return true;
+}
+
+static bool cpu_execute_blocks(CPU* cpu)
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+    static void* const block_dispatch[256] = {
+	[0 ... 255] = &&block_op_stop,
+	CPU_OPCODES(block_label_entry)
+    };
+#pragma GCC diagnostic pop
+    BLOCK_CACHE* cache = cpu->blocks;
+    const MICRO_OP* micro_op;
+    uint64_t generation;
+
+next_block:
+    generation = cache->generation;
+    const BLOCK* block = block_lookup(cache, cpu, block_dispatch, &&block_end);
+    if (block == NULL) {
+	if (cpu_execute_one(cpu)) return true;
+	if (cpu->cycles >= cpu->deadline) return false;
+	goto next_block;
+    }
+    micro_op = &block->ops[0];
+    goto *micro_op->label;
+
+    CPU_OPCODES(block_label)
+
+block_op_stop:
+    cpu_trace(cpu);
+    cpu_profile(cpu);
+    cpu_log_code(cpu, 1);
+    cpu->pc = micro_op->next_pc;
+    cpu->cycles = cpu->cycles + 7;
+    cpu->halted = true;
+    return true;
+
+block_end:
+    goto next_block;
+}
+
+#else
+
+static bool cpu_execute(CPU* cpu)
 {
     while (1) {
-	INSTRUCTION_SET instruction_set = cpu_turn_op_into_instruction_set(cpu_read_memory(cpu, cpu->pc));
+	cpu_trace(cpu);
+	cpu_profile(cpu);
+	const INSTRUCTION_SET* instruction_set = &cpu_opcode_table[cpu_bus_read(cpu, cpu->pc)];
+	cpu_log_code(cpu, instruction_set->handler != NULL ? instruction_set->bytes : 1);
 	cpu->pc = cpu->pc + 1;
 
-	switch (instruction_set.instruction) {
-	case INSTRUCTION_ASL: {
-	    cpu_instruction_ASL(cpu, instruction_set.mode);
-	    cpu->pc = cpu->pc + instruction_set.bytes - 1;	    
-	} break;
-	case INSTRUCTION_ADC: {
-	    cpu_instruction_ADC(cpu, instruction_set.mode);
-	    cpu->pc = cpu->pc + instruction_set.bytes - 1;	    
-	} break;
-	case INSTRUCTION_AND: {
-	    cpu_instruction_AND(cpu, instruction_set.mode);
-	    cpu->pc = cpu->pc + instruction_set.bytes - 1;
-	} break;
-	case INSTRUCTION_BRK: {
-	    return;
-	} break;
-	case INSTRUCTION_LDA: {	    
-	    cpu_instruction_LDA(cpu, instruction_set.mode);
-	    cpu->pc = cpu->pc + instruction_set.bytes - 1;
-	} break;
-	case INSTRUCTION_TAX: {	    
-	    cpu_instruction_TAX(cpu);
-	    cpu->pc = cpu->pc + instruction_set.bytes - 1;
-	} break;
-	case INSTRUCTION_INX: {	    
-	    cpu_instruction_INX(cpu);
-	    cpu->pc = cpu->pc + instruction_set.bytes - 1;
-	} break;
-	case INSTRUCTION_INY: {	    
-	    cpu_instruction_INY(cpu);
-	    cpu->pc = cpu->pc + instruction_set.bytes - 1;
-	} break;
-	case INSTRUCTION_BCC: {
-		cpu_instruction_branch(cpu, !cpu_contains_flag(cpu, FLAG_CARRY));
-		cpu->pc = cpu->pc + instruction_set.bytes - 1;
-	} break;
-	case INSTRUCTION_BCS: {
-		cpu_instruction_branch(cpu, cpu_contains_flag(cpu, FLAG_CARRY));
-		cpu->pc = cpu->pc + instruction_set.bytes - 1;		
-	} break;
-	case INSTRUCTION_BEQ: {
-		cpu_instruction_branch(cpu, cpu_contains_flag(cpu, FLAG_ZERO));
-		cpu->pc = cpu->pc + instruction_set.bytes - 1;		
-	} break;
-	case INSTRUCTION_BMI: {
-		cpu_instruction_branch(cpu, cpu_contains_flag(cpu, FLAG_NEGATIVE));
-		cpu->pc = cpu->pc + instruction_set.bytes - 1;				
-	} break;
-	case INSTRUCTION_BNE: {
-		cpu_instruction_branch(cpu, !cpu_contains_flag(cpu, FLAG_ZERO));
-		cpu->pc = cpu->pc + instruction_set.bytes - 1;				
-	} break;
-	case INSTRUCTION_BPL: {
-		cpu_instruction_branch(cpu, !cpu_contains_flag(cpu, FLAG_NEGATIVE));
-		cpu->pc = cpu->pc + instruction_set.bytes - 1;				
-	} break;
-	case INSTRUCTION_BVC: {
-		cpu_instruction_branch(cpu, !cpu_contains_flag(cpu, FLAG_OVERFLOW));
-		cpu->pc = cpu->pc + instruction_set.bytes - 1;				
-	} break;
-	case INSTRUCTION_BVS: {
-		cpu_instruction_branch(cpu, cpu_contains_flag(cpu, FLAG_OVERFLOW));
-		cpu->pc = cpu->pc + instruction_set.bytes - 1;				
-	} break;
-	case INSTRUCTION_BIT: {
-		cpu_instruction_BIT(cpu, instruction_set.mode);
-		cpu->pc = cpu->pc + instruction_set.bytes - 1;				
-	} break;
-	case INSTRUCTION_CLC: {
-		cpu_remove_flag(cpu, FLAG_CARRY);
-		cpu->pc = cpu->pc + instruction_set.bytes - 1;				
-	} break;
-	case INSTRUCTION_CLD: {
-		cpu_remove_flag(cpu, FLAG_DECIMAL);
-		cpu->pc = cpu->pc + instruction_set.bytes - 1;				
-	} break;
-	case INSTRUCTION_CLI: {
-		cpu_remove_flag(cpu, FLAG_INTERRUPT_DISABLE);
-		cpu->pc = cpu->pc + instruction_set.bytes - 1;				
-	} break;
-	case INSTRUCTION_CLV: {
-		cpu_remove_flag(cpu, FLAG_OVERFLOW);
-		cpu->pc = cpu->pc + instruction_set.bytes - 1;				
-	} break;		
+	if (instruction_set->handler == NULL) {
+	    cpu->cycles = cpu->cycles + 7;
+	    cpu->halted = true;
+	    return true;
+	}
+
+	cpu->cycles = cpu->cycles + instruction_set->cycles;
+
+	ushort addr = cpu_get_operand_address(cpu, instruction_set->mode);
+	cpu->pc = cpu->pc + instruction_set->bytes - 1;
+	if (instruction_set->page_penalty && cpu->page_crossed) cpu->cycles = cpu->cycles + 1;
+	instruction_set->handler(cpu, addr);
+	if (cpu->cycles >= cpu->deadline) return false;
+    }
+}
+
+static bool cpu_execute_blocks(CPU* cpu)
+{
+    BLOCK_CACHE* cache = cpu->blocks;
+
+    while (1) {
+	uint64_t generation = cache->generation;
+	const BLOCK* block = block_lookup(cache, cpu, NULL, NULL);
+	if (block == NULL) {
+	    if (cpu_execute_one(cpu)) return true;
+	    if (cpu->cycles >= cpu->deadline) return false;
+	    continue;
+	}
+
+	for (int i = 0; i < block->count; i++) {
+	    const MICRO_OP* micro_op = &block->ops[i];
+	    cpu_trace(cpu);
+	    cpu_profile(cpu);
+	    cpu_log_code(cpu, micro_op->handler != NULL ? (ushort)(micro_op->next_pc - cpu->pc) : 1);
+	    ushort addr = cpu_operand_resolve(cpu, micro_op->mode, micro_op->operand);
+	    cpu->pc = micro_op->next_pc;
+
+	    if (micro_op->handler == NULL) {
+		cpu->cycles = cpu->cycles + 7;
+		cpu->halted = true;
+		return true;
+	    }
+
+	    cpu->cycles = cpu->cycles + micro_op->cycles;
+	    if (micro_op->page_penalty && cpu->page_crossed) cpu->cycles = cpu->cycles + 1;
+	    micro_op->handler(cpu, addr);
+	    if (cpu->cycles >= cpu->deadline) return false;
+	    if (cache->generation != generation) break;
+	}
     }
+}
+
+#endif
+
+// Runs straight through to the earlier of `end` and the next scheduled
+// event, so the interpreters only ever compare against cpu->deadline, then
+// dispatches whatever is due and takes a pending IRQ.
+static void cpu_dispatch(CPU* cpu, uint64_t end)
+{
+    // Pick up any status the host stored directly and hand back an exact one.
+    cpu_set_status(cpu, cpu->status);
+    while (1) {
+	while (cpu->scheduler != NULL && scheduler_next(cpu->scheduler) <= cpu->cycles) {
+	    // Handlers see an exact status, as they would outside cpu_run.
+	    cpu->status = cpu_get_status(cpu);
+	    scheduler_dispatch(cpu->scheduler, cpu->cycles);
+	    cpu_set_status(cpu, cpu->status);
+	}
+	if (cpu->irq_line) cpu_irq(cpu);
+	if (cpu->cycles >= end) break;
+
+	// Events, interrupts and the host may all have changed what a spin
+	// loop sees since it was last measured.
+	if (cpu->idle != NULL) cpu->idle->armed = false;
+	cpu->deadline = end;
+	if (cpu->scheduler != NULL && scheduler_next(cpu->scheduler) < end) cpu->deadline = scheduler_next(cpu->scheduler);
+	bool stopped = cpu->blocks != NULL ? cpu_execute_blocks(cpu) : cpu_execute(cpu);
+	if (stopped) break;
     }
+    cpu->deadline = UINT64_MAX;
+#if CPU_PROFILE
+    if (cpu->profiler != NULL) profiler_settle(cpu->profiler, cpu);
+#endif
+    cpu->status = cpu_get_status(cpu);
+}
+
+void cpu_run(CPU* cpu)
+{
+    cpu_dispatch(cpu, UINT64_MAX);
+}
+
+uint64_t cpu_run_for_cycles(CPU* cpu, uint64_t budget)
+{
+    uint64_t start = cpu->cycles;
+    // Stop on the first instruction boundary at or past the budget; the
+    // overshoot is carried by cpu->cycles into the caller's next slice.
+    if (budget > UINT64_MAX - start) budget = UINT64_MAX - start;
+    cpu_dispatch(cpu, start + budget);
+    return cpu->cycles - start;
 }
 
 void cpu_load_and_run(CPU* cpu, uchar *program, size_t program_length)
 {
-    cpu_load(cpu, program, program_length);
+    if (!cpu_load(cpu, program, program_length)) return;
     cpu_reset(cpu);
     cpu_run(cpu);
 }
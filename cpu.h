@@ -3,21 +3,27 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include "bus.h"
 
 #define uchar unsigned char
 #define ushort unsigned short
-#define MEMORY_SIZE 0xFFFF
-
-#define instruction_case(op, ins, by, cy, mo) \
-       case op: { \
-           return (INSTRUCTION_SET){ \
-	       .op_code = op, \
-	       .instruction = ins, \
-	       .bytes = by, \
-	       .cycles = cy, \
-	       .mode = mo \
-	   }; \
-       } break \
+#define MEMORY_SIZE 0x10000
+
+// Build with -DCPU_TRACE=0 to compile the tracer hook out of the interpreter.
+#ifndef CPU_TRACE
+#define CPU_TRACE 1
+#endif
+
+// Build with -DCPU_PROFILE=0 to compile the profiler hook out as well.
+#ifndef CPU_PROFILE
+#define CPU_PROFILE 1
+#endif
+
+// Build with -DCPU_CDL=0 to compile the code/data logger hooks out.
+#ifndef CPU_CDL
+#define CPU_CDL 1
+#endif
 
 typedef enum {
     INSTRUCTION_BRK,
@@ -40,7 +46,16 @@ typedef enum {
 	INSTRUCTION_CLC,
 	INSTRUCTION_CLD,
 	INSTRUCTION_CLI,
-	INSTRUCTION_CLV
+	INSTRUCTION_CLV,
+	INSTRUCTION_JSR,
+	INSTRUCTION_RTS,
+	INSTRUCTION_RTI,
+	INSTRUCTION_SEI,
+	INSTRUCTION_PHA,
+	INSTRUCTION_PHP,
+	INSTRUCTION_PLA,
+	INSTRUCTION_PLP,
+	INSTRUCTION_JMP
 } INSTRUCTION;
 
 typedef enum {
@@ -56,54 +71,127 @@ typedef enum {
     ADDRESS_INDIRECT_X,
     ADDRESS_INDIRECT_Y,
     ADDRESS_NONE,
+    ADDRESS_MODE_COUNT
 } ADDRESS_MODE;
 
+// Each flag is its bit in the status register.
 typedef enum {
-	FLAG_NEGATIVE,
-	FLAG_OVERFLOW,
-	FLAG_B,
-	FLAG_DECIMAL,
-	FLAG_INTERRUPT_DISABLE,
-	FLAG_ZERO,
-	FLAG_CARRY
+	FLAG_NEGATIVE = 0b10000000,
+	FLAG_OVERFLOW = 0b01000000,
+	FLAG_B = 0b00010000,
+	FLAG_DECIMAL = 0b00001000,
+	FLAG_INTERRUPT_DISABLE = 0b00000100,
+	FLAG_ZERO = 0b00000010,
+	FLAG_CARRY = 0b00000001
 } CPU_FLAG;
 
 
+struct CPU;
+
+// Every handler receives the operand address already resolved from the
+// opcode's addressing mode (0 for implied and accumulator modes).
+typedef void (*INSTRUCTION_HANDLER)(struct CPU* cpu, ushort addr);
+
 typedef struct INSTRUCTION_SET{
     uchar op_code;
     INSTRUCTION instruction;
+    const char* name;
+    INSTRUCTION_HANDLER handler; // NULL stops cpu_run (BRK, unimplemented)
     uchar bytes;
     uchar cycles;
     ADDRESS_MODE mode;    
+    bool page_penalty; // +1 cycle when the indexed address crosses a page
 } INSTRUCTION_SET;
 
+// The first cache line holds the registers and cycle state every
+// instruction updates, the second the attachments the run loop checks. The
+// 64 KB of memory lives elsewhere, so a CPU is cheap to set up and recycle.
 typedef struct CPU{
-    uchar reg_a;
+    _Alignas(64) uchar reg_a;
     uchar reg_x;
     uchar reg_y;
-    uchar status;
+    uchar reg_sp;
+    uchar status;      // N and Z are only exact outside cpu_run, see cpu_get_status
+    uchar flag_n;      // bit 7 is N
+    uchar flag_z;      // zero when Z is set
     ushort pc;
-    uchar memory[MEMORY_SIZE];
+    uint64_t cycles;   // total cycles since power on, including penalties
+    bool page_crossed; // set by cpu_get_operand_address for indexed modes
+    bool halted;       // set when BRK stops execution
+    bool irq_line;     // IRQ input level, taken between instructions while I is clear
+    uint64_t deadline; // the interpreters stop at the first instruction boundary past it
+    _Alignas(64) struct BLOCK_CACHE* blocks; // predecoded blocks, NULL to interpret directly
+    struct TRACER* tracer;      // instruction tracer, NULL when not tracing
+    struct PROFILER* profiler;  // opcode/pc profiler, NULL when not profiling
+    struct SCHEDULER* scheduler; // timed device events, NULL when there are none
+    struct IDLE_DETECTOR* idle;  // spin-wait fast forward, NULL to run every iteration
+    struct CDL* cdl;             // code/data logger, NULL when not logging
+    uchar* memory;     // MEMORY_SIZE bytes of page storage, see cpu_init
+    BUS bus;           // page table in front of memory, see bus.h
 } CPU;
 
+// Sets up a CPU in its power-on state on `memory`, MEMORY_SIZE zeroed bytes
+// that outlive it. The CPU never frees them.
+void cpu_init(CPU* cpu, uchar* memory);
+
+// Same, with memory of its own that cpu_free_memory releases.
 CPU make_cpu(void);
 
+void cpu_free_memory(CPU* cpu);
+
+// Returns a used CPU to the state cpu_init left it in. Only the memory pages
+// written since (see BUS.dirty) are zeroed, and the page table is only
+// rebuilt if it was changed. Attachments are dropped, not destroyed.
+// Returns the number of pages zeroed.
+int cpu_recycle(CPU* cpu);
+
 ushort add_wrap_ushort(ushort a, ushort b);
 
 uchar cpu_read_memory(CPU* cpu, ushort addr);
 
 void cpu_write_memory(CPU* cpu, ushort addr, uchar data);
 
+// Reads the storage behind addr without triggering I/O callbacks.
+uchar cpu_peek_memory(CPU* cpu, ushort addr);
+
 ushort cpu_read_memory_ushort(CPU* cpu, ushort pos);
 
 void cpu_write_memory_ushort(CPU* cpu, ushort pos, ushort data);
 
 void cpu_reset(CPU* cpu);
 
-void cpu_load(CPU* cpu, uchar *program, size_t program_length);
+#define CPU_IMAGE_SIZE 0x8000
+
+// Programs load at $8000 and end before the reset vector at $FFFC.
+#define CPU_PROGRAM_MAX (CPU_IMAGE_SIZE - 4)
+
+// Copies the program to $8000 and points the reset vector at it. Returns
+// false, leaving memory alone, for programs longer than CPU_PROGRAM_MAX.
+bool cpu_load(CPU* cpu, uchar *program, size_t program_length);
+
+// Lays out $8000-$FFFF the way cpu_load would: the program at $8000 and the
+// reset vector pointing at it. Returns false if the program is longer than
+// CPU_PROGRAM_MAX.
+bool cpu_build_image(uchar* image, const uchar* program, size_t program_length);
+
+// Maps $8000-$FFFF copy-on-write onto an image built once and shared by
+// any number of CPUs. Pages a CPU writes become private to it; the rest
+// are only ever read from the image.
+void cpu_map_image(CPU* cpu, const uchar* image);
+
+// Reads the raw operand of an instruction whose operand bytes start at `at`
+// (for immediate and relative modes this is `at` itself).
+ushort cpu_read_operand(CPU* cpu, ADDRESS_MODE mode, ushort at);
+
+// Turns a raw operand into the effective address using the current registers.
+ushort cpu_resolve_operand_address(CPU* cpu, ADDRESS_MODE mode, ushort operand);
 
 ushort cpu_get_operand_address(CPU* cpu, ADDRESS_MODE mode);
 
+uchar cpu_get_status(CPU* cpu);
+
+void cpu_set_status(CPU* cpu, uchar status);
+
 bool cpu_contains_flag(CPU* cpu, CPU_FLAG flag);
 
 void cpu_set_flag(CPU* cpu, CPU_FLAG flag);
@@ -112,28 +200,98 @@ void cpu_remove_flag(CPU* cpu, CPU_FLAG flag);
 
 void cpu_update_zero_and_negative_flags(CPU* cpu, uchar result);
 
-void cpu_instruction_LDA(CPU* cpu, ADDRESS_MODE mode);
+const INSTRUCTION_SET* cpu_get_instruction_set(uchar op);
+
+void cpu_instruction_LDA(CPU* cpu, ushort addr);
+
+void cpu_instruction_TAX(CPU* cpu, ushort addr);
+
+void cpu_instruction_INX(CPU* cpu, ushort addr);
+
+void cpu_instruction_INY(CPU* cpu, ushort addr);
+
+void cpu_instruction_STA(CPU* cpu, ushort addr);
+
+void cpu_instruction_AND(CPU* cpu, ushort addr);
+
+void cpu_instruction_ADC(CPU* cpu, ushort addr);
+
+void cpu_instruction_ASL(CPU* cpu, ushort addr);
 
-void cpu_instruction_TAX(CPU* cpu);
+void cpu_instruction_ASL_accumulator(CPU* cpu, ushort addr);
 
-void cpu_instruction_INX(CPU* cpu);
+void cpu_instruction_branch(CPU* cpu, ushort addr, bool condition);
 
-void cpu_instruction_INY(CPU* cpu);
+void cpu_instruction_BCC(CPU* cpu, ushort addr);
 
-void cpu_instruction_STA(CPU* cpu, ADDRESS_MODE mode);
+void cpu_instruction_BCS(CPU* cpu, ushort addr);
 
-void cpu_instruction_AND(CPU* cpu, ADDRESS_MODE mode);
+void cpu_instruction_BEQ(CPU* cpu, ushort addr);
 
-void cpu_instruction_ADC(CPU* cpu, ADDRESS_MODE mode);
+void cpu_instruction_BMI(CPU* cpu, ushort addr);
 
-void cpu_instruction_ASL(CPU* cpu, ADDRESS_MODE mode);
+void cpu_instruction_BNE(CPU* cpu, ushort addr);
 
-void cpu_instruction_branch(CPU* cpu, bool condition);
+void cpu_instruction_BPL(CPU* cpu, ushort addr);
 
-void cpu_instruction_BIT(CPU* cpu, ADDRESS_MODE mode);
+void cpu_instruction_BVC(CPU* cpu, ushort addr);
+
+void cpu_instruction_BVS(CPU* cpu, ushort addr);
+
+void cpu_instruction_BIT(CPU* cpu, ushort addr);
+
+void cpu_instruction_CLC(CPU* cpu, ushort addr);
+
+void cpu_instruction_CLD(CPU* cpu, ushort addr);
+
+void cpu_instruction_CLI(CPU* cpu, ushort addr);
+
+void cpu_instruction_CLV(CPU* cpu, ushort addr);
+
+void cpu_stack_push(CPU* cpu, uchar data);
+
+uchar cpu_stack_pop(CPU* cpu);
+
+void cpu_stack_push_ushort(CPU* cpu, ushort data);
+
+ushort cpu_stack_pop_ushort(CPU* cpu);
+
+void cpu_instruction_JSR(CPU* cpu, ushort addr);
+
+void cpu_instruction_RTS(CPU* cpu, ushort addr);
+
+void cpu_instruction_RTI(CPU* cpu, ushort addr);
+
+void cpu_instruction_SEI(CPU* cpu, ushort addr);
+
+void cpu_instruction_PHA(CPU* cpu, ushort addr);
+
+void cpu_instruction_PHP(CPU* cpu, ushort addr);
+
+void cpu_instruction_PLA(CPU* cpu, ushort addr);
+
+void cpu_instruction_PLP(CPU* cpu, ushort addr);
+
+void cpu_instruction_JMP(CPU* cpu, ushort addr);
+
+void cpu_instruction_JMP_indirect(CPU* cpu, ushort addr);
+
+// Interrupt sequences: push pc and status, set I and jump through the
+// vector, 7 cycles. cpu_irq does nothing and returns false while I is set.
+void cpu_nmi(CPU* cpu);
+
+bool cpu_irq(CPU* cpu);
+
+// Drives the IRQ input. A rising line with I clear ends the current run
+// slice so the interrupt is taken after this instruction.
+void cpu_set_irq_line(CPU* cpu, bool level);
 
 void cpu_run(CPU* cpu);
 
+// Runs until at least `budget` cycles have elapsed or BRK is reached and
+// returns the number of cycles actually executed.
+uint64_t cpu_run_for_cycles(CPU* cpu, uint64_t budget);
+
 void cpu_load_and_run(CPU* cpu, uchar *program, size_t program_length);
 
 #endif // CPU_H_
@@ -0,0 +1,534 @@
+#include "fuzz.h"
+#include <stdio.h>
+#include <string.h>
+
+// What the oracle expects one instruction to leave behind.
+typedef struct FUZZ_EXPECT {
+    uchar reg_a;
+    uchar reg_x;
+    uchar reg_y;
+    uchar reg_sp;
+    uchar status;
+    ushort pc;
+    uint64_t cycles;
+    bool halted;
+    int writes;
+    ushort write_addr[3];
+    uchar write_value[3];
+    int outcome;             // coverage bits, see FUZZ_OUTCOMES
+} FUZZ_EXPECT;
+
+FUZZER* fuzz_create(void)
+{
+    FUZZER* fuzzer = aligned_alloc(64, sizeof(FUZZER));
+    if (fuzzer == NULL) return NULL;
+    memset(fuzzer, 0, sizeof(FUZZER));
+    fuzzer->step_period = 1;
+    fuzzer->cpu = make_cpu();
+    if (fuzzer->cpu.memory == NULL) {
+	free(fuzzer);
+	return NULL;
+    }
+    return fuzzer;
+}
+
+void fuzz_destroy(FUZZER* fuzzer)
+{
+    if (fuzzer == NULL) return;
+    cpu_free_memory(&fuzzer->cpu);
+    free(fuzzer);
+}
+
+// Pages the last input wrote are zeroed by the recycle and the new program
+// is written over others, so all of them are stale in `expected`.
+static void fuzz_load(FUZZER* fuzzer, const uchar* data, size_t size)
+{
+    CPU* cpu = &fuzzer->cpu;
+    for (int word = 0; word < BUS_PAGE_COUNT / 64; word++) fuzzer->stale[word] = fuzzer->stale[word] | cpu->bus.dirty[word];
+    cpu_recycle(cpu);
+    uchar header[FUZZ_HEADER_SIZE] = { 0 };
+    memcpy(header, data, size < FUZZ_HEADER_SIZE ? size : FUZZ_HEADER_SIZE);
+    size_t length = size > FUZZ_HEADER_SIZE ? size - FUZZ_HEADER_SIZE : 0;
+    if (length > FUZZ_PROGRAM_MAX) length = FUZZ_PROGRAM_MAX;
+    memcpy(cpu->memory + 0x8000, data + FUZZ_HEADER_SIZE, length);
+    memcpy(cpu->memory, data + FUZZ_HEADER_SIZE, length);
+    bus_mark_dirty(&cpu->bus, 0x8000, length);
+    bus_mark_dirty(&cpu->bus, 0x0000, length);
+
+    cpu->reg_a = header[0];
+    cpu->reg_x = header[1];
+    cpu->reg_y = header[2];
+    cpu->reg_sp = header[3];
+    // B and bit 5 only exist on the stack copy.
+    cpu_set_status(cpu, (header[4] & (uchar)~FLAG_B) | 0b00100000);
+    cpu->pc = 0x8000;
+    for (int word = 0; word < BUS_PAGE_COUNT / 64; word++) fuzzer->stale[word] = fuzzer->stale[word] | cpu->bus.dirty[word];
+}
+
+// Copies the stale pages of memory into `expected` before stepping.
+static void fuzz_sync_expected(FUZZER* fuzzer)
+{
+    for (int word = 0; word < BUS_PAGE_COUNT / 64; word++) {
+	uint64_t pages = fuzzer->stale[word];
+	while (pages != 0) {
+	    int page = word * 64 + __builtin_ctzll(pages);
+	    pages = pages & (pages - 1);
+	    memcpy(fuzzer->expected + page * BUS_PAGE_SIZE, fuzzer->cpu.memory + page * BUS_PAGE_SIZE, BUS_PAGE_SIZE);
+	}
+	fuzzer->stale[word] = 0;
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+/* Oracle                                                                 */
+/* ---------------------------------------------------------------------- */
+
+// Written from the 6502 documentation rather than from cpu.c, so the two
+// only agree when both are right. Memory is read without side effects
+// before the instruction runs.
+
+static uchar fuzz_peek(CPU* cpu, ushort addr)
+{
+    return cpu_peek_memory(cpu, addr);
+}
+
+static ushort fuzz_peek_word(CPU* cpu, ushort addr)
+{
+    return (ushort)(fuzz_peek(cpu, addr) | fuzz_peek(cpu, (ushort)(addr + 1)) << 8);
+}
+
+static ushort fuzz_peek_zeropage_word(CPU* cpu, uchar addr)
+{
+    return (ushort)(fuzz_peek(cpu, addr) | fuzz_peek(cpu, (uchar)(addr + 1)) << 8);
+}
+
+static uchar fuzz_zero_and_negative(uchar status, uchar result)
+{
+    status = status & (uchar)~(FLAG_ZERO | FLAG_NEGATIVE);
+    if (result == 0) status = status | FLAG_ZERO;
+    return status | (result & FLAG_NEGATIVE);
+}
+
+static void fuzz_set_flag(uchar* status, uchar flag, bool set)
+{
+    *status = set ? (*status | flag) : (*status & (uchar)~flag);
+}
+
+static void fuzz_write(FUZZ_EXPECT* expect, ushort addr, uchar value)
+{
+    expect->write_addr[expect->writes] = addr;
+    expect->write_value[expect->writes] = value;
+    expect->writes = expect->writes + 1;
+}
+
+static void fuzz_push(FUZZ_EXPECT* expect, uchar value)
+{
+    fuzz_write(expect, 0x0100 | expect->reg_sp, value);
+    expect->reg_sp = expect->reg_sp - 1;
+}
+
+static uchar fuzz_pull(CPU* cpu, FUZZ_EXPECT* expect)
+{
+    expect->reg_sp = expect->reg_sp + 1;
+    return fuzz_peek(cpu, 0x0100 | expect->reg_sp);
+}
+
+// Operand bytes each addressing mode takes after the opcode.
+static int fuzz_operand_bytes(ADDRESS_MODE mode)
+{
+    switch (mode) {
+    case ADDRESS_ABSOLUTE:
+    case ADDRESS_ABSOLUTE_X:
+    case ADDRESS_ABSOLUTE_Y: return 2;
+    case ADDRESS_ACCUMULATOR:
+    case ADDRESS_NONE: return 0;
+    default: return 1;
+    }
+}
+
+static bool fuzz_predict(CPU* cpu, FUZZ_EXPECT* expect, FUZZ_FAILURE* failure)
+{
+    memset(expect, 0, sizeof(FUZZ_EXPECT));
+    expect->reg_a = cpu->reg_a;
+    expect->reg_x = cpu->reg_x;
+    expect->reg_y = cpu->reg_y;
+    expect->reg_sp = cpu->reg_sp;
+    expect->status = cpu->status;
+    expect->cycles = cpu->cycles;
+    ushort pc = cpu->pc;
+    uchar op = fuzz_peek(cpu, pc);
+    const INSTRUCTION_SET* set = cpu_get_instruction_set(op);
+    if (set->handler == NULL) {
+	expect->pc = (ushort)(pc + 1);
+	expect->cycles = expect->cycles + 7;
+	expect->halted = true;
+	return true;
+    }
+    if (set->bytes != 1 + fuzz_operand_bytes(set->mode)) {
+	*failure = (FUZZ_FAILURE){ pc, op, "instruction length", (unsigned)(1 + fuzz_operand_bytes(set->mode)), set->bytes };
+	return false;
+    }
+
+    ushort at = (ushort)(pc + 1);
+    ushort addr = 0;
+    bool crossed = false;
+    switch (set->mode) {
+    case ADDRESS_IMMEDIATE:
+    case ADDRESS_RELATIVE: addr = at; break;
+    case ADDRESS_ZEROPAGE: addr = fuzz_peek(cpu, at); break;
+    case ADDRESS_ZEROPAGE_X: addr = (uchar)(fuzz_peek(cpu, at) + cpu->reg_x); break;
+    case ADDRESS_ZEROPAGE_Y: addr = (uchar)(fuzz_peek(cpu, at) + cpu->reg_y); break;
+    case ADDRESS_ABSOLUTE: addr = fuzz_peek_word(cpu, at); break;
+    case ADDRESS_ABSOLUTE_X:
+    case ADDRESS_ABSOLUTE_Y: {
+	ushort base = fuzz_peek_word(cpu, at);
+	addr = (ushort)(base + (set->mode == ADDRESS_ABSOLUTE_X ? cpu->reg_x : cpu->reg_y));
+	crossed = (base & 0xFF00) != (addr & 0xFF00);
+    } break;
+    case ADDRESS_INDIRECT_X: addr = fuzz_peek_zeropage_word(cpu, (uchar)(fuzz_peek(cpu, at) + cpu->reg_x)); break;
+    case ADDRESS_INDIRECT_Y: {
+	ushort base = fuzz_peek_zeropage_word(cpu, fuzz_peek(cpu, at));
+	addr = (ushort)(base + cpu->reg_y);
+	crossed = (base & 0xFF00) != (addr & 0xFF00);
+    } break;
+    default: break;
+    }
+
+    expect->pc = (ushort)(pc + set->bytes);
+    expect->cycles = expect->cycles + set->cycles + (set->page_penalty && crossed);
+    if (crossed) expect->outcome = expect->outcome | 1;
+    uchar value = fuzz_peek(cpu, addr);
+    uchar* status = &expect->status;
+    switch (set->instruction) {
+    case INSTRUCTION_LDA: {
+	expect->reg_a = value;
+	*status = fuzz_zero_and_negative(*status, value);
+    } break;
+    case INSTRUCTION_TAX: {
+	expect->reg_x = expect->reg_a;
+	*status = fuzz_zero_and_negative(*status, expect->reg_x);
+    } break;
+    case INSTRUCTION_INX: {
+	expect->reg_x = expect->reg_x + 1;
+	*status = fuzz_zero_and_negative(*status, expect->reg_x);
+    } break;
+    case INSTRUCTION_INY: {
+	expect->reg_y = expect->reg_y + 1;
+	*status = fuzz_zero_and_negative(*status, expect->reg_y);
+    } break;
+    case INSTRUCTION_AND: {
+	expect->reg_a = expect->reg_a & value;
+	*status = fuzz_zero_and_negative(*status, expect->reg_a);
+    } break;
+    case INSTRUCTION_ADC: {
+	unsigned sum = (unsigned)expect->reg_a + value + (*status & FLAG_CARRY);
+	// Overflow: both operands have the same sign and the result does not.
+	bool overflow = (~(expect->reg_a ^ value) & (expect->reg_a ^ sum) & 0x80) != 0;
+	fuzz_set_flag(status, FLAG_CARRY, sum > 0xFF);
+	fuzz_set_flag(status, FLAG_OVERFLOW, overflow);
+	expect->reg_a = (uchar)sum;
+	*status = fuzz_zero_and_negative(*status, expect->reg_a);
+    } break;
+    case INSTRUCTION_ASL: {
+	uchar operand = set->mode == ADDRESS_ACCUMULATOR ? expect->reg_a : value;
+	uchar result = (uchar)(operand << 1);
+	fuzz_set_flag(status, FLAG_CARRY, (operand & 0x80) != 0);
+	*status = fuzz_zero_and_negative(*status, result);
+	if (set->mode == ADDRESS_ACCUMULATOR) expect->reg_a = result; else fuzz_write(expect, addr, result);
+    } break;
+    case INSTRUCTION_BIT: {
+	fuzz_set_flag(status, FLAG_ZERO, (expect->reg_a & value) == 0);
+	fuzz_set_flag(status, FLAG_NEGATIVE, (value & 0x80) != 0);
+	fuzz_set_flag(status, FLAG_OVERFLOW, (value & 0x40) != 0);
+    } break;
+    case INSTRUCTION_BCC:
+    case INSTRUCTION_BCS:
+    case INSTRUCTION_BEQ:
+    case INSTRUCTION_BMI:
+    case INSTRUCTION_BNE:
+    case INSTRUCTION_BPL:
+    case INSTRUCTION_BVC:
+    case INSTRUCTION_BVS: {
+	static const uchar flags[] = { FLAG_CARRY, FLAG_CARRY, FLAG_ZERO, FLAG_NEGATIVE, FLAG_ZERO, FLAG_NEGATIVE, FLAG_OVERFLOW, FLAG_OVERFLOW };
+	static const bool when_set[] = { false, true, true, true, false, false, false, true };
+	int branch = set->instruction - INSTRUCTION_BCC;
+	if (((*status & flags[branch]) != 0) == when_set[branch]) {
+	    ushort target = (ushort)(expect->pc + (signed char)value);
+	    expect->cycles = expect->cycles + 1 + ((target & 0xFF00) != (expect->pc & 0xFF00));
+	    expect->pc = target;
+	    expect->outcome = expect->outcome | 2;
+	}
+    } break;
+    case INSTRUCTION_CLC: fuzz_set_flag(status, FLAG_CARRY, false); break;
+    case INSTRUCTION_CLD: fuzz_set_flag(status, FLAG_DECIMAL, false); break;
+    case INSTRUCTION_CLI: fuzz_set_flag(status, FLAG_INTERRUPT_DISABLE, false); break;
+    case INSTRUCTION_CLV: fuzz_set_flag(status, FLAG_OVERFLOW, false); break;
+    case INSTRUCTION_SEI: fuzz_set_flag(status, FLAG_INTERRUPT_DISABLE, true); break;
+    case INSTRUCTION_JSR: {
+	ushort last = (ushort)(pc + 2);
+	fuzz_push(expect, (uchar)(last >> 8));
+	fuzz_push(expect, (uchar)last);
+	expect->pc = addr;
+    } break;
+    case INSTRUCTION_RTS: {
+	ushort lo = fuzz_pull(cpu, expect);
+	ushort hi = fuzz_pull(cpu, expect);
+	expect->pc = (ushort)((hi << 8 | lo) + 1);
+    } break;
+    case INSTRUCTION_RTI: {
+	*status = (fuzz_pull(cpu, expect) & (uchar)~FLAG_B) | 0b00100000;
+	ushort lo = fuzz_pull(cpu, expect);
+	ushort hi = fuzz_pull(cpu, expect);
+	expect->pc = (ushort)(hi << 8 | lo);
+    } break;
+    case INSTRUCTION_PHA: fuzz_push(expect, expect->reg_a); break;
+    case INSTRUCTION_PHP: fuzz_push(expect, *status | FLAG_B | 0b00100000); break;
+    case INSTRUCTION_PLA: {
+	expect->reg_a = fuzz_pull(cpu, expect);
+	*status = fuzz_zero_and_negative(*status, expect->reg_a);
+    } break;
+    case INSTRUCTION_PLP: *status = (fuzz_pull(cpu, expect) & (uchar)~FLAG_B) | 0b00100000; break;
+    case INSTRUCTION_JMP: {
+	if (op == 0x6C) {
+	    // The pointer's high byte comes from the same page.
+	    ushort hi_addr = (ushort)((addr & 0xFF00) | ((addr + 1) & 0x00FF));
+	    addr = (ushort)(fuzz_peek(cpu, addr) | fuzz_peek(cpu, hi_addr) << 8);
+	}
+	expect->pc = addr;
+    } break;
+    default: {
+	*failure = (FUZZ_FAILURE){ pc, op, "instruction the oracle does not know", 0, set->instruction };
+	return false;
+    }
+    }
+    if (*status & FLAG_CARRY) expect->outcome = expect->outcome | 4;
+    return true;
+}
+
+static bool fuzz_compare(FUZZ_FAILURE* failure, ushort pc, uchar op, const char* check, unsigned expected, unsigned actual)
+{
+    if (expected == actual) return true;
+    *failure = (FUZZ_FAILURE){ pc, op, check, expected, actual };
+    return false;
+}
+
+// Applies the predicted writes to `expected`, then compares every page the
+// CPU or the oracle has written since the load, so a write to an address
+// the oracle did not predict fails as well as a predicted one that is
+// missing or wrong.
+static bool fuzz_check_memory(FUZZER* fuzzer, const FUZZ_EXPECT* expect, ushort pc, uchar op)
+{
+    CPU* cpu = &fuzzer->cpu;
+    for (int i = 0; i < expect->writes; i++) {
+	ushort addr = expect->write_addr[i];
+	if (!fuzz_compare(&fuzzer->failure, pc, op, "memory write", expect->write_value[i], fuzz_peek(cpu, addr))) return false;
+	fuzzer->expected[addr] = expect->write_value[i];
+	fuzzer->stale[addr / BUS_PAGE_SIZE / 64] = fuzzer->stale[addr / BUS_PAGE_SIZE / 64] | 1ull << (addr / BUS_PAGE_SIZE % 64);
+    }
+    for (int word = 0; word < BUS_PAGE_COUNT / 64; word++) {
+	uint64_t pages = cpu->bus.dirty[word] | fuzzer->stale[word];
+	while (pages != 0) {
+	    int page = word * 64 + __builtin_ctzll(pages);
+	    pages = pages & (pages - 1);
+	    const uchar* actual = cpu->memory + page * BUS_PAGE_SIZE;
+	    const uchar* expected = fuzzer->expected + page * BUS_PAGE_SIZE;
+	    if (memcmp(actual, expected, BUS_PAGE_SIZE) == 0) continue;
+	    int i = 0;
+	    while (actual[i] == expected[i]) i++;
+	    return fuzz_compare(&fuzzer->failure, pc, op, "unexpected memory write", expected[i], actual[i]);
+	}
+    }
+    return true;
+}
+
+static bool fuzz_check(CPU* cpu, const FUZZ_EXPECT* expect, ushort pc, uchar op, FUZZ_FAILURE* failure)
+{
+    return fuzz_compare(failure, pc, op, "A", expect->reg_a, cpu->reg_a)
+	&& fuzz_compare(failure, pc, op, "X", expect->reg_x, cpu->reg_x)
+	&& fuzz_compare(failure, pc, op, "Y", expect->reg_y, cpu->reg_y)
+	&& fuzz_compare(failure, pc, op, "SP", expect->reg_sp, cpu->reg_sp)
+	&& fuzz_compare(failure, pc, op, "status", expect->status, cpu->status)
+	&& fuzz_compare(failure, pc, op, "pc", expect->pc, cpu->pc)
+	&& fuzz_compare(failure, pc, op, "cycles", (unsigned)expect->cycles, (unsigned)cpu->cycles)
+	&& fuzz_compare(failure, pc, op, "halted", expect->halted, cpu->halted);
+}
+
+/* ---------------------------------------------------------------------- */
+/* Runs                                                                   */
+/* ---------------------------------------------------------------------- */
+
+static void fuzz_cover(FUZZER* fuzzer, uchar op, const FUZZ_EXPECT* expect)
+{
+    const INSTRUCTION_SET* set = cpu_get_instruction_set(op);
+    fuzzer->opcode_hits[op] = fuzzer->opcode_hits[op] + 1;
+    fuzzer->mode_hits[set->mode] = fuzzer->mode_hits[set->mode] + 1;
+    uchar* hits = &fuzzer->coverage[op * FUZZ_OUTCOMES + expect->outcome];
+    if (*hits == 0) {
+	fuzzer->covered = fuzzer->covered + 1;
+	fuzzer->new_coverage = fuzzer->new_coverage + 1;
+    }
+    if (*hits != 0xFF) *hits = *hits + 1;
+}
+
+// Hashes which pages were written since the load and what they hold, so
+// comparing two runs costs a few pages rather than 64 KB.
+static uint64_t fuzz_hash_written(CPU* cpu)
+{
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (int word = 0; word < BUS_PAGE_COUNT / 64; word++) {
+	uint64_t dirty = cpu->bus.dirty[word];
+	hash = (hash ^ dirty) * 0x100000001B3ull;
+	while (dirty != 0) {
+	    int page = word * 64 + __builtin_ctzll(dirty);
+	    dirty = dirty & (dirty - 1);
+	    for (int i = 0; i < BUS_PAGE_SIZE; i += 8) {
+		uint64_t value;
+		memcpy(&value, cpu->memory + page * BUS_PAGE_SIZE + i, 8);
+		hash = (hash ^ value) * 0x100000001B3ull;
+	    }
+	}
+    }
+    return hash;
+}
+
+bool fuzz_run(FUZZER* fuzzer, const uchar* data, size_t size)
+{
+    CPU* cpu = &fuzzer->cpu;
+    fuzzer->executions = fuzzer->executions + 1;
+    fuzzer->new_coverage = 0;
+
+    if (fuzzer->step_period > 1 && fuzzer->executions % fuzzer->step_period != 0) {
+	fuzz_load(fuzzer, data, size);
+	cpu_run_for_cycles(cpu, FUZZ_MAX_CYCLES);
+	return true;
+    }
+
+    // Step one instruction at a time under the oracle.
+    fuzz_load(fuzzer, data, size);
+    fuzz_sync_expected(fuzzer);
+    uint64_t end = cpu->cycles + FUZZ_MAX_CYCLES;
+    while (!cpu->halted && cpu->cycles < end) {
+	FUZZ_EXPECT expect;
+	ushort pc = cpu->pc;
+	uchar op = fuzz_peek(cpu, pc);
+	if (!fuzz_predict(cpu, &expect, &fuzzer->failure)) return false;
+	cpu_run_for_cycles(cpu, 1);
+	fuzzer->instructions = fuzzer->instructions + 1;
+	if (!fuzz_check(cpu, &expect, pc, op, &fuzzer->failure)) return false;
+	if (!fuzz_check_memory(fuzzer, &expect, pc, op)) return false;
+	fuzz_cover(fuzzer, op, &expect);
+    }
+
+    // Running straight through keeps N and Z lazy across instructions;
+    // it has to end in the same place.
+    FUZZ_EXPECT stepped = {
+	.reg_a = cpu->reg_a, .reg_x = cpu->reg_x, .reg_y = cpu->reg_y, .reg_sp = cpu->reg_sp,
+	.status = cpu->status, .pc = cpu->pc, .cycles = cpu->cycles, .halted = cpu->halted
+    };
+    uint64_t hash = fuzz_hash_written(cpu);
+    fuzz_load(fuzzer, data, size);
+    cpu_run_for_cycles(cpu, FUZZ_MAX_CYCLES);
+    uint64_t run_hash = fuzz_hash_written(cpu);
+    ushort pc = stepped.pc;
+    uchar op = fuzz_peek(cpu, pc);
+    return fuzz_compare(&fuzzer->failure, pc, op, "run A", stepped.reg_a, cpu->reg_a)
+	&& fuzz_compare(&fuzzer->failure, pc, op, "run X", stepped.reg_x, cpu->reg_x)
+	&& fuzz_compare(&fuzzer->failure, pc, op, "run Y", stepped.reg_y, cpu->reg_y)
+	&& fuzz_compare(&fuzzer->failure, pc, op, "run SP", stepped.reg_sp, cpu->reg_sp)
+	&& fuzz_compare(&fuzzer->failure, pc, op, "run status", stepped.status, cpu->status)
+	&& fuzz_compare(&fuzzer->failure, pc, op, "run pc", stepped.pc, cpu->pc)
+	&& fuzz_compare(&fuzzer->failure, pc, op, "run cycles", (unsigned)stepped.cycles, (unsigned)cpu->cycles)
+	&& fuzz_compare(&fuzzer->failure, pc, op, "run halted", stepped.halted, cpu->halted)
+	&& fuzz_compare(&fuzzer->failure, pc, op, "run memory", (unsigned)(hash ^ hash >> 32), (unsigned)(run_hash ^ run_hash >> 32));
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    static FUZZER* fuzzer = NULL;
+    if (fuzzer == NULL) fuzzer = fuzz_create();
+    if (fuzzer == NULL) return 0;
+    if (!fuzz_run(fuzzer, data, size)) {
+	FUZZ_FAILURE* failure = &fuzzer->failure;
+	fprintf(stderr, "quick_nes fuzz: %s differs at $%04X (opcode %02X): expected %X, got %X\n",
+		failure->check, failure->pc, failure->opcode, failure->expected, failure->actual);
+	abort();
+    }
+    return 0;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Inputs                                                                 */
+/* ---------------------------------------------------------------------- */
+
+static uint64_t fuzz_random(uint64_t* seed)
+{
+    uint64_t x = *seed;
+    x = x ^ x << 13;
+    x = x ^ x >> 7;
+    x = x ^ x << 17;
+    *seed = x;
+    return x;
+}
+
+size_t fuzz_generate(uint64_t* seed, uchar* out)
+{
+    static uchar implemented[256];
+    static uchar implemented_bytes[256];
+    static int implemented_count = 0;
+    if (implemented_count == 0) {
+	for (int op = 0; op < 256; op++) {
+	    const INSTRUCTION_SET* set = cpu_get_instruction_set((uchar)op);
+	    if (set->handler == NULL) continue;
+	    implemented[implemented_count] = (uchar)op;
+	    implemented_bytes[implemented_count] = set->bytes;
+	    implemented_count = implemented_count + 1;
+	}
+    }
+
+    for (int i = 0; i < FUZZ_HEADER_SIZE; i++) out[i] = (uchar)fuzz_random(seed);
+    size_t length = 16 + fuzz_random(seed) % (FUZZ_PROGRAM_MAX - 16);
+    // Every instruction writes three bytes and then moves past only the
+    // ones it has, so the loop does not branch on random data; the spare
+    // room catches the overhang of the last one.
+    uchar program[FUZZ_PROGRAM_MAX + 2];
+    size_t at = 0;
+    while (at < length) {
+	uint64_t r = fuzz_random(seed);
+	// Mostly real instructions, with operands picked to land near the
+	// program and its data; the odd random byte keeps BRK and junk in play.
+	// The top 16 bits pick the opcode by multiply and shift.
+	size_t pick = (size_t)((r >> 48) * (uint64_t)implemented_count >> 16);
+	bool junk = r % 16 == 0;
+	uchar high = (uchar)(r >> 32);
+	program[at] = junk ? (uchar)(r >> 8) : implemented[pick];
+	program[at + 1] = (uchar)(r >> 24);
+	program[at + 2] = (r >> 40) & 1 ? 0x80 + (high & 1) : high & 0x03;
+	at = at + (junk ? 1 : implemented_bytes[pick]);
+    }
+    memcpy(out + FUZZ_HEADER_SIZE, program, length);
+    return FUZZ_HEADER_SIZE + length;
+}
+
+size_t fuzz_mutate(uint64_t* seed, uchar* data, size_t size)
+{
+    int mutations = 1 + (int)(fuzz_random(seed) % 4);
+    for (int m = 0; m < mutations; m++) {
+	uint64_t r = fuzz_random(seed);
+	size_t at = (size_t)(r >> 16) % size;
+	switch (r % 4) {
+	case 0: data[at] = (uchar)(r >> 40); break;
+	case 1: data[at] = data[at] ^ (uchar)(1 << (r >> 40) % 8); break;
+	case 2: data[at] = data[at] + (uchar)((r >> 40) % 5) - 2; break;
+	default: {
+	    // Grow or shrink the program by a few bytes.
+	    size_t grown = size + (r >> 40) % 9;
+	    grown = grown > 8 ? grown - 4 : grown;
+	    if (grown > FUZZ_INPUT_MAX) grown = FUZZ_INPUT_MAX;
+	    if (grown < FUZZ_HEADER_SIZE + 1) grown = FUZZ_HEADER_SIZE + 1;
+	    for (size_t i = size; i < grown; i++) data[i] = (uchar)fuzz_random(seed);
+	    size = grown;
+	} break;
+	}
+    }
+    return size;
+}
@@ -0,0 +1,71 @@
+#ifndef FUZZ_H_
+#define FUZZ_H_
+
+#include "cpu.h"
+
+// An input is five register bytes (A, X, Y, SP, status) followed by up to
+// FUZZ_PROGRAM_MAX bytes that are loaded both as the program at $8000 and
+// as data at $0000.
+#define FUZZ_HEADER_SIZE 5
+#define FUZZ_PROGRAM_MAX 256
+#define FUZZ_INPUT_MAX (FUZZ_HEADER_SIZE + FUZZ_PROGRAM_MAX)
+#define FUZZ_MAX_CYCLES 512
+
+// Coverage is counted per opcode and outcome: whether the operand
+// crossed a page, the branch was taken, and carry came out set.
+#define FUZZ_OUTCOMES 8
+#define FUZZ_COVERAGE_SIZE (256 * FUZZ_OUTCOMES)
+
+typedef struct FUZZ_FAILURE {
+    ushort pc;               // of the instruction that broke the invariant
+    uchar opcode;
+    const char* check;       // what differed
+    unsigned expected;
+    unsigned actual;
+} FUZZ_FAILURE;
+
+// Runs inputs on one CPU, recycled between them so a reset only zeroes the
+// pages the last input wrote. Every instruction is checked against an
+// independent model of the 6502 (the oracle), which also keeps its own copy
+// of memory so a write it did not predict fails. Then the whole input is run
+// again in one go and must end in the same state as stepping did.
+//
+// With step_period N above 1 only one input in N is stepped under the
+// oracle; the others are only run straight through, which is several times
+// cheaper and still catches crashes and sanitizer reports.
+typedef struct FUZZER {
+    CPU cpu;
+    uchar coverage[FUZZ_COVERAGE_SIZE];          // saturating hit counts
+    uint64_t opcode_hits[256];
+    uint64_t mode_hits[ADDRESS_MODE_COUNT];
+    int covered;                                 // coverage entries hit so far
+    int new_coverage;                            // of them, first hit by the last input
+    uint64_t executions;
+    uint64_t instructions;
+    FUZZ_FAILURE failure;                        // of the last failed input
+    unsigned step_period;                        // 1 steps every input
+    uint64_t stale[BUS_PAGE_COUNT / 64];         // pages where expected may differ from memory
+    uchar expected[MEMORY_SIZE];                 // memory as the oracle predicts it
+} FUZZER;
+
+FUZZER* fuzz_create(void);
+
+void fuzz_destroy(FUZZER* fuzzer);
+
+// Runs one input. Returns false, with fuzzer->failure set, when the CPU
+// disagreed with the oracle.
+bool fuzz_run(FUZZER* fuzzer, const uchar* data, size_t size);
+
+// Writes a random input, mostly implemented instructions, to `out`
+// (FUZZ_INPUT_MAX bytes) and returns its size. `seed` must not be zero.
+size_t fuzz_generate(uint64_t* seed, uchar* out);
+
+// Changes a few bytes of an input in place, possibly resizing it within
+// FUZZ_INPUT_MAX. Returns the new size.
+size_t fuzz_mutate(uint64_t* seed, uchar* data, size_t size);
+
+// libFuzzer entry point: aborts on a failure. Build with
+// `make quick_nes_libfuzzer` (clang).
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+#endif // FUZZ_H_
@@ -0,0 +1,167 @@
+#include "fuzz.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define FUZZ_CORPUS_MAX 4096
+
+typedef struct FUZZ_OPTIONS {
+    uint64_t runs;               // 0 runs until `seconds` is up
+    double seconds;
+    uint64_t seed;
+    unsigned step_period;        // see FUZZER.step_period
+    const char* crash_path;
+    const char* replay_path;     // run one saved input instead of fuzzing
+} FUZZ_OPTIONS;
+
+typedef struct FUZZ_INPUT {
+    uchar data[FUZZ_INPUT_MAX];
+    size_t size;
+} FUZZ_INPUT;
+
+static double fuzz_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void fuzz_usage(void)
+{
+    fprintf(stderr,
+	    "usage: quick_nes_fuzz [--runs N] [--seconds S] [--seed N] [--step-every N] [--crash FILE] [--replay FILE]\n"
+	    "Feeds random and mutated programs to the CPU, checking every instruction\n"
+	    "against a model of the 6502. --step-every N only checks one input in N\n"
+	    "and runs the rest straight through. A failing input is written to --crash\n"
+	    "(default crash.bin) and can be run again with --replay.\n");
+}
+
+static void fuzz_report_failure(const FUZZER* fuzzer)
+{
+    const FUZZ_FAILURE* failure = &fuzzer->failure;
+    const INSTRUCTION_SET* set = cpu_get_instruction_set(failure->opcode);
+    fprintf(stderr, "FAILED: %s at $%04X (%02X %s): expected $%X, got $%X\n",
+	    failure->check, failure->pc, failure->opcode, set->name, failure->expected, failure->actual);
+}
+
+static void fuzz_report(const FUZZER* fuzzer, double seconds, int corpus)
+{
+    int opcodes = 0;
+    for (int op = 0; op < 256; op++) opcodes = opcodes + (fuzzer->opcode_hits[op] != 0);
+    fprintf(stderr, "%llu execs in %.2fs (%.0f exec/s, %.1fM checked instructions/s), %d/%d coverage, %d opcodes, corpus %d\n",
+	    (unsigned long long)fuzzer->executions, seconds,
+	    (double)fuzzer->executions / seconds, (double)fuzzer->instructions / seconds / 1e6,
+	    fuzzer->covered, FUZZ_COVERAGE_SIZE, opcodes, corpus);
+}
+
+static int fuzz_replay(FUZZER* fuzzer, const char* path)
+{
+    FUZZ_INPUT input;
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+	fprintf(stderr, "ERROR: could not read %s\n", path);
+	return 2;
+    }
+    input.size = fread(input.data, 1, sizeof(input.data), file);
+    fclose(file);
+    if (!fuzz_run(fuzzer, input.data, input.size)) {
+	fuzz_report_failure(fuzzer);
+	return 1;
+    }
+    printf("PASSED: %s\n", path);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    FUZZ_OPTIONS options = {
+	.runs = 0,
+	.seconds = 10,
+	.seed = (uint64_t)time(NULL),
+	.step_period = 1,
+	.crash_path = "crash.bin",
+	.replay_path = NULL
+    };
+    for (int i = 1; i < argc; i++) {
+	bool has_value = i + 1 < argc;
+	if (strcmp(argv[i], "--runs") == 0 && has_value) {
+	    options.runs = strtoull(argv[++i], NULL, 0);
+	} else if (strcmp(argv[i], "--seconds") == 0 && has_value) {
+	    options.seconds = atof(argv[++i]);
+	} else if (strcmp(argv[i], "--seed") == 0 && has_value) {
+	    options.seed = strtoull(argv[++i], NULL, 0);
+	} else if (strcmp(argv[i], "--step-every") == 0 && has_value) {
+	    options.step_period = (unsigned)strtoul(argv[++i], NULL, 0);
+	} else if (strcmp(argv[i], "--crash") == 0 && has_value) {
+	    options.crash_path = argv[++i];
+	} else if (strcmp(argv[i], "--replay") == 0 && has_value) {
+	    options.replay_path = argv[++i];
+	} else {
+	    fuzz_usage();
+	    return 2;
+	}
+    }
+
+    FUZZER* fuzzer = fuzz_create();
+    if (fuzzer == NULL) {
+	fprintf(stderr, "ERROR: out of memory\n");
+	return 2;
+    }
+    // A replayed input is always stepped.
+    if (options.replay_path != NULL) {
+	int result = fuzz_replay(fuzzer, options.replay_path);
+	fuzz_destroy(fuzzer);
+	return result;
+    }
+
+    FUZZ_INPUT* corpus = malloc(sizeof(FUZZ_INPUT) * FUZZ_CORPUS_MAX);
+    if (corpus == NULL) {
+	fprintf(stderr, "ERROR: out of memory\n");
+	fuzz_destroy(fuzzer);
+	return 2;
+    }
+    fprintf(stderr, "seed %llu\n", (unsigned long long)options.seed);
+    fuzzer->step_period = options.step_period;
+    uint64_t seed = options.seed != 0 ? options.seed : 1;
+    int corpus_size = 0;
+    FUZZ_INPUT input;
+    int result = 0;
+    double start = fuzz_now();
+    double next_report = start + 1;
+    for (uint64_t run = 0; options.runs == 0 || run < options.runs; run++) {
+	// Half the inputs are fresh, half mutate something that found new
+	// coverage before.
+	if (corpus_size == 0 || (run & 1) == 0) {
+	    input.size = fuzz_generate(&seed, input.data);
+	} else {
+	    input = corpus[(size_t)(seed >> 16) % (size_t)corpus_size];
+	    input.size = fuzz_mutate(&seed, input.data, input.size);
+	}
+	if (!fuzz_run(fuzzer, input.data, input.size)) {
+	    fuzz_report_failure(fuzzer);
+	    FILE* file = fopen(options.crash_path, "wb");
+	    if (file != NULL) {
+		fwrite(input.data, 1, input.size, file);
+		fclose(file);
+		fprintf(stderr, "input written to %s\n", options.crash_path);
+	    }
+	    result = 1;
+	    break;
+	}
+	if (fuzzer->new_coverage > 0 && corpus_size < FUZZ_CORPUS_MAX) corpus[corpus_size++] = input;
+
+	if ((run & 0xFFF) == 0) {
+	    double now = fuzz_now();
+	    if (options.runs == 0 && now - start >= options.seconds) break;
+	    if (now >= next_report) {
+		fuzz_report(fuzzer, now - start, corpus_size);
+		next_report = now + 1;
+	    }
+	}
+    }
+    fuzz_report(fuzzer, fuzz_now() - start, corpus_size);
+
+    free(corpus);
+    fuzz_destroy(fuzzer);
+    return result;
+}
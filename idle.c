@@ -0,0 +1,136 @@
+#include "idle.h"
+#include <string.h>
+
+IDLE_DETECTOR* idle_create(void)
+{
+    IDLE_DETECTOR* detector = malloc(sizeof(IDLE_DETECTOR));
+    if (detector == NULL) return NULL;
+    memset(detector, 0, sizeof(IDLE_DETECTOR));
+    return detector;
+}
+
+void idle_destroy(IDLE_DETECTOR* detector)
+{
+    free(detector);
+}
+
+void idle_set_io_limit(IDLE_DETECTOR* detector, IDLE_IO_LIMIT io_limit, void* ctx)
+{
+    detector->io_limit = io_limit;
+    detector->io_ctx = ctx;
+}
+
+// Only instructions that read fixed addresses, copy registers or clear
+// flags qualify; running any of them twice from the same state gives the
+// same state. Anything that writes, counts or touches the stack does not.
+static bool idle_decode(IDLE_LOOP* loop)
+{
+    int length = loop->end - loop->start;
+    int at = 0;
+    while (at < length) {
+	const uchar* code = &loop->code[at];
+	const INSTRUCTION_SET* instruction_set = cpu_get_instruction_set(code[0]);
+	if (instruction_set->handler == NULL || at + instruction_set->bytes > length) return false;
+	switch (instruction_set->instruction) {
+	case INSTRUCTION_LDA:
+	case INSTRUCTION_AND:
+	case INSTRUCTION_BIT: {
+	    if (instruction_set->mode == ADDRESS_IMMEDIATE) break;
+	    if (instruction_set->mode != ADDRESS_ZEROPAGE && instruction_set->mode != ADDRESS_ABSOLUTE) return false;
+	    if (loop->read_count == IDLE_MAX_READS) return false;
+	    ushort addr = code[1];
+	    if (instruction_set->mode == ADDRESS_ABSOLUTE) addr = addr | (code[2] << 8);
+	    loop->reads[loop->read_count] = addr;
+	    loop->read_count = loop->read_count + 1;
+	} break;
+	case INSTRUCTION_TAX:
+	case INSTRUCTION_CLC:
+	case INSTRUCTION_CLD:
+	case INSTRUCTION_CLV:
+	case INSTRUCTION_BCC:
+	case INSTRUCTION_BCS:
+	case INSTRUCTION_BEQ:
+	case INSTRUCTION_BMI:
+	case INSTRUCTION_BNE:
+	case INSTRUCTION_BPL:
+	case INSTRUCTION_BVC:
+	case INSTRUCTION_BVS: {
+	} break;
+	case INSTRUCTION_JMP: {
+	    // Only the absolute JMP closing the loop itself.
+	    if (instruction_set->mode != ADDRESS_ABSOLUTE || at + 3 != length) return false;
+	} break;
+	default: {
+	    return false;
+	} break;
+	}
+	at = at + instruction_set->bytes;
+    }
+    return true;
+}
+
+static IDLE_LOOP* idle_lookup(IDLE_DETECTOR* detector, CPU* cpu, ushort start, ushort end)
+{
+    IDLE_LOOP* loop = &detector->loops[(start ^ (start >> 6)) % IDLE_SLOTS];
+    int length = end - start;
+    if (loop->valid && loop->start == start && loop->end == end) {
+	// Bank switches and self-modifying code show up as different bytes.
+	if (!loop->idle) return loop;
+	bool same = true;
+	for (int i = 0; i < length && same; i++) same = cpu_peek_memory(cpu, start + i) == loop->code[i];
+	if (same) return loop;
+    }
+
+    memset(loop, 0, sizeof(IDLE_LOOP));
+    loop->valid = true;
+    loop->start = start;
+    loop->end = end;
+    if (end <= start || length > IDLE_MAX_BYTES) return loop;
+    for (int i = 0; i < length; i++) loop->code[i] = cpu_peek_memory(cpu, start + i);
+    loop->idle = idle_decode(loop);
+    return loop;
+}
+
+void idle_loop_end(IDLE_DETECTOR* detector, CPU* cpu, ushort start, ushort end)
+{
+    // A trace or profile should show every instruction.
+    if (cpu->tracer != NULL || cpu->profiler != NULL) return;
+
+    IDLE_LOOP* loop = idle_lookup(detector, cpu, start, end);
+    if (!loop->idle) {
+	detector->armed = false;
+	return;
+    }
+
+    uchar status = cpu_get_status(cpu);
+    if (detector->armed && detector->start == start && detector->reg_a == cpu->reg_a
+	&& detector->reg_x == cpu->reg_x && detector->reg_y == cpu->reg_y
+	&& detector->reg_sp == cpu->reg_sp && detector->status == status) {
+	uint64_t period = cpu->cycles - detector->cycles;
+	uint64_t limit = cpu->deadline;
+	for (int i = 0; i < loop->read_count; i++) {
+	    ushort addr = loop->reads[i];
+	    if (cpu->bus.page[addr >> 8].read == NULL) continue;
+	    uint64_t io = detector->io_limit != NULL ? detector->io_limit(detector->io_ctx, addr) : 0;
+	    if (io < limit) limit = io;
+	}
+	// With nothing scheduled there is nothing to skip to.
+	if (limit != UINT64_MAX && period > 0 && limit > cpu->cycles) {
+	    uint64_t skipped = (limit - cpu->cycles) / period * period;
+	    if (skipped > 0) {
+		cpu->cycles = cpu->cycles + skipped;
+		detector->skips = detector->skips + 1;
+		detector->skipped_cycles = detector->skipped_cycles + skipped;
+	    }
+	}
+    }
+
+    detector->armed = true;
+    detector->start = start;
+    detector->reg_a = cpu->reg_a;
+    detector->reg_x = cpu->reg_x;
+    detector->reg_y = cpu->reg_y;
+    detector->reg_sp = cpu->reg_sp;
+    detector->status = status;
+    detector->cycles = cpu->cycles;
+}
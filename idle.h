@@ -0,0 +1,64 @@
+#ifndef IDLE_H_
+#define IDLE_H_
+
+#include "cpu.h"
+
+#define IDLE_MAX_BYTES 16
+#define IDLE_MAX_READS 4
+#define IDLE_SLOTS 64
+
+// First CPU cycle at which a read of `addr` could return a different value
+// or have a different side effect than one made now, or 0 if the device
+// cannot tell. Only asked about pages with a read callback.
+typedef uint64_t (*IDLE_IO_LIMIT)(void* ctx, ushort addr);
+
+// A loop body, decoded once: [start, end) ends in the backward branch or
+// JMP that closes it. `idle` is true when every instruction in it only
+// reads fixed addresses and registers, so running it again from the same
+// state can only change the cycle counter.
+typedef struct IDLE_LOOP {
+    bool valid;
+    bool idle;
+    ushort start;
+    ushort end;
+    uchar code[IDLE_MAX_BYTES];
+    int read_count;
+    ushort reads[IDLE_MAX_READS];
+} IDLE_LOOP;
+
+// Spin-wait detector. When the same candidate loop closes twice in a row
+// with identical registers and flags it is at a fixed point: until one of
+// its inputs can change, further iterations only burn cycles, so the
+// cycle counter jumps straight to the last iteration boundary before the
+// next deadline (the next scheduled event or the end of the run slice).
+typedef struct IDLE_DETECTOR {
+    IDLE_LOOP loops[IDLE_SLOTS];
+    IDLE_IO_LIMIT io_limit;
+    void* io_ctx;
+
+    // State when the last candidate loop closed.
+    bool armed;
+    ushort start;
+    uchar reg_a;
+    uchar reg_x;
+    uchar reg_y;
+    uchar reg_sp;
+    uchar status;
+    uint64_t cycles;
+
+    uint64_t skips;
+    uint64_t skipped_cycles;
+} IDLE_DETECTOR;
+
+IDLE_DETECTOR* idle_create(void);
+
+void idle_destroy(IDLE_DETECTOR* detector);
+
+// Lets loops read from I/O pages the device can vouch for.
+void idle_set_io_limit(IDLE_DETECTOR* detector, IDLE_IO_LIMIT io_limit, void* ctx);
+
+// Called by the interpreter when a jump back to `start` closes the loop
+// whose last instruction ends at `end`.
+void idle_loop_end(IDLE_DETECTOR* detector, CPU* cpu, ushort start, ushort end);
+
+#endif // IDLE_H_
@@ -0,0 +1,645 @@
+#include "lockstep.h"
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && defined(__SSE2__) && !defined(LOCKSTEP_NO_SIMD)
+#define LOCKSTEP_SIMD_X86 1
+#include <immintrin.h>
+#else
+#define LOCKSTEP_SIMD_X86 0
+#endif
+
+// The three things a kernel does for a group of lanes, given as a lane
+// bit mask: find the group to issue to, execute a register-only
+// instruction (or the register half of one that reads memory, with the
+// operands in `value`), and move pc and cycles on.
+typedef struct LOCKSTEP_OPS {
+    uint32_t (*select)(const LOCKSTEP* lockstep, uint32_t running);
+    void (*execute)(LOCKSTEP* lockstep, uint32_t lanes, INSTRUCTION instruction, bool accumulator, uchar* value);
+    void (*advance)(LOCKSTEP* lockstep, uint32_t lanes, uchar bytes, const uchar* cycles);
+} LOCKSTEP_OPS;
+
+// The flag an instruction clears, sets or branches on. Branches are taken
+// when the flag is `set`.
+static uchar lockstep_flag(INSTRUCTION instruction, bool* set)
+{
+    *set = true;
+    switch (instruction) {
+    case INSTRUCTION_CLC: return FLAG_CARRY;
+    case INSTRUCTION_CLD: return FLAG_DECIMAL;
+    case INSTRUCTION_CLI: return FLAG_INTERRUPT_DISABLE;
+    case INSTRUCTION_CLV: return FLAG_OVERFLOW;
+    case INSTRUCTION_SEI: return FLAG_INTERRUPT_DISABLE;
+    case INSTRUCTION_BCS: return FLAG_CARRY;
+    case INSTRUCTION_BEQ: return FLAG_ZERO;
+    case INSTRUCTION_BMI: return FLAG_NEGATIVE;
+    case INSTRUCTION_BVS: return FLAG_OVERFLOW;
+    default: break;
+    }
+    *set = false;
+    switch (instruction) {
+    case INSTRUCTION_BCC: return FLAG_CARRY;
+    case INSTRUCTION_BNE: return FLAG_ZERO;
+    case INSTRUCTION_BPL: return FLAG_NEGATIVE;
+    case INSTRUCTION_BVC: return FLAG_OVERFLOW;
+    default: return 0;
+    }
+}
+
+static bool lockstep_is_branch(INSTRUCTION instruction)
+{
+    return instruction >= INSTRUCTION_BCC && instruction <= INSTRUCTION_BVS;
+}
+
+// Instructions the kernels execute; the rest go to the reference handlers.
+static bool lockstep_in_kernel(INSTRUCTION instruction)
+{
+    switch (instruction) {
+    case INSTRUCTION_LDA:
+    case INSTRUCTION_AND:
+    case INSTRUCTION_ADC:
+    case INSTRUCTION_BIT:
+    case INSTRUCTION_ASL:
+    case INSTRUCTION_TAX:
+    case INSTRUCTION_INX:
+    case INSTRUCTION_INY:
+    case INSTRUCTION_CLC:
+    case INSTRUCTION_CLD:
+    case INSTRUCTION_CLI:
+    case INSTRUCTION_CLV:
+    case INSTRUCTION_SEI: return true;
+    default: return lockstep_is_branch(instruction);
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+/* Scalar kernel                                                          */
+/* ---------------------------------------------------------------------- */
+
+static uchar lockstep_zero_and_negative(uchar status, uchar result)
+{
+    status = status & (uchar)~(FLAG_NEGATIVE | FLAG_ZERO);
+    return status | (result & FLAG_NEGATIVE) | (result == 0 ? FLAG_ZERO : 0);
+}
+
+static uint32_t lockstep_select_scalar(const LOCKSTEP* lockstep, uint32_t running)
+{
+    ushort lowest = 0xFFFF;
+    for (int i = 0; i < lockstep->lanes; i++) {
+	if ((running >> i & 1) && lockstep->pc[i] < lowest) lowest = lockstep->pc[i];
+    }
+    uint32_t group = 0;
+    for (int i = 0; i < lockstep->lanes; i++) {
+	if (lockstep->pc[i] == lowest) group = group | 1u << i;
+    }
+    return group & running;
+}
+
+// Mirrors the cpu_instruction_* handlers.
+static void lockstep_execute_scalar(LOCKSTEP* lockstep, uint32_t lanes, INSTRUCTION instruction, bool accumulator, uchar* value)
+{
+    bool set;
+    uchar flag = lockstep_flag(instruction, &set);
+    for (int i = 0; i < lockstep->lanes; i++) {
+	if (!(lanes >> i & 1)) continue;
+	uchar a = lockstep->reg_a[i];
+	uchar status = lockstep->status[i];
+	switch (instruction) {
+	case INSTRUCTION_LDA: {
+	    lockstep->reg_a[i] = value[i];
+	    status = lockstep_zero_and_negative(status, value[i]);
+	} break;
+	case INSTRUCTION_AND: {
+	    lockstep->reg_a[i] = a & value[i];
+	    status = lockstep_zero_and_negative(status, a & value[i]);
+	} break;
+	case INSTRUCTION_ADC: {
+	    unsigned sum = (unsigned)a + value[i] + (status & FLAG_CARRY);
+	    status = status & (uchar)~(FLAG_CARRY | FLAG_OVERFLOW);
+	    if (sum > 0xFF) status = status | FLAG_CARRY;
+	    if (~(a ^ value[i]) & (a ^ sum) & 0x80) status = status | FLAG_OVERFLOW;
+	    status = lockstep_zero_and_negative(status, (uchar)sum);
+	    lockstep->reg_a[i] = (uchar)sum;
+	} break;
+	case INSTRUCTION_BIT: {
+	    status = status & (uchar)~(FLAG_NEGATIVE | FLAG_OVERFLOW | FLAG_ZERO);
+	    status = status | (value[i] & (FLAG_NEGATIVE | FLAG_OVERFLOW)) | ((a & value[i]) == 0 ? FLAG_ZERO : 0);
+	} break;
+	case INSTRUCTION_ASL: {
+	    uchar* target = accumulator ? &lockstep->reg_a[i] : &value[i];
+	    status = (status & (uchar)~FLAG_CARRY) | (*target >> 7);
+	    *target = (uchar)(*target << 1);
+	    status = lockstep_zero_and_negative(status, *target);
+	} break;
+	case INSTRUCTION_TAX: {
+	    lockstep->reg_x[i] = a;
+	    status = lockstep_zero_and_negative(status, a);
+	} break;
+	case INSTRUCTION_INX: {
+	    lockstep->reg_x[i] = lockstep->reg_x[i] + 1;
+	    status = lockstep_zero_and_negative(status, lockstep->reg_x[i]);
+	} break;
+	case INSTRUCTION_INY: {
+	    lockstep->reg_y[i] = lockstep->reg_y[i] + 1;
+	    status = lockstep_zero_and_negative(status, lockstep->reg_y[i]);
+	} break;
+	case INSTRUCTION_SEI: {
+	    status = status | flag;
+	} break;
+	case INSTRUCTION_CLC:
+	case INSTRUCTION_CLD:
+	case INSTRUCTION_CLI:
+	case INSTRUCTION_CLV: {
+	    status = status & (uchar)~flag;
+	} break;
+	default: {
+	    // Branches: whether each lane takes it.
+	    value[i] = ((status & flag) != 0) == set ? 0xFF : 0x00;
+	} break;
+	}
+	lockstep->status[i] = status;
+    }
+}
+
+static void lockstep_advance_scalar(LOCKSTEP* lockstep, uint32_t lanes, uchar bytes, const uchar* cycles)
+{
+    for (int i = 0; i < lockstep->lanes; i++) {
+	if (!(lanes >> i & 1)) continue;
+	lockstep->pc[i] = lockstep->pc[i] + bytes;
+	lockstep->cycles[i] = lockstep->cycles[i] + cycles[i];
+    }
+}
+
+static const LOCKSTEP_OPS lockstep_scalar_ops = {
+    lockstep_select_scalar,
+    lockstep_execute_scalar,
+    lockstep_advance_scalar
+};
+
+#if LOCKSTEP_SIMD_X86
+
+/* ---------------------------------------------------------------------- */
+/* SSE2 and AVX2 kernels                                                  */
+/* ---------------------------------------------------------------------- */
+
+// Lane bits to 0xFF/0x00 bytes, lane i in byte i.
+static inline __attribute__((always_inline)) __m128i lockstep_x86_mask(uint32_t lanes)
+{
+    const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 1, 2, 4, 8, 16, 32, 64, (char)128);
+    __m128i spread = _mm_unpacklo_epi64(_mm_set1_epi8((char)lanes), _mm_set1_epi8((char)(lanes >> 8)));
+    return _mm_cmpeq_epi8(_mm_and_si128(spread, bits), bits);
+}
+
+static inline __attribute__((always_inline)) __m128i lockstep_x86_zero_and_negative(__m128i status, __m128i result)
+{
+    const __m128i zero = _mm_setzero_si128();
+    status = _mm_andnot_si128(_mm_set1_epi8((char)(FLAG_NEGATIVE | FLAG_ZERO)), status);
+    status = _mm_or_si128(status, _mm_and_si128(result, _mm_set1_epi8((char)FLAG_NEGATIVE)));
+    return _mm_or_si128(status, _mm_and_si128(_mm_cmpeq_epi8(result, zero), _mm_set1_epi8(FLAG_ZERO)));
+}
+
+static inline __attribute__((always_inline)) __m128i lockstep_x86_blend(__m128i mask, __m128i changed, __m128i kept)
+{
+    return _mm_or_si128(_mm_and_si128(mask, changed), _mm_andnot_si128(mask, kept));
+}
+
+// The byte lanes fit one 128 bit register, so the body is the same for
+// both kernels; the AVX2 one is just compiled with VEX encodings.
+static inline __attribute__((always_inline)) void lockstep_x86_execute(LOCKSTEP* lockstep, uint32_t lanes, INSTRUCTION instruction, bool accumulator, uchar* value)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi8(-1);
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i mask = lockstep_x86_mask(lanes);
+    __m128i a = _mm_load_si128((const __m128i*)lockstep->reg_a);
+    __m128i x = _mm_load_si128((const __m128i*)lockstep->reg_x);
+    __m128i y = _mm_load_si128((const __m128i*)lockstep->reg_y);
+    __m128i status = _mm_load_si128((const __m128i*)lockstep->status);
+    __m128i operand = _mm_loadu_si128((const __m128i*)value);
+    __m128i new_a = a;
+    __m128i new_x = x;
+    __m128i new_y = y;
+    __m128i new_status = status;
+    __m128i new_value = operand;
+    bool set;
+    __m128i flag = _mm_set1_epi8((char)lockstep_flag(instruction, &set));
+
+    switch (instruction) {
+    case INSTRUCTION_LDA: {
+	new_a = operand;
+	new_status = lockstep_x86_zero_and_negative(status, new_a);
+    } break;
+    case INSTRUCTION_AND: {
+	new_a = _mm_and_si128(a, operand);
+	new_status = lockstep_x86_zero_and_negative(status, new_a);
+    } break;
+    case INSTRUCTION_ADC: {
+	// Carry out of a + operand shows as saturation; a carry in then only
+	// carries again from 0xFF.
+	__m128i carry_in = _mm_and_si128(status, one);
+	__m128i partial = _mm_add_epi8(a, operand);
+	__m128i carry = _mm_xor_si128(_mm_cmpeq_epi8(_mm_adds_epu8(a, operand), partial), ones);
+	carry = _mm_or_si128(carry, _mm_and_si128(_mm_cmpeq_epi8(partial, ones), _mm_cmpeq_epi8(carry_in, one)));
+	__m128i sum = _mm_add_epi8(partial, carry_in);
+	// Overflow when a and the operand agree in sign and the sum does not.
+	__m128i overflow = _mm_andnot_si128(_mm_xor_si128(a, operand), _mm_xor_si128(a, sum));
+	overflow = _mm_cmplt_epi8(overflow, zero);
+	new_status = _mm_andnot_si128(_mm_set1_epi8(FLAG_CARRY | FLAG_OVERFLOW), status);
+	new_status = _mm_or_si128(new_status, _mm_and_si128(carry, one));
+	new_status = _mm_or_si128(new_status, _mm_and_si128(overflow, _mm_set1_epi8(FLAG_OVERFLOW)));
+	new_status = lockstep_x86_zero_and_negative(new_status, sum);
+	new_a = sum;
+    } break;
+    case INSTRUCTION_BIT: {
+	new_status = _mm_andnot_si128(_mm_set1_epi8((char)(FLAG_NEGATIVE | FLAG_OVERFLOW | FLAG_ZERO)), status);
+	new_status = _mm_or_si128(new_status, _mm_and_si128(operand, _mm_set1_epi8((char)(FLAG_NEGATIVE | FLAG_OVERFLOW))));
+	__m128i is_zero = _mm_cmpeq_epi8(_mm_and_si128(a, operand), zero);
+	new_status = _mm_or_si128(new_status, _mm_and_si128(is_zero, _mm_set1_epi8(FLAG_ZERO)));
+    } break;
+    case INSTRUCTION_ASL: {
+	__m128i target = accumulator ? a : operand;
+	__m128i carry = _mm_and_si128(_mm_cmpgt_epi8(zero, target), one);
+	__m128i shifted = _mm_add_epi8(target, target);
+	new_status = _mm_or_si128(_mm_andnot_si128(one, status), carry);
+	new_status = lockstep_x86_zero_and_negative(new_status, shifted);
+	if (accumulator) new_a = shifted; else new_value = shifted;
+    } break;
+    case INSTRUCTION_TAX: {
+	new_x = a;
+	new_status = lockstep_x86_zero_and_negative(status, new_x);
+    } break;
+    case INSTRUCTION_INX: {
+	new_x = _mm_add_epi8(x, one);
+	new_status = lockstep_x86_zero_and_negative(status, new_x);
+    } break;
+    case INSTRUCTION_INY: {
+	new_y = _mm_add_epi8(y, one);
+	new_status = lockstep_x86_zero_and_negative(status, new_y);
+    } break;
+    case INSTRUCTION_SEI: {
+	new_status = _mm_or_si128(status, flag);
+    } break;
+    case INSTRUCTION_CLC:
+    case INSTRUCTION_CLD:
+    case INSTRUCTION_CLI:
+    case INSTRUCTION_CLV: {
+	new_status = _mm_andnot_si128(flag, status);
+    } break;
+    default: {
+	__m128i taken = _mm_cmpeq_epi8(_mm_and_si128(status, flag), flag);
+	new_value = set ? taken : _mm_xor_si128(taken, ones);
+    } break;
+    }
+
+    _mm_store_si128((__m128i*)lockstep->reg_a, lockstep_x86_blend(mask, new_a, a));
+    _mm_store_si128((__m128i*)lockstep->reg_x, lockstep_x86_blend(mask, new_x, x));
+    _mm_store_si128((__m128i*)lockstep->reg_y, lockstep_x86_blend(mask, new_y, y));
+    _mm_store_si128((__m128i*)lockstep->status, lockstep_x86_blend(mask, new_status, status));
+    _mm_storeu_si128((__m128i*)value, lockstep_x86_blend(mask, new_value, operand));
+}
+
+static void lockstep_execute_sse2(LOCKSTEP* lockstep, uint32_t lanes, INSTRUCTION instruction, bool accumulator, uchar* value)
+{
+    lockstep_x86_execute(lockstep, lanes, instruction, accumulator, value);
+}
+
+// SSE2 only compares words as signed, so the pcs are biased by 0x8000.
+// Lanes not running read as 0xFFFF and never win unless a running lane
+// is there too.
+static uint32_t lockstep_select_sse2(const LOCKSTEP* lockstep, uint32_t running)
+{
+    const __m128i bias = _mm_set1_epi16((short)0x8000);
+    __m128i run = lockstep_x86_mask(running);
+    __m128i low = _mm_or_si128(_mm_load_si128((const __m128i*)lockstep->pc), _mm_xor_si128(_mm_unpacklo_epi8(run, run), _mm_set1_epi8(-1)));
+    __m128i high = _mm_or_si128(_mm_load_si128((const __m128i*)lockstep->pc + 1), _mm_xor_si128(_mm_unpackhi_epi8(run, run), _mm_set1_epi8(-1)));
+    low = _mm_xor_si128(low, bias);
+    high = _mm_xor_si128(high, bias);
+    __m128i lowest = _mm_min_epi16(low, high);
+    lowest = _mm_min_epi16(lowest, _mm_shuffle_epi32(lowest, 0x4E));
+    lowest = _mm_min_epi16(lowest, _mm_shuffle_epi32(lowest, 0xB1));
+    lowest = _mm_min_epi16(lowest, _mm_srli_epi32(lowest, 16));
+    lowest = _mm_shuffle_epi32(_mm_shufflelo_epi16(lowest, 0x00), 0x00);
+    __m128i equal = _mm_packs_epi16(_mm_cmpeq_epi16(low, lowest), _mm_cmpeq_epi16(high, lowest));
+    return (uint32_t)_mm_movemask_epi8(equal) & running;
+}
+
+static void lockstep_advance_sse2(LOCKSTEP* lockstep, uint32_t lanes, uchar bytes, const uchar* cycles)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i step = _mm_and_si128(lockstep_x86_mask(lanes), _mm_set1_epi8((char)bytes));
+    __m128i* pc = (__m128i*)lockstep->pc;
+    _mm_store_si128(pc, _mm_add_epi16(_mm_load_si128(pc), _mm_unpacklo_epi8(step, zero)));
+    _mm_store_si128(pc + 1, _mm_add_epi16(_mm_load_si128(pc + 1), _mm_unpackhi_epi8(step, zero)));
+
+    __m128i added = _mm_loadu_si128((const __m128i*)cycles);
+    __m128i words[2] = { _mm_unpacklo_epi8(added, zero), _mm_unpackhi_epi8(added, zero) };
+    __m128i* total = (__m128i*)lockstep->cycles;
+    for (int i = 0; i < 2; i++) {
+	__m128i dwords[2] = { _mm_unpacklo_epi16(words[i], zero), _mm_unpackhi_epi16(words[i], zero) };
+	for (int j = 0; j < 2; j++) {
+	    __m128i* at = total + i * 4 + j * 2;
+	    _mm_store_si128(at, _mm_add_epi64(_mm_load_si128(at), _mm_unpacklo_epi32(dwords[j], zero)));
+	    _mm_store_si128(at + 1, _mm_add_epi64(_mm_load_si128(at + 1), _mm_unpackhi_epi32(dwords[j], zero)));
+	}
+    }
+}
+
+static const LOCKSTEP_OPS lockstep_sse2_ops = {
+    lockstep_select_sse2,
+    lockstep_execute_sse2,
+    lockstep_advance_sse2
+};
+
+__attribute__((target("avx2")))
+static void lockstep_execute_avx2(LOCKSTEP* lockstep, uint32_t lanes, INSTRUCTION instruction, bool accumulator, uchar* value)
+{
+    lockstep_x86_execute(lockstep, lanes, instruction, accumulator, value);
+}
+
+// All 16 pcs fit one register, and minpos finds the lowest of each half.
+__attribute__((target("avx2")))
+static uint32_t lockstep_select_avx2(const LOCKSTEP* lockstep, uint32_t running)
+{
+    __m256i idle = _mm256_xor_si256(_mm256_cvtepi8_epi16(lockstep_x86_mask(running)), _mm256_set1_epi8(-1));
+    __m256i pc = _mm256_or_si256(_mm256_load_si256((const __m256i*)lockstep->pc), idle);
+    __m128i low = _mm256_castsi256_si128(pc);
+    __m128i high = _mm256_extracti128_si256(pc, 1);
+    int lowest = _mm_cvtsi128_si32(_mm_minpos_epu16(_mm_min_epu16(low, high))) & 0xFFFF;
+    __m128i target = _mm_set1_epi16((short)lowest);
+    __m128i equal = _mm_packs_epi16(_mm_cmpeq_epi16(low, target), _mm_cmpeq_epi16(high, target));
+    return (uint32_t)_mm_movemask_epi8(equal) & running;
+}
+
+__attribute__((target("avx2")))
+static void lockstep_advance_avx2(LOCKSTEP* lockstep, uint32_t lanes, uchar bytes, const uchar* cycles)
+{
+    __m128i step = _mm_and_si128(lockstep_x86_mask(lanes), _mm_set1_epi8((char)bytes));
+    __m256i* pc = (__m256i*)lockstep->pc;
+    _mm256_store_si256(pc, _mm256_add_epi16(_mm256_load_si256(pc), _mm256_cvtepu8_epi16(step)));
+
+    __m128i added = _mm_loadu_si128((const __m128i*)cycles);
+    __m256i* total = (__m256i*)lockstep->cycles;
+    for (int i = 0; i < 4; i++) {
+	__m256i wide = _mm256_cvtepu8_epi64(added);
+	_mm256_store_si256(total + i, _mm256_add_epi64(_mm256_load_si256(total + i), wide));
+	added = _mm_srli_si128(added, 4);
+    }
+}
+
+static const LOCKSTEP_OPS lockstep_avx2_ops = {
+    lockstep_select_avx2,
+    lockstep_execute_avx2,
+    lockstep_advance_avx2
+};
+
+static bool lockstep_has_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+static const LOCKSTEP_OPS* lockstep_get_ops(LOCKSTEP_KERNEL kernel)
+{
+    switch (kernel) {
+    case LOCKSTEP_KERNEL_SCALAR: return &lockstep_scalar_ops;
+#if LOCKSTEP_SIMD_X86
+    case LOCKSTEP_KERNEL_SSE2: return &lockstep_sse2_ops;
+    case LOCKSTEP_KERNEL_AVX2: return lockstep_has_avx2() ? &lockstep_avx2_ops : NULL;
+    case LOCKSTEP_KERNEL_AUTO: return lockstep_has_avx2() ? &lockstep_avx2_ops : &lockstep_sse2_ops;
+#else
+    case LOCKSTEP_KERNEL_AUTO: return &lockstep_scalar_ops;
+#endif
+    default: return NULL;
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+/* Lanes                                                                  */
+/* ---------------------------------------------------------------------- */
+
+LOCKSTEP* lockstep_create(int lanes)
+{
+    if (lanes < 1 || lanes > LOCKSTEP_LANES) return NULL;
+    LOCKSTEP* lockstep = aligned_alloc(64, sizeof(LOCKSTEP));
+    if (lockstep == NULL) return NULL;
+    memset(lockstep, 0, sizeof(LOCKSTEP));
+    lockstep->lanes = lanes;
+    lockstep->ops = lockstep_get_ops(LOCKSTEP_KERNEL_AUTO);
+    lockstep->cpus = aligned_alloc(64, sizeof(CPU) * (size_t)lanes);
+    lockstep->memory = calloc((size_t)lanes, MEMORY_SIZE);
+    if (lockstep->cpus == NULL || lockstep->memory == NULL) {
+	lockstep_destroy(lockstep);
+	return NULL;
+    }
+    for (int i = 0; i < lanes; i++) cpu_init(&lockstep->cpus[i], lockstep->memory + (size_t)i * MEMORY_SIZE);
+    return lockstep;
+}
+
+void lockstep_destroy(LOCKSTEP* lockstep)
+{
+    if (lockstep == NULL) return;
+    free(lockstep->cpus);
+    free(lockstep->memory);
+    free(lockstep);
+}
+
+CPU* lockstep_cpu(LOCKSTEP* lockstep, int lane)
+{
+    if (lane < 0 || lane >= lockstep->lanes) return NULL;
+    return &lockstep->cpus[lane];
+}
+
+bool lockstep_set_kernel(LOCKSTEP* lockstep, LOCKSTEP_KERNEL kernel)
+{
+    const LOCKSTEP_OPS* ops = lockstep_get_ops(kernel);
+    if (ops == NULL) return false;
+    lockstep->ops = ops;
+    return true;
+}
+
+static void lockstep_load_lane(LOCKSTEP* lockstep, int lane)
+{
+    CPU* cpu = &lockstep->cpus[lane];
+    lockstep->reg_a[lane] = cpu->reg_a;
+    lockstep->reg_x[lane] = cpu->reg_x;
+    lockstep->reg_y[lane] = cpu->reg_y;
+    lockstep->reg_sp[lane] = cpu->reg_sp;
+    lockstep->status[lane] = cpu_get_status(cpu);
+    lockstep->pc[lane] = cpu->pc;
+    lockstep->cycles[lane] = cpu->cycles;
+}
+
+static void lockstep_store_lane(LOCKSTEP* lockstep, int lane)
+{
+    CPU* cpu = &lockstep->cpus[lane];
+    cpu->reg_a = lockstep->reg_a[lane];
+    cpu->reg_x = lockstep->reg_x[lane];
+    cpu->reg_y = lockstep->reg_y[lane];
+    cpu->reg_sp = lockstep->reg_sp[lane];
+    cpu_set_status(cpu, lockstep->status[lane]);
+    cpu->pc = lockstep->pc[lane];
+    cpu->cycles = lockstep->cycles[lane];
+}
+
+// The fast path of cpu_read_memory, inlined into the gather loops.
+static inline uchar lockstep_read(CPU* cpu, ushort addr)
+{
+    const uchar* page = cpu->bus.read_fast[addr >> 8];
+    if (bus_likely(page != NULL)) return page[addr & 0xFF];
+    return cpu_read_memory(cpu, addr);
+}
+
+// cpu_get_operand_address for one lane, with the lane's index registers.
+static inline __attribute__((always_inline)) ushort lockstep_address(LOCKSTEP* lockstep, int lane, ADDRESS_MODE mode, ushort at)
+{
+    CPU* cpu = &lockstep->cpus[lane];
+    switch (mode) {
+    case ADDRESS_IMMEDIATE:
+    case ADDRESS_RELATIVE: return at;
+    case ADDRESS_ZEROPAGE: return lockstep_read(cpu, at);
+    case ADDRESS_ZEROPAGE_X: return (uchar)(lockstep_read(cpu, at) + lockstep->reg_x[lane]);
+    case ADDRESS_ZEROPAGE_Y: return (uchar)(lockstep_read(cpu, at) + lockstep->reg_y[lane]);
+    case ADDRESS_ABSOLUTE:
+    case ADDRESS_ABSOLUTE_X:
+    case ADDRESS_ABSOLUTE_Y: {
+	ushort operand = lockstep_read(cpu, at);
+	operand = operand | (ushort)(lockstep_read(cpu, (ushort)(at + 1)) << 8);
+	if (mode == ADDRESS_ABSOLUTE) return operand;
+	ushort addr = (ushort)(operand + (mode == ADDRESS_ABSOLUTE_X ? lockstep->reg_x[lane] : lockstep->reg_y[lane]));
+	cpu->page_crossed = (operand & 0xFF00) != (addr & 0xFF00);
+	return addr;
+    }
+    case ADDRESS_INDIRECT_X:
+    case ADDRESS_INDIRECT_Y: {
+	cpu->reg_x = lockstep->reg_x[lane];
+	cpu->reg_y = lockstep->reg_y[lane];
+	return cpu_resolve_operand_address(cpu, mode, cpu_read_operand(cpu, mode, at));
+    }
+    default: return 0;
+    }
+}
+
+// Resolves the operand address, cycles and (for `reads`) the operand of
+// every lane in the group. Called with a constant mode so the addressing
+// switch folds away.
+static inline __attribute__((always_inline)) void lockstep_gather(LOCKSTEP* lockstep, uint32_t group, const INSTRUCTION_SET* set, ADDRESS_MODE mode,
+								  bool reads, ushort* addr, uchar* value, uchar* cycles)
+{
+    for (uint32_t rest = group; rest != 0; rest = rest & (rest - 1)) {
+	int lane = __builtin_ctz(rest);
+	addr[lane] = lockstep_address(lockstep, lane, mode, (ushort)(lockstep->pc[lane] + 1));
+	cycles[lane] = set->cycles + (set->page_penalty && lockstep->cpus[lane].page_crossed);
+	if (reads) value[lane] = lockstep_read(&lockstep->cpus[lane], addr[lane]);
+    }
+}
+
+#define LOCKSTEP_GATHER(mode) \
+    case mode: lockstep_gather(lockstep, group, set, mode, reads, addr, value, cycles); break;
+
+// Issues one instruction to the lanes at the lowest pc that hold the same
+// opcode there; lanes at that pc whose memory differs are issued to next.
+static void lockstep_issue(LOCKSTEP* lockstep)
+{
+    uint32_t group = lockstep->ops->select(lockstep, lockstep->running);
+    ushort pc = lockstep->pc[__builtin_ctz(group)];
+    uchar op = lockstep_read(&lockstep->cpus[__builtin_ctz(group)], pc);
+    for (uint32_t rest = group & (group - 1); rest != 0; rest = rest & (rest - 1)) {
+	int lane = __builtin_ctz(rest);
+	if (lockstep_read(&lockstep->cpus[lane], pc) != op) group = group & ~(1u << lane);
+    }
+    lockstep->issued = lockstep->issued + 1;
+    lockstep->executed = lockstep->executed + (uint64_t)__builtin_popcount(group);
+
+    const INSTRUCTION_SET* set = cpu_get_instruction_set(op);
+    if (set->handler == NULL) {
+	for (uint32_t rest = group; rest != 0; rest = rest & (rest - 1)) {
+	    int lane = __builtin_ctz(rest);
+	    lockstep->pc[lane] = lockstep->pc[lane] + 1;
+	    lockstep->cycles[lane] = lockstep->cycles[lane] + 7;
+	    lockstep->cpus[lane].halted = true;
+	}
+	lockstep->running = lockstep->running & ~group;
+	return;
+    }
+
+    INSTRUCTION instruction = set->instruction;
+    bool accumulator = set->mode == ADDRESS_ACCUMULATOR;
+    bool reads = instruction == INSTRUCTION_LDA || instruction == INSTRUCTION_AND || instruction == INSTRUCTION_ADC
+	|| instruction == INSTRUCTION_BIT || (instruction == INSTRUCTION_ASL && !accumulator);
+    _Alignas(16) uchar value[LOCKSTEP_LANES] = { 0 };
+    _Alignas(16) uchar cycles[LOCKSTEP_LANES] = { 0 };
+    ushort addr[LOCKSTEP_LANES];
+    switch (set->mode) {
+    LOCKSTEP_GATHER(ADDRESS_IMMEDIATE)
+    LOCKSTEP_GATHER(ADDRESS_RELATIVE)
+    LOCKSTEP_GATHER(ADDRESS_ZEROPAGE)
+    LOCKSTEP_GATHER(ADDRESS_ZEROPAGE_X)
+    LOCKSTEP_GATHER(ADDRESS_ZEROPAGE_Y)
+    LOCKSTEP_GATHER(ADDRESS_ABSOLUTE)
+    LOCKSTEP_GATHER(ADDRESS_ABSOLUTE_X)
+    LOCKSTEP_GATHER(ADDRESS_ABSOLUTE_Y)
+    LOCKSTEP_GATHER(ADDRESS_INDIRECT_X)
+    LOCKSTEP_GATHER(ADDRESS_INDIRECT_Y)
+    default: lockstep_gather(lockstep, group, set, ADDRESS_NONE, false, addr, value, cycles); break;
+    }
+    lockstep->ops->advance(lockstep, group, set->bytes, cycles);
+
+    if (lockstep_is_branch(instruction)) {
+	lockstep->ops->execute(lockstep, group, instruction, false, value);
+	for (uint32_t rest = group; rest != 0; rest = rest & (rest - 1)) {
+	    int lane = __builtin_ctz(rest);
+	    if (value[lane] == 0) continue;
+	    signed char offset = (signed char)cpu_read_memory(&lockstep->cpus[lane], addr[lane]);
+	    ushort next = lockstep->pc[lane];
+	    ushort target = (ushort)(next + offset);
+	    lockstep->cycles[lane] = lockstep->cycles[lane] + 1 + ((target & 0xFF00) != (next & 0xFF00));
+	    lockstep->pc[lane] = target;
+	}
+    } else if (lockstep_in_kernel(instruction)) {
+	lockstep->ops->execute(lockstep, group, instruction, accumulator, value);
+	if (instruction == INSTRUCTION_ASL && !accumulator) {
+	    for (uint32_t rest = group; rest != 0; rest = rest & (rest - 1)) {
+		int lane = __builtin_ctz(rest);
+		cpu_write_memory(&lockstep->cpus[lane], addr[lane], value[lane]);
+	    }
+	}
+    } else {
+	// Stack and jumps: the reference handler, one lane at a time.
+	for (uint32_t rest = group; rest != 0; rest = rest & (rest - 1)) {
+	    int lane = __builtin_ctz(rest);
+	    lockstep_store_lane(lockstep, lane);
+	    set->handler(&lockstep->cpus[lane], addr[lane]);
+	    lockstep_load_lane(lockstep, lane);
+	}
+    }
+
+    for (uint32_t rest = group; rest != 0; rest = rest & (rest - 1)) {
+	int lane = __builtin_ctz(rest);
+	if (lockstep->cycles[lane] >= lockstep->end[lane]) lockstep->running = lockstep->running & ~(1u << lane);
+    }
+}
+
+// Like cpu_dispatch without a scheduler or IRQs: a lane runs while it is
+// short of its end, and stops early on BRK.
+static void lockstep_dispatch(LOCKSTEP* lockstep, uint64_t budget)
+{
+    lockstep->running = 0;
+    for (int i = 0; i < lockstep->lanes; i++) {
+	lockstep_load_lane(lockstep, i);
+	uint64_t start = lockstep->cycles[i];
+	lockstep->end[i] = budget > UINT64_MAX - start ? UINT64_MAX : start + budget;
+	if (start < lockstep->end[i]) lockstep->running = lockstep->running | 1u << i;
+    }
+    while (lockstep->running != 0) lockstep_issue(lockstep);
+    for (int i = 0; i < lockstep->lanes; i++) lockstep_store_lane(lockstep, i);
+}
+
+void lockstep_run(LOCKSTEP* lockstep)
+{
+    lockstep_dispatch(lockstep, UINT64_MAX);
+}
+
+void lockstep_run_for_cycles(LOCKSTEP* lockstep, uint64_t budget)
+{
+    lockstep_dispatch(lockstep, budget);
+}
@@ -0,0 +1,69 @@
+#ifndef LOCKSTEP_H_
+#define LOCKSTEP_H_
+
+#include "cpu.h"
+
+#define LOCKSTEP_LANES 16
+
+typedef enum {
+    LOCKSTEP_KERNEL_AUTO,
+    LOCKSTEP_KERNEL_SCALAR,
+    LOCKSTEP_KERNEL_SSE2,
+    LOCKSTEP_KERNEL_AVX2
+} LOCKSTEP_KERNEL;
+
+struct LOCKSTEP_OPS;
+
+// Up to 16 CPUs running the same program on different inputs, one
+// instruction for all of them at a time. While running, the registers live
+// here, one array per register with a byte (or word) per lane, so the ALU,
+// flag and branch tests of 16 lanes are a few vector operations; memory
+// accesses still go through each lane's bus. Each step issues the next
+// instruction of the lanes with the lowest pc, so lanes that took
+// different branches wait for each other and run together again once they
+// reach common code. Stack and jump instructions call the cpu_instruction_*
+// handlers on the lane's CPU, which are also the reference the vector
+// kernels are tested against: every lane ends up exactly where cpu_run
+// would have left it.
+//
+// Lanes take no interrupts and use no attachments (tracer, profiler,
+// scheduler, idle detector, block cache); their CPUs should have none. I/O
+// callbacks on a lane's bus see its registers as they were when the run
+// started.
+typedef struct LOCKSTEP {
+    _Alignas(64) uchar reg_a[LOCKSTEP_LANES];
+    uchar reg_x[LOCKSTEP_LANES];
+    uchar reg_y[LOCKSTEP_LANES];
+    uchar reg_sp[LOCKSTEP_LANES];
+    uchar status[LOCKSTEP_LANES];  // exact, N and Z included
+    _Alignas(32) ushort pc[LOCKSTEP_LANES];
+    _Alignas(64) uint64_t cycles[LOCKSTEP_LANES];
+    uint64_t end[LOCKSTEP_LANES];  // a lane stops at the first instruction boundary at or past it
+    uint32_t running;              // one bit per lane
+    int lanes;
+    const struct LOCKSTEP_OPS* ops;
+    CPU* cpus;                     // the lanes; their registers are only current between runs
+    uchar* memory;                 // lanes * MEMORY_SIZE bytes of page storage
+
+    uint64_t issued;               // instructions issued to a group of lanes
+    uint64_t executed;             // instructions summed over the lanes that ran them
+} LOCKSTEP;
+
+// `lanes` CPUs in their power-on state, each with memory of its own.
+LOCKSTEP* lockstep_create(int lanes);
+
+void lockstep_destroy(LOCKSTEP* lockstep);
+
+// Lane `lane` as a CPU, to load, set up and inspect between runs.
+CPU* lockstep_cpu(LOCKSTEP* lockstep, int lane);
+
+// Fails for a kernel this machine cannot run.
+bool lockstep_set_kernel(LOCKSTEP* lockstep, LOCKSTEP_KERNEL kernel);
+
+// cpu_run on every lane.
+void lockstep_run(LOCKSTEP* lockstep);
+
+// cpu_run_for_cycles(budget) on every lane.
+void lockstep_run_for_cycles(LOCKSTEP* lockstep, uint64_t budget);
+
+#endif // LOCKSTEP_H_
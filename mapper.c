@@ -0,0 +1,306 @@
+#include "mapper.h"
+#include "scheduler.h"
+#include <string.h>
+#include <stddef.h>
+
+#define MAPPER_NROM 0
+#define MAPPER_MMC1 1
+#define MAPPER_UXROM 2
+#define MAPPER_CNROM 3
+#define MAPPER_MMC3 4
+
+bool mapper_supported(ushort id)
+{
+    return id <= MAPPER_MMC3;
+}
+
+// Points the size byte window at `addr` to PRG bank `bank` (negative banks
+// count from the end). It goes 8 KB at a time so that a window larger than
+// the whole ROM mirrors it instead of running off its end.
+static void mapper_map_prg(MAPPER* mapper, ushort addr, size_t size, int bank)
+{
+    int chunks = (int)(size / 0x2000);
+    for (int i = 0; i < chunks; i++) {
+	uchar* host = (uchar*)rom_prg_bank(mapper->rom, 0x2000, bank * chunks + i);
+	bus_remap_host(&mapper->cpu->bus, (uchar)((addr >> 8) + i * 0x20), 0x20, host);
+    }
+}
+
+// Points slot_count 1 KB CHR windows starting at first_slot to bank `bank`,
+// counted in units of the window size.
+static void mapper_map_chr(MAPPER* mapper, int first_slot, int slot_count, int bank)
+{
+    for (int i = 0; i < slot_count; i++) {
+	int page = bank * slot_count + i;
+	if (mapper->chr_writable) {
+	    int count = MAPPER_CHR_RAM_SIZE / MAPPER_CHR_PAGE_SIZE;
+	    page = page % count;
+	    if (page < 0) page = page + count;
+	    mapper->chr_page[first_slot + i] = mapper->chr_ram + page * MAPPER_CHR_PAGE_SIZE;
+	} else {
+	    mapper->chr_page[first_slot + i] = (uchar*)rom_chr_bank(mapper->rom, MAPPER_CHR_PAGE_SIZE, page);
+	}
+    }
+}
+
+static void mapper_mmc1_apply(MAPPER* mapper)
+{
+    switch (mapper->control & 0x03) {
+    case 0: mapper->mirroring = ROM_MIRROR_SINGLE_LOWER; break;
+    case 1: mapper->mirroring = ROM_MIRROR_SINGLE_UPPER; break;
+    case 2: mapper->mirroring = ROM_MIRROR_VERTICAL; break;
+    case 3: mapper->mirroring = ROM_MIRROR_HORIZONTAL; break;
+    }
+
+    int prg_bank = mapper->prg_bank & 0x0F;
+    switch ((mapper->control >> 2) & 0x03) {
+    case 0:
+    case 1: {
+	mapper_map_prg(mapper, 0x8000, 0x8000, prg_bank >> 1);
+    } break;
+    case 2: {
+	mapper_map_prg(mapper, 0x8000, 0x4000, 0);
+	mapper_map_prg(mapper, 0xC000, 0x4000, prg_bank);
+    } break;
+    case 3: {
+	mapper_map_prg(mapper, 0x8000, 0x4000, prg_bank);
+	mapper_map_prg(mapper, 0xC000, 0x4000, -1);
+    } break;
+    }
+
+    if (mapper->control & 0x10) {
+	mapper_map_chr(mapper, 0, 4, mapper->chr_bank[0]);
+	mapper_map_chr(mapper, 4, 4, mapper->chr_bank[1]);
+    } else {
+	mapper_map_chr(mapper, 0, 8, mapper->chr_bank[0] >> 1);
+    }
+}
+
+// MMC1 registers are loaded one bit per write through a 5 bit shift
+// register; the fifth write picks the register from address bits 13-14.
+static void mapper_mmc1_write(MAPPER* mapper, ushort addr, uchar data)
+{
+    if (data & 0x80) {
+	mapper->shift = 0;
+	mapper->shift_count = 0;
+	mapper->control = mapper->control | 0x0C;
+	mapper_mmc1_apply(mapper);
+	return;
+    }
+
+    mapper->shift = mapper->shift | ((data & 0x01) << mapper->shift_count);
+    mapper->shift_count = mapper->shift_count + 1;
+    if (mapper->shift_count < 5) return;
+
+    switch ((addr >> 13) & 0x03) {
+    case 0: mapper->control = mapper->shift; break;
+    case 1: mapper->chr_bank[0] = mapper->shift; break;
+    case 2: mapper->chr_bank[1] = mapper->shift; break;
+    case 3: mapper->prg_bank = mapper->shift; break;
+    }
+    mapper->shift = 0;
+    mapper->shift_count = 0;
+    mapper_mmc1_apply(mapper);
+}
+
+static void mapper_mmc3_apply(MAPPER* mapper)
+{
+    int r6 = mapper->bank[6] & 0x3F;
+    int r7 = mapper->bank[7] & 0x3F;
+    if (mapper->bank_select & 0x40) {
+	mapper_map_prg(mapper, 0x8000, 0x2000, -2);
+	mapper_map_prg(mapper, 0xC000, 0x2000, r6);
+    } else {
+	mapper_map_prg(mapper, 0x8000, 0x2000, r6);
+	mapper_map_prg(mapper, 0xC000, 0x2000, -2);
+    }
+    mapper_map_prg(mapper, 0xA000, 0x2000, r7);
+    mapper_map_prg(mapper, 0xE000, 0x2000, -1);
+
+    // R0/R1 are 2 KB banks and R2-R5 1 KB banks; bit 7 of bank select
+    // swaps the two pattern table halves.
+    int invert = (mapper->bank_select & 0x80) ? 4 : 0;
+    mapper_map_chr(mapper, 0 ^ invert, 2, mapper->bank[0] >> 1);
+    mapper_map_chr(mapper, 2 ^ invert, 2, mapper->bank[1] >> 1);
+    for (int i = 0; i < 4; i++) {
+	mapper_map_chr(mapper, (4 + i) ^ invert, 1, mapper->bank[2 + i]);
+    }
+}
+
+static void mapper_mmc3_write(MAPPER* mapper, ushort addr, uchar data)
+{
+    switch (addr & 0xE001) {
+    case 0x8000: {
+	mapper->bank_select = data;
+	mapper_mmc3_apply(mapper);
+    } break;
+    case 0x8001: {
+	mapper->bank[mapper->bank_select & 0x07] = data;
+	mapper_mmc3_apply(mapper);
+    } break;
+    case 0xA000: {
+	if (mapper->rom->mirroring != ROM_MIRROR_FOUR_SCREEN) {
+	    mapper->mirroring = (data & 0x01) ? ROM_MIRROR_HORIZONTAL : ROM_MIRROR_VERTICAL;
+	}
+    } break;
+    case 0xC000: {
+	mapper->irq_latch = data;
+    } break;
+    case 0xC001: {
+	mapper->irq_counter = 0;
+	mapper->irq_reload = true;
+    } break;
+    case 0xE000: {
+	mapper->irq_enabled = false;
+	mapper->irq_pending = false;
+    } break;
+    case 0xE001: {
+	mapper->irq_enabled = true;
+    } break;
+    default: {
+	// $A001 PRG RAM protect is not emulated.
+    } break;
+    }
+    // IRQ writes move the next scanline IRQ; whoever schedules it recomputes.
+    if (addr >= 0xC000 && mapper->cpu->scheduler != NULL) {
+	scheduler_schedule(mapper->cpu->scheduler, SCHEDULER_EVENT_MAPPER, mapper->cpu->cycles);
+    }
+}
+
+static void mapper_write(void* ctx, ushort addr, uchar data)
+{
+    MAPPER* mapper = ctx;
+    switch (mapper->id) {
+    case MAPPER_MMC1: {
+	mapper_mmc1_write(mapper, addr, data);
+    } break;
+    case MAPPER_UXROM: {
+	mapper->prg_bank = data;
+	mapper_map_prg(mapper, 0x8000, 0x4000, data);
+    } break;
+    case MAPPER_CNROM: {
+	mapper->chr_bank[0] = data;
+	mapper_map_chr(mapper, 0, 8, data);
+    } break;
+    case MAPPER_MMC3: {
+	mapper_mmc3_write(mapper, addr, data);
+    } break;
+    default: {
+    } break;
+    }
+}
+
+// Maps the banks the registers select.
+static void mapper_apply(MAPPER* mapper)
+{
+    switch (mapper->id) {
+    case MAPPER_MMC1: {
+	mapper_mmc1_apply(mapper);
+    } break;
+    case MAPPER_MMC3: {
+	mapper_mmc3_apply(mapper);
+    } break;
+    default: {
+	// NROM-128 mirrors its one bank; UxROM fixes the last one at $C000.
+	mapper_map_prg(mapper, 0x8000, 0x4000, mapper->id == MAPPER_UXROM ? mapper->prg_bank : 0);
+	mapper_map_prg(mapper, 0xC000, 0x4000, -1);
+	mapper_map_chr(mapper, 0, 8, mapper->id == MAPPER_CNROM ? mapper->chr_bank[0] : 0);
+    } break;
+    }
+}
+
+MAPPER* mapper_create(const ROM* rom, CPU* cpu)
+{
+    if (!mapper_supported(rom->mapper)) return NULL;
+    // Banks are switched in 8 KB PRG and 1 KB CHR units.
+    if (rom->prg_size % 0x2000 != 0 || rom->chr_size % MAPPER_CHR_PAGE_SIZE != 0) return NULL;
+    MAPPER* mapper = malloc(sizeof(MAPPER));
+    if (mapper == NULL) return NULL;
+    memset(mapper, 0, sizeof(MAPPER));
+    mapper->id = rom->mapper;
+    mapper->rom = rom;
+    mapper->cpu = cpu;
+    mapper->chr_writable = rom->chr == NULL;
+
+    bus_map_host(&cpu->bus, 0x60, 0x20, mapper->prg_ram, false);
+    for (int page = 0x80; page < 0x100; page += 0x20) {
+	bus_map_host(&cpu->bus, (uchar)page, 0x20, (uchar*)rom->prg, true);
+    }
+    if (mapper->id != MAPPER_NROM) {
+	bus_map_io(&cpu->bus, 0x80, 0x80, NULL, mapper_write, mapper);
+    }
+    mapper_reset(mapper);
+    return mapper;
+}
+
+void mapper_destroy(MAPPER* mapper)
+{
+    free(mapper);
+}
+
+void mapper_reset(MAPPER* mapper)
+{
+    mapper->mirroring = mapper->rom->mirroring;
+    mapper->shift = 0;
+    mapper->shift_count = 0;
+    mapper->control = 0x0C;
+    mapper->chr_bank[0] = 0;
+    mapper->chr_bank[1] = 0;
+    mapper->prg_bank = 0;
+    mapper->bank_select = 0;
+    memcpy(mapper->bank, (uchar[8]){ 0, 2, 4, 5, 6, 7, 0, 1 }, sizeof(mapper->bank));
+    mapper->irq_latch = 0;
+    mapper->irq_counter = 0;
+    mapper->irq_reload = false;
+    mapper->irq_enabled = false;
+    mapper->irq_pending = false;
+
+    mapper_apply(mapper);
+}
+
+#define MAPPER_STATE SAVESTATE_TAG('M', 'A', 'P', 'R')
+#define MAPPER_STATE_MIRRORING SAVESTATE_TAG('M', 'I', 'R', 'R')
+#define MAPPER_STATE_SIZE (sizeof(MAPPER) - offsetof(MAPPER, shift))
+
+bool mapper_save_state(MAPPER* mapper, SAVESTATE* state)
+{
+    uchar mirroring = (uchar)mapper->mirroring;
+    return savestate_put(state, MAPPER_STATE, &mapper->shift, MAPPER_STATE_SIZE)
+	&& savestate_put(state, MAPPER_STATE_MIRRORING, &mirroring, 1);
+}
+
+bool mapper_load_state(MAPPER* mapper, const SAVESTATE* state)
+{
+    const void* data = savestate_find(state, MAPPER_STATE, MAPPER_STATE_SIZE);
+    const uchar* mirroring = savestate_find(state, MAPPER_STATE_MIRRORING, 1);
+    if (data == NULL || mirroring == NULL) return false;
+    memcpy(&mapper->shift, data, MAPPER_STATE_SIZE);
+    mapper->mirroring = (ROM_MIRRORING)*mirroring;
+    mapper_apply(mapper);
+    return true;
+}
+
+uchar mapper_chr_read(MAPPER* mapper, ushort addr)
+{
+    addr = addr & 0x1FFF;
+    return mapper->chr_page[addr >> 10][addr & (MAPPER_CHR_PAGE_SIZE - 1)];
+}
+
+void mapper_chr_write(MAPPER* mapper, ushort addr, uchar data)
+{
+    if (!mapper->chr_writable) return;
+    addr = addr & 0x1FFF;
+    mapper->chr_page[addr >> 10][addr & (MAPPER_CHR_PAGE_SIZE - 1)] = data;
+}
+
+void mapper_scanline(MAPPER* mapper)
+{
+    if (mapper->id != MAPPER_MMC3) return;
+    if (mapper->irq_counter == 0 || mapper->irq_reload) {
+	mapper->irq_counter = mapper->irq_latch;
+	mapper->irq_reload = false;
+    } else {
+	mapper->irq_counter = mapper->irq_counter - 1;
+    }
+    if (mapper->irq_counter == 0 && mapper->irq_enabled) mapper->irq_pending = true;
+}
@@ -0,0 +1,74 @@
+#ifndef MAPPER_H_
+#define MAPPER_H_
+
+#include "cpu.h"
+#include "rom.h"
+#include "savestate.h"
+
+#define MAPPER_PRG_RAM_SIZE 0x2000
+#define MAPPER_CHR_RAM_SIZE 0x2000
+#define MAPPER_CHR_PAGE_SIZE 0x400
+#define MAPPER_CHR_PAGES 8
+
+// The cartridge board. PRG banks are switched by repointing the CPU bus
+// pages at $8000-$FFFF straight into the ROM mapping; CHR banks by
+// repointing chr_page, the eight 1 KB windows the PPU reads pattern data
+// through. Neither ever copies bank contents.
+typedef struct MAPPER {
+    ushort id;
+    const ROM* rom;
+    CPU* cpu;
+    ROM_MIRRORING mirroring;
+    bool chr_writable;               // CHR RAM boards
+
+    uchar* chr_page[MAPPER_CHR_PAGES];
+
+    // Board registers; each mapper uses the ones it has.
+    uchar shift;                     // MMC1 serial port
+    uchar shift_count;
+    uchar control;
+    uchar chr_bank[2];
+    uchar prg_bank;
+    uchar bank_select;               // MMC3
+    uchar bank[8];
+
+    // MMC3 scanline counter. irq_pending stays set until the game writes
+    // $E000 to acknowledge it.
+    uchar irq_latch;
+    uchar irq_counter;
+    bool irq_reload;
+    bool irq_enabled;
+    bool irq_pending;
+
+    uchar prg_ram[MAPPER_PRG_RAM_SIZE];
+    uchar chr_ram[MAPPER_CHR_RAM_SIZE];
+} MAPPER;
+
+bool mapper_supported(ushort id);
+
+// Maps the cartridge of `rom` into the CPU's address space: PRG RAM at
+// $6000-$7FFF and PRG ROM at $8000-$FFFF. Returns NULL for unsupported
+// boards and for ROM sizes that are not whole 8 KB PRG / 1 KB CHR banks.
+// The ROM and the CPU must outlive the mapper.
+MAPPER* mapper_create(const ROM* rom, CPU* cpu);
+
+void mapper_destroy(MAPPER* mapper);
+
+// Restores the power on banks.
+void mapper_reset(MAPPER* mapper);
+
+// Board registers and RAM; loading remaps the banks they select.
+bool mapper_save_state(MAPPER* mapper, SAVESTATE* state);
+
+bool mapper_load_state(MAPPER* mapper, const SAVESTATE* state);
+
+// PPU pattern table access, $0000-$1FFF.
+uchar mapper_chr_read(MAPPER* mapper, ushort addr);
+
+void mapper_chr_write(MAPPER* mapper, ushort addr, uchar data);
+
+// Clocks the MMC3 IRQ counter, once per rendered scanline (the PPU A12
+// rise); a no-op on boards without one.
+void mapper_scanline(MAPPER* mapper);
+
+#endif // MAPPER_H_
@@ -0,0 +1,308 @@
+#include "nes.h"
+#include <string.h>
+
+#define NES_OAM_DMA 0x4014
+#define NES_CONTROLLER 0x4016
+
+// The IRQ line is the OR of every source; it is only recomputed when one of
+// them can have changed.
+static void nes_update_irq(NES* nes)
+{
+    cpu_set_irq_line(&nes->cpu, nes->mapper->irq_pending || apu_irq(&nes->apu));
+}
+
+static void nes_schedule_nmi(NES* nes)
+{
+    ppu_sync(&nes->ppu);
+    uint64_t clock = nes->ppu.clock + ppu_dots_to_vblank(&nes->ppu);
+    scheduler_schedule(&nes->scheduler, SCHEDULER_EVENT_NMI, (clock + 2) / 3);
+}
+
+static void nes_schedule_irq(NES* nes)
+{
+    uint64_t cycle = apu_next_irq(&nes->apu);
+    if (cycle == UINT64_MAX) {
+	scheduler_cancel(&nes->scheduler, SCHEDULER_EVENT_IRQ);
+    } else {
+	scheduler_schedule(&nes->scheduler, SCHEDULER_EVENT_IRQ, cycle);
+    }
+}
+
+// The scanline counter is clocked at dot 260 of every rendered line; this
+// finds the dot the counter reaches zero at, assuming rendering stays as it
+// is (a $2001 write reschedules).
+static void nes_schedule_mapper(NES* nes)
+{
+    MAPPER* mapper = nes->mapper;
+    PPU* ppu = &nes->ppu;
+    ppu_sync(ppu);
+    if (!mapper->irq_enabled || mapper->irq_pending || !(ppu->mask & 0x18)) {
+	scheduler_cancel(&nes->scheduler, SCHEDULER_EVENT_MAPPER);
+	return;
+    }
+    int clocks = (mapper->irq_counter == 0 || mapper->irq_reload) ? mapper->irq_latch + 1 : mapper->irq_counter;
+    int scanline = ppu->scanline;
+    int64_t dots = 260 - ppu->dot;
+    if (dots <= 0) {
+	dots = dots + PPU_DOTS_PER_SCANLINE;
+	scanline = (scanline + 1) % PPU_SCANLINES;
+    }
+    while (1) {
+	if (scanline < PPU_HEIGHT || scanline == PPU_PRERENDER_SCANLINE) {
+	    clocks = clocks - 1;
+	    if (clocks == 0) break;
+	}
+	dots = dots + PPU_DOTS_PER_SCANLINE;
+	scanline = (scanline + 1) % PPU_SCANLINES;
+    }
+    scheduler_schedule(&nes->scheduler, SCHEDULER_EVENT_MAPPER, (ppu->clock + (uint64_t)dots + 2) / 3);
+}
+
+static void nes_event(void* ctx, SCHEDULER_EVENT event, uint64_t cycle)
+{
+    NES* nes = ctx;
+    (void)cycle;
+    switch (event) {
+    case SCHEDULER_EVENT_NMI: {
+	ppu_sync(&nes->ppu);
+	if (nes->ppu.nmi_pending) {
+	    nes->ppu.nmi_pending = false;
+	    cpu_nmi(&nes->cpu);
+	}
+	nes_schedule_nmi(nes);
+    } break;
+    case SCHEDULER_EVENT_IRQ: {
+	apu_sync(&nes->apu);
+	nes_update_irq(nes);
+	nes_schedule_irq(nes);
+    } break;
+    case SCHEDULER_EVENT_DMA: {
+	// The CPU is stalled for the 256 read/write pairs, plus one cycle
+	// to align on odd cycles.
+	ppu_sync(&nes->ppu);
+	for (int i = 0; i < 256; i++) {
+	    uchar byte = cpu_read_memory(&nes->cpu, (ushort)((nes->dma_page << 8) | i));
+	    nes->ppu.oam[(uchar)(nes->ppu.oam_addr + i)] = byte;
+	}
+	nes->cpu.cycles = nes->cpu.cycles + 513 + (nes->cpu.cycles & 1);
+    } break;
+    case SCHEDULER_EVENT_MAPPER: {
+	ppu_sync(&nes->ppu);
+	nes_update_irq(nes);
+	nes_schedule_mapper(nes);
+    } break;
+    default: {
+    } break;
+    }
+}
+
+// Each read shifts out the next button, A first; after all eight an
+// official controller returns ones. The upper bits are open bus, which is
+// usually the $40 of the address.
+static uchar nes_read_controller(NES* nes, int port)
+{
+    if (nes->controller_strobe) nes->controller_shift[port] = nes->buttons[port];
+    uchar bit = nes->controller_shift[port] & 1;
+    nes->controller_shift[port] = (uchar)(nes->controller_shift[port] >> 1 | 0x80);
+    return 0x40 | bit;
+}
+
+static uchar nes_io_read(void* ctx, ushort addr)
+{
+    NES* nes = ctx;
+    if (addr == 0x4015) {
+	uchar status = apu_read_status(&nes->apu);
+	nes_update_irq(nes);
+	return status;
+    }
+    if (addr == NES_CONTROLLER || addr == NES_CONTROLLER + 1) return nes_read_controller(nes, addr - NES_CONTROLLER);
+    return 0;
+}
+
+static void nes_io_write(void* ctx, ushort addr, uchar data)
+{
+    NES* nes = ctx;
+    if (addr == NES_OAM_DMA) {
+	// Starts once the writing instruction is done.
+	nes->dma_page = data;
+	scheduler_schedule(&nes->scheduler, SCHEDULER_EVENT_DMA, nes->cpu.cycles);
+    } else if (addr == NES_CONTROLLER) {
+	// While the strobe is high the shift registers keep reloading.
+	nes->controller_strobe = data & 1;
+	if (nes->controller_strobe) memcpy(nes->controller_shift, nes->buttons, sizeof(nes->buttons));
+    } else if (addr <= 0x4013 || addr == 0x4015 || addr == 0x4017) {
+	apu_write_register(&nes->apu, addr, data);
+	if (addr == 0x4010 || addr == 0x4015 || addr == 0x4017) {
+	    nes_update_irq(nes);
+	    nes_schedule_irq(nes);
+	}
+    }
+}
+
+static uint64_t nes_idle_io_limit(void* ctx, ushort addr)
+{
+    NES* nes = ctx;
+    if (addr >= 0x2000 && addr < 0x4000 && (addr & 0x07) == 2) return ppu_status_stable_until(&nes->ppu);
+    return 0;
+}
+
+static NES* nes_boot(NES* nes, ROM_ERROR* error)
+{
+    nes->cpu = make_cpu();
+    nes->idle = NULL;
+    memset(nes->buttons, 0, sizeof(nes->buttons));
+    scheduler_init(&nes->scheduler, &nes->cpu);
+    for (int i = 0; i < SCHEDULER_EVENT_COUNT; i++) scheduler_set_handler(&nes->scheduler, i, nes_event, nes);
+    bus_mirror_nes_ram(&nes->cpu.bus);
+    bus_map_io(&nes->cpu.bus, 0x40, 1, nes_io_read, nes_io_write, nes);
+    nes->mapper = mapper_create(&nes->rom, &nes->cpu);
+    if (nes->mapper == NULL) {
+	if (error != NULL) *error = ROM_ERROR_UNSUPPORTED_MAPPER;
+	cpu_free_memory(&nes->cpu);
+	rom_close(&nes->rom);
+	free(nes);
+	return NULL;
+    }
+    ppu_init(&nes->ppu, &nes->cpu, nes->mapper);
+    apu_init(&nes->apu, &nes->cpu, NES_SAMPLE_RATE);
+    nes_reset(nes);
+    if (error != NULL) *error = ROM_OK;
+    return nes;
+}
+
+NES* nes_open(const char* path, ROM_ERROR* error)
+{
+    NES* nes = aligned_alloc(64, sizeof(NES));
+    if (nes == NULL) return NULL;
+    ROM_ERROR status = rom_open(path, &nes->rom);
+    if (status != ROM_OK) {
+	if (error != NULL) *error = status;
+	free(nes);
+	return NULL;
+    }
+    return nes_boot(nes, error);
+}
+
+NES* nes_create(const uchar* data, size_t size, ROM_ERROR* error)
+{
+    NES* nes = aligned_alloc(64, sizeof(NES));
+    if (nes == NULL) return NULL;
+    ROM_ERROR status = rom_parse(data, size, &nes->rom);
+    if (status != ROM_OK) {
+	if (error != NULL) *error = status;
+	free(nes);
+	return NULL;
+    }
+    return nes_boot(nes, error);
+}
+
+void nes_destroy(NES* nes)
+{
+    if (nes == NULL) return;
+    idle_destroy(nes->idle);
+    mapper_destroy(nes->mapper);
+    cpu_free_memory(&nes->cpu);
+    rom_close(&nes->rom);
+    free(nes);
+}
+
+#define NES_STATE SAVESTATE_TAG('N', 'E', 'S', ' ')
+
+// Device chunks are raw structs, so a state only loads into the same
+// cartridge on the same build.
+typedef struct NES_STATE_DATA {
+    uint32_t layout[6];
+    uchar dma_page;
+    uchar controller_shift[2];
+    bool controller_strobe;
+} NES_STATE_DATA;
+
+static NES_STATE_DATA nes_state_data(NES* nes)
+{
+    NES_STATE_DATA data;
+    memset(&data, 0, sizeof(data));
+    data.layout[0] = nes->rom.mapper;
+    data.layout[1] = (uint32_t)nes->rom.prg_size;
+    data.layout[2] = (uint32_t)nes->rom.chr_size;
+    data.layout[3] = sizeof(PPU);
+    data.layout[4] = sizeof(APU);
+    data.layout[5] = sizeof(MAPPER);
+    data.dma_page = nes->dma_page;
+    memcpy(data.controller_shift, nes->controller_shift, sizeof(data.controller_shift));
+    data.controller_strobe = nes->controller_strobe;
+    return data;
+}
+
+bool nes_save_state(NES* nes, SAVESTATE* state)
+{
+    NES_STATE_DATA data = nes_state_data(nes);
+    savestate_capture(state, &nes->cpu);
+    return savestate_put(state, NES_STATE, &data, sizeof(data))
+	&& ppu_save_state(&nes->ppu, state)
+	&& apu_save_state(&nes->apu, state)
+	&& mapper_save_state(nes->mapper, state)
+	&& scheduler_save_state(&nes->scheduler, state);
+}
+
+bool nes_load_state(NES* nes, SAVESTATE* state)
+{
+    NES_STATE_DATA expected = nes_state_data(nes);
+    const NES_STATE_DATA* data = savestate_find(state, NES_STATE, sizeof(NES_STATE_DATA));
+    if (data == NULL || memcmp(data->layout, expected.layout, sizeof(expected.layout)) != 0) return false;
+
+    savestate_restore(state, &nes->cpu);
+    nes->dma_page = data->dma_page;
+    memcpy(nes->controller_shift, data->controller_shift, sizeof(nes->controller_shift));
+    nes->controller_strobe = data->controller_strobe;
+    bool loaded = mapper_load_state(nes->mapper, state)
+	&& ppu_load_state(&nes->ppu, state)
+	&& apu_load_state(&nes->apu, state)
+	&& scheduler_load_state(&nes->scheduler, state);
+    if (nes->idle != NULL) nes->idle->armed = false;
+    return loaded;
+}
+
+void nes_reset(NES* nes)
+{
+    mapper_reset(nes->mapper);
+    cpu_reset(&nes->cpu);
+    ppu_reset(&nes->ppu);
+    apu_reset(&nes->apu);
+    memset(nes->controller_shift, 0, sizeof(nes->controller_shift));
+    nes->controller_strobe = false;
+    for (int i = 0; i < SCHEDULER_EVENT_COUNT; i++) scheduler_cancel(&nes->scheduler, i);
+    nes_update_irq(nes);
+    nes_schedule_nmi(nes);
+    nes_schedule_irq(nes);
+}
+
+void nes_set_buttons(NES* nes, int port, uchar buttons)
+{
+    nes->buttons[port & 1] = buttons;
+}
+
+bool nes_set_idle_skip(NES* nes, bool enabled)
+{
+    if (enabled && nes->idle == NULL) {
+	nes->idle = idle_create();
+	if (nes->idle == NULL) return false;
+	idle_set_io_limit(nes->idle, nes_idle_io_limit, nes);
+    } else if (!enabled && nes->idle != NULL) {
+	idle_destroy(nes->idle);
+	nes->idle = NULL;
+    }
+    nes->cpu.idle = nes->idle;
+    return true;
+}
+
+bool nes_run_frame(NES* nes)
+{
+    uint64_t frame = nes->ppu.frame;
+    while (nes->ppu.frame == frame && !nes->cpu.halted) {
+	uint64_t dots = ppu_dots_to_vblank(&nes->ppu);
+	cpu_run_for_cycles(&nes->cpu, (dots + 2) / 3);
+	ppu_sync(&nes->ppu);
+    }
+    apu_sync(&nes->apu);
+    return !nes->cpu.halted;
+}
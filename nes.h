@@ -0,0 +1,74 @@
+#ifndef NES_H_
+#define NES_H_
+
+#include "cpu.h"
+#include "rom.h"
+#include "mapper.h"
+#include "ppu.h"
+#include "apu.h"
+#include "scheduler.h"
+#include "idle.h"
+#include "savestate.h"
+
+#define NES_SAMPLE_RATE 48000
+
+// Standard controller buttons, in the order the shift register reports them.
+#define NES_BUTTON_A      0x01
+#define NES_BUTTON_B      0x02
+#define NES_BUTTON_SELECT 0x04
+#define NES_BUTTON_START  0x08
+#define NES_BUTTON_UP     0x10
+#define NES_BUTTON_DOWN   0x20
+#define NES_BUTTON_LEFT   0x40
+#define NES_BUTTON_RIGHT  0x80
+
+// A console: the CPU bus wired to 2 KB of RAM, the PPU, the APU and the
+// rest of the $4000 I/O page, and the cartridge. It holds pointers into
+// itself, so it lives on the heap and is never copied.
+typedef struct NES {
+    CPU cpu;
+    ROM rom;
+    MAPPER* mapper;
+    PPU ppu;
+    APU apu;                 // apu.sink is NULL until the host attaches one
+    SCHEDULER scheduler;     // vblank NMI, OAM DMA, APU and mapper IRQs
+    uchar dma_page;          // source page of the pending OAM DMA
+    uchar buttons[2];        // held on each controller; host input, not saved
+    uchar controller_shift[2];
+    bool controller_strobe;  // bit 0 of the last $4016 write
+    IDLE_DETECTOR* idle;     // NULL unless nes_set_idle_skip turned it on
+} NES;
+
+// Boots the .nes file at `path`. On failure returns NULL and, when `error`
+// is not NULL, stores why.
+NES* nes_open(const char* path, ROM_ERROR* error);
+
+// Same, for an image in memory that outlives the console.
+NES* nes_create(const uchar* data, size_t size, ROM_ERROR* error);
+
+void nes_destroy(NES* nes);
+
+void nes_reset(NES* nes);
+
+// Fast forwards spin-waits (on RAM, ROM or $2002) to the next event. The
+// emulated machine ends up in exactly the same state, just sooner.
+bool nes_set_idle_skip(NES* nes, bool enabled);
+
+// Sets the buttons held on controller `port` (0 or 1), as read through
+// $4016 and $4017 from the next strobe on.
+void nes_set_buttons(NES* nes, int port, uchar buttons);
+
+// Captures the whole console: CPU, RAM, PPU, APU, mapper and pending
+// events. Repeated captures into the same state only copy the RAM pages
+// written in between.
+bool nes_save_state(NES* nes, SAVESTATE* state);
+
+// Fails without touching the console for a state taken from another
+// cartridge or build.
+bool nes_load_state(NES* nes, SAVESTATE* state);
+
+// Runs until the next vblank, when the framebuffer holds a whole frame.
+// Returns false once the CPU has stopped.
+bool nes_run_frame(NES* nes);
+
+#endif // NES_H_
@@ -0,0 +1,139 @@
+#include "pool.h"
+#include <string.h>
+#include <unistd.h>
+
+typedef struct POOL {
+    int workers;
+    POOL_DEQUE* deques;
+    POOL_TASK task;
+    void* ctx;
+} POOL;
+
+typedef struct POOL_WORKER {
+    POOL* pool;
+    int index;
+} POOL_WORKER;
+
+int pool_default_workers(void)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (int)cores : 1;
+}
+
+static bool pool_pop(POOL_DEQUE* deque, size_t* task)
+{
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+	deque->bottom = deque->bottom - 1;
+	*task = deque->tasks[deque->bottom];
+	found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool pool_steal(POOL_DEQUE* deque, size_t* task)
+{
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+	*task = deque->tasks[deque->top];
+	deque->top = deque->top + 1;
+	found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static void* pool_worker(void* arg)
+{
+    POOL_WORKER* worker = arg;
+    POOL* pool = worker->pool;
+    POOL_DEQUE* own = &pool->deques[worker->index];
+    uint32_t seed = 2654435761u * (uint32_t)(worker->index + 1);
+
+    while (1) {
+	size_t task;
+	if (pool_pop(own, &task)) {
+	    pool->task(pool->ctx, task, worker->index);
+	    own->executed = own->executed + 1;
+	    continue;
+	}
+
+	// Sweep every other deque once, starting from a random victim.
+	bool stolen = false;
+	seed = seed ^ (seed << 13);
+	seed = seed ^ (seed >> 17);
+	seed = seed ^ (seed << 5);
+	for (int i = 0; i < pool->workers && !stolen; i++) {
+	    int victim = (int)((worker->index + seed + (uint32_t)i) % (uint32_t)pool->workers);
+	    if (victim == worker->index) continue;
+	    stolen = pool_steal(&pool->deques[victim], &task);
+	}
+	if (!stolen) break;
+	pool->task(pool->ctx, task, worker->index);
+	own->executed = own->executed + 1;
+	own->steals = own->steals + 1;
+    }
+    return NULL;
+}
+
+bool pool_run(int workers, size_t count, POOL_TASK task, void* ctx, POOL_STATS* stats)
+{
+    if (workers < 1) workers = 1;
+    if ((size_t)workers > count && count > 0) workers = (int)count;
+
+    POOL pool = { .workers = workers, .task = task, .ctx = ctx };
+    size_t* tasks = malloc((count > 0 ? count : 1) * sizeof(size_t));
+    pool.deques = aligned_alloc(64, sizeof(POOL_DEQUE) * (size_t)workers);
+    POOL_WORKER* slots = malloc(sizeof(POOL_WORKER) * (size_t)workers);
+    pthread_t* threads = malloc(sizeof(pthread_t) * (size_t)workers);
+    if (tasks == NULL || pool.deques == NULL || slots == NULL || threads == NULL) {
+	free(tasks);
+	free(pool.deques);
+	free(slots);
+	free(threads);
+	return false;
+    }
+
+    // Contiguous runs keep neighbouring jobs (often similar in cost) on
+    // the same worker; the owner pops from the end, so it works backwards.
+    for (size_t i = 0; i < count; i++) tasks[i] = i;
+    for (int w = 0; w < workers; w++) {
+	POOL_DEQUE* deque = &pool.deques[w];
+	memset(deque, 0, sizeof(POOL_DEQUE));
+	pthread_mutex_init(&deque->lock, NULL);
+	deque->tasks = tasks;
+	deque->top = count * (size_t)w / (size_t)workers;
+	deque->bottom = count * (size_t)(w + 1) / (size_t)workers;
+	slots[w] = (POOL_WORKER){ .pool = &pool, .index = w };
+    }
+
+    // The calling thread is worker 0. Should a thread fail to start, the
+    // others steal its share.
+    int started = 1;
+    for (int w = 1; w < workers; w++) {
+	if (pthread_create(&threads[w], NULL, pool_worker, &slots[w]) != 0) break;
+	started = started + 1;
+    }
+    pool_worker(&slots[0]);
+    for (int w = 1; w < started; w++) pthread_join(threads[w], NULL);
+
+    if (stats != NULL) {
+	memset(stats, 0, sizeof(POOL_STATS));
+	stats->workers = workers;
+	stats->min_executed = UINT64_MAX;
+	for (int w = 0; w < workers; w++) {
+	    stats->steals = stats->steals + pool.deques[w].steals;
+	    if (pool.deques[w].executed > stats->max_executed) stats->max_executed = pool.deques[w].executed;
+	    if (pool.deques[w].executed < stats->min_executed) stats->min_executed = pool.deques[w].executed;
+	}
+    }
+    for (int w = 0; w < workers; w++) pthread_mutex_destroy(&pool.deques[w].lock);
+    free(tasks);
+    free(pool.deques);
+    free(slots);
+    free(threads);
+    return true;
+}
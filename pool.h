@@ -0,0 +1,40 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Runs task(ctx, index, worker) once for every index below the task count.
+typedef void (*POOL_TASK)(void* ctx, size_t index, int worker);
+
+// One worker's share of the indexes, tasks[top, bottom). The owner takes
+// from the bottom and thieves from the top, so they only meet on the last
+// task; the lock is held for a couple of instructions either way.
+typedef struct POOL_DEQUE {
+    _Alignas(64) pthread_mutex_t lock;
+    size_t* tasks;
+    size_t top;
+    size_t bottom;
+    uint64_t executed;
+    uint64_t steals;
+} POOL_DEQUE;
+
+typedef struct POOL_STATS {
+    int workers;
+    uint64_t steals;             // tasks that ran on another worker than planned
+    uint64_t max_executed;       // most tasks run by one worker
+    uint64_t min_executed;
+} POOL_STATS;
+
+// Number of online cores, at least 1.
+int pool_default_workers(void);
+
+// Splits the indexes into contiguous runs, one per worker, and runs them
+// on `workers` threads; a worker that runs dry steals from a random other
+// one. No task adds tasks, so a worker that finds every deque empty is
+// done. Returns false only if it could not allocate its bookkeeping.
+bool pool_run(int workers, size_t count, POOL_TASK task, void* ctx, POOL_STATS* stats);
+
+#endif // POOL_H_
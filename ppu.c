@@ -0,0 +1,892 @@
+#include "ppu.h"
+#include "scheduler.h"
+#include <string.h>
+#include <stddef.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && defined(__SSE2__) && !defined(PPU_NO_SIMD)
+#define PPU_SIMD_X86 1
+#include <immintrin.h>
+#else
+#define PPU_SIMD_X86 0
+#endif
+
+#define PPU_CTRL_INCREMENT 0x04
+#define PPU_CTRL_SPRITE_TABLE 0x08
+#define PPU_CTRL_BACKGROUND_TABLE 0x10
+#define PPU_CTRL_SPRITE_16 0x20
+#define PPU_CTRL_NMI 0x80
+#define PPU_MASK_GRAYSCALE 0x01
+#define PPU_MASK_BACKGROUND_LEFT 0x02
+#define PPU_MASK_SPRITES_LEFT 0x04
+#define PPU_MASK_BACKGROUND 0x08
+#define PPU_MASK_SPRITES 0x10
+#define PPU_STATUS_OVERFLOW 0x20
+#define PPU_STATUS_SPRITE_ZERO 0x40
+#define PPU_STATUS_VBLANK 0x80
+
+/* ---------------------------------------------------------------------- */
+/* 2bpp tile decoding                                                     */
+/* ---------------------------------------------------------------------- */
+
+static void ppu_decode_row_scalar(const uchar* lo, const uchar* hi, const uchar* attr, int tiles, uchar* out)
+{
+    for (int tile = 0; tile < tiles; tile++) {
+	uchar palette = (uchar)(attr[tile] << 2);
+	for (int bit = 0; bit < 8; bit++) {
+	    int shift = 7 - bit;
+	    out[tile * 8 + bit] = palette | ((lo[tile] >> shift) & 1) | (((hi[tile] >> shift) & 1) << 1);
+	}
+    }
+}
+
+static void ppu_lookup_row_scalar(const uchar* colors, const uchar* in, int count, uchar* out)
+{
+    for (int x = 0; x < count; x++) out[x] = colors[in[x]];
+}
+
+#if PPU_SIMD_X86
+
+// Turns each byte of `plane` into 0xFF or 0x00 per bit (msb first) and
+// keeps `value` where the bit was set.
+static inline __m128i ppu_sse2_bits(__m128i plane, __m128i mask, __m128i value)
+{
+    return _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(plane, mask), mask), value);
+}
+
+// Spreads 8 bytes into four vectors holding each byte eight times.
+static inline void ppu_sse2_spread(__m128i bytes, __m128i spread[4])
+{
+    __m128i pairs = _mm_unpacklo_epi8(bytes, bytes);
+    __m128i low = _mm_unpacklo_epi16(pairs, pairs);
+    __m128i high = _mm_unpackhi_epi16(pairs, pairs);
+    spread[0] = _mm_unpacklo_epi32(low, low);
+    spread[1] = _mm_unpackhi_epi32(low, low);
+    spread[2] = _mm_unpacklo_epi32(high, high);
+    spread[3] = _mm_unpackhi_epi32(high, high);
+}
+
+static void ppu_decode_row_sse2(const uchar* lo, const uchar* hi, const uchar* attr, int tiles, uchar* out)
+{
+    const __m128i mask = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 1, 2, 4, 8, 16, 32, 64, (char)128);
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i two = _mm_set1_epi8(2);
+    for (int tile = 0; tile < tiles; tile += 8) {
+	__m128i lo_spread[4], hi_spread[4], attr_spread[4];
+	ppu_sse2_spread(_mm_loadl_epi64((const __m128i*)(lo + tile)), lo_spread);
+	ppu_sse2_spread(_mm_loadl_epi64((const __m128i*)(hi + tile)), hi_spread);
+	ppu_sse2_spread(_mm_loadl_epi64((const __m128i*)(attr + tile)), attr_spread);
+	for (int i = 0; i < 4; i++) {
+	    __m128i pixels = _mm_or_si128(ppu_sse2_bits(lo_spread[i], mask, one), ppu_sse2_bits(hi_spread[i], mask, two));
+	    // Attributes are 0-3, so shifting 16 bit lanes never carries across bytes.
+	    pixels = _mm_or_si128(pixels, _mm_slli_epi16(attr_spread[i], 2));
+	    _mm_storeu_si128((__m128i*)(out + tile * 8 + i * 16), pixels);
+	}
+    }
+}
+
+__attribute__((target("avx2")))
+static void ppu_decode_row_avx2(const uchar* lo, const uchar* hi, const uchar* attr, int tiles, uchar* out)
+{
+    const __m256i mask = _mm256_setr_epi8(
+	(char)128, 64, 32, 16, 8, 4, 2, 1, (char)128, 64, 32, 16, 8, 4, 2, 1,
+	(char)128, 64, 32, 16, 8, 4, 2, 1, (char)128, 64, 32, 16, 8, 4, 2, 1);
+    // Both 128 bit lanes hold all eight source bytes; each lane picks two.
+    const __m256i pick[2] = {
+	_mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+			 2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3),
+	_mm256_setr_epi8(4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5,
+			 6, 6, 6, 6, 6, 6, 6, 6, 7, 7, 7, 7, 7, 7, 7, 7)
+    };
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i two = _mm256_set1_epi8(2);
+    for (int tile = 0; tile < tiles; tile += 8) {
+	long long lo_bytes, hi_bytes, attr_bytes;
+	memcpy(&lo_bytes, lo + tile, 8);
+	memcpy(&hi_bytes, hi + tile, 8);
+	memcpy(&attr_bytes, attr + tile, 8);
+	__m256i lo_all = _mm256_set1_epi64x(lo_bytes);
+	__m256i hi_all = _mm256_set1_epi64x(hi_bytes);
+	__m256i attr_all = _mm256_slli_epi16(_mm256_set1_epi64x(attr_bytes), 2);
+	for (int i = 0; i < 2; i++) {
+	    __m256i lo_bits = _mm256_shuffle_epi8(lo_all, pick[i]);
+	    __m256i hi_bits = _mm256_shuffle_epi8(hi_all, pick[i]);
+	    lo_bits = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(lo_bits, mask), mask), one);
+	    hi_bits = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(hi_bits, mask), mask), two);
+	    __m256i pixels = _mm256_or_si256(_mm256_or_si256(lo_bits, hi_bits), _mm256_shuffle_epi8(attr_all, pick[i]));
+	    _mm256_storeu_si256((__m256i*)(out + tile * 8 + i * 32), pixels);
+	}
+    }
+}
+
+// Ragged ends are covered by one more vector ending at the last pixel,
+// overlapping the one before; `out` never aliases `in`.
+__attribute__((target("avx2")))
+static void ppu_lookup_row_avx2(const uchar* colors, const uchar* in, int count, uchar* out)
+{
+    __m128i half_table = _mm_loadu_si128((const __m128i*)colors);
+    if (count < 16) {
+	ppu_lookup_row_scalar(colors, in, count, out);
+	return;
+    }
+    if (count < 32) {
+	__m128i head = _mm_loadu_si128((const __m128i*)in);
+	__m128i tail = _mm_loadu_si128((const __m128i*)(in + count - 16));
+	_mm_storeu_si128((__m128i*)out, _mm_shuffle_epi8(half_table, head));
+	_mm_storeu_si128((__m128i*)(out + count - 16), _mm_shuffle_epi8(half_table, tail));
+	return;
+    }
+    __m256i table = _mm256_broadcastsi128_si256(half_table);
+    int x = 0;
+    for (; x + 32 <= count; x += 32) {
+	__m256i index = _mm256_loadu_si256((const __m256i*)(in + x));
+	_mm256_storeu_si256((__m256i*)(out + x), _mm256_shuffle_epi8(table, index));
+    }
+    if (x < count) {
+	__m256i index = _mm256_loadu_si256((const __m256i*)(in + count - 32));
+	_mm256_storeu_si256((__m256i*)(out + count - 32), _mm256_shuffle_epi8(table, index));
+    }
+}
+
+static bool ppu_has_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+PPU_DECODE_ROW ppu_get_decoder(PPU_DECODER decoder)
+{
+    switch (decoder) {
+    case PPU_DECODE_SCALAR: return ppu_decode_row_scalar;
+#if PPU_SIMD_X86
+    case PPU_DECODE_SSE2: return ppu_decode_row_sse2;
+    case PPU_DECODE_AVX2: return ppu_has_avx2() ? ppu_decode_row_avx2 : NULL;
+    case PPU_DECODE_AUTO: return ppu_has_avx2() ? ppu_decode_row_avx2 : ppu_decode_row_sse2;
+#else
+    case PPU_DECODE_AUTO: return ppu_decode_row_scalar;
+#endif
+    default: return NULL;
+    }
+}
+
+// SSE2 has no byte shuffle, so only the AVX2 set has a vector lookup.
+PPU_LOOKUP_ROW ppu_get_lookup(PPU_DECODER decoder)
+{
+#if PPU_SIMD_X86
+    if ((decoder == PPU_DECODE_AUTO || decoder == PPU_DECODE_AVX2) && ppu_has_avx2()) return ppu_lookup_row_avx2;
+#endif
+    return decoder == PPU_DECODE_AVX2 ? NULL : ppu_lookup_row_scalar;
+}
+
+bool ppu_set_decoder(PPU* ppu, PPU_DECODER decoder)
+{
+    PPU_DECODE_ROW decode_row = ppu_get_decoder(decoder);
+    PPU_LOOKUP_ROW lookup_row = ppu_get_lookup(decoder);
+    if (decode_row == NULL || lookup_row == NULL) return false;
+    ppu->decode_row = decode_row;
+    ppu->lookup_row = lookup_row;
+    return true;
+}
+
+/* ---------------------------------------------------------------------- */
+/* PPU address space                                                      */
+/* ---------------------------------------------------------------------- */
+
+static inline int ppu_nametable_index(PPU* ppu, ushort addr)
+{
+    int table = (addr >> 10) & 0x03;
+    int offset = addr & 0x3FF;
+    ROM_MIRRORING mirroring = ppu->mapper != NULL ? ppu->mapper->mirroring : ROM_MIRROR_VERTICAL;
+    switch (mirroring) {
+    case ROM_MIRROR_HORIZONTAL: table = table >> 1; break;
+    case ROM_MIRROR_VERTICAL: table = table & 1; break;
+    case ROM_MIRROR_SINGLE_LOWER: table = 0; break;
+    case ROM_MIRROR_SINGLE_UPPER: table = 1; break;
+    case ROM_MIRROR_FOUR_SCREEN: break;
+    }
+    return table * 0x400 + offset;
+}
+
+// $3F10/$3F14/$3F18/$3F1C mirror the backdrop entries below them.
+static inline int ppu_palette_index(ushort addr)
+{
+    int index = addr & 0x1F;
+    if ((index & 0x13) == 0x10) index = index & 0x0F;
+    return index;
+}
+
+static inline uchar ppu_chr_read(PPU* ppu, ushort addr)
+{
+    if (ppu->mapper == NULL) return 0;
+    return ppu->mapper->chr_page[(addr >> 10) & 0x07][addr & (MAPPER_CHR_PAGE_SIZE - 1)];
+}
+
+uchar ppu_bus_read(PPU* ppu, ushort addr)
+{
+    addr = addr & 0x3FFF;
+    if (addr < 0x2000) return ppu_chr_read(ppu, addr);
+    if (addr < 0x3F00) return ppu->vram[ppu_nametable_index(ppu, addr)];
+    return ppu->palette[ppu_palette_index(addr)];
+}
+
+// Stales the cached background rows drawn from nametable byte `index`: its
+// own row, or the four rows an attribute byte colors.
+static void ppu_touch_nametable(PPU* ppu, int index)
+{
+    int table = index >> 10;
+    int offset = index & 0x3FF;
+    if (offset < 0x3C0) {
+	ppu->row_generation[table][offset >> 5] = ppu->row_generation[table][offset >> 5] + 1;
+	return;
+    }
+    int first = ((offset - 0x3C0) >> 3) * 4;
+    for (int row = first; row < first + 4 && row < 30; row++) ppu->row_generation[table][row] = ppu->row_generation[table][row] + 1;
+}
+
+void ppu_bus_write(PPU* ppu, ushort addr, uchar data)
+{
+    addr = addr & 0x3FFF;
+    if (addr < 0x2000) {
+	if (ppu->mapper == NULL) return;
+	uchar old = mapper_chr_read(ppu->mapper, addr);
+	mapper_chr_write(ppu->mapper, addr, data);
+	if (mapper_chr_read(ppu->mapper, addr) != old) ppu->chr_generation = ppu->chr_generation + 1;
+    } else if (addr < 0x3F00) {
+	int index = ppu_nametable_index(ppu, addr);
+	if (ppu->vram[index] == data) return;
+	ppu->vram[index] = data;
+	ppu_touch_nametable(ppu, index);
+    } else {
+	ppu->palette[ppu_palette_index(addr)] = data & 0x3F;
+	ppu->colors_gray = 0;
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+/* Scanline rendering                                                     */
+/* ---------------------------------------------------------------------- */
+
+static inline bool ppu_rendering(PPU* ppu)
+{
+    return (ppu->mask & (PPU_MASK_BACKGROUND | PPU_MASK_SPRITES)) != 0;
+}
+
+static void ppu_increment_y(PPU* ppu)
+{
+    if ((ppu->v & 0x7000) != 0x7000) {
+	ppu->v = ppu->v + 0x1000;
+	return;
+    }
+    ppu->v = ppu->v & ~0x7000;
+    int coarse_y = (ppu->v & 0x03E0) >> 5;
+    if (coarse_y == 29) {
+	coarse_y = 0;
+	ppu->v = ppu->v ^ 0x0800;
+    } else if (coarse_y == 31) {
+	coarse_y = 0;
+    } else {
+	coarse_y = coarse_y + 1;
+    }
+    ppu->v = (ushort)((ppu->v & ~0x03E0) | (coarse_y << 5));
+}
+
+// Decodes the 32 tiles of one nametable row at fine y `fine_y`, one
+// attr << 2 | pixel byte per dot.
+static void ppu_decode_nametable_row(PPU* ppu, int index, int coarse_y, int fine_y, const uchar* const* pattern, uchar* out)
+{
+    uchar lo[32], hi[32], attr[32];
+    const uchar* table = ppu->vram + index * 0x400;
+    const uchar* names = table + coarse_y * 32;
+    const uchar* attributes = table + 0x3C0 + (coarse_y >> 2) * 8;
+    int attribute_shift = (coarse_y & 0x02) << 1;
+    for (int x = 0; x < 32; x++) {
+	uchar name = names[x];
+	attr[x] = (attributes[x >> 2] >> (attribute_shift | (x & 0x02))) & 0x03;
+	// 64 tiles of 16 bytes per 1 KB window.
+	const uchar* bytes = pattern[name >> 6] + (name & 0x3F) * 16 + fine_y;
+	lo[x] = bytes[0];
+	hi[x] = bytes[8];
+    }
+    ppu->decode_row(lo, hi, attr, 32, out);
+}
+
+// A decoded row of physical nametable `index`, from the cache when nothing
+// under it changed since it was decoded. Rows 30 and 31 hold the attribute
+// table and are only reached by odd scroll values, so they are decoded into
+// `scratch` every time.
+static const uchar* ppu_background_row(PPU* ppu, int index, int coarse_y, int fine_y, const uchar* const* pattern, uchar* scratch)
+{
+    if (coarse_y >= 30) {
+	ppu_decode_nametable_row(ppu, index, coarse_y, fine_y, pattern, scratch);
+	return scratch;
+    }
+    PPU_ROW_CACHE* row = &ppu->row_cache[index][coarse_y][fine_y];
+    uint32_t generation = ppu->row_generation[index][coarse_y];
+    if (row->row_generation != generation || row->chr_generation != ppu->chr_generation
+	|| memcmp(row->pattern, pattern, sizeof(row->pattern)) != 0) {
+	ppu_decode_nametable_row(ppu, index, coarse_y, fine_y, pattern, row->pixels);
+	memcpy(row->pattern, pattern, sizeof(row->pattern));
+	row->row_generation = generation;
+	row->chr_generation = ppu->chr_generation;
+    }
+    return row->pixels;
+}
+
+// Background pixels of a line with the background off, and of the
+// leftmost eight dots when they are masked.
+static const uchar ppu_transparent[PPU_WIDTH];
+
+// Finds the background pixels under the scanline starting at v, one
+// attr << 2 | pixel byte per dot, straight in the cached rows: dots before
+// the returned seam start at line[0], the tail of one nametable row from
+// fine x on, and the rest at line[1], the head of the same row in the
+// nametable to its right.
+static int ppu_fetch_background(PPU* ppu, const uchar* line[2], uchar scratch[2][256])
+{
+    if (ppu->mapper == NULL) {
+	line[0] = ppu_transparent;
+	line[1] = ppu_transparent;
+	return PPU_WIDTH;
+    }
+
+    int coarse_x = ppu->v & 0x1F;
+    int coarse_y = (ppu->v >> 5) & 0x1F;
+    int fine_y = (ppu->v >> 12) & 0x07;
+    // The 4 KB pattern table in use, as four 1 KB windows.
+    const uchar* pattern[4];
+    int first_page = (ppu->ctrl & PPU_CTRL_BACKGROUND_TABLE) ? 4 : 0;
+    for (int i = 0; i < 4; i++) pattern[i] = ppu->mapper->chr_page[first_page + i];
+    ushort nametable = 0x2000 | (ppu->v & 0x0C00);
+    int left = ppu_nametable_index(ppu, nametable) >> 10;
+    int right = ppu_nametable_index(ppu, nametable ^ 0x0400) >> 10;
+
+    int start = coarse_x * 8 + ppu->fine_x;
+    line[0] = ppu_background_row(ppu, left, coarse_y, fine_y, pattern, scratch[0]) + start;
+    line[1] = ppu_background_row(ppu, right, coarse_y, fine_y, pattern, scratch[1]);
+    return 256 - start;
+}
+
+#define PPU_SPRITE_BEHIND 0x20
+#define PPU_SPRITE_ZERO 0x40
+
+// A sprite row drawn eight dots to a uint64_t: the bit of each plane byte
+// that lands in each byte of the word, leftmost dot at the lowest address.
+#define PPU_BYTES_01 0x0101010101010101ull
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define PPU_SPRITE_BITS 0x8040201008040201ull
+#define PPU_SPRITE_BITS_FLIPPED 0x0102040810204080ull
+#else
+#define PPU_SPRITE_BITS 0x0102040810204080ull
+#define PPU_SPRITE_BITS_FLIPPED 0x8040201008040201ull
+#endif
+
+// One bit per OAM entry whose sprite covers the scanline. Sprites show
+// one line below their y, so nothing is on line 0.
+#if PPU_SIMD_X86
+static uint64_t ppu_sprites_on_line(const uchar* oam, int scanline, int height)
+{
+    if (scanline == 0) return 0;
+    const __m128i low_byte = _mm_set1_epi32(0xFF);
+    const __m128i top = _mm_set1_epi8((char)(scanline - 1));
+    const __m128i last_row = _mm_set1_epi8((char)(height - 1));
+    uint64_t on_line = 0;
+    for (int i = 0; i < 64; i += 16) {
+	// The y bytes of sixteen entries, packed down from every fourth byte.
+	__m128i y[4];
+	for (int j = 0; j < 4; j++) y[j] = _mm_and_si128(_mm_loadu_si128((const __m128i*)(oam + (i + j * 4) * 4)), low_byte);
+	__m128i ys = _mm_packus_epi16(_mm_packs_epi32(y[0], y[1]), _mm_packs_epi32(y[2], y[3]));
+	// Unsigned y <= scanline - 1 and scanline - 1 - y <= height - 1.
+	__m128i row = _mm_sub_epi8(top, ys);
+	__m128i above = _mm_cmpeq_epi8(_mm_min_epu8(ys, top), ys);
+	__m128i within = _mm_cmpeq_epi8(_mm_min_epu8(row, last_row), row);
+	on_line = on_line | (uint64_t)(unsigned)_mm_movemask_epi8(_mm_and_si128(above, within)) << i;
+    }
+    return on_line;
+}
+#else
+static uint64_t ppu_sprites_on_line(const uchar* oam, int scanline, int height)
+{
+    uint64_t on_line = 0;
+    for (int i = 0; i < 64; i++) {
+	unsigned row = (unsigned)(scanline - 1 - oam[i * 4]);
+	on_line = on_line | (uint64_t)(row < (unsigned)height) << i;
+    }
+    return on_line;
+}
+#endif
+
+// Evaluates OAM for the scanline and draws the (at most eight) sprites on
+// it into `pixels` (PPU_WIDTH + 8 bytes, for sprites hanging off the
+// right edge) as 0x10 | palette << 2 | pixel, plus PPU_SPRITE_BEHIND and
+// PPU_SPRITE_ZERO, and their colors from `colors` into `shades`. Returns
+// how many there are, with their left edges in `left`; the rest of both
+// buffers is left alone.
+static int ppu_fetch_sprites(PPU* ppu, int scanline, const uchar* colors, uchar* pixels, uchar* shades, int* left)
+{
+    int height = (ppu->ctrl & PPU_CTRL_SPRITE_16) ? 16 : 8;
+    uint64_t on_line = ppu_sprites_on_line(ppu->oam, scanline, height);
+    int selected[8];
+    int count = 0;
+    for (; on_line != 0 && count < 8; count++) {
+	selected[count] = __builtin_ctzll(on_line);
+	on_line = on_line & (on_line - 1);
+    }
+    if (on_line != 0) ppu->status = ppu->status | PPU_STATUS_OVERFLOW;
+    if (count == 0) return 0;
+
+    // Only the dots under a sprite are cleared and read back.
+    for (int k = 0; k < count; k++) {
+	left[k] = ppu->oam[selected[k] * 4 + 3];
+	memset(pixels + left[k], 0, 8);
+    }
+    // Drawn back to front so the lowest OAM index wins, even when it is
+    // behind the background.
+    for (int k = count - 1; k >= 0; k--) {
+	const uchar* sprite = &ppu->oam[selected[k] * 4];
+	int row = scanline - 1 - sprite[0];
+	int tile = sprite[1];
+	uchar attribute = sprite[2];
+	if (attribute & 0x80) row = height - 1 - row;
+
+	ushort table;
+	if (height == 16) {
+	    table = (ushort)((tile & 0x01) << 12);
+	    tile = tile & 0xFE;
+	    if (row >= 8) {
+		tile = tile + 1;
+		row = row - 8;
+	    }
+	} else {
+	    table = (ppu->ctrl & PPU_CTRL_SPRITE_TABLE) ? 0x1000 : 0x0000;
+	}
+	uint64_t lo = ppu_chr_read(ppu, table + tile * 16 + row);
+	uint64_t hi = ppu_chr_read(ppu, table + tile * 16 + row + 8);
+
+	// All eight dots at once, one byte each: every byte gets a copy of
+	// the plane and keeps only its own bit, msb first unless flipped,
+	// and adding 0x7F moves "any bit set" up to bit 7.
+	uint64_t order = (attribute & 0x40) ? PPU_SPRITE_BITS_FLIPPED : PPU_SPRITE_BITS;
+	uint64_t lo_bits = ((lo * PPU_BYTES_01 & order) + PPU_BYTES_01 * 0x7F) >> 7 & PPU_BYTES_01;
+	uint64_t hi_bits = ((hi * PPU_BYTES_01 & order) + PPU_BYTES_01 * 0x7F) >> 7 & PPU_BYTES_01;
+	uint64_t opaque = (lo_bits | hi_bits) * 0xFF;
+	uchar tag = (uchar)(0x10 | ((attribute & 0x03) << 2)
+			    | ((attribute & 0x20) ? PPU_SPRITE_BEHIND : 0) | (selected[k] == 0 ? PPU_SPRITE_ZERO : 0));
+	uint64_t drawn = (lo_bits | hi_bits << 1 | tag * PPU_BYTES_01) & opaque;
+	const uchar* palette = colors + (tag & 0x1C);
+	uint64_t shade = (lo_bits & ~hi_bits) * palette[1] + (hi_bits & ~lo_bits) * palette[2] + (lo_bits & hi_bits) * palette[3];
+	uint64_t under;
+	memcpy(&under, pixels + sprite[3], 8);
+	under = (under & ~opaque) | drawn;
+	memcpy(pixels + sprite[3], &under, 8);
+	memcpy(&under, shades + sprite[3], 8);
+	under = (under & ~opaque) | shade;
+	memcpy(shades + sprite[3], &under, 8);
+    }
+    return count;
+}
+
+// Lays the sprite pixels of dots [from, to) over `out`, `background`
+// holding the background pixels from dot `from` on, and returns whether
+// sprite zero met an opaque one. Running it twice over the same dots
+// changes nothing, so overlapping sprites need no merging.
+static bool ppu_compose_sprites(const uchar* colors, const uchar* sprites, const uchar* background, int from, int to, uchar* out)
+{
+    // The pixels are as good as random, so the conditions are all-ones or
+    // all-zero bytes; written as booleans gcc branches on them.
+    uchar hit = 0;
+    for (int x = from; x < to; x++) {
+	uchar sprite = sprites[x];
+	uchar opaque = (uchar)-((background[x - from] & 0x03) != 0);
+	uchar drawn = (uchar)-((sprite & 0x03) != 0);
+	uchar front = (uchar)-((sprite & PPU_SPRITE_BEHIND) == 0);
+	uchar shown = drawn & (front | (uchar)~opaque);
+	hit = hit | (sprite & opaque & (x != 255 ? PPU_SPRITE_ZERO : 0));
+	out[x] = (uchar)((colors[sprite & 0x1F] & shown) | (out[x] & ~shown));
+    }
+    return hit != 0;
+}
+
+// The same for one sprite's eight dots [x, x + 8), all over one run of
+// `background` and short of dot 255, a byte per dot in a uint64_t with
+// the colors already in `shades`.
+static bool ppu_compose_sprite_word(const uchar* sprites, const uchar* shades, const uchar* background, int x, uchar* out)
+{
+    uint64_t sprite, shade, ground, screen;
+    memcpy(&sprite, sprites + x, 8);
+    memcpy(&shade, shades + x, 8);
+    memcpy(&ground, background, 8);
+    memcpy(&screen, out + x, 8);
+    uint64_t opaque = (((ground & PPU_BYTES_01 * 0x03) + PPU_BYTES_01 * 0x7F) >> 7 & PPU_BYTES_01) * 0xFF;
+    uint64_t drawn = (((sprite & PPU_BYTES_01 * 0x03) + PPU_BYTES_01 * 0x7F) >> 7 & PPU_BYTES_01) * 0xFF;
+    uint64_t behind = ((sprite & PPU_BYTES_01 * PPU_SPRITE_BEHIND) >> 5) * 0xFF;
+    uint64_t shown = drawn & ~(behind & opaque);
+    screen = (screen & ~shown) | (shade & shown);
+    memcpy(out + x, &screen, 8);
+    return (sprite & opaque & PPU_BYTES_01 * PPU_SPRITE_ZERO) != 0;
+}
+
+static void ppu_render_scanline(PPU* ppu, int scanline)
+{
+    uchar* out = ppu->framebuffer[scanline];
+    uchar gray = (ppu->mask & PPU_MASK_GRAYSCALE) ? 0x30 : 0x3F;
+    if (!ppu_rendering(ppu)) {
+	memset(out, ppu->palette[0] & gray, PPU_WIDTH);
+	return;
+    }
+
+    uchar* colors = ppu->colors;
+    if (ppu->colors_gray != gray) {
+	for (int i = 0; i < 32; i++) colors[i] = ppu->palette[(i & 0x03) ? i : 0] & gray;
+	ppu->colors_gray = gray;
+    }
+
+    // Colored straight from the cached rows, one lookup on each side of the
+    // seam; transparent pixels fall back to the backdrop through the table
+    // instead of a branch per pixel.
+    uchar scratch[2][256];
+    const uchar* line[2] = { ppu_transparent, ppu_transparent };
+    int seam = PPU_WIDTH;
+    if (ppu->mask & PPU_MASK_BACKGROUND) seam = ppu_fetch_background(ppu, line, scratch);
+    ppu->lookup_row(colors, line[0], seam, out);
+    ppu->lookup_row(colors, line[1], PPU_WIDTH - seam, out + seam);
+    int masked = (ppu->mask & PPU_MASK_BACKGROUND_LEFT) ? 0 : 8;
+    if (masked) memset(out, colors[0], 8);
+
+    uchar sprites[PPU_WIDTH + 8], shades[PPU_WIDTH + 8];
+    int left[8];
+    int count = (ppu->mask & PPU_MASK_SPRITES) ? ppu_fetch_sprites(ppu, scanline, colors, sprites, shades, left) : 0;
+    if (count == 0) return;
+    if (!(ppu->mask & PPU_MASK_SPRITES_LEFT)) memset(sprites, 0, 8);
+
+    // Sprites are laid over after, eight dots each, a word at a time when
+    // the background under them is in one piece. The rest are split where
+    // it comes from: the masked left edge, then either side of the seam.
+    bool hit = false;
+    for (int k = 0; k < count; k++) {
+	int x = left[k];
+	if (x >= masked && x + 8 <= seam && x != 248) {
+	    hit = ppu_compose_sprite_word(sprites, shades, line[0] + x, x, out) | hit;
+	    continue;
+	}
+	if (x >= seam && x < 248) {
+	    hit = ppu_compose_sprite_word(sprites, shades, line[1] + (x - seam), x, out) | hit;
+	    continue;
+	}
+	int last = x + 8 < PPU_WIDTH ? x + 8 : PPU_WIDTH;
+	if (x < masked) {
+	    int to = last < masked ? last : masked;
+	    hit = ppu_compose_sprites(colors, sprites, ppu_transparent, x, to, out) | hit;
+	    x = to;
+	}
+	if (x < seam && x < last) {
+	    int to = last < seam ? last : seam;
+	    hit = ppu_compose_sprites(colors, sprites, line[0] + x, x, to, out) | hit;
+	    x = to;
+	}
+	if (x < last) hit = ppu_compose_sprites(colors, sprites, line[1] + (x - seam), x, last, out) | hit;
+    }
+    if (hit) ppu->status = ppu->status | PPU_STATUS_SPRITE_ZERO;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Timing                                                                 */
+/* ---------------------------------------------------------------------- */
+
+static int ppu_line_length(PPU* ppu)
+{
+    // The pre-render line of odd frames skips its last dot while rendering.
+    if (ppu->scanline == PPU_PRERENDER_SCANLINE && ppu->odd_frame && ppu_rendering(ppu)) {
+	return PPU_DOTS_PER_SCANLINE - 1;
+    }
+    return PPU_DOTS_PER_SCANLINE;
+}
+
+// The dots of a scanline where something happens: vblank edges at 1, the
+// rendered line and y increment at 256, the horizontal copy at 257, the
+// MMC3 A12 clock at 260, the vertical copy at 280 and the end of the line.
+static int ppu_next_event(PPU* ppu)
+{
+    static const int events[] = { 1, 256, 257, 260, 280 };
+    for (size_t i = 0; i < sizeof(events) / sizeof(events[0]); i++) {
+	if (events[i] > ppu->dot) return events[i];
+    }
+    return ppu_line_length(ppu);
+}
+
+static void ppu_next_line(PPU* ppu)
+{
+    ppu->dot = 0;
+    ppu->scanline = ppu->scanline + 1;
+    if (ppu->scanline == PPU_SCANLINES) {
+	ppu->scanline = 0;
+	ppu->odd_frame = !ppu->odd_frame;
+    }
+}
+
+static void ppu_vblank_edge(PPU* ppu)
+{
+    if (ppu->scanline == PPU_VBLANK_SCANLINE) {
+	ppu->status = ppu->status | PPU_STATUS_VBLANK;
+	ppu->frame = ppu->frame + 1;
+	if (ppu->ctrl & PPU_CTRL_NMI) ppu->nmi_pending = true;
+    } else if (ppu->scanline == PPU_PRERENDER_SCANLINE) {
+	ppu->status = ppu->status & ~(PPU_STATUS_VBLANK | PPU_STATUS_SPRITE_ZERO | PPU_STATUS_OVERFLOW);
+    }
+}
+
+static void ppu_event(PPU* ppu)
+{
+    bool rendering = ppu_rendering(ppu);
+    bool fetching = ppu->scanline < PPU_HEIGHT || ppu->scanline == PPU_PRERENDER_SCANLINE;
+
+    if (ppu->dot == ppu_line_length(ppu)) {
+	ppu_next_line(ppu);
+	return;
+    }
+
+    switch (ppu->dot) {
+    case 1: ppu_vblank_edge(ppu); break;
+    case 256: {
+	if (ppu->scanline < PPU_HEIGHT) ppu_render_scanline(ppu, ppu->scanline);
+	if (rendering && fetching) ppu_increment_y(ppu);
+    } break;
+    case 257: {
+	if (rendering && fetching) ppu->v = (ppu->v & ~0x041F) | (ppu->t & 0x041F);
+    } break;
+    case 260: {
+	if (rendering && fetching && ppu->mapper != NULL) mapper_scanline(ppu->mapper);
+    } break;
+    case 280: {
+	if (rendering && ppu->scanline == PPU_PRERENDER_SCANLINE) ppu->v = (ppu->v & 0x041F) | (ppu->t & 0x7BE0);
+    } break;
+    default: {
+    } break;
+    }
+}
+
+// A whole scanline from dot 0, when nothing can touch the PPU before it
+// ends: the same events in the same order, without looking for each one.
+static void ppu_run_line(PPU* ppu, int length)
+{
+    bool rendering = ppu_rendering(ppu);
+    bool fetching = ppu->scanline < PPU_HEIGHT || ppu->scanline == PPU_PRERENDER_SCANLINE;
+    ppu_vblank_edge(ppu);
+    if (ppu->scanline < PPU_HEIGHT) ppu_render_scanline(ppu, ppu->scanline);
+    if (rendering && fetching) {
+	ppu_increment_y(ppu);
+	ppu->v = (ppu->v & ~0x041F) | (ppu->t & 0x041F);
+	if (ppu->mapper != NULL) mapper_scanline(ppu->mapper);
+	if (ppu->scanline == PPU_PRERENDER_SCANLINE) ppu->v = (ppu->v & 0x041F) | (ppu->t & 0x7BE0);
+    }
+    ppu->clock = ppu->clock + (uint64_t)length;
+    ppu_next_line(ppu);
+}
+
+void ppu_catch_up(PPU* ppu, uint64_t clock)
+{
+    while (ppu->clock < clock) {
+	if (ppu->dot == 0) {
+	    int length = ppu_line_length(ppu);
+	    if (clock - ppu->clock >= (uint64_t)length) {
+		ppu_run_line(ppu, length);
+		continue;
+	    }
+	}
+	int next = ppu_next_event(ppu);
+	uint64_t step = (uint64_t)(next - ppu->dot);
+	if (clock - ppu->clock < step) {
+	    ppu->dot = ppu->dot + (int)(clock - ppu->clock);
+	    ppu->clock = clock;
+	    return;
+	}
+	ppu->clock = ppu->clock + step;
+	ppu->dot = next;
+	ppu_event(ppu);
+    }
+}
+
+// Register accesses happen once the CPU has already counted the whole
+// instruction, so the PPU sees them up to a few dots late.
+void ppu_sync(PPU* ppu)
+{
+    ppu_catch_up(ppu, ppu->cpu->cycles * 3);
+}
+
+uint64_t ppu_dots_to_vblank(PPU* ppu)
+{
+    int64_t now = (int64_t)ppu->scanline * PPU_DOTS_PER_SCANLINE + ppu->dot;
+    int64_t vblank = (int64_t)PPU_VBLANK_SCANLINE * PPU_DOTS_PER_SCANLINE + 1;
+    int64_t dots = vblank - now;
+    if (dots <= 0) dots = dots + (int64_t)PPU_SCANLINES * PPU_DOTS_PER_SCANLINE;
+    return (uint64_t)dots;
+}
+
+// Dots until the PPU next reaches (scanline, dot), ignoring the dot the
+// odd frames skip.
+static uint64_t ppu_dots_until(PPU* ppu, int scanline, int dot)
+{
+    int64_t now = (int64_t)ppu->scanline * PPU_DOTS_PER_SCANLINE + ppu->dot;
+    int64_t dots = (int64_t)scanline * PPU_DOTS_PER_SCANLINE + dot - now;
+    if (dots <= 0) dots = dots + (int64_t)PPU_SCANLINES * PPU_DOTS_PER_SCANLINE;
+    return (uint64_t)dots;
+}
+
+uint64_t ppu_status_stable_until(PPU* ppu)
+{
+    ppu_sync(ppu);
+    // Reading clears vblank, so only a clear flag reads the same twice.
+    if (ppu->status & PPU_STATUS_VBLANK) return ppu->cpu->cycles;
+    uint64_t dots = ppu_dots_until(ppu, PPU_VBLANK_SCANLINE, 1);
+    uint64_t clear = ppu_dots_until(ppu, PPU_PRERENDER_SCANLINE, 1);
+    if (clear < dots) dots = clear;
+    // Sprite zero hit and overflow are decided when a line is rendered.
+    bool settled = (ppu->status & (PPU_STATUS_SPRITE_ZERO | PPU_STATUS_OVERFLOW)) == (PPU_STATUS_SPRITE_ZERO | PPU_STATUS_OVERFLOW);
+    if (ppu_rendering(ppu) && !settled && ppu->scanline < PPU_HEIGHT) {
+	uint64_t line = ppu_dots_until(ppu, ppu->dot < 256 ? ppu->scanline : ppu->scanline + 1, 256);
+	if (line < dots) dots = line;
+    }
+    // One dot early, in case an odd frame skips one on the way.
+    return (ppu->clock + dots - 1) / 3;
+}
+
+/* ---------------------------------------------------------------------- */
+/* CPU interface                                                          */
+/* ---------------------------------------------------------------------- */
+
+uchar ppu_read_register(void* ctx, ushort addr)
+{
+    PPU* ppu = ctx;
+    ppu_sync(ppu);
+    switch (addr & 0x07) {
+    case 2: {
+	ppu->latch = (ppu->status & 0xE0) | (ppu->latch & 0x1F);
+	ppu->status = ppu->status & ~PPU_STATUS_VBLANK;
+	ppu->write_toggle = false;
+    } break;
+    case 4: {
+	ppu->latch = ppu->oam[ppu->oam_addr];
+    } break;
+    case 7: {
+	ushort v = ppu->v & 0x3FFF;
+	if (v < 0x3F00) {
+	    ppu->latch = ppu->read_buffer;
+	    ppu->read_buffer = ppu_bus_read(ppu, v);
+	} else {
+	    // Palette reads are immediate; the buffer gets the nametable below.
+	    ppu->latch = ppu_bus_read(ppu, v);
+	    ppu->read_buffer = ppu_bus_read(ppu, v - 0x1000);
+	}
+	ppu->v = (ppu->v + ((ppu->ctrl & PPU_CTRL_INCREMENT) ? 32 : 1)) & 0x7FFF;
+    } break;
+    default: {
+    } break;
+    }
+    return ppu->latch;
+}
+
+void ppu_write_register(void* ctx, ushort addr, uchar data)
+{
+    PPU* ppu = ctx;
+    ppu_sync(ppu);
+    ppu->latch = data;
+    switch (addr & 0x07) {
+    case 0: {
+	if (!(ppu->ctrl & PPU_CTRL_NMI) && (data & PPU_CTRL_NMI) && (ppu->status & PPU_STATUS_VBLANK)) {
+	    ppu->nmi_pending = true;
+	    if (ppu->cpu->scheduler != NULL) scheduler_schedule(ppu->cpu->scheduler, SCHEDULER_EVENT_NMI, ppu->cpu->cycles);
+	}
+	ppu->ctrl = data;
+	ppu->t = (ushort)((ppu->t & 0xF3FF) | ((data & 0x03) << 10));
+    } break;
+    case 1: {
+	// Turning rendering on or off starts or stops the mapper's scanline
+	// counter.
+	if (((ppu->mask ^ data) & (PPU_MASK_BACKGROUND | PPU_MASK_SPRITES)) && ppu->cpu->scheduler != NULL) {
+	    scheduler_schedule(ppu->cpu->scheduler, SCHEDULER_EVENT_MAPPER, ppu->cpu->cycles);
+	}
+	ppu->mask = data;
+    } break;
+    case 3: {
+	ppu->oam_addr = data;
+    } break;
+    case 4: {
+	ppu->oam[ppu->oam_addr] = data;
+	ppu->oam_addr = ppu->oam_addr + 1;
+    } break;
+    case 5: {
+	if (!ppu->write_toggle) {
+	    ppu->t = (ushort)((ppu->t & 0xFFE0) | (data >> 3));
+	    ppu->fine_x = data & 0x07;
+	} else {
+	    ppu->t = (ushort)((ppu->t & 0x8C1F) | ((data & 0x07) << 12) | ((data & 0xF8) << 2));
+	}
+	ppu->write_toggle = !ppu->write_toggle;
+    } break;
+    case 6: {
+	if (!ppu->write_toggle) {
+	    ppu->t = (ushort)((ppu->t & 0x00FF) | ((data & 0x3F) << 8));
+	} else {
+	    ppu->t = (ushort)((ppu->t & 0xFF00) | data);
+	    ppu->v = ppu->t;
+	}
+	ppu->write_toggle = !ppu->write_toggle;
+    } break;
+    case 7: {
+	ppu_bus_write(ppu, ppu->v, data);
+	ppu->v = (ppu->v + ((ppu->ctrl & PPU_CTRL_INCREMENT) ? 32 : 1)) & 0x7FFF;
+    } break;
+    default: {
+    } break;
+    }
+}
+
+void ppu_init(PPU* ppu, CPU* cpu, MAPPER* mapper)
+{
+    memset(ppu, 0, sizeof(PPU));
+    ppu->cpu = cpu;
+    ppu->mapper = mapper;
+    ppu_set_decoder(ppu, PPU_DECODE_AUTO);
+    bus_map_io(&cpu->bus, 0x20, 0x20, ppu_read_register, ppu_write_register, ppu);
+    ppu_reset(ppu);
+}
+
+#define PPU_STATE_REGISTERS SAVESTATE_TAG('P', 'P', 'U', 'R')
+#define PPU_STATE_MEMORY SAVESTATE_TAG('P', 'P', 'U', 'M')
+#define PPU_REGISTERS_SIZE (offsetof(PPU, decode_row) - offsetof(PPU, clock))
+#define PPU_MEMORY_SIZE (offsetof(PPU, framebuffer) - offsetof(PPU, vram))
+
+bool ppu_save_state(PPU* ppu, SAVESTATE* state)
+{
+    return savestate_put(state, PPU_STATE_REGISTERS, &ppu->clock, PPU_REGISTERS_SIZE)
+	&& savestate_put(state, PPU_STATE_MEMORY, ppu->vram, PPU_MEMORY_SIZE);
+}
+
+bool ppu_load_state(PPU* ppu, const SAVESTATE* state)
+{
+    const void* registers = savestate_find(state, PPU_STATE_REGISTERS, PPU_REGISTERS_SIZE);
+    const void* memory = savestate_find(state, PPU_STATE_MEMORY, PPU_MEMORY_SIZE);
+    if (registers == NULL || memory == NULL) return false;
+    memcpy(&ppu->clock, registers, PPU_REGISTERS_SIZE);
+    memcpy(ppu->vram, memory, PPU_MEMORY_SIZE);
+    // The nametables, the palette and, through the mapper, CHR RAM were
+    // replaced under the cached rows and colors.
+    ppu->chr_generation = ppu->chr_generation + 1;
+    ppu->colors_gray = 0;
+    return true;
+}
+
+void ppu_reset(PPU* ppu)
+{
+    ppu->clock = ppu->cpu->cycles * 3;
+    ppu->scanline = 0;
+    ppu->dot = 0;
+    ppu->odd_frame = false;
+    ppu->ctrl = 0;
+    ppu->mask = 0;
+    ppu->status = 0;
+    ppu->oam_addr = 0;
+    ppu->latch = 0;
+    ppu->read_buffer = 0;
+    ppu->write_toggle = false;
+    ppu->nmi_pending = false;
+}
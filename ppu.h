@@ -0,0 +1,128 @@
+#ifndef PPU_H_
+#define PPU_H_
+
+#include "cpu.h"
+#include "mapper.h"
+#include "savestate.h"
+
+#define PPU_WIDTH 256
+#define PPU_HEIGHT 240
+#define PPU_DOTS_PER_SCANLINE 341
+#define PPU_SCANLINES 262
+#define PPU_VBLANK_SCANLINE 241
+#define PPU_PRERENDER_SCANLINE 261
+
+// Expands tiles bitplane pairs into one byte per pixel, attr << 2 | pixel,
+// eight pixels per tile. `tiles` is a multiple of eight.
+typedef void (*PPU_DECODE_ROW)(const uchar* lo, const uchar* hi, const uchar* attr, int tiles, uchar* out);
+
+// Maps count background pixel bytes (0-15) to colors through a 16 entry
+// table. `count` can be anything from 0 to PPU_WIDTH.
+typedef void (*PPU_LOOKUP_ROW)(const uchar* colors, const uchar* in, int count, uchar* out);
+
+// One decoded row of pixels of one nametable row, 32 tiles wide, tagged
+// with what it was decoded from. It is stale once any of that changes.
+typedef struct PPU_ROW_CACHE {
+    const uchar* pattern[4];     // background pattern table windows
+    uint32_t row_generation;
+    uint32_t chr_generation;
+    uchar pixels[256];
+} PPU_ROW_CACHE;
+
+typedef enum {
+    PPU_DECODE_AUTO,
+    PPU_DECODE_SCALAR,
+    PPU_DECODE_SSE2,
+    PPU_DECODE_AVX2
+} PPU_DECODER;
+
+// The picture processing unit is caught up lazily: nothing runs until the
+// CPU touches a PPU register or the host asks for a frame, and then whole
+// scanlines are rendered at once, each at its dot 256. `clock` counts dots
+// since power on, three per CPU cycle.
+typedef struct PPU {
+    CPU* cpu;
+    MAPPER* mapper;
+    uint64_t clock;
+    int scanline;
+    int dot;
+    uint64_t frame;          // completed frames, bumped when vblank starts
+    bool odd_frame;
+
+    uchar ctrl;              // $2000
+    uchar mask;              // $2001
+    uchar status;            // $2002
+    uchar oam_addr;          // $2003
+    uchar latch;             // last value on the register bus
+    uchar read_buffer;       // $2007 read delay
+    ushort v;                // current VRAM address
+    ushort t;                // temporary VRAM address
+    uchar fine_x;
+    bool write_toggle;
+    bool nmi_pending;        // vblank NMI waiting for the CPU
+
+    PPU_DECODE_ROW decode_row;
+    PPU_LOOKUP_ROW lookup_row;
+
+    uchar vram[0x1000];      // nametables, four screen boards use all of it
+    uchar palette[32];
+    uchar oam[256];
+    uchar framebuffer[PPU_HEIGHT][PPU_WIDTH]; // 6 bit palette indexes
+
+    // Background rows decoded in earlier frames, per physical nametable,
+    // coarse y and fine y. Nametable and attribute writes bump the
+    // generation of the rows they touch and CHR writes bump chr_generation,
+    // so a line is only decoded again once something under it changed.
+    // Bank switches are caught by the pattern window tags.
+    uint32_t chr_generation;
+    uint32_t row_generation[4][30];
+    PPU_ROW_CACHE row_cache[4][30][8];
+
+    // The palette masked to grayscale or not, with the backdrop in every
+    // transparent slot. colors_gray is the mask it was built with, or 0
+    // after a palette write.
+    uchar colors[32];
+    uchar colors_gray;
+} PPU;
+
+// Attaches the PPU to the CPU bus at $2000-$3FFF. The mapper supplies
+// pattern data and nametable mirroring.
+void ppu_init(PPU* ppu, CPU* cpu, MAPPER* mapper);
+
+void ppu_reset(PPU* ppu);
+
+// Registers, timing, nametables, palette and OAM. The framebuffer is not
+// part of the state; the next frame redraws it.
+bool ppu_save_state(PPU* ppu, SAVESTATE* state);
+
+bool ppu_load_state(PPU* ppu, const SAVESTATE* state);
+
+bool ppu_set_decoder(PPU* ppu, PPU_DECODER decoder);
+
+PPU_DECODE_ROW ppu_get_decoder(PPU_DECODER decoder);
+
+PPU_LOOKUP_ROW ppu_get_lookup(PPU_DECODER decoder);
+
+// Runs the PPU up to `clock` dots.
+void ppu_catch_up(PPU* ppu, uint64_t clock);
+
+// Runs the PPU up to the CPU's cycle counter.
+void ppu_sync(PPU* ppu);
+
+// Dots left until the next vblank starts, and with it the next frame.
+uint64_t ppu_dots_to_vblank(PPU* ppu);
+
+// First CPU cycle at which reading $2002 might give a different value
+// than reading it now: vblank starting, the flags clearing on the
+// pre-render line, or a rendered line setting sprite zero hit or overflow.
+uint64_t ppu_status_stable_until(PPU* ppu);
+
+uchar ppu_read_register(void* ctx, ushort addr);
+
+void ppu_write_register(void* ctx, ushort addr, uchar data);
+
+uchar ppu_bus_read(PPU* ppu, ushort addr);
+
+void ppu_bus_write(PPU* ppu, ushort addr, uchar data);
+
+#endif // PPU_H_
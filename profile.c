@@ -0,0 +1,244 @@
+#include "profile.h"
+#include <string.h>
+
+#define PROFILE_OP_JSR 0x20
+#define PROFILE_OP_RTS 0x60
+
+static const char* const profile_mode_names[ADDRESS_MODE_COUNT] = {
+    [ADDRESS_ACCUMULATOR] = "accumulator",
+    [ADDRESS_RELATIVE] = "relative",
+    [ADDRESS_IMMEDIATE] = "immediate",
+    [ADDRESS_ZEROPAGE] = "zeropage",
+    [ADDRESS_ZEROPAGE_X] = "zeropage,x",
+    [ADDRESS_ZEROPAGE_Y] = "zeropage,y",
+    [ADDRESS_ABSOLUTE] = "absolute",
+    [ADDRESS_ABSOLUTE_X] = "absolute,x",
+    [ADDRESS_ABSOLUTE_Y] = "absolute,y",
+    [ADDRESS_INDIRECT_X] = "(indirect,x)",
+    [ADDRESS_INDIRECT_Y] = "(indirect),y",
+    [ADDRESS_NONE] = "implied"
+};
+
+typedef struct PROFILE_ROW {
+    int key;
+    uint64_t count;
+    uint64_t cycles;
+} PROFILE_ROW;
+
+PROFILER* profiler_create(uint64_t sample_period)
+{
+    PROFILER* profiler = malloc(sizeof(PROFILER));
+    if (profiler == NULL) return NULL;
+    memset(profiler, 0, sizeof(PROFILER));
+    profiler->sample_period = sample_period == 0 ? 1 : sample_period;
+    profiler->pc_count = malloc(MEMORY_SIZE * sizeof(uint64_t));
+    profiler->pc_cycles = malloc(MEMORY_SIZE * sizeof(uint64_t));
+    profiler->nodes = malloc(PROFILE_MAX_NODES * sizeof(PROFILE_NODE));
+    if (profiler->pc_count == NULL || profiler->pc_cycles == NULL || profiler->nodes == NULL) {
+	profiler_destroy(profiler);
+	return NULL;
+    }
+    profiler_reset(profiler);
+    return profiler;
+}
+
+void profiler_destroy(PROFILER* profiler)
+{
+    if (profiler == NULL) return;
+    free(profiler->pc_count);
+    free(profiler->pc_cycles);
+    free(profiler->nodes);
+    free(profiler);
+}
+
+void profiler_reset(PROFILER* profiler)
+{
+    memset(profiler->opcode_count, 0, sizeof(profiler->opcode_count));
+    memset(profiler->opcode_cycles, 0, sizeof(profiler->opcode_cycles));
+    memset(profiler->mode_count, 0, sizeof(profiler->mode_count));
+    memset(profiler->mode_cycles, 0, sizeof(profiler->mode_cycles));
+    memset(profiler->pc_count, 0, MEMORY_SIZE * sizeof(uint64_t));
+    memset(profiler->pc_cycles, 0, MEMORY_SIZE * sizeof(uint64_t));
+    profiler->instructions = 0;
+    profiler->sampled = 0;
+    profiler->countdown = profiler->sample_period;
+    profiler->active = true;
+    profiler->pending = false;
+    profiler->node_count = 0;
+    profiler->current = -1;
+}
+
+static int profiler_new_node(PROFILER* profiler, ushort entry, int parent)
+{
+    if (profiler->node_count == PROFILE_MAX_NODES) return -1;
+    int index = profiler->node_count;
+    profiler->node_count = profiler->node_count + 1;
+    profiler->nodes[index] = (PROFILE_NODE){
+	.entry = entry,
+	.parent = parent,
+	.first_child = -1,
+	.next_sibling = -1,
+	.self_cycles = 0
+    };
+    if (parent >= 0) {
+	profiler->nodes[index].next_sibling = profiler->nodes[parent].first_child;
+	profiler->nodes[parent].first_child = index;
+    }
+    return index;
+}
+
+static void profiler_enter(PROFILER* profiler, ushort entry)
+{
+    int parent = profiler->current;
+    for (int child = profiler->nodes[parent].first_child; child >= 0; child = profiler->nodes[child].next_sibling) {
+	if (profiler->nodes[child].entry == entry) {
+	    profiler->current = child;
+	    return;
+	}
+    }
+    // Out of nodes: keep charging the caller rather than dropping cycles.
+    int child = profiler_new_node(profiler, entry, parent);
+    if (child >= 0) profiler->current = child;
+}
+
+void profiler_settle(PROFILER* profiler, CPU* cpu)
+{
+    if (!profiler->pending) return;
+    profiler->pending = false;
+
+    uint64_t cycles = (cpu->cycles - profiler->pending_cycles) * profiler->sample_period;
+    uchar op_code = profiler->pending_op_code;
+    ADDRESS_MODE mode = cpu_get_instruction_set(op_code)->mode;
+    profiler->opcode_cycles[op_code] = profiler->opcode_cycles[op_code] + cycles;
+    profiler->mode_cycles[mode] = profiler->mode_cycles[mode] + cycles;
+    profiler->pc_cycles[profiler->pending_pc] = profiler->pc_cycles[profiler->pending_pc] + cycles;
+    profiler->nodes[profiler->pending_node].self_cycles = profiler->nodes[profiler->pending_node].self_cycles + cycles;
+}
+
+void profiler_record(PROFILER* profiler, CPU* cpu)
+{
+    if (!profiler->active) return;
+    profiler_settle(profiler, cpu);
+    profiler->instructions = profiler->instructions + 1;
+
+    uchar op_code = cpu_peek_memory(cpu, cpu->pc);
+    if (profiler->current < 0) profiler->current = profiler_new_node(profiler, cpu->pc, -1);
+
+    profiler->countdown = profiler->countdown - 1;
+    if (profiler->countdown == 0) {
+	profiler->countdown = profiler->sample_period;
+	profiler->sampled = profiler->sampled + 1;
+	ADDRESS_MODE mode = cpu_get_instruction_set(op_code)->mode;
+	profiler->opcode_count[op_code] = profiler->opcode_count[op_code] + profiler->sample_period;
+	profiler->mode_count[mode] = profiler->mode_count[mode] + profiler->sample_period;
+	profiler->pc_count[cpu->pc] = profiler->pc_count[cpu->pc] + profiler->sample_period;
+	profiler->pending = true;
+	profiler->pending_pc = cpu->pc;
+	profiler->pending_op_code = op_code;
+	profiler->pending_node = profiler->current;
+	profiler->pending_cycles = cpu->cycles;
+    }
+
+    // The JSR/RTS itself is charged to the caller, so the frame moves after
+    // the pending instruction has picked its node.
+    if (op_code == PROFILE_OP_JSR) {
+	ushort entry = (ushort)(cpu_peek_memory(cpu, cpu->pc + 1) | (cpu_peek_memory(cpu, cpu->pc + 2) << 8));
+	profiler_enter(profiler, entry);
+    } else if (op_code == PROFILE_OP_RTS) {
+	int parent = profiler->nodes[profiler->current].parent;
+	if (parent >= 0) profiler->current = parent;
+    }
+}
+
+static int profile_row_compare(const void* a, const void* b)
+{
+    const PROFILE_ROW* row_a = a;
+    const PROFILE_ROW* row_b = b;
+    if (row_a->cycles != row_b->cycles) return row_a->cycles < row_b->cycles ? 1 : -1;
+    if (row_a->count != row_b->count) return row_a->count < row_b->count ? 1 : -1;
+    return row_a->key - row_b->key;
+}
+
+// Fills rows with the non-empty entries, sorted hottest first.
+static int profile_rows(PROFILE_ROW* rows, const uint64_t* count, const uint64_t* cycles, int size)
+{
+    int used = 0;
+    for (int i = 0; i < size; i++) {
+	if (count[i] == 0 && cycles[i] == 0) continue;
+	rows[used] = (PROFILE_ROW){ .key = i, .count = count[i], .cycles = cycles[i] };
+	used = used + 1;
+    }
+    qsort(rows, used, sizeof(PROFILE_ROW), profile_row_compare);
+    return used;
+}
+
+static double profile_percent(uint64_t part, uint64_t total)
+{
+    return total == 0 ? 0.0 : 100.0 * (double)part / (double)total;
+}
+
+void profiler_write_report(PROFILER* profiler, FILE* out, int top_n)
+{
+    PROFILE_ROW* rows = malloc(MEMORY_SIZE * sizeof(PROFILE_ROW));
+    if (rows == NULL) return;
+
+    uint64_t total = 0;
+    for (int i = 0; i < 256; i++) total = total + profiler->opcode_cycles[i];
+
+    fprintf(out, "instructions: %llu (%llu sampled, period %llu)\n",
+	    (unsigned long long)profiler->instructions,
+	    (unsigned long long)profiler->sampled,
+	    (unsigned long long)profiler->sample_period);
+    fprintf(out, "cycles: %llu\n\n", (unsigned long long)total);
+
+    fprintf(out, "%-4s %-4s %-13s %12s %14s %7s\n", "op", "name", "mode", "count", "cycles", "%");
+    int used = profile_rows(rows, profiler->opcode_count, profiler->opcode_cycles, 256);
+    for (int i = 0; i < used; i++) {
+	const INSTRUCTION_SET* instruction_set = cpu_get_instruction_set((uchar)rows[i].key);
+	fprintf(out, "$%02X  %-4s %-13s %12llu %14llu %6.2f%%\n",
+		rows[i].key,
+		instruction_set->name,
+		profile_mode_names[instruction_set->mode],
+		(unsigned long long)rows[i].count,
+		(unsigned long long)rows[i].cycles,
+		profile_percent(rows[i].cycles, total));
+    }
+
+    fprintf(out, "\n%-18s %12s %14s %7s\n", "mode", "count", "cycles", "%");
+    used = profile_rows(rows, profiler->mode_count, profiler->mode_cycles, ADDRESS_MODE_COUNT);
+    for (int i = 0; i < used; i++) {
+	fprintf(out, "%-18s %12llu %14llu %6.2f%%\n",
+		profile_mode_names[rows[i].key],
+		(unsigned long long)rows[i].count,
+		(unsigned long long)rows[i].cycles,
+		profile_percent(rows[i].cycles, total));
+    }
+
+    fprintf(out, "\n%-6s %12s %14s %7s\n", "pc", "count", "cycles", "%");
+    used = profile_rows(rows, profiler->pc_count, profiler->pc_cycles, MEMORY_SIZE);
+    for (int i = 0; i < used && i < top_n; i++) {
+	fprintf(out, "$%04X  %12llu %14llu %6.2f%%\n",
+		rows[i].key,
+		(unsigned long long)rows[i].count,
+		(unsigned long long)rows[i].cycles,
+		profile_percent(rows[i].cycles, total));
+    }
+    free(rows);
+}
+
+void profiler_write_collapsed(PROFILER* profiler, FILE* out)
+{
+    int path[PROFILE_MAX_NODES];
+    for (int i = 0; i < profiler->node_count; i++) {
+	if (profiler->nodes[i].self_cycles == 0) continue;
+	int depth = 0;
+	for (int node = i; node >= 0; node = profiler->nodes[node].parent) {
+	    path[depth] = node;
+	    depth = depth + 1;
+	}
+	for (int d = depth - 1; d >= 0; d--) {
+	    fprintf(out, "$%04X%s", profiler->nodes[path[d]].entry, d > 0 ? ";" : "");
+	}
+	fprintf(out, " %llu\n", (unsigned long long)profiler->nodes[i].self_cycles);
+    }
+}
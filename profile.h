@@ -0,0 +1,65 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include "cpu.h"
+#include <stdio.h>
+
+#define PROFILE_MAX_NODES 4096
+
+// One frame of the JSR/RTS call tree. entry is the subroutine address (the
+// pc where profiling started for the root); children are a sibling list.
+typedef struct PROFILE_NODE {
+    ushort entry;
+    int parent;
+    int first_child;
+    int next_sibling;
+    uint64_t self_cycles;
+} PROFILE_NODE;
+
+typedef struct PROFILER {
+    uint64_t opcode_count[256];
+    uint64_t opcode_cycles[256];
+    uint64_t mode_count[ADDRESS_MODE_COUNT];
+    uint64_t mode_cycles[ADDRESS_MODE_COUNT];
+    uint64_t* pc_count;          // MEMORY_SIZE entries
+    uint64_t* pc_cycles;
+    uint64_t instructions;       // every instruction seen, sampled or not
+    uint64_t sampled;
+    uint64_t sample_period;      // 1 records every instruction
+    uint64_t countdown;
+    bool active;
+
+    // The instruction being timed, charged when the next one starts.
+    bool pending;
+    ushort pending_pc;
+    uchar pending_op_code;
+    int pending_node;
+    uint64_t pending_cycles;
+
+    PROFILE_NODE* nodes;
+    int node_count;
+    int current;                 // -1 until the first instruction
+} PROFILER;
+
+// sample_period N times one instruction in N and scales its counts by N;
+// JSR/RTS nesting is still followed on every instruction.
+PROFILER* profiler_create(uint64_t sample_period);
+
+void profiler_destroy(PROFILER* profiler);
+
+void profiler_reset(PROFILER* profiler);
+
+// Called right before each instruction executes.
+void profiler_record(PROFILER* profiler, CPU* cpu);
+
+// Charges the last instruction once cpu_run returns.
+void profiler_settle(PROFILER* profiler, CPU* cpu);
+
+// Opcode, addressing mode and the top_n hottest pcs, sorted by cycles.
+void profiler_write_report(PROFILER* profiler, FILE* out, int top_n);
+
+// One "frame;frame;frame cycles" line per call path, the format
+// flamegraph.pl and speedscope read.
+void profiler_write_collapsed(PROFILER* profiler, FILE* out);
+
+#endif // PROFILE_H_
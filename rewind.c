@@ -0,0 +1,225 @@
+#include "rewind.h"
+#include <string.h>
+
+REWIND* rewind_create(size_t ring_bytes, int max_entries)
+{
+    if (ring_bytes == 0 || max_entries < 1) return NULL;
+    REWIND* rewind = malloc(sizeof(REWIND));
+    if (rewind == NULL) return NULL;
+    memset(rewind, 0, sizeof(REWIND));
+    rewind->capacity = ring_bytes;
+    rewind->max_entries = max_entries;
+    rewind->ring = malloc(ring_bytes);
+    rewind->entries = malloc(sizeof(REWIND_ENTRY) * (size_t)max_entries);
+    if (rewind->ring == NULL || rewind->entries == NULL) {
+	rewind_destroy(rewind);
+	return NULL;
+    }
+    return rewind;
+}
+
+void rewind_destroy(REWIND* rewind)
+{
+    if (rewind == NULL) return;
+    free(rewind->ring);
+    free(rewind->entries);
+    free(rewind->current);
+    free(rewind->next);
+    free(rewind->scratch);
+    free(rewind);
+}
+
+// Grows the state buffers to hold `size` bytes; the scratch buffer gets
+// room for the worst case encoding, see rewind_encode.
+static bool rewind_reserve(REWIND* rewind, size_t size)
+{
+    if (size <= rewind->buffer_size) return true;
+    size_t buffer_size = size + size / 2;
+    uchar* current = realloc(rewind->current, buffer_size);
+    if (current != NULL) rewind->current = current;
+    uchar* next = realloc(rewind->next, buffer_size);
+    if (next != NULL) rewind->next = next;
+    uchar* scratch = realloc(rewind->scratch, buffer_size * 2 + 16);
+    if (scratch != NULL) rewind->scratch = scratch;
+    if (current == NULL || next == NULL || scratch == NULL) return false;
+    // The states are XORed as if zero padded to the longer one.
+    memset(rewind->current + rewind->current_size, 0, buffer_size - rewind->current_size);
+    rewind->buffer_size = buffer_size;
+    return true;
+}
+
+static uchar* rewind_put_varint(uchar* out, size_t value)
+{
+    while (value >= 0x80) {
+	*out++ = (uchar)(value | 0x80);
+	value = value >> 7;
+    }
+    *out++ = (uchar)value;
+    return out;
+}
+
+static const uchar* rewind_get_varint(const uchar* in, size_t* value)
+{
+    size_t result = 0;
+    int shift = 0;
+    uchar byte;
+    do {
+	byte = *in++;
+	result = result | (size_t)(byte & 0x7F) << shift;
+	shift = shift + 7;
+    } while (byte & 0x80);
+    *value = result;
+    return in;
+}
+
+// Encodes a XOR b as (zero run, literal run, literal bytes) tokens. A
+// literal run only ends at 8 or more zeros, so a token covers at least 9
+// input bytes once it is not the last; the output never exceeds twice the
+// input plus a few bytes. Runs of zeros are skipped 8 bytes at a time.
+static size_t rewind_encode(const uchar* a, const uchar* b, size_t size, uchar* out)
+{
+    uchar* start = out;
+    size_t at = 0;
+    while (at < size) {
+	size_t zeros_start = at;
+	while (at + 8 <= size) {
+	    uint64_t x;
+	    uint64_t y;
+	    memcpy(&x, a + at, 8);
+	    memcpy(&y, b + at, 8);
+	    if (x != y) break;
+	    at = at + 8;
+	}
+	while (at < size && a[at] == b[at]) at = at + 1;
+	if (at == size) break;
+
+	size_t literal_start = at;
+	size_t zero_run = 0;
+	while (at < size && zero_run < 8) {
+	    zero_run = a[at] == b[at] ? zero_run + 1 : 0;
+	    at = at + 1;
+	}
+	size_t literal_end = at - zero_run;
+	at = literal_end;
+
+	out = rewind_put_varint(out, literal_start - zeros_start);
+	out = rewind_put_varint(out, literal_end - literal_start);
+	for (size_t i = literal_start; i < literal_end; i++) *out++ = a[i] ^ b[i];
+    }
+    return (size_t)(out - start);
+}
+
+// XORs an encoded delta into `state`, turning one side of it into the other.
+static void rewind_apply(uchar* state, const uchar* in, size_t size)
+{
+    const uchar* end = in + size;
+    size_t at = 0;
+    while (in < end) {
+	size_t zeros;
+	size_t literals;
+	in = rewind_get_varint(in, &zeros);
+	in = rewind_get_varint(in, &literals);
+	at = at + zeros;
+	for (size_t i = 0; i < literals; i++) state[at + i] = state[at + i] ^ in[i];
+	in = in + literals;
+	at = at + literals;
+    }
+}
+
+static void rewind_drop_oldest(REWIND* rewind)
+{
+    rewind->first = (rewind->first + 1) % rewind->max_entries;
+    rewind->count = rewind->count - 1;
+    rewind->dropped = rewind->dropped + 1;
+}
+
+// Finds room for `size` bytes after the newest delta, dropping the oldest
+// ones in the way. Deltas are laid out in push order, so the oldest is
+// always the next one ahead of `head`.
+static size_t rewind_allocate(REWIND* rewind, size_t size)
+{
+    if (rewind->count == rewind->max_entries) rewind_drop_oldest(rewind);
+    size_t offset = rewind->head;
+    if (offset + size > rewind->capacity) {
+	// Wrap to the start; whatever lies between head and the end goes.
+	while (rewind->count > 0 && rewind->entries[rewind->first].offset >= rewind->head) rewind_drop_oldest(rewind);
+	offset = 0;
+    }
+    while (rewind->count > 0) {
+	REWIND_ENTRY* oldest = &rewind->entries[rewind->first];
+	if (oldest->offset >= offset + size || offset >= oldest->offset + oldest->size) break;
+	rewind_drop_oldest(rewind);
+    }
+    rewind->head = offset + size;
+    return offset;
+}
+
+bool rewind_push(REWIND* rewind, const SAVESTATE* state)
+{
+    size_t size = savestate_write(state, NULL, 0);
+    if (!rewind_reserve(rewind, size)) return false;
+    memset(rewind->next + size, 0, rewind->buffer_size - size);
+    savestate_write(state, rewind->next, size);
+
+    if (rewind->has_current) {
+	size_t span = size > rewind->current_size ? size : rewind->current_size;
+	size_t encoded = rewind_encode(rewind->current, rewind->next, span, rewind->scratch);
+	if (encoded <= rewind->capacity) {
+	    size_t offset = rewind_allocate(rewind, encoded);
+	    memcpy(rewind->ring + offset, rewind->scratch, encoded);
+	    int index = (rewind->first + rewind->count) % rewind->max_entries;
+	    rewind->entries[index] = (REWIND_ENTRY){
+		.offset = offset,
+		.size = (uint32_t)encoded,
+		.previous_size = (uint32_t)rewind->current_size
+	    };
+	    rewind->count = rewind->count + 1;
+	} else {
+	    // Too big to keep at all: the history restarts here.
+	    rewind->dropped = rewind->dropped + (uint64_t)rewind->count;
+	    rewind->count = 0;
+	    rewind->head = 0;
+	}
+    }
+
+    uchar* swap = rewind->current;
+    rewind->current = rewind->next;
+    rewind->next = swap;
+    rewind->current_size = size;
+    rewind->has_current = true;
+    rewind->pushed = rewind->pushed + 1;
+    return true;
+}
+
+bool rewind_pop(REWIND* rewind, SAVESTATE* state)
+{
+    if (!rewind->has_current) return false;
+    bool loaded = savestate_read(state, rewind->current, rewind->current_size);
+    if (rewind->count == 0) {
+	rewind->has_current = false;
+	rewind->head = 0;
+	return loaded;
+    }
+
+    int index = (rewind->first + rewind->count - 1) % rewind->max_entries;
+    REWIND_ENTRY* entry = &rewind->entries[index];
+    rewind_apply(rewind->current, rewind->ring + entry->offset, entry->size);
+    size_t span = entry->previous_size > rewind->current_size ? entry->previous_size : rewind->current_size;
+    memset(rewind->current + entry->previous_size, 0, span - entry->previous_size);
+    rewind->current_size = entry->previous_size;
+    rewind->head = entry->offset;
+    rewind->count = rewind->count - 1;
+    return loaded;
+}
+
+int rewind_depth(const REWIND* rewind)
+{
+    return rewind->has_current ? rewind->count + 1 : 0;
+}
+
+size_t rewind_used(const REWIND* rewind)
+{
+    size_t used = 0;
+    for (int i = 0; i < rewind->count; i++) used = used + rewind->entries[(rewind->first + i) % rewind->max_entries].size;
+    return used;
+}
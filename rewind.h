@@ -0,0 +1,55 @@
+#ifndef REWIND_H_
+#define REWIND_H_
+
+#include "savestate.h"
+
+typedef struct REWIND_ENTRY {
+    size_t offset;              // into the ring
+    uint32_t size;              // encoded delta bytes
+    uint32_t previous_size;     // serialized size of the older state
+} REWIND_ENTRY;
+
+// Rewind history: a stack of serialized savestates where only the newest
+// is kept whole. Every older one is stored as the XOR of it and the state
+// after it, run-length encoded. Consecutive frames differ in a few hundred
+// bytes, so the XOR is almost all zeros and encodes to about that much.
+// The deltas share one fixed-size ring; when it fills up, or `max_entries`
+// is reached, the oldest ones are dropped.
+typedef struct REWIND {
+    uchar* ring;
+    size_t capacity;
+    size_t head;                // where the next delta goes
+    REWIND_ENTRY* entries;      // ring of max_entries, oldest at `first`
+    int max_entries;
+    int first;
+    int count;
+
+    uchar* current;             // newest state, serialized
+    size_t current_size;
+    bool has_current;
+    uchar* next;                // the state being pushed
+    uchar* scratch;             // its encoded delta
+    size_t buffer_size;         // of current, next and scratch
+
+    uint64_t pushed;
+    uint64_t dropped;
+} REWIND;
+
+REWIND* rewind_create(size_t ring_bytes, int max_entries);
+
+void rewind_destroy(REWIND* rewind);
+
+// Makes `state` the newest entry. Fails only when memory runs out.
+bool rewind_push(REWIND* rewind, const SAVESTATE* state);
+
+// Loads the newest entry into `state` and forgets it, so repeated pops walk
+// back one entry at a time. False once the history is empty.
+bool rewind_pop(REWIND* rewind, SAVESTATE* state);
+
+// Entries that can be popped, including the newest.
+int rewind_depth(const REWIND* rewind);
+
+// Bytes of the ring holding deltas.
+size_t rewind_used(const REWIND* rewind);
+
+#endif // REWIND_H_
@@ -0,0 +1,163 @@
+#include "rom.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const uchar rom_magic[4] = { 'N', 'E', 'S', 0x1A };
+
+// NES 2.0 ROM sizes: a 12 bit count of units, or when the top nibble is
+// all ones, 2^E * (2M + 1) bytes packed into the low byte.
+static uint64_t rom_nes2_size(uchar low, uchar high_nibble, size_t unit)
+{
+    if (high_nibble == 0x0F) {
+	uint64_t exponent = low >> 2;
+	uint64_t multiplier = (low & 0x03) * 2 + 1;
+	if (exponent > 40) return UINT64_MAX;
+	return (1ULL << exponent) * multiplier;
+    }
+    return (uint64_t)((high_nibble << 8) | low) * unit;
+}
+
+// NES 2.0 RAM sizes: 0 means none, otherwise 64 << shift bytes.
+static size_t rom_nes2_ram_size(uchar shift)
+{
+    return shift == 0 ? 0 : (size_t)64 << shift;
+}
+
+ROM_ERROR rom_parse(const uchar* data, size_t size, ROM* rom)
+{
+    memset(rom, 0, sizeof(ROM));
+    if (size < ROM_HEADER_SIZE) return ROM_ERROR_TOO_SMALL;
+    if (memcmp(data, rom_magic, sizeof(rom_magic)) != 0) return ROM_ERROR_BAD_MAGIC;
+
+    const uchar* header = data;
+    rom->data = data;
+    rom->size = size;
+    rom->format = (header[7] & 0x0C) == 0x08 ? ROM_FORMAT_NES2 : ROM_FORMAT_INES;
+    rom->battery = (header[6] & 0x02) != 0;
+    if (header[6] & 0x08) {
+	rom->mirroring = ROM_MIRROR_FOUR_SCREEN;
+    } else {
+	rom->mirroring = (header[6] & 0x01) ? ROM_MIRROR_VERTICAL : ROM_MIRROR_HORIZONTAL;
+    }
+
+    uint64_t prg_size;
+    uint64_t chr_size;
+    if (rom->format == ROM_FORMAT_NES2) {
+	rom->mapper = (ushort)((header[6] >> 4) | (header[7] & 0xF0) | ((header[8] & 0x0F) << 8));
+	rom->submapper = header[8] >> 4;
+	prg_size = rom_nes2_size(header[4], header[9] & 0x0F, ROM_PRG_BANK_SIZE);
+	chr_size = rom_nes2_size(header[5], header[9] >> 4, ROM_CHR_BANK_SIZE);
+	rom->prg_ram_size = rom_nes2_ram_size(header[10] & 0x0F);
+	rom->prg_nvram_size = rom_nes2_ram_size(header[10] >> 4);
+	rom->chr_ram_size = rom_nes2_ram_size(header[11] & 0x0F);
+	rom->chr_nvram_size = rom_nes2_ram_size(header[11] >> 4);
+	rom->timing = (ROM_TIMING)(header[12] & 0x03);
+    } else {
+	// Old dumping tools wrote their name over bytes 7-15; when the tail
+	// is not blank, byte 7 cannot be trusted for the mapper high nibble.
+	bool dirty_tail = header[12] != 0 || header[13] != 0 || header[14] != 0 || header[15] != 0;
+	rom->mapper = (ushort)((header[6] >> 4) | (dirty_tail ? 0 : (header[7] & 0xF0)));
+	prg_size = (uint64_t)header[4] * ROM_PRG_BANK_SIZE;
+	chr_size = (uint64_t)header[5] * ROM_CHR_BANK_SIZE;
+	size_t prg_ram_size = (size_t)(header[8] == 0 ? 1 : header[8]) * 0x2000;
+	if (rom->battery) {
+	    rom->prg_nvram_size = prg_ram_size;
+	} else {
+	    rom->prg_ram_size = prg_ram_size;
+	}
+	rom->chr_ram_size = chr_size == 0 ? ROM_CHR_BANK_SIZE : 0;
+	rom->timing = (!dirty_tail && (header[9] & 0x01)) ? ROM_TIMING_PAL : ROM_TIMING_NTSC;
+    }
+
+    if (prg_size == 0) return ROM_ERROR_NO_PRG;
+
+    uint64_t offset = ROM_HEADER_SIZE;
+    if (header[6] & 0x04) {
+	if (size - offset < ROM_TRAINER_SIZE) return ROM_ERROR_TRUNCATED;
+	rom->trainer = data + offset;
+	offset = offset + ROM_TRAINER_SIZE;
+    }
+    if (prg_size > size - offset) return ROM_ERROR_TRUNCATED;
+    rom->prg = data + offset;
+    rom->prg_size = (size_t)prg_size;
+    offset = offset + prg_size;
+    if (chr_size > size - offset) return ROM_ERROR_TRUNCATED;
+    rom->chr = chr_size == 0 ? NULL : data + offset;
+    rom->chr_size = (size_t)chr_size;
+    return ROM_OK;
+}
+
+ROM_ERROR rom_open(const char* path, ROM* rom)
+{
+    memset(rom, 0, sizeof(ROM));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return ROM_ERROR_OPEN;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+	close(fd);
+	return ROM_ERROR_OPEN;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size < ROM_HEADER_SIZE) {
+	close(fd);
+	return ROM_ERROR_TOO_SMALL;
+    }
+
+    // The mapping keeps the file alive, so the descriptor is not needed.
+    void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return ROM_ERROR_MAP;
+
+    ROM_ERROR error = rom_parse(map, size, rom);
+    if (error != ROM_OK) {
+	munmap(map, size);
+	memset(rom, 0, sizeof(ROM));
+	return error;
+    }
+    rom->mapped = true;
+    return ROM_OK;
+}
+
+void rom_close(ROM* rom)
+{
+    if (rom->mapped) munmap((void*)rom->data, rom->size);
+    memset(rom, 0, sizeof(ROM));
+}
+
+const char* rom_error_string(ROM_ERROR error)
+{
+    switch (error) {
+    case ROM_OK: return "ok";
+    case ROM_ERROR_OPEN: return "could not open file";
+    case ROM_ERROR_MAP: return "could not map file";
+    case ROM_ERROR_TOO_SMALL: return "file is smaller than an iNES header";
+    case ROM_ERROR_BAD_MAGIC: return "not an iNES file";
+    case ROM_ERROR_TRUNCATED: return "file is shorter than its header says";
+    case ROM_ERROR_NO_PRG: return "header declares no PRG ROM";
+    case ROM_ERROR_UNSUPPORTED_MAPPER: return "mapper is not supported";
+    }
+    return "unknown error";
+}
+
+static const uchar* rom_bank(const uchar* base, size_t size, size_t bank_size, int bank)
+{
+    if (base == NULL || bank_size == 0) return NULL;
+    int count = (int)(size / bank_size);
+    if (count == 0) return base;
+    bank = bank % count;
+    if (bank < 0) bank = bank + count;
+    return base + (size_t)bank * bank_size;
+}
+
+const uchar* rom_prg_bank(const ROM* rom, size_t bank_size, int bank)
+{
+    return rom_bank(rom->prg, rom->prg_size, bank_size, bank);
+}
+
+const uchar* rom_chr_bank(const ROM* rom, size_t bank_size, int bank)
+{
+    return rom_bank(rom->chr, rom->chr_size, bank_size, bank);
+}
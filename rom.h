@@ -0,0 +1,93 @@
+#ifndef ROM_H_
+#define ROM_H_
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define uchar unsigned char
+#define ushort unsigned short
+#define ROM_HEADER_SIZE 16
+#define ROM_TRAINER_SIZE 512
+#define ROM_PRG_BANK_SIZE 0x4000
+#define ROM_CHR_BANK_SIZE 0x2000
+
+typedef enum {
+    ROM_OK,
+    ROM_ERROR_OPEN,
+    ROM_ERROR_MAP,
+    ROM_ERROR_TOO_SMALL,
+    ROM_ERROR_BAD_MAGIC,
+    ROM_ERROR_TRUNCATED,
+    ROM_ERROR_NO_PRG,
+    ROM_ERROR_UNSUPPORTED_MAPPER
+} ROM_ERROR;
+
+typedef enum {
+    ROM_FORMAT_INES,
+    ROM_FORMAT_NES2
+} ROM_FORMAT;
+
+typedef enum {
+    ROM_MIRROR_HORIZONTAL,
+    ROM_MIRROR_VERTICAL,
+    ROM_MIRROR_FOUR_SCREEN,
+    ROM_MIRROR_SINGLE_LOWER,   // only selected at run time by mappers
+    ROM_MIRROR_SINGLE_UPPER
+} ROM_MIRRORING;
+
+typedef enum {
+    ROM_TIMING_NTSC,
+    ROM_TIMING_PAL,
+    ROM_TIMING_MULTI,
+    ROM_TIMING_DENDY
+} ROM_TIMING;
+
+// A parsed cartridge image. prg, chr and trainer point into `data` and
+// are never copied; when the ROM came from rom_open, `data` is a read-only
+// mapping of the file, so every process loading the same file shares its
+// page cache. chr is NULL for boards with CHR RAM.
+typedef struct ROM {
+    const uchar* data;
+    size_t size;
+    bool mapped;         // data is an mmap owned by the ROM
+
+    ROM_FORMAT format;
+    ushort mapper;
+    uchar submapper;
+    ROM_MIRRORING mirroring;
+    ROM_TIMING timing;
+    bool battery;
+
+    const uchar* trainer;
+    const uchar* prg;
+    size_t prg_size;
+    const uchar* chr;
+    size_t chr_size;
+
+    // Sizes of the work and CHR RAM the board has. NES 2.0 states them;
+    // for iNES they are the customary defaults.
+    size_t prg_ram_size;
+    size_t prg_nvram_size;
+    size_t chr_ram_size;
+    size_t chr_nvram_size;
+} ROM;
+
+// Maps a .nes file read-only and parses it in place.
+ROM_ERROR rom_open(const char* path, ROM* rom);
+
+// Parses an image already in memory. The views point into `data`, which
+// must outlive the ROM.
+ROM_ERROR rom_parse(const uchar* data, size_t size, ROM* rom);
+
+void rom_close(ROM* rom);
+
+const char* rom_error_string(ROM_ERROR error);
+
+// The bank_size sized bank `bank` of PRG/CHR ROM, wrapping around the
+// image as the address lines of a smaller chip would.
+const uchar* rom_prg_bank(const ROM* rom, size_t bank_size, int bank);
+
+const uchar* rom_chr_bank(const ROM* rom, size_t bank_size, int bank);
+
+#endif // ROM_H_
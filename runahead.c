@@ -0,0 +1,92 @@
+#include "runahead.h"
+#include <string.h>
+
+RUNAHEAD* runahead_create(NES* nes, int frames, bool second_instance)
+{
+    if (frames < 0) return NULL;
+    RUNAHEAD* runahead = malloc(sizeof(RUNAHEAD));
+    if (runahead == NULL) return NULL;
+    memset(runahead, 0, sizeof(RUNAHEAD));
+    runahead->nes = nes;
+    runahead->frames = frames;
+    runahead->state = savestate_create();
+    if (runahead->state == NULL) {
+	runahead_destroy(runahead);
+	return NULL;
+    }
+    if (second_instance && frames > 0) {
+	runahead->shadow = nes_create(nes->rom.data, nes->rom.size, NULL);
+	if (runahead->shadow == NULL || !nes_set_idle_skip(runahead->shadow, nes->idle != NULL)) {
+	    runahead_destroy(runahead);
+	    return NULL;
+	}
+    }
+    return runahead;
+}
+
+void runahead_destroy(RUNAHEAD* runahead)
+{
+    if (runahead == NULL) return;
+    nes_destroy(runahead->shadow);
+    savestate_destroy(runahead->state);
+    free(runahead);
+}
+
+// Look-ahead frames are silent; nes_run_frame flushes the APU at the end of
+// each, so their samples go nowhere.
+static void runahead_run_silent(RUNAHEAD* runahead, NES* nes, int frames)
+{
+    AUDIO_SINK* sink = nes->apu.sink;
+    nes->apu.sink = NULL;
+    for (int i = 0; i < frames && nes_run_frame(nes); i++) runahead->frames_run = runahead->frames_run + 1;
+    nes->apu.sink = sink;
+}
+
+static bool runahead_single(RUNAHEAD* runahead)
+{
+    NES* nes = runahead->nes;
+    if (!nes_save_state(nes, runahead->state)) return false;
+    runahead_run_silent(runahead, nes, runahead->frames);
+    runahead->states_loaded = runahead->states_loaded + 1;
+    return nes_load_state(nes, runahead->state);
+}
+
+static bool runahead_second_instance(RUNAHEAD* runahead, const uchar buttons[2])
+{
+    NES* shadow = runahead->shadow;
+    int frames = 1;
+    if (!runahead->synced || memcmp(runahead->predicted, buttons, sizeof(runahead->predicted)) != 0) {
+	runahead->synced = false;
+	if (!nes_save_state(runahead->nes, runahead->state) || !nes_load_state(shadow, runahead->state)) return false;
+	runahead->states_loaded = runahead->states_loaded + 1;
+	memcpy(runahead->predicted, buttons, sizeof(runahead->predicted));
+	runahead->synced = true;
+	frames = runahead->frames;
+    }
+    nes_set_buttons(shadow, 0, buttons[0]);
+    nes_set_buttons(shadow, 1, buttons[1]);
+    runahead_run_silent(runahead, shadow, frames);
+    return true;
+}
+
+bool runahead_frame(RUNAHEAD* runahead, const uchar buttons[2])
+{
+    NES* nes = runahead->nes;
+    nes_set_buttons(nes, 0, buttons[0]);
+    nes_set_buttons(nes, 1, buttons[1]);
+    if (!nes_run_frame(nes)) return false;
+    runahead->frames_run = runahead->frames_run + 1;
+    if (runahead->frames == 0) return true;
+    // If the shadow cannot be synced the real frame is shown instead.
+    if (runahead->shadow != NULL) {
+	runahead_second_instance(runahead, buttons);
+	return true;
+    }
+    return runahead_single(runahead);
+}
+
+const PPU* runahead_view(const RUNAHEAD* runahead)
+{
+    if (runahead->shadow != NULL && runahead->synced) return &runahead->shadow->ppu;
+    return &runahead->nes->ppu;
+}
@@ -0,0 +1,41 @@
+#ifndef RUNAHEAD_H_
+#define RUNAHEAD_H_
+
+#include "nes.h"
+
+// Run-ahead hides the frames a game takes to react to input: every host
+// frame, the console runs one real frame with the input held now, and the
+// frame shown is the one `frames` further on, assuming the input stays
+// held. Only the real frames reach the audio sink.
+//
+// Run on a single console, the real frame is saved and the look-ahead
+// frames are thrown away by loading it back, every host frame. With a
+// second instance, a shadow console stays `frames` ahead of the real one
+// and is only reloaded from it when the input differs from what the
+// shadow ran ahead with; otherwise it just runs one more frame as well.
+typedef struct RUNAHEAD {
+    NES* nes;                // the real console, owned by the caller
+    NES* shadow;             // NULL unless running a second instance
+    int frames;
+    SAVESTATE* state;
+    uchar predicted[2];      // buttons the shadow has run ahead with
+    bool synced;             // the shadow is `frames` ahead of nes
+
+    uint64_t frames_run;     // real and look-ahead
+    uint64_t states_loaded;
+} RUNAHEAD;
+
+// The shadow console is booted from nes->rom, so `nes` must outlive the
+// run-ahead. `frames` of 0 just runs the real console.
+RUNAHEAD* runahead_create(NES* nes, int frames, bool second_instance);
+
+void runahead_destroy(RUNAHEAD* runahead);
+
+// Runs one host frame with `buttons` held on the two controllers. Returns
+// false once the real console has stopped.
+bool runahead_frame(RUNAHEAD* runahead, const uchar buttons[2]);
+
+// The PPU whose framebuffer holds the frame to show.
+const PPU* runahead_view(const RUNAHEAD* runahead);
+
+#endif // RUNAHEAD_H_
@@ -0,0 +1,315 @@
+#include "savestate.h"
+#include "block.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#define SAVESTATE_MAGIC SAVESTATE_TAG('Q', 'N', 'S', 'S')
+#define SAVESTATE_HEADER_SIZE 8
+#define SAVESTATE_REGISTERS_SIZE 16
+
+// Generations are unique across every CPU and state, so a state can only
+// ever match the memory it was taken from.
+static _Atomic uint64_t savestate_generations = 0;
+
+SAVESTATE* savestate_create(void)
+{
+    SAVESTATE* state = malloc(sizeof(SAVESTATE));
+    if (state == NULL) return NULL;
+    memset(state, 0, sizeof(SAVESTATE));
+    state->memory = calloc(1, MEMORY_SIZE);
+    if (state->memory == NULL) {
+	free(state);
+	return NULL;
+    }
+    return state;
+}
+
+void savestate_destroy(SAVESTATE* state)
+{
+    if (state == NULL) return;
+    free(state->memory);
+    free(state->devices);
+    free(state);
+}
+
+static bool savestate_matches(const SAVESTATE* state, const CPU* cpu)
+{
+    return state->cpu == cpu && state->generation != 0 && state->generation == cpu->bus.snapshot;
+}
+
+// Copies the pages in `pages`, or all of them when `pages` is NULL.
+static int savestate_copy_pages(uchar* to, const uchar* from, const uint64_t* pages)
+{
+    if (pages == NULL) {
+	memcpy(to, from, MEMORY_SIZE);
+	return BUS_PAGE_COUNT;
+    }
+    int copied = 0;
+    for (int word = 0; word < BUS_PAGE_COUNT / 64; word++) {
+	uint64_t bits = pages[word];
+	while (bits != 0) {
+	    size_t offset = (size_t)(word * 64 + __builtin_ctzll(bits)) * BUS_PAGE_SIZE;
+	    bits = bits & (bits - 1);
+	    memcpy(to + offset, from + offset, BUS_PAGE_SIZE);
+	    copied = copied + 1;
+	}
+    }
+    return copied;
+}
+
+// Both sides now hold the same memory; writes from here on are tracked
+// against this state.
+static void savestate_bind(SAVESTATE* state, CPU* cpu)
+{
+    state->generation = atomic_fetch_add(&savestate_generations, 1) + 1;
+    state->cpu = cpu;
+    cpu->bus.snapshot = state->generation;
+}
+
+void savestate_capture(SAVESTATE* state, CPU* cpu)
+{
+    SAVESTATE_REGISTERS* registers = &state->registers;
+    registers->reg_a = cpu->reg_a;
+    registers->reg_x = cpu->reg_x;
+    registers->reg_y = cpu->reg_y;
+    registers->reg_sp = cpu->reg_sp;
+    registers->status = cpu_get_status(cpu);
+    registers->pc = cpu->pc;
+    registers->cycles = cpu->cycles;
+    registers->halted = cpu->halted;
+    registers->irq_line = cpu->irq_line;
+
+    uint64_t changed[BUS_PAGE_COUNT / 64];
+    bool incremental = savestate_matches(state, cpu);
+    bus_take_changed(&cpu->bus, changed);
+    state->pages_copied = savestate_copy_pages(state->memory, cpu->memory, incremental ? changed : NULL);
+
+    memset(state->shared, 0, sizeof(state->shared));
+    for (int page = 0; page < BUS_PAGE_COUNT; page++) {
+	if (cpu->bus.page[page].copy_on_write) state->shared[page / 64] |= 1ull << (page % 64);
+    }
+    state->device_size = 0;
+    savestate_bind(state, cpu);
+}
+
+void savestate_restore(SAVESTATE* state, CPU* cpu)
+{
+    // Pages made private here are copied from the shared storage and then
+    // overwritten like any other changed page.
+    for (int page = 0; page < BUS_PAGE_COUNT; page++) {
+	bool shared = (state->shared[page / 64] >> (page % 64)) & 1;
+	bus_set_shared(&cpu->bus, cpu->memory, (uchar)page, shared);
+    }
+    uint64_t changed[BUS_PAGE_COUNT / 64];
+    bool incremental = savestate_matches(state, cpu);
+    bus_take_changed(&cpu->bus, changed);
+    state->pages_copied = savestate_copy_pages(cpu->memory, state->memory, incremental ? changed : NULL);
+    bus_mark_unhashed(&cpu->bus, incremental ? changed : NULL);
+    bus_flush(&cpu->bus);
+    if (cpu->blocks != NULL) block_cache_clear(cpu->blocks);
+
+    const SAVESTATE_REGISTERS* registers = &state->registers;
+    cpu->reg_a = registers->reg_a;
+    cpu->reg_x = registers->reg_x;
+    cpu->reg_y = registers->reg_y;
+    cpu->reg_sp = registers->reg_sp;
+    cpu_set_status(cpu, registers->status);
+    cpu->pc = registers->pc;
+    cpu->cycles = registers->cycles;
+    cpu->halted = registers->halted;
+    cpu->irq_line = registers->irq_line;
+    cpu->deadline = UINT64_MAX;
+    savestate_bind(state, cpu);
+}
+
+// Chunks are padded to 8 bytes, so their data can be read in place.
+#define SAVESTATE_PADDED(size) (((size) + 7) & ~(size_t)7)
+
+bool savestate_put(SAVESTATE* state, uint32_t tag, const void* data, size_t size)
+{
+    size_t needed = state->device_size + 8 + SAVESTATE_PADDED(size);
+    if (needed > state->device_capacity) {
+	size_t capacity = state->device_capacity > 0 ? state->device_capacity : 0x4000;
+	while (capacity < needed) capacity = capacity * 2;
+	uchar* grown = realloc(state->devices, capacity);
+	if (grown == NULL) return false;
+	state->devices = grown;
+	state->device_capacity = capacity;
+    }
+    uchar* at = state->devices + state->device_size;
+    uint32_t length = (uint32_t)size;
+    memcpy(at, &tag, 4);
+    memcpy(at + 4, &length, 4);
+    memcpy(at + 8, data, size);
+    memset(at + 8 + size, 0, SAVESTATE_PADDED(size) - size);
+    state->device_size = needed;
+    return true;
+}
+
+const void* savestate_find(const SAVESTATE* state, uint32_t tag, size_t size)
+{
+    size_t at = 0;
+    while (at + 8 <= state->device_size) {
+	uint32_t chunk_tag;
+	uint32_t length;
+	memcpy(&chunk_tag, state->devices + at, 4);
+	memcpy(&length, state->devices + at + 4, 4);
+	if (length > state->device_size - at - 8) return NULL;
+	if (chunk_tag == tag) return length == size ? state->devices + at + 8 : NULL;
+	at = at + 8 + SAVESTATE_PADDED(length);
+    }
+    return NULL;
+}
+
+static uchar* savestate_put_le(uchar* at, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++) at[i] = (uchar)(value >> (8 * i));
+    return at + bytes;
+}
+
+static uint64_t savestate_get_le(const uchar* at, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) value = value | (uint64_t)at[i] << (8 * i);
+    return value;
+}
+
+static bool savestate_page_used(const SAVESTATE* state, int page)
+{
+    const uchar* data = state->memory + page * BUS_PAGE_SIZE;
+    for (int i = 0; i < BUS_PAGE_SIZE; i++) {
+	if (data[i] != 0) return true;
+    }
+    return false;
+}
+
+// Layout: magic, version, registers, shared page mask, used page mask, the
+// used pages, device chunk bytes and the chunks as put.
+size_t savestate_write(const SAVESTATE* state, uchar* buffer, size_t capacity)
+{
+    uint64_t used[BUS_PAGE_COUNT / 64] = { 0 };
+    size_t used_count = 0;
+    for (int page = 0; page < BUS_PAGE_COUNT; page++) {
+	if (!savestate_page_used(state, page)) continue;
+	used[page / 64] |= 1ull << (page % 64);
+	used_count = used_count + 1;
+    }
+    size_t size = SAVESTATE_HEADER_SIZE + SAVESTATE_REGISTERS_SIZE + 2 * sizeof(used)
+	+ used_count * BUS_PAGE_SIZE + 8 + state->device_size;
+    if (buffer == NULL || capacity < size) return size;
+
+    const SAVESTATE_REGISTERS* registers = &state->registers;
+    uchar* at = buffer;
+    at = savestate_put_le(at, SAVESTATE_MAGIC, 4);
+    at = savestate_put_le(at, SAVESTATE_VERSION, 4);
+    at = savestate_put_le(at, registers->reg_a, 1);
+    at = savestate_put_le(at, registers->reg_x, 1);
+    at = savestate_put_le(at, registers->reg_y, 1);
+    at = savestate_put_le(at, registers->reg_sp, 1);
+    at = savestate_put_le(at, registers->status, 1);
+    at = savestate_put_le(at, registers->pc, 2);
+    at = savestate_put_le(at, registers->cycles, 8);
+    at = savestate_put_le(at, (uint64_t)registers->halted | (uint64_t)registers->irq_line << 1, 1);
+    for (int i = 0; i < BUS_PAGE_COUNT / 64; i++) at = savestate_put_le(at, state->shared[i], 8);
+    for (int i = 0; i < BUS_PAGE_COUNT / 64; i++) at = savestate_put_le(at, used[i], 8);
+    for (int page = 0; page < BUS_PAGE_COUNT; page++) {
+	if (!((used[page / 64] >> (page % 64)) & 1)) continue;
+	memcpy(at, state->memory + page * BUS_PAGE_SIZE, BUS_PAGE_SIZE);
+	at = at + BUS_PAGE_SIZE;
+    }
+    at = savestate_put_le(at, state->device_size, 8);
+    if (state->device_size > 0) memcpy(at, state->devices, state->device_size);
+    return size;
+}
+
+bool savestate_read(SAVESTATE* state, const uchar* buffer, size_t size)
+{
+    size_t fixed = SAVESTATE_HEADER_SIZE + SAVESTATE_REGISTERS_SIZE + 2 * sizeof(state->shared);
+    if (size < fixed + 8) return false;
+    if (savestate_get_le(buffer, 4) != SAVESTATE_MAGIC) return false;
+    if (savestate_get_le(buffer + 4, 4) != SAVESTATE_VERSION) return false;
+
+    const uchar* at = buffer + SAVESTATE_HEADER_SIZE;
+    SAVESTATE_REGISTERS registers;
+    registers.reg_a = at[0];
+    registers.reg_x = at[1];
+    registers.reg_y = at[2];
+    registers.reg_sp = at[3];
+    registers.status = at[4];
+    registers.pc = (ushort)savestate_get_le(at + 5, 2);
+    registers.cycles = savestate_get_le(at + 7, 8);
+    registers.halted = at[15] & 1;
+    registers.irq_line = (at[15] >> 1) & 1;
+    at = at + SAVESTATE_REGISTERS_SIZE;
+
+    uint64_t shared[BUS_PAGE_COUNT / 64];
+    uint64_t used[BUS_PAGE_COUNT / 64];
+    size_t used_count = 0;
+    for (int i = 0; i < BUS_PAGE_COUNT / 64; i++) shared[i] = savestate_get_le(at + i * 8, 8);
+    at = at + sizeof(shared);
+    for (int i = 0; i < BUS_PAGE_COUNT / 64; i++) {
+	used[i] = savestate_get_le(at + i * 8, 8);
+	used_count = used_count + (size_t)__builtin_popcountll(used[i]);
+    }
+    at = at + sizeof(used);
+    if (size < fixed + used_count * BUS_PAGE_SIZE + 8) return false;
+    const uchar* pages = at;
+    at = at + used_count * BUS_PAGE_SIZE;
+    uint64_t device_size = savestate_get_le(at, 8);
+    at = at + 8;
+    if (device_size > size - (size_t)(at - buffer)) return false;
+
+    // Everything checked out; only now is the state overwritten.
+    state->device_size = 0;
+    if (device_size > 0) {
+	uchar* devices = realloc(state->devices, device_size);
+	if (devices == NULL) return false;
+	state->devices = devices;
+	state->device_capacity = device_size;
+	memcpy(state->devices, at, device_size);
+    }
+    state->device_size = device_size;
+    memset(state->memory, 0, MEMORY_SIZE);
+    for (int page = 0; page < BUS_PAGE_COUNT; page++) {
+	if (!((used[page / 64] >> (page % 64)) & 1)) continue;
+	memcpy(state->memory + page * BUS_PAGE_SIZE, pages, BUS_PAGE_SIZE);
+	pages = pages + BUS_PAGE_SIZE;
+    }
+    memcpy(state->shared, shared, sizeof(shared));
+    state->registers = registers;
+    state->generation = 0;
+    state->cpu = NULL;
+    return true;
+}
+
+bool savestate_save_file(const SAVESTATE* state, const char* path)
+{
+    size_t size = savestate_write(state, NULL, 0);
+    uchar* buffer = malloc(size);
+    if (buffer == NULL) return false;
+    savestate_write(state, buffer, size);
+    FILE* file = fopen(path, "wb");
+    bool saved = file != NULL && fwrite(buffer, 1, size, file) == size;
+    if (file != NULL && fclose(file) != 0) saved = false;
+    free(buffer);
+    return saved;
+}
+
+bool savestate_load_file(SAVESTATE* state, const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return false;
+    bool loaded = false;
+    if (fseek(file, 0, SEEK_END) == 0) {
+	long size = ftell(file);
+	uchar* buffer = size > 0 ? malloc((size_t)size) : NULL;
+	if (buffer != NULL) {
+	    rewind(file);
+	    if (fread(buffer, 1, (size_t)size, file) == (size_t)size) loaded = savestate_read(state, buffer, (size_t)size);
+	    free(buffer);
+	}
+    }
+    fclose(file);
+    return loaded;
+}
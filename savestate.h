@@ -0,0 +1,64 @@
+#ifndef SAVESTATE_H_
+#define SAVESTATE_H_
+
+#include "cpu.h"
+
+#define SAVESTATE_VERSION 1
+#define SAVESTATE_TAG(a, b, c, d) ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
+
+typedef struct SAVESTATE_REGISTERS {
+    uchar reg_a;
+    uchar reg_x;
+    uchar reg_y;
+    uchar reg_sp;
+    uchar status;
+    ushort pc;
+    uint64_t cycles;
+    bool halted;
+    bool irq_line;
+} SAVESTATE_REGISTERS;
+
+// A CPU's registers and memory plus whatever device state its owner adds
+// as tagged chunks. Capturing into the state the CPU was last captured
+// from or restored to only copies the memory pages written since (see
+// BUS.changed); any other capture or restore copies all 64 KB.
+typedef struct SAVESTATE {
+    uint64_t generation;         // matches cpu->bus.snapshot while still incremental
+    const CPU* cpu;
+    SAVESTATE_REGISTERS registers;
+    uint64_t shared[BUS_PAGE_COUNT / 64];  // copy-on-write pages still shared
+    uchar* memory;               // MEMORY_SIZE bytes
+    uchar* devices;              // chunks: tag, size, then the data padded to 8 bytes
+    size_t device_size;
+    size_t device_capacity;
+    int pages_copied;            // by the last capture or restore
+} SAVESTATE;
+
+SAVESTATE* savestate_create(void);
+
+void savestate_destroy(SAVESTATE* state);
+
+// Takes the CPU's registers and memory and empties the device chunks.
+void savestate_capture(SAVESTATE* state, CPU* cpu);
+
+void savestate_restore(SAVESTATE* state, CPU* cpu);
+
+// Device chunks. savestate_find returns the data of the chunk with this tag
+// if it has exactly `size` bytes, NULL otherwise.
+bool savestate_put(SAVESTATE* state, uint32_t tag, const void* data, size_t size);
+
+const void* savestate_find(const SAVESTATE* state, uint32_t tag, size_t size);
+
+// Serialized form: a versioned header, the registers, the non-zero memory
+// pages and the device chunks, all little endian. savestate_write returns
+// the number of bytes it needs, and fills `buffer` when `capacity` is at
+// least that. savestate_read rejects other versions and truncated input.
+size_t savestate_write(const SAVESTATE* state, uchar* buffer, size_t capacity);
+
+bool savestate_read(SAVESTATE* state, const uchar* buffer, size_t size);
+
+bool savestate_save_file(const SAVESTATE* state, const char* path);
+
+bool savestate_load_file(SAVESTATE* state, const char* path);
+
+#endif // SAVESTATE_H_
@@ -0,0 +1,140 @@
+#include "scheduler.h"
+#include <string.h>
+
+// Ties go to the lower event so that dispatch order never depends on the
+// order things were scheduled in.
+static bool scheduler_before(const SCHEDULER_ENTRY* a, const SCHEDULER_ENTRY* b)
+{
+    return a->cycle < b->cycle || (a->cycle == b->cycle && a->event < b->event);
+}
+
+static void scheduler_place(SCHEDULER* scheduler, int index, SCHEDULER_ENTRY entry)
+{
+    scheduler->heap[index] = entry;
+    scheduler->position[entry.event] = index;
+}
+
+static void scheduler_sift_up(SCHEDULER* scheduler, int index)
+{
+    SCHEDULER_ENTRY entry = scheduler->heap[index];
+    while (index > 0) {
+	int parent = (index - 1) / 2;
+	if (!scheduler_before(&entry, &scheduler->heap[parent])) break;
+	scheduler_place(scheduler, index, scheduler->heap[parent]);
+	index = parent;
+    }
+    scheduler_place(scheduler, index, entry);
+}
+
+static void scheduler_sift_down(SCHEDULER* scheduler, int index)
+{
+    SCHEDULER_ENTRY entry = scheduler->heap[index];
+    while (1) {
+	int child = index * 2 + 1;
+	if (child >= scheduler->count) break;
+	if (child + 1 < scheduler->count && scheduler_before(&scheduler->heap[child + 1], &scheduler->heap[child])) {
+	    child = child + 1;
+	}
+	if (!scheduler_before(&scheduler->heap[child], &entry)) break;
+	scheduler_place(scheduler, index, scheduler->heap[child]);
+	index = child;
+    }
+    scheduler_place(scheduler, index, entry);
+}
+
+static void scheduler_remove_at(SCHEDULER* scheduler, int index)
+{
+    scheduler->position[scheduler->heap[index].event] = -1;
+    scheduler->count = scheduler->count - 1;
+    if (index == scheduler->count) return;
+    SCHEDULER_EVENT moved = scheduler->heap[scheduler->count].event;
+    scheduler_place(scheduler, index, scheduler->heap[scheduler->count]);
+    scheduler_sift_up(scheduler, index);
+    scheduler_sift_down(scheduler, scheduler->position[moved]);
+}
+
+void scheduler_init(SCHEDULER* scheduler, CPU* cpu)
+{
+    memset(scheduler, 0, sizeof(SCHEDULER));
+    scheduler->cpu = cpu;
+    for (int i = 0; i < SCHEDULER_EVENT_COUNT; i++) scheduler->position[i] = -1;
+    cpu->scheduler = scheduler;
+}
+
+void scheduler_set_handler(SCHEDULER* scheduler, SCHEDULER_EVENT event, SCHEDULER_HANDLER handler, void* ctx)
+{
+    scheduler->handler[event] = handler;
+    scheduler->ctx[event] = ctx;
+}
+
+void scheduler_schedule(SCHEDULER* scheduler, SCHEDULER_EVENT event, uint64_t cycle)
+{
+    int index = scheduler->position[event];
+    if (index < 0) {
+	index = scheduler->count;
+	scheduler->count = scheduler->count + 1;
+    }
+    scheduler_place(scheduler, index, (SCHEDULER_ENTRY){ .cycle = cycle, .event = event });
+    scheduler_sift_up(scheduler, index);
+    scheduler_sift_down(scheduler, scheduler->position[event]);
+    if (cycle < scheduler->cpu->deadline) scheduler->cpu->deadline = cycle;
+}
+
+void scheduler_cancel(SCHEDULER* scheduler, SCHEDULER_EVENT event)
+{
+    int index = scheduler->position[event];
+    if (index >= 0) scheduler_remove_at(scheduler, index);
+}
+
+bool scheduler_pending(SCHEDULER* scheduler, SCHEDULER_EVENT event)
+{
+    return scheduler->position[event] >= 0;
+}
+
+uint64_t scheduler_next(SCHEDULER* scheduler)
+{
+    return scheduler->count > 0 ? scheduler->heap[0].cycle : UINT64_MAX;
+}
+
+void scheduler_dispatch(SCHEDULER* scheduler, uint64_t now)
+{
+    while (scheduler->count > 0 && scheduler->heap[0].cycle <= now) {
+	SCHEDULER_ENTRY entry = scheduler->heap[0];
+	scheduler_remove_at(scheduler, 0);
+	scheduler->dispatched = scheduler->dispatched + 1;
+	if (scheduler->handler[entry.event] != NULL) {
+	    scheduler->handler[entry.event](scheduler->ctx[entry.event], entry.event, entry.cycle);
+	}
+    }
+}
+
+#define SCHEDULER_STATE SAVESTATE_TAG('S', 'C', 'H', 'D')
+
+typedef struct SCHEDULER_STATE_DATA {
+    SCHEDULER_ENTRY heap[SCHEDULER_EVENT_COUNT];
+    int count;
+    int position[SCHEDULER_EVENT_COUNT];
+    uint64_t dispatched;
+} SCHEDULER_STATE_DATA;
+
+bool scheduler_save_state(SCHEDULER* scheduler, SAVESTATE* state)
+{
+    SCHEDULER_STATE_DATA data;
+    memset(&data, 0, sizeof(data));
+    memcpy(data.heap, scheduler->heap, sizeof(data.heap));
+    data.count = scheduler->count;
+    memcpy(data.position, scheduler->position, sizeof(data.position));
+    data.dispatched = scheduler->dispatched;
+    return savestate_put(state, SCHEDULER_STATE, &data, sizeof(data));
+}
+
+bool scheduler_load_state(SCHEDULER* scheduler, const SAVESTATE* state)
+{
+    const SCHEDULER_STATE_DATA* data = savestate_find(state, SCHEDULER_STATE, sizeof(SCHEDULER_STATE_DATA));
+    if (data == NULL) return false;
+    memcpy(scheduler->heap, data->heap, sizeof(scheduler->heap));
+    scheduler->count = data->count;
+    memcpy(scheduler->position, data->position, sizeof(scheduler->position));
+    scheduler->dispatched = data->dispatched;
+    return true;
+}
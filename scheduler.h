@@ -0,0 +1,61 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include "cpu.h"
+#include "savestate.h"
+
+typedef enum {
+    SCHEDULER_EVENT_NMI,      // vblank NMI
+    SCHEDULER_EVENT_IRQ,      // APU frame counter and DMC IRQs
+    SCHEDULER_EVENT_DMA,      // OAM DMA
+    SCHEDULER_EVENT_MAPPER,   // mapper scanline counter IRQ
+    SCHEDULER_EVENT_COUNT
+} SCHEDULER_EVENT;
+
+typedef void (*SCHEDULER_HANDLER)(void* ctx, SCHEDULER_EVENT event, uint64_t cycle);
+
+typedef struct SCHEDULER_ENTRY {
+    uint64_t cycle;
+    SCHEDULER_EVENT event;
+} SCHEDULER_ENTRY;
+
+// Min-heap of (cycle, event) with at most one pending entry per event, so
+// scheduling an event again moves it instead of adding another. The CPU
+// runs straight to the earliest cycle in the heap; scheduling anything
+// earlier while it runs pulls cpu->deadline in.
+typedef struct SCHEDULER {
+    CPU* cpu;
+    SCHEDULER_ENTRY heap[SCHEDULER_EVENT_COUNT];
+    int count;
+    int position[SCHEDULER_EVENT_COUNT];   // heap index, -1 when not pending
+    SCHEDULER_HANDLER handler[SCHEDULER_EVENT_COUNT];
+    void* ctx[SCHEDULER_EVENT_COUNT];
+    uint64_t dispatched;                   // events run so far
+} SCHEDULER;
+
+// Attaches the scheduler to `cpu`, which then dispatches due events between
+// instructions in cpu_run and cpu_run_for_cycles.
+void scheduler_init(SCHEDULER* scheduler, CPU* cpu);
+
+void scheduler_set_handler(SCHEDULER* scheduler, SCHEDULER_EVENT event, SCHEDULER_HANDLER handler, void* ctx);
+
+// Schedules `event` at `cycle`, replacing its pending entry if it has one.
+void scheduler_schedule(SCHEDULER* scheduler, SCHEDULER_EVENT event, uint64_t cycle);
+
+void scheduler_cancel(SCHEDULER* scheduler, SCHEDULER_EVENT event);
+
+bool scheduler_pending(SCHEDULER* scheduler, SCHEDULER_EVENT event);
+
+// Cycle of the earliest pending event, UINT64_MAX when there is none.
+uint64_t scheduler_next(SCHEDULER* scheduler);
+
+// The pending events; the handlers stay as they are.
+bool scheduler_save_state(SCHEDULER* scheduler, SAVESTATE* state);
+
+bool scheduler_load_state(SCHEDULER* scheduler, const SAVESTATE* state);
+
+// Runs, in cycle order, every event due at or before `now`, including the
+// ones the handlers schedule for no later than `now`.
+void scheduler_dispatch(SCHEDULER* scheduler, uint64_t now);
+
+#endif // SCHEDULER_H_
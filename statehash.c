@@ -0,0 +1,244 @@
+#include "statehash.h"
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && defined(__SSE2__) && !defined(STATEHASH_NO_SIMD)
+#define STATEHASH_SIMD_X86 1
+#include <immintrin.h>
+#else
+#define STATEHASH_SIMD_X86 0
+#endif
+
+/* ---------------------------------------------------------------------- */
+/* Page hash                                                              */
+/* ---------------------------------------------------------------------- */
+
+// A page is eight 32 byte stripes folded into four 64 bit accumulators in
+// the manner of XXH3: each word is XORed with its key, its two halves
+// multiplied together and added to its lane, and the word itself added to
+// the neighbouring lane. A vector does the same lanes at once, so every
+// kernel gives the same result.
+#define STATEHASH_STRIPES (BUS_PAGE_SIZE / 32)
+#define STATEHASH_PRIME 0x9E3779B97F4A7C15ull
+
+static const uint64_t statehash_keys[STATEHASH_STRIPES * 4] = {
+    0xF19DC11DCAF541F6ull, 0xA841731B499CE10Dull, 0xDA0C14F1016231D5ull,
+    0xB564344E8EC526F2ull, 0xC20BC8DB46E94B07ull, 0x3F6658A569D30259ull,
+    0xA51B7E95F23FBE1Dull, 0x2CFC5A64F5A38608ull, 0xD042993407658B1Aull,
+    0xB28E9326ECBA2127ull, 0xFD058157D5F41F3Eull, 0x7ED8D2797F0A238Aull,
+    0xD4B68FF2938A0C08ull, 0xBD9E166D1E864185ull, 0xA43F56C0F74595AAull,
+    0x0ECDED665ECA0E91ull, 0x809A32A858229D49ull, 0x220FBF2FC3CC4696ull,
+    0x68572C89F3A40D63ull, 0x65FF1C6FA6A6ED04ull, 0xBE343E4FBA9E36D8ull,
+    0x4E14220784C14DC7ull, 0x06C06F1261AFD6AEull, 0xF1E9F2633E2C83F7ull,
+    0x59523E5AD634DAC4ull, 0x12FF0E8C2740545Cull, 0x70B192A26FD71D2Full,
+    0xC077D8FC92E73275ull, 0xE7A303DD7DA056EFull, 0x4B478432052AF34Bull,
+    0xB7389F12ADEB7C6Aull, 0x795AB7A49361065Bull
+};
+
+static const uint64_t statehash_seeds[4] = {
+    0x4A42AA05C1FB6357ull, 0xFA1EA6CC1B4CE466ull, 0x8754581F0BEB05C1ull, 0x28A461C0A2548E4Full
+};
+
+static uint64_t statehash_avalanche(uint64_t h)
+{
+    h = h ^ h >> 33;
+    h = h * 0xFF51AFD7ED558CCDull;
+    h = h ^ h >> 33;
+    h = h * 0xC4CEB9FE1A85EC53ull;
+    return h ^ h >> 33;
+}
+
+static uint64_t statehash_finish(const uint64_t* acc)
+{
+    uint64_t h = BUS_PAGE_SIZE * STATEHASH_PRIME;
+    for (int i = 0; i < 4; i++) h = (h ^ statehash_avalanche(acc[i])) * STATEHASH_PRIME;
+    return statehash_avalanche(h);
+}
+
+// Words are read little endian, as every target so far is.
+uint64_t statehash_page(const uchar* page)
+{
+    uint64_t acc[4];
+    memcpy(acc, statehash_seeds, sizeof(acc));
+    for (int stripe = 0; stripe < STATEHASH_STRIPES; stripe++) {
+	for (int i = 0; i < 4; i++) {
+	    uint64_t word;
+	    memcpy(&word, page + stripe * 32 + i * 8, 8);
+	    uint64_t keyed = word ^ statehash_keys[stripe * 4 + i];
+	    acc[i ^ 1] = acc[i ^ 1] + word;
+	    acc[i] = acc[i] + (keyed & 0xFFFFFFFF) * (keyed >> 32);
+	}
+    }
+    return statehash_finish(acc);
+}
+
+#if STATEHASH_SIMD_X86
+
+static inline __attribute__((always_inline)) __m128i statehash_sse2_lanes(__m128i acc, __m128i word, __m128i key)
+{
+    __m128i keyed = _mm_xor_si128(word, key);
+    __m128i product = _mm_mul_epu32(keyed, _mm_srli_epi64(keyed, 32));
+    __m128i swapped = _mm_shuffle_epi32(word, _MM_SHUFFLE(1, 0, 3, 2));
+    return _mm_add_epi64(acc, _mm_add_epi64(product, swapped));
+}
+
+static uint64_t statehash_page_sse2(const uchar* page)
+{
+    __m128i low = _mm_loadu_si128((const __m128i*)statehash_seeds);
+    __m128i high = _mm_loadu_si128((const __m128i*)(statehash_seeds + 2));
+    for (int stripe = 0; stripe < STATEHASH_STRIPES; stripe++) {
+	const __m128i* words = (const __m128i*)(page + stripe * 32);
+	const __m128i* keys = (const __m128i*)(statehash_keys + stripe * 4);
+	low = statehash_sse2_lanes(low, _mm_loadu_si128(words), _mm_loadu_si128(keys));
+	high = statehash_sse2_lanes(high, _mm_loadu_si128(words + 1), _mm_loadu_si128(keys + 1));
+    }
+    uint64_t acc[4];
+    _mm_storeu_si128((__m128i*)acc, low);
+    _mm_storeu_si128((__m128i*)(acc + 2), high);
+    return statehash_finish(acc);
+}
+
+__attribute__((target("avx2")))
+static uint64_t statehash_page_avx2(const uchar* page)
+{
+    __m256i acc = _mm256_loadu_si256((const __m256i*)statehash_seeds);
+    for (int stripe = 0; stripe < STATEHASH_STRIPES; stripe++) {
+	__m256i word = _mm256_loadu_si256((const __m256i*)(page + stripe * 32));
+	__m256i keyed = _mm256_xor_si256(word, _mm256_loadu_si256((const __m256i*)(statehash_keys + stripe * 4)));
+	__m256i product = _mm256_mul_epu32(keyed, _mm256_srli_epi64(keyed, 32));
+	__m256i swapped = _mm256_shuffle_epi32(word, _MM_SHUFFLE(1, 0, 3, 2));
+	acc = _mm256_add_epi64(acc, _mm256_add_epi64(product, swapped));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    return statehash_finish(lanes);
+}
+
+static bool statehash_has_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+static STATEHASH_PAGE_HASH statehash_get_kernel(STATEHASH_KERNEL kernel)
+{
+    switch (kernel) {
+    case STATEHASH_KERNEL_SCALAR: return statehash_page;
+#if STATEHASH_SIMD_X86
+    case STATEHASH_KERNEL_SSE2: return statehash_page_sse2;
+    case STATEHASH_KERNEL_AVX2: return statehash_has_avx2() ? statehash_page_avx2 : NULL;
+    case STATEHASH_KERNEL_AUTO: return statehash_has_avx2() ? statehash_page_avx2 : statehash_page_sse2;
+#else
+    case STATEHASH_KERNEL_AUTO: return statehash_page;
+#endif
+    default: return NULL;
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+/* Digest                                                                 */
+/* ---------------------------------------------------------------------- */
+
+void statehash_init(STATEHASH* hash)
+{
+    memset(hash, 0, sizeof(STATEHASH));
+    hash->page_hash = statehash_get_kernel(STATEHASH_KERNEL_AUTO);
+}
+
+bool statehash_set_kernel(STATEHASH* hash, STATEHASH_KERNEL kernel)
+{
+    STATEHASH_PAGE_HASH page_hash = statehash_get_kernel(kernel);
+    if (page_hash == NULL) return false;
+    hash->page_hash = page_hash;
+    return true;
+}
+
+static uint64_t statehash_mix(uint64_t h, uint64_t value)
+{
+    return (h ^ statehash_avalanche(value)) * STATEHASH_PRIME;
+}
+
+static uint64_t statehash_registers(CPU* cpu)
+{
+    uint64_t h = 0;
+    h = statehash_mix(h, (uint64_t)cpu->reg_a | (uint64_t)cpu->reg_x << 8 | (uint64_t)cpu->reg_y << 16
+		      | (uint64_t)cpu->reg_sp << 24 | (uint64_t)cpu_get_status(cpu) << 32 | (uint64_t)cpu->pc << 40
+		      | (uint64_t)cpu->halted << 56 | (uint64_t)cpu->irq_line << 57);
+    h = statehash_mix(h, cpu->cycles);
+    uint64_t shared[BUS_PAGE_COUNT / 64] = { 0 };
+    for (int page = 0; page < BUS_PAGE_COUNT; page++) {
+	if (cpu->bus.page[page].copy_on_write) shared[page / 64] |= 1ull << (page % 64);
+    }
+    for (int word = 0; word < BUS_PAGE_COUNT / 64; word++) h = statehash_mix(h, shared[word]);
+    return h;
+}
+
+static uint64_t statehash_term(uint64_t page_hash, int page)
+{
+    return statehash_avalanche(page_hash + (uint64_t)(page + 1) * STATEHASH_PRIME);
+}
+
+uint64_t statehash_update(STATEHASH* hash, CPU* cpu)
+{
+    uint64_t pages[BUS_PAGE_COUNT / 64];
+    bus_take_unhashed(&cpu->bus, pages);
+    if (hash->cpu != cpu) {
+	// Nothing hashed so far describes this CPU.
+	memset(pages, 0xFF, sizeof(pages));
+	memset(hash->pages, 0, sizeof(hash->pages));
+	hash->combined = 0;
+	for (int page = 0; page < BUS_PAGE_COUNT; page++) hash->combined = hash->combined ^ statehash_term(0, page);
+	hash->cpu = cpu;
+    }
+
+    // The pages combine by XOR, each mixed with its number, so a page that
+    // changes swaps its old term for the new one.
+    int hashed = 0;
+    for (int word = 0; word < BUS_PAGE_COUNT / 64; word++) {
+	uint64_t bits = pages[word];
+	while (bits != 0) {
+	    int page = word * 64 + __builtin_ctzll(bits);
+	    bits = bits & (bits - 1);
+	    uint64_t page_hash = hash->page_hash(cpu->memory + page * BUS_PAGE_SIZE);
+	    hash->combined = hash->combined ^ statehash_term(hash->pages[page], page) ^ statehash_term(page_hash, page);
+	    hash->pages[page] = page_hash;
+	    hashed = hashed + 1;
+	}
+    }
+    hash->pages_hashed = hashed;
+
+    hash->registers = statehash_registers(cpu);
+    hash->root = statehash_avalanche(statehash_mix(hash->registers, hash->combined));
+    return hash->root;
+}
+
+int statehash_first_difference(const STATEHASH* a, const STATEHASH* b)
+{
+    if (a->root == b->root) return -1;
+    for (int page = 0; page < BUS_PAGE_COUNT; page++) {
+	if (a->pages[page] != b->pages[page]) return page;
+    }
+    return BUS_PAGE_COUNT;
+}
+
+void statehash_checker_init(STATEHASH_CHECKER* checker)
+{
+    memset(checker, 0, sizeof(STATEHASH_CHECKER));
+    statehash_init(&checker->a);
+    statehash_init(&checker->b);
+    checker->diverged_page = -1;
+}
+
+bool statehash_check(STATEHASH_CHECKER* checker, CPU* a, CPU* b)
+{
+    statehash_update(&checker->a, a);
+    statehash_update(&checker->b, b);
+    int page = statehash_first_difference(&checker->a, &checker->b);
+    if (page >= 0 && !checker->diverged) {
+	checker->diverged = true;
+	checker->diverged_frame = checker->frame;
+	checker->diverged_page = page;
+    }
+    checker->frame = checker->frame + 1;
+    return !checker->diverged;
+}
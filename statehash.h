@@ -0,0 +1,65 @@
+#ifndef STATEHASH_H_
+#define STATEHASH_H_
+
+#include "cpu.h"
+
+typedef enum {
+    STATEHASH_KERNEL_AUTO,
+    STATEHASH_KERNEL_SCALAR,
+    STATEHASH_KERNEL_SSE2,
+    STATEHASH_KERNEL_AVX2
+} STATEHASH_KERNEL;
+
+typedef uint64_t (*STATEHASH_PAGE_HASH)(const uchar* page);
+
+// A digest of a CPU's registers and memory that is cheap to keep current:
+// each 256 byte storage page has its own hash, redone only for the pages
+// written since the last update (BUS.unhashed), and the root digest
+// combines them with the registers. Every kernel computes the same values,
+// so digests compare across machines and builds. Pages still shared
+// copy-on-write are not hashed; which pages are shared is.
+//
+// A STATEHASH follows one CPU, and nothing else should take that CPU's
+// unhashed bits.
+typedef struct STATEHASH {
+    uint64_t pages[BUS_PAGE_COUNT];
+    uint64_t combined;           // the page hashes folded together
+    uint64_t registers;
+    uint64_t root;
+    const CPU* cpu;              // whose pages are hashed, NULL before the first update
+    STATEHASH_PAGE_HASH page_hash;
+    int pages_hashed;            // by the last update
+} STATEHASH;
+
+void statehash_init(STATEHASH* hash);
+
+// Fails for a kernel this machine cannot run.
+bool statehash_set_kernel(STATEHASH* hash, STATEHASH_KERNEL kernel);
+
+// Brings the page hashes up to date and returns the root digest.
+uint64_t statehash_update(STATEHASH* hash, CPU* cpu);
+
+// The page hash, computed by the scalar kernel.
+uint64_t statehash_page(const uchar* page);
+
+// The first page whose hash differs, BUS_PAGE_COUNT when only the
+// registers do, or -1 when the two digests match.
+int statehash_first_difference(const STATEHASH* a, const STATEHASH* b);
+
+// Runs two instances side by side and finds where they first part.
+typedef struct STATEHASH_CHECKER {
+    STATEHASH a;
+    STATEHASH b;
+    uint64_t frame;              // checks so far
+    bool diverged;
+    uint64_t diverged_frame;     // index of the first check that differed
+    int diverged_page;           // as statehash_first_difference
+} STATEHASH_CHECKER;
+
+void statehash_checker_init(STATEHASH_CHECKER* checker);
+
+// Hashes both CPUs after a frame. Returns false from the first frame on
+// where they differ; the first divergence is kept.
+bool statehash_check(STATEHASH_CHECKER* checker, CPU* a, CPU* b);
+
+#endif // STATEHASH_H_
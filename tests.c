@@ -1,5 +1,29 @@
 #include "tests.h"
 #include "cpu.h"
+#include "block.h"
+#include "scheduler.h"
+#include "idle.h"
+#include "trace.h"
+#include "profile.h"
+#include "rom.h"
+#include "mapper.h"
+#include "ppu.h"
+#include "apu.h"
+#include "audio.h"
+#include "nes.h"
+#include "pool.h"
+#include "arena.h"
+#include "savestate.h"
+#include "rewind.h"
+#include "runahead.h"
+#include "lockstep.h"
+#include "fuzz.h"
+#include "conform.h"
+#include "statehash.h"
+#include "cdl.h"
+#include "cfg.h"
+#include <stddef.h>
+#include <string.h>
 #include <assert.h>
 #include <stdio.h>
 
@@ -11,6 +35,7 @@ void test_0xa9_lda_immediate_load_data()
     assert(cpu.reg_a == 0x05);
     assert((cpu.status & 0b00000010) == 0); // Zero
     assert((cpu.status & 0b10000000) == 0); // Negative
+    cpu_free_memory(&cpu);
     printf("PASSED: test_0xa9_lda_immediate_load_data\n");   
 }
 
@@ -20,6 +45,7 @@ void test_0xa9_lda_zero_flag()
     uchar program2[3] = {0xa9, 0x00, 0x00};
     cpu_load_and_run(&cpu2, program2, 3);
     assert((cpu2.status & 0b00000010) == 0b10); // Zero
+    cpu_free_memory(&cpu2);
     printf("PASSED: test_0xa9_lda_zero_flag\n");   
 }
 
@@ -29,6 +55,7 @@ void test_5ops_working_together()
     uchar program[5] = {0xA9, 0xC0, 0xAA, 0xE8, 0x00};
     cpu_load_and_run(&cpu, program, 5);    
     assert(cpu.reg_x == 0xC1);
+    cpu_free_memory(&cpu);
     printf("PASSED: test_5ops_working_together\n");
 }
 
@@ -38,6 +65,7 @@ void test_lda_from_memory() {
     uchar program[3] = {0xA5, 0x10, 0x00};
     cpu_load_and_run(&cpu, program, 3);
     assert(cpu.reg_a == 0x55);
+    cpu_free_memory(&cpu);
     printf("PASSED: test_lda_from_memory\n");
 }
 
@@ -49,6 +77,7 @@ void test_0x29_and_immediate()
     assert(cpu.reg_a == 0x04);
     assert((cpu.status & 0b00000010) == 0);
     assert((cpu.status & 0b10000000) == 0);
+    cpu_free_memory(&cpu);
     printf("PASSED: test_0x29_and_immediate\n");
 }
 
@@ -61,6 +90,7 @@ void test_0x69_adc_immediate()
     assert((cpu.status & 0b00000010) == 0); // Zero
     assert((cpu.status & 0b10000000) == 0); // Negative
     assert((cpu.status & 0b00000001) == 0); // Carry
+    cpu_free_memory(&cpu);
     printf("PASSED: test_0x69_adc_immediate\n");
 }
 
@@ -70,10 +100,11 @@ void test_0x69_adc_immediate_carry_overflow()
     uchar program[5] = {0xA9, 0xFF, 0x69, 0x01, 0x00}; // 256 + 1
     cpu_load_and_run(&cpu, program, 5);
     assert(cpu.reg_a == 0x00); // 0
-    assert((cpu.status & 0b00000010) == 0); // Zero
-    assert((cpu.status & 0b10000000) != 0); // Negative
+    assert((cpu.status & 0b00000010) != 0); // Zero
+    assert((cpu.status & 0b10000000) == 0); // Negative
 	assert((cpu.status & 0b00000001) != 0); // Carry
     assert((cpu.status & 0b01000000) == 0); // Overflow
+    cpu_free_memory(&cpu);
     printf("PASSED: test_0x69_and_immediate_carry_overflow\n");
 }
 
@@ -87,6 +118,7 @@ void test_0x69_adc_immediate_carry_through()
     assert((cpu.status & 0b10000000) == 0); // Negative
     assert((cpu.status & 0b00000001) == 0); // Carry
     assert((cpu.status & 0b01000000) == 0); // Overflow
+    cpu_free_memory(&cpu);
     printf("PASSED: test_0x69_and_immediate_carry_through\n");
 }
 
@@ -100,6 +132,7 @@ void test_0x0a_asl_accumulator()
     assert((cpu.status & 0b10000000) == 0); // Negative
     assert((cpu.status & 0b00000001) == 0); // Carry
     assert((cpu.status & 0b01000000) == 0); // Overflow
+    cpu_free_memory(&cpu);
     printf("PASSED: test_0x0A_asl_accumulator\n");	
 }
 
@@ -113,9 +146,1514 @@ void test_0x0a_asl_accumulator_carry()
     assert((cpu.status & 0b10000000) == 0); // Negative
     assert((cpu.status & 0b00000001) == 0); // Carry
     assert((cpu.status & 0b01000000) == 0); // Overflow
+    cpu_free_memory(&cpu);
     printf("PASSED: test_0x0A_asl_accumulator_carry\n");	
 }
 
+void test_0x65_adc_zeropage()
+{
+    CPU cpu = make_cpu();
+    cpu_write_memory(&cpu, 0x20, 0x07);
+    uchar program[5] = {0xA9, 0x05, 0x65, 0x20, 0x00}; // 5 + mem[0x20]
+    cpu_load_and_run(&cpu, program, 5);
+    assert(cpu.reg_a == 0x0C);
+    assert(cpu.pc == 0x8005);
+    cpu_free_memory(&cpu);
+    printf("PASSED: test_0x65_adc_zeropage\n");
+}
+
+void test_0x4c_0x6c_jmp()
+{
+    CPU cpu = make_cpu();
+    // JMP $8006; three BRKs; JMP ($02FF) through a pointer split across
+    // $02FF and $0200, not $0300; LDA #$42 at $800A; BRK.
+    uchar program[13] = {0x4C, 0x06, 0x80, 0x00, 0x00, 0x00, 0x6C, 0xFF, 0x02, 0x00, 0xA9, 0x42, 0x00};
+    cpu_write_memory(&cpu, 0x02FF, 0x0A);
+    cpu_write_memory(&cpu, 0x0200, 0x80);
+    cpu_write_memory(&cpu, 0x0300, 0x90);
+    cpu_load_and_run(&cpu, program, 13);
+    assert(cpu.reg_a == 0x42);
+    assert(cpu.pc == 0x800D);
+    assert(cpu.cycles == 7 + 3 + 5 + 2 + 7);
+    cpu_free_memory(&cpu);
+    printf("PASSED: test_0x4c_0x6c_jmp\n");
+}
+
+void test_cycles_page_cross_and_branch()
+{
+    CPU cpu = make_cpu();
+    uchar program[8] = {0xA9, 0x01, 0xAA, 0xBD, 0xFF, 0x80, 0xF0, 0x00}; // LDA $80FF,X crosses into $8100; BEQ +0
+    cpu_load(&cpu, program, 8);
+    cpu_reset(&cpu);
+    assert(cpu_run_for_cycles(&cpu, 5) == 9); // LDA #, TAX, then LDA abs,X with +1 penalty
+    assert(cpu.pc == 0x8006);
+    assert(!cpu.halted);
+    cpu_run(&cpu);
+    assert(cpu.halted);
+    assert(cpu.cycles == 7 + 2 + 2 + 5 + 3 + 7);
+
+    CPU loop = make_cpu();
+    uchar loop_program[4] = {0xE8, 0xD0, 0xFD, 0x00}; // INX; BNE -3
+    cpu_load_and_run(&loop, loop_program, 4);
+    assert(loop.reg_x == 0);
+    assert(loop.pc == 0x8004);
+    assert(loop.cycles == 7 + 256 * 2 + 255 * 3 + 2 + 7);
+    cpu_free_memory(&cpu);
+    cpu_free_memory(&loop);
+    printf("PASSED: test_cycles_page_cross_and_branch\n");
+}
+
+static uchar test_io_register = 0;
+
+static uchar test_io_read(void* ctx, ushort addr)
+{
+    int* accesses = ctx;
+    *accesses = *accesses + 1;
+    return (uchar)(addr & 0x07) | test_io_register;
+}
+
+static void test_io_write(void* ctx, ushort addr, uchar data)
+{
+    int* accesses = ctx;
+    *accesses = *accesses + 1;
+    (void)addr;
+    test_io_register = data;
+}
+
+void test_bus_mirrors_and_io()
+{
+    CPU cpu = make_cpu();
+    int accesses = 0;
+    uchar rom[BUS_PAGE_SIZE] = {0x42};
+    bus_mirror_nes_ram(&cpu.bus);
+    bus_map_io(&cpu.bus, 0x20, 0x20, test_io_read, test_io_write, &accesses);
+    bus_map_host(&cpu.bus, 0xC0, 1, rom, true);
+
+    cpu_write_memory(&cpu, 0x0001, 0x99);
+    assert(cpu_read_memory(&cpu, 0x1801) == 0x99); // RAM mirror
+    cpu_write_memory(&cpu, 0x2000, 0x10);
+    assert(cpu_read_memory(&cpu, 0x3FFA) == 0x12); // register $2002 mirror
+    assert(accesses == 2);
+    cpu_write_memory(&cpu, 0xC000, 0x00);
+    assert(cpu_read_memory(&cpu, 0xC000) == 0x42); // ROM ignores writes
+    cpu_write_memory(&cpu, 0xFFFF, 0x81);
+    assert(cpu_read_memory_ushort(&cpu, 0xFFFE) == 0x8100); // last byte of the IRQ vector
+    cpu_free_memory(&cpu);
+    printf("PASSED: test_bus_mirrors_and_io\n");
+}
+
+void test_block_cache_matches_interpreter()
+{
+    uchar program[11] = {0xE8, 0x69, 0x01, 0x29, 0x7F, 0xD0, 0xF9, 0xC8, 0xD0, 0xF6, 0x00};
+    CPU plain = make_cpu();
+    cpu_load_and_run(&plain, program, 11);
+
+    CPU cached = make_cpu();
+    cached.blocks = block_cache_create();
+    cpu_load_and_run(&cached, program, 11);
+    assert(cached.reg_a == plain.reg_a);
+    assert(cached.reg_x == plain.reg_x);
+    assert(cached.reg_y == plain.reg_y);
+    assert(cached.status == plain.status);
+    assert(cached.pc == plain.pc);
+    assert(cached.cycles == plain.cycles);
+    assert(cached.blocks->hits > 1000);
+    assert(cached.blocks->invalidations == 0);
+    block_cache_destroy(cached.blocks);
+    cpu_free_memory(&plain);
+    cpu_free_memory(&cached);
+    printf("PASSED: test_block_cache_matches_interpreter\n");
+}
+
+void test_block_cache_self_modifying_code()
+{
+    CPU cpu = make_cpu();
+    cpu.blocks = block_cache_create();
+    uchar program[6] = {0x0E, 0x04, 0x80, 0xA9, 0x01, 0x00}; // ASL $8004 doubles the LDA operand
+    cpu_load_and_run(&cpu, program, 6);
+    assert(cpu.reg_a == 0x02);
+    assert(cpu.blocks->invalidations == 1);
+
+    cpu_write_memory(&cpu, 0x8004, 0x10);
+    cpu_reset(&cpu);
+    cpu_run(&cpu);
+    assert(cpu.reg_a == 0x20);
+    block_cache_destroy(cpu.blocks);
+    cpu_free_memory(&cpu);
+    printf("PASSED: test_block_cache_self_modifying_code\n");
+}
+
+void test_block_cache_code_patched_through_mirror()
+{
+    CPU cpu = make_cpu();
+    bus_mirror_nes_ram(&cpu.bus);
+    cpu.blocks = block_cache_create();
+    cpu_write_memory(&cpu, 0x10, 0x11);
+    cpu_write_memory(&cpu, 0x20, 0x22);
+    cpu_write_memory(&cpu, 0x0B05, 0x00); // fills the write cache of the mirror
+    uchar code[3] = {0xA5, 0x10, 0x00};   // LDA $10; BRK at $0300
+    for (int i = 0; i < 3; i++) cpu_write_memory(&cpu, 0x0300 + i, code[i]);
+    cpu_reset(&cpu);
+    cpu.pc = 0x0300;
+    cpu_run(&cpu);
+    assert(cpu.reg_a == 0x11);
+
+    // $0B01 is $0301 through the third mirror.
+    cpu_write_memory(&cpu, 0x0B01, 0x20);
+    assert(cpu_peek_memory(&cpu, 0x0301) == 0x20);
+    cpu.pc = 0x0300;
+    cpu.halted = false;
+    cpu_run(&cpu);
+    assert(cpu.reg_a == 0x22);
+    assert(cpu.blocks->invalidations == 1);
+
+    // And through the page the code itself runs from.
+    cpu_write_memory(&cpu, 0x0301, 0x10);
+    cpu.pc = 0x0300;
+    cpu.halted = false;
+    cpu_run(&cpu);
+    assert(cpu.reg_a == 0x11);
+    block_cache_destroy(cpu.blocks);
+    cpu_free_memory(&cpu);
+    printf("PASSED: test_block_cache_code_patched_through_mirror\n");
+}
+
+void test_lazy_flags_status_is_exact()
+{
+    CPU cpu = make_cpu();
+    cpu_write_memory(&cpu, 0x10, 0xC0);
+    uchar program[5] = {0xA9, 0x01, 0x24, 0x10, 0x00}; // LDA #1; BIT $10
+    cpu_load_and_run(&cpu, program, 5);
+    assert((cpu.status & 0b11000010) == 0b11000010); // N, V and Z all set
+    assert(cpu_get_status(&cpu) == cpu.status);
+
+    CPU host = make_cpu();
+    uchar branch[5] = {0xF0, 0x02, 0xA9, 0x05, 0x00}; // BEQ over LDA #5
+    cpu_load(&host, branch, 5);
+    cpu_reset(&host);
+    host.status = host.status | FLAG_ZERO; // poked directly by the host
+    cpu_run(&host);
+    assert(host.reg_a == 0x00);
+    assert((host.status & FLAG_ZERO) != 0);
+    cpu_free_memory(&cpu);
+    cpu_free_memory(&host);
+    printf("PASSED: test_lazy_flags_status_is_exact\n");
+}
+
+#if CPU_TRACE
+void test_tracer_nestest_export()
+{
+    const char* path = "/tmp/quick_nes_test_trace.bin";
+    CPU cpu = make_cpu();
+    cpu.tracer = tracer_open_file(path, 3); // rounds up to 4 records
+    uchar program[5] = {0xA9, 0xC0, 0xAA, 0xE8, 0x00};
+    cpu_load_and_run(&cpu, program, 5);
+    assert(cpu.tracer->head == 4);
+    assert(cpu.tracer->records[0].pc == 0x8000);
+    assert(cpu.tracer->records[3].bytes[0] == 0x00);
+    assert(cpu.tracer->records[3].reg_x == 0xC1);
+    tracer_destroy(cpu.tracer);
+
+    FILE* log = tmpfile();
+    assert(trace_export_log(path, log, true));
+    rewind(log);
+    char line[128];
+    assert(fgets(line, sizeof(line), log) != NULL);
+    assert(strcmp(line, "8000  A9 C0     LDA #$C0                        A:00 X:00 Y:00 P:20 SP:FD PPU:  0, 21 CYC:7\n") == 0);
+    assert(fgets(line, sizeof(line), log) != NULL);
+    assert(strcmp(line, "8002  AA        TAX                             A:C0 X:00 Y:00 P:A0 SP:FD PPU:  0, 27 CYC:9\n") == 0);
+    fclose(log);
+    remove(path);
+    cpu_free_memory(&cpu);
+    printf("PASSED: test_tracer_nestest_export\n");
+}
+#endif
+
+#if CPU_PROFILE
+void test_profiler_counts_and_collapsed_stacks()
+{
+    CPU cpu = make_cpu();
+    // JSR $8007; JSR $8007; BRK; $8007: INX; RTS
+    uchar program[9] = {0x20, 0x07, 0x80, 0x20, 0x07, 0x80, 0x00, 0xe8, 0x60};
+    cpu.profiler = profiler_create(1);
+    cpu_load_and_run(&cpu, program, 9);
+    assert(cpu.reg_x == 2);
+    assert(cpu.reg_sp == 0xFD);
+
+    PROFILER* profiler = cpu.profiler;
+    assert(profiler->instructions == 7);
+    assert(profiler->opcode_count[0x20] == 2);
+    assert(profiler->opcode_cycles[0x20] == 12);
+    assert(profiler->opcode_cycles[0x60] == 12);
+    assert(profiler->opcode_cycles[0x00] == 7);
+    assert(profiler->mode_count[ADDRESS_ABSOLUTE] == 2);
+    assert(profiler->pc_count[0x8007] == 2);
+    assert(profiler->pc_cycles[0x8007] == 4);
+
+    FILE* out = tmpfile();
+    profiler_write_collapsed(profiler, out);
+    rewind(out);
+    char line[64];
+    assert(fgets(line, sizeof(line), out) != NULL);
+    assert(strcmp(line, "$8000 19\n") == 0);
+    assert(fgets(line, sizeof(line), out) != NULL);
+    assert(strcmp(line, "$8000;$8007 16\n") == 0);
+    fclose(out);
+    profiler_destroy(profiler);
+
+    // Sampling every other instruction still follows the call nesting.
+    cpu_recycle(&cpu);
+    cpu.profiler = profiler_create(2);
+    cpu_load_and_run(&cpu, program, 9);
+    assert(cpu.profiler->instructions == 7);
+    assert(cpu.profiler->sampled == 3);
+    assert(cpu.profiler->current == 0);
+    profiler_destroy(cpu.profiler);
+    cpu_free_memory(&cpu);
+    printf("PASSED: test_profiler_counts_and_collapsed_stacks\n");
+}
+#endif
+
+void test_rom_open_ines_and_nes2()
+{
+    // iNES, mapper 1, vertical, battery, 2 PRG banks, 1 CHR bank.
+    static uchar image[ROM_HEADER_SIZE + 2 * ROM_PRG_BANK_SIZE + ROM_CHR_BANK_SIZE];
+    memset(image, 0, sizeof(image));
+    memcpy(image, "NES\x1a", 4);
+    image[4] = 2;
+    image[5] = 1;
+    image[6] = 0x13;
+    image[ROM_HEADER_SIZE] = 0xA1;
+    image[ROM_HEADER_SIZE + ROM_PRG_BANK_SIZE] = 0xB2;
+    image[ROM_HEADER_SIZE + 2 * ROM_PRG_BANK_SIZE] = 0xC3;
+
+    const char* path = "/tmp/quick_nes_test_rom.nes";
+    FILE* file = fopen(path, "wb");
+    assert(file != NULL);
+    assert(fwrite(image, 1, sizeof(image), file) == sizeof(image));
+    fclose(file);
+
+    ROM rom;
+    assert(rom_open(path, &rom) == ROM_OK);
+    assert(rom.format == ROM_FORMAT_INES);
+    assert(rom.mapper == 1);
+    assert(rom.mirroring == ROM_MIRROR_VERTICAL);
+    assert(rom.battery && rom.prg_nvram_size == 0x2000);
+    assert(rom.prg == rom.data + ROM_HEADER_SIZE);
+    assert(rom.prg_size == 2 * ROM_PRG_BANK_SIZE && rom.chr_size == ROM_CHR_BANK_SIZE);
+    assert(rom_prg_bank(&rom, ROM_PRG_BANK_SIZE, -1)[0] == 0xB2);
+    assert(rom_prg_bank(&rom, ROM_PRG_BANK_SIZE, 2)[0] == 0xA1);
+    assert(rom_chr_bank(&rom, 0x400, 0)[0] == 0xC3);
+    rom_close(&rom);
+    remove(path);
+
+    // NES 2.0, mapper 0x101 submapper 2, CHR RAM, PRG size in exponent form.
+    image[7] = 0x08;
+    image[8] = 0x21;
+    image[4] = (13 << 2) | 1;   // 2^13 * 3 bytes
+    image[5] = 0;
+    image[9] = 0x0F;
+    image[11] = 0x07;
+    assert(rom_parse(image, sizeof(image), &rom) == ROM_OK);
+    assert(rom.format == ROM_FORMAT_NES2);
+    assert(rom.mapper == 0x101 && rom.submapper == 2);
+    assert(rom.prg_size == 3 * 0x2000);
+    assert(rom.chr == NULL && rom.chr_ram_size == 0x2000);
+
+    image[5] = 3;
+    assert(rom_parse(image, sizeof(image), &rom) == ROM_ERROR_TRUNCATED);
+    assert(rom_parse(image, 8, &rom) == ROM_ERROR_TOO_SMALL);
+    printf("PASSED: test_rom_open_ines_and_nes2\n");
+}
+
+// An iNES image whose PRG banks of bank_size start with their own index
+// and whose 1 KB CHR banks start with 0x10 + their index.
+static size_t test_make_cartridge(uchar* image, uchar mapper, int prg_16k, size_t bank_size)
+{
+    size_t size = ROM_HEADER_SIZE + prg_16k * ROM_PRG_BANK_SIZE + ROM_CHR_BANK_SIZE;
+    memset(image, 0, size);
+    memcpy(image, "NES\x1a", 4);
+    image[4] = (uchar)prg_16k;
+    image[5] = 1;
+    image[6] = (uchar)(mapper << 4);
+    for (size_t bank = 0; bank * bank_size < (size_t)prg_16k * ROM_PRG_BANK_SIZE; bank++) {
+	image[ROM_HEADER_SIZE + bank * bank_size] = (uchar)bank;
+    }
+    for (int bank = 0; bank < 8; bank++) {
+	image[ROM_HEADER_SIZE + prg_16k * ROM_PRG_BANK_SIZE + bank * 0x400] = (uchar)(0x10 + bank);
+    }
+    return size;
+}
+
+void test_mapper_mmc1_and_uxrom_bank_switching()
+{
+    static uchar image[ROM_HEADER_SIZE + 4 * ROM_PRG_BANK_SIZE + ROM_CHR_BANK_SIZE];
+    ROM rom;
+    CPU cpu = make_cpu();
+    assert(rom_parse(image, test_make_cartridge(image, 1, 4, 0x4000), &rom) == ROM_OK);
+    MAPPER* mapper = mapper_create(&rom, &cpu);
+    assert(mapper != NULL);
+    assert(cpu_read_memory(&cpu, 0x8000) == 0);
+    assert(cpu_read_memory(&cpu, 0xC000) == 3);
+
+    // Five serial writes of 2 to the PRG register at $E000.
+    uchar value = 2;
+    for (int i = 0; i < 5; i++) cpu_write_memory(&cpu, 0xE000, (value >> i) & 1);
+    assert(cpu_read_memory(&cpu, 0x8000) == 2);
+    assert(cpu_read_memory(&cpu, 0xC000) == 3);
+    assert(cpu.bus.page[0x80].host == rom.prg + 2 * 0x4000);
+
+    // Control = 0x10 | 2: 4 KB CHR, vertical, 32 KB PRG.
+    value = 0x12;
+    for (int i = 0; i < 5; i++) cpu_write_memory(&cpu, 0x8000, (value >> i) & 1);
+    assert(mapper->mirroring == ROM_MIRROR_VERTICAL);
+    assert(cpu_read_memory(&cpu, 0x8000) == 2);
+    assert(cpu_read_memory(&cpu, 0xC000) == 3);
+    cpu_write_memory(&cpu, 0x6123, 0x5A);
+    assert(mapper->prg_ram[0x123] == 0x5A);
+    mapper_destroy(mapper);
+
+    cpu_recycle(&cpu);
+    assert(rom_parse(image, test_make_cartridge(image, 2, 4, 0x4000), &rom) == ROM_OK);
+    mapper = mapper_create(&rom, &cpu);
+    cpu_write_memory(&cpu, 0x8000, 1);
+    assert(cpu_read_memory(&cpu, 0x8000) == 1);
+    assert(cpu_read_memory(&cpu, 0xC000) == 3);
+    assert(mapper_chr_read(mapper, 0x0C00) == 0x13);
+    mapper_destroy(mapper);
+    cpu_free_memory(&cpu);
+    printf("PASSED: test_mapper_mmc1_and_uxrom_bank_switching\n");
+}
+
+void test_mapper_mmc3_banks_and_irq()
+{
+    static uchar image[ROM_HEADER_SIZE + 4 * ROM_PRG_BANK_SIZE + ROM_CHR_BANK_SIZE];
+    ROM rom;
+    CPU cpu = make_cpu();
+    assert(rom_parse(image, test_make_cartridge(image, 4, 4, 0x2000), &rom) == ROM_OK);
+    MAPPER* mapper = mapper_create(&rom, &cpu);
+    assert(cpu_read_memory(&cpu, 0x8000) == 0);
+    assert(cpu_read_memory(&cpu, 0xA000) == 1);
+    assert(cpu_read_memory(&cpu, 0xC000) == 6);
+    assert(cpu_read_memory(&cpu, 0xE000) == 7);
+    assert(mapper_chr_read(mapper, 0x1000) == 0x14);
+
+    cpu_write_memory(&cpu, 0x8000, 6);
+    cpu_write_memory(&cpu, 0x8001, 3);
+    assert(cpu_read_memory(&cpu, 0x8000) == 3);
+    cpu_write_memory(&cpu, 0x8000, 0xC6);
+    assert(cpu_read_memory(&cpu, 0x8000) == 6);
+    assert(cpu_read_memory(&cpu, 0xC000) == 3);
+    assert(mapper_chr_read(mapper, 0x0000) == 0x14);
+
+    cpu_write_memory(&cpu, 0xC000, 2);
+    cpu_write_memory(&cpu, 0xC001, 0);
+    cpu_write_memory(&cpu, 0xE001, 0);
+    mapper_scanline(mapper);
+    mapper_scanline(mapper);
+    assert(!mapper->irq_pending);
+    mapper_scanline(mapper);
+    assert(mapper->irq_pending);
+    cpu_write_memory(&cpu, 0xE000, 0);
+    assert(!mapper->irq_pending);
+    mapper_destroy(mapper);
+    cpu_free_memory(&cpu);
+    printf("PASSED: test_mapper_mmc3_banks_and_irq\n");
+}
+
+void test_ppu_renders_background_and_sprites()
+{
+    static uchar image[ROM_HEADER_SIZE + ROM_PRG_BANK_SIZE + ROM_CHR_BANK_SIZE];
+    size_t size = test_make_cartridge(image, 0, 1, 0x4000);
+    uchar* chr = image + ROM_HEADER_SIZE + ROM_PRG_BANK_SIZE;
+    for (int row = 0; row < 8; row++) {
+	chr[16 + row] = 0xFF;        // tile 1: pixel 1 everywhere
+	chr[32 + row] = 0xF0;        // tile 2: pixel 1 on the left half,
+	chr[32 + row + 8] = 0x0F;    //         pixel 2 on the right
+    }
+    ROM_ERROR error;
+    NES* nes = nes_create(image, size, &error);
+    assert(nes != NULL && error == ROM_OK);
+    CPU* cpu = &nes->cpu;
+    PPU* ppu = &nes->ppu;
+
+    uchar palette[] = { 0x0F, 0x16, 0x27 };
+    cpu_write_memory(cpu, 0x2006, 0x3F);
+    cpu_write_memory(cpu, 0x2006, 0x00);
+    for (int i = 0; i < 3; i++) cpu_write_memory(cpu, 0x2007, palette[i]);
+    cpu_write_memory(cpu, 0x2006, 0x3F);
+    cpu_write_memory(cpu, 0x2006, 0x11);
+    cpu_write_memory(cpu, 0x2007, 0x30);
+    cpu_write_memory(cpu, 0x2006, 0x20);
+    cpu_write_memory(cpu, 0x2006, 0x00);
+    cpu_write_memory(cpu, 0x2007, 1);
+    cpu_write_memory(cpu, 0x2007, 2);
+
+    // Buffered $2007 reads lag one behind.
+    cpu_write_memory(cpu, 0x2006, 0x20);
+    cpu_write_memory(cpu, 0x2006, 0x01);
+    cpu_read_memory(cpu, 0x2007);
+    assert(cpu_read_memory(cpu, 0x2007) == 2);
+
+    // Sprite 0 over the second tile through OAM DMA from page $02.
+    uchar sprite[4] = { 0, 1, 0, 8 };
+    for (int i = 0; i < 4; i++) cpu_write_memory(cpu, 0x0200 + i, sprite[i]);
+    for (int i = 4; i < 256; i++) cpu_write_memory(cpu, 0x0200 + i, 0xFF);
+    uint64_t cycles = cpu->cycles;
+    cpu_write_memory(cpu, 0x4014, 0x02);
+    scheduler_dispatch(&nes->scheduler, cpu->cycles);
+    assert(cpu->cycles - cycles >= 513);
+    assert(ppu->oam[3] == 8 && ppu->oam[4] == 0xFF);
+
+    cpu_write_memory(cpu, 0x2006, 0x20);
+    cpu_write_memory(cpu, 0x2006, 0x00);
+    cpu_write_memory(cpu, 0x2001, 0x1E);
+    // Into line 20 of the next frame, the first one rendered from the top.
+    ppu_catch_up(ppu, ppu->clock + ppu_dots_to_vblank(ppu) + (PPU_SCANLINES - PPU_VBLANK_SCANLINE + 20) * PPU_DOTS_PER_SCANLINE);
+
+    assert(ppu->framebuffer[0][0] == 0x16);
+    assert(ppu->framebuffer[0][8] == 0x16);
+    assert(ppu->framebuffer[0][12] == 0x27);
+    assert(ppu->framebuffer[0][16] == 0x0F);
+    assert(ppu->framebuffer[1][8] == 0x30);
+    assert(ppu->framebuffer[1][12] == 0x30);
+    assert(ppu->framebuffer[9][0] == 0x0F);
+    assert(ppu->status & 0x40);
+
+    uint64_t frame = ppu->frame;
+    ppu_catch_up(ppu, ppu->clock + ppu_dots_to_vblank(ppu));
+    assert(ppu->frame == frame + 1);
+    assert(cpu_read_memory(cpu, 0x2002) & 0x80);
+    assert(!(cpu_read_memory(cpu, 0x2002) & 0x80));
+    nes_destroy(nes);
+    printf("PASSED: test_ppu_renders_background_and_sprites\n");
+}
+
+void test_ppu_decoders_agree()
+{
+    uchar lo[32], hi[32], attr[32];
+    uchar expected[32 * 8], actual[32 * 8];
+    unsigned seed = 12345;
+    for (int i = 0; i < 32; i++) {
+	seed = seed * 1103515245 + 12345;
+	lo[i] = (uchar)(seed >> 16);
+	hi[i] = (uchar)(seed >> 8);
+	attr[i] = (uchar)(seed >> 24) & 0x03;
+    }
+    ppu_get_decoder(PPU_DECODE_SCALAR)(lo, hi, attr, 32, expected);
+    assert(expected[0] == (attr[0] << 2 | ((lo[0] >> 7) & 1) | ((hi[0] >> 7) << 1)));
+    for (PPU_DECODER decoder = PPU_DECODE_AUTO; decoder <= PPU_DECODE_AVX2; decoder++) {
+	PPU_DECODE_ROW decode_row = ppu_get_decoder(decoder);
+	if (decode_row == NULL) continue;
+	memset(actual, 0, sizeof(actual));
+	decode_row(lo, hi, attr, 32, actual);
+	assert(memcmp(expected, actual, sizeof(expected)) == 0);
+    }
+
+    // Lookups run on either side of the seam in a scrolled line, so any
+    // count, and must not touch the bytes past it.
+    uchar colors[32];
+    for (int i = 0; i < 32; i++) colors[i] = (uchar)(i * 5 + 1);
+    for (PPU_DECODER decoder = PPU_DECODE_AUTO; decoder <= PPU_DECODE_AVX2; decoder++) {
+	PPU_LOOKUP_ROW lookup_row = ppu_get_lookup(decoder);
+	if (lookup_row == NULL) continue;
+	for (int count = 0; count <= 256; count = count + (count < 40 ? 1 : 37)) {
+	    memset(actual, 0xEE, sizeof(actual));
+	    lookup_row(colors, expected + 256 - count, count, actual);
+	    for (int x = 0; x < count; x++) assert(actual[x] == colors[expected[256 - count + x]]);
+	    for (int x = count; x < 256; x++) assert(actual[x] == 0xEE);
+	}
+    }
+    printf("PASSED: test_ppu_decoders_agree\n");
+}
+
+// PPU writes for the background cache test, in order: a scene, then
+// changes to it. 0x4000 stands for $2000 and 0x4005 for the two $2005
+// writes, x | y << 8; everything else goes through $2006/$2007.
+#define TEST_PPU_CACHE_SCENE 20
+static const ushort test_ppu_cache_writes[][2] = {
+    { 0x3F00, 0x0F }, { 0x3F01, 0x16 }, { 0x3F02, 0x27 }, { 0x3F03, 0x30 },
+    { 0x3F05, 0x11 }, { 0x3F06, 0x21 }, { 0x3F07, 0x31 },
+    { 0x0010, 0xFF }, { 0x0018, 0x0F }, { 0x0020, 0xF0 }, { 0x0028, 0x3C },
+    { 0x1010, 0xAA }, { 0x1018, 0x55 },
+    { 0x2000, 0x01 }, { 0x2001, 0x02 }, { 0x2021, 0x01 }, { 0x2062, 0x02 },
+    { 0x2004, 0x01 }, { 0x2401, 0x02 }, { 0x23C0, 0x1B },
+    { 0x2021, 0x02 },                    // a name
+    { 0x23C0, 0xE4 },                    // an attribute
+    { 0x0011, 0x81 }, { 0x0010, 0x00 },  // pattern rows
+    { 0x2001, 0x02 },                    // the same value again
+    { 0x4005, 13 | 5 << 8 },             // into the second nametable
+    { 0x4000, 0x10 },                    // the other pattern table
+    { 0x3F01, 0x2A },                    // a color
+    { 0x4000, 0x11 }, { 0x2402, 0x01 },
+};
+
+// Makes the writes from `first` up to `count` with rendering off, then
+// renders a whole frame of background from the pre-render line on.
+static void test_ppu_cache_render(NES* nes, int first, int count)
+{
+    CPU* cpu = &nes->cpu;
+    uchar ctrl = 0;
+    ushort scroll = 0;
+    cpu_write_memory(cpu, 0x2001, 0x00);
+    for (int i = 0; i < count; i++) {
+	ushort addr = test_ppu_cache_writes[i][0];
+	ushort data = test_ppu_cache_writes[i][1];
+	if (addr == 0x4000) {
+	    ctrl = (uchar)data;
+	} else if (addr == 0x4005) {
+	    scroll = data;
+	} else if (i >= first) {
+	    cpu_write_memory(cpu, 0x2006, (uchar)(addr >> 8));
+	    cpu_write_memory(cpu, 0x2006, (uchar)addr);
+	    cpu_write_memory(cpu, 0x2007, (uchar)data);
+	}
+    }
+    cpu_write_memory(cpu, 0x2000, ctrl);
+    cpu_read_memory(cpu, 0x2002);
+    cpu_write_memory(cpu, 0x2005, (uchar)scroll);
+    cpu_write_memory(cpu, 0x2005, (uchar)(scroll >> 8));
+    cpu_write_memory(cpu, 0x2001, 0x0A);
+    for (int i = 0; i < 2; i++) ppu_catch_up(&nes->ppu, nes->ppu.clock + ppu_dots_to_vblank(&nes->ppu));
+}
+
+void test_ppu_background_cache_follows_writes()
+{
+    // CHR RAM and vertical mirroring.
+    static uchar image[ROM_HEADER_SIZE + ROM_PRG_BANK_SIZE + ROM_CHR_BANK_SIZE];
+    size_t size = test_make_cartridge(image, 0, 1, 0x4000);
+    image[5] = 0;
+    image[6] = image[6] | 0x01;
+    ROM_ERROR error;
+    NES* nes = nes_create(image, size, &error);
+    assert(nes != NULL && error == ROM_OK);
+
+    // After every write, a console that has rendered all along draws the
+    // same frame as one that starts cold.
+    // Every change past the scene shows, unless it repeats an earlier write.
+    static uchar previous[PPU_HEIGHT][PPU_WIDTH];
+    int count = (int)(sizeof(test_ppu_cache_writes) / sizeof(test_ppu_cache_writes[0]));
+    for (int i = 0; i <= count; i++) {
+	test_ppu_cache_render(nes, i > 0 ? i - 1 : 0, i);
+	if (i > TEST_PPU_CACHE_SCENE) {
+	    bool repeat = false;
+	    for (int j = 0; j < i - 1; j++) {
+		repeat = repeat || memcmp(test_ppu_cache_writes[j], test_ppu_cache_writes[i - 1], sizeof(test_ppu_cache_writes[j])) == 0;
+	    }
+	    assert((memcmp(previous, nes->ppu.framebuffer, sizeof(previous)) != 0) == !repeat);
+	}
+	memcpy(previous, nes->ppu.framebuffer, sizeof(previous));
+	NES* cold = nes_create(image, size, &error);
+	assert(cold != NULL);
+	test_ppu_cache_render(cold, 0, i);
+	assert(memcmp(nes->ppu.framebuffer, cold->ppu.framebuffer, sizeof(nes->ppu.framebuffer)) == 0);
+	nes_destroy(cold);
+    }
+    nes_destroy(nes);
+    printf("PASSED: test_ppu_background_cache_follows_writes\n");
+}
+
+void test_apu_length_counters_and_frame_irq()
+{
+    static uchar image[ROM_HEADER_SIZE + 2 * ROM_PRG_BANK_SIZE + ROM_CHR_BANK_SIZE];
+    ROM_ERROR error;
+    NES* nes = nes_create(image, test_make_cartridge(image, 0, 2, 0x4000), &error);
+    assert(nes != NULL);
+    CPU* cpu = &nes->cpu;
+
+    // Lengths only load while the channel is enabled.
+    cpu_write_memory(cpu, 0x4003, 0x08);
+    assert((cpu_read_memory(cpu, 0x4015) & 0x01) == 0);
+    cpu_write_memory(cpu, 0x4015, 0x0F);
+    cpu_write_memory(cpu, 0x4000, 0x10);
+    cpu_write_memory(cpu, 0x4003, 0x18); // length index 3: 2 half frames
+    cpu_write_memory(cpu, 0x4007, 0x08); // length index 1: 254
+    assert((cpu_read_memory(cpu, 0x4015) & 0x0F) == 0x03);
+
+    // Two half frames into the 4-step sequence pulse 1 is done, and the
+    // sequence end raises the frame IRQ, cleared by the read.
+    cpu->cycles = cpu->cycles + 29830;
+    uchar status = cpu_read_memory(cpu, 0x4015);
+    assert((status & 0x03) == 0x02);
+    assert(status & 0x40);
+    assert(!apu_irq(&nes->apu));
+
+    // Disabling clears the length at once; inhibit keeps the IRQ quiet.
+    cpu_write_memory(cpu, 0x4015, 0x00);
+    cpu_write_memory(cpu, 0x4017, 0x40);
+    cpu->cycles = cpu->cycles + 2 * 29830;
+    assert(cpu_read_memory(cpu, 0x4015) == 0);
+    nes_destroy(nes);
+    printf("PASSED: test_apu_length_counters_and_frame_irq\n");
+}
+
+void test_apu_streams_pulse_to_wav()
+{
+    static uchar image[ROM_HEADER_SIZE + 2 * ROM_PRG_BANK_SIZE + ROM_CHR_BANK_SIZE];
+    const char* path = "/tmp/quick_nes_test_apu.wav";
+    ROM_ERROR error;
+    NES* nes = nes_create(image, test_make_cartridge(image, 0, 2, 0x4000), &error);
+    assert(nes != NULL);
+    CPU* cpu = &nes->cpu;
+    nes->apu.sink = audio_sink_open(path, AUDIO_FORMAT_WAV, NES_SAMPLE_RATE, 1 << 16);
+    assert(nes->apu.sink != NULL);
+
+    // 440 Hz at constant volume 15, 50% duty, for a tenth of a second.
+    ushort timer = APU_CPU_CLOCK / (16 * 440) - 1;
+    cpu_write_memory(cpu, 0x4015, 0x01);
+    cpu_write_memory(cpu, 0x4000, 0xBF);
+    cpu_write_memory(cpu, 0x4002, (uchar)timer);
+    cpu_write_memory(cpu, 0x4003, (uchar)(0x08 | (timer >> 8)));
+    cpu->cycles = cpu->cycles + APU_CPU_CLOCK / 10;
+    apu_sync(&nes->apu);
+    uint64_t samples = nes->apu.samples;
+    assert(samples >= NES_SAMPLE_RATE / 10 - 1 && samples <= NES_SAMPLE_RATE / 10 + 1);
+    assert(audio_sink_close(nes->apu.sink));
+    nes->apu.sink = NULL;
+
+    FILE* file = fopen(path, "rb");
+    assert(file != NULL);
+    uchar header[44];
+    assert(fread(header, 1, 44, file) == 44);
+    assert(memcmp(header, "RIFF", 4) == 0 && memcmp(header + 36, "data", 4) == 0);
+    uint32_t data_size = header[40] | header[41] << 8 | header[42] << 16 | (uint32_t)header[43] << 24;
+    assert(data_size == samples * 2);
+
+    // A square wave: both signs, and about 2 * 44 zero crossings.
+    int16_t wave[NES_SAMPLE_RATE / 10];
+    size_t count = fread(wave, 2, NES_SAMPLE_RATE / 10, file);
+    fclose(file);
+    remove(path);
+    int16_t low = 0, high = 0;
+    int crossings = 0;
+    for (size_t i = count / 10; i < count; i++) {
+	if (wave[i] < low) low = wave[i];
+	if (wave[i] > high) high = wave[i];
+	if ((wave[i] < 0) != (wave[i - 1] < 0)) crossings = crossings + 1;
+    }
+    assert(high > 1000 && low < -1000);
+    assert(crossings >= 70 && crossings <= 82);
+    nes_destroy(nes);
+    printf("PASSED: test_apu_streams_pulse_to_wav\n");
+}
+
+static void test_scheduler_record(void* ctx, SCHEDULER_EVENT event, uint64_t cycle)
+{
+    uint64_t* log = ctx;
+    log[0] = log[0] + 1;
+    log[log[0]] = cycle << 8 | event;
+}
+
+static void test_scheduler_record_cpu(void* ctx, SCHEDULER_EVENT event, uint64_t cycle)
+{
+    CPU* cpu = ctx;
+    (void)event;
+    (void)cycle;
+    cpu->reg_y = cpu->reg_x;
+    cpu_write_memory(cpu, 0x0000, (uchar)(cpu->cycles - cycle));
+}
+
+void test_scheduler_orders_reschedules_and_cancels()
+{
+    CPU cpu = make_cpu();
+    SCHEDULER scheduler;
+    uint64_t log[16] = { 0 };
+    scheduler_init(&scheduler, &cpu);
+    for (int i = 0; i < SCHEDULER_EVENT_COUNT; i++) scheduler_set_handler(&scheduler, i, test_scheduler_record, log);
+
+    scheduler_schedule(&scheduler, SCHEDULER_EVENT_NMI, 300);
+    scheduler_schedule(&scheduler, SCHEDULER_EVENT_IRQ, 100);
+    scheduler_schedule(&scheduler, SCHEDULER_EVENT_DMA, 200);
+    scheduler_schedule(&scheduler, SCHEDULER_EVENT_MAPPER, 100);
+    assert(scheduler_next(&scheduler) == 100);
+    // Moving and cancelling keep one entry per event.
+    scheduler_schedule(&scheduler, SCHEDULER_EVENT_NMI, 50);
+    scheduler_cancel(&scheduler, SCHEDULER_EVENT_DMA);
+    assert(!scheduler_pending(&scheduler, SCHEDULER_EVENT_DMA));
+    assert(scheduler.count == 3 && scheduler_next(&scheduler) == 50);
+
+    scheduler_dispatch(&scheduler, 99);
+    assert(log[0] == 1 && log[1] == (50 << 8 | SCHEDULER_EVENT_NMI));
+    scheduler_dispatch(&scheduler, 1000);
+    assert(log[0] == 3);
+    assert(log[2] == (100 << 8 | SCHEDULER_EVENT_IRQ));
+    assert(log[3] == (100 << 8 | SCHEDULER_EVENT_MAPPER));
+    assert(scheduler_next(&scheduler) == UINT64_MAX);
+
+    // A running CPU stops for an event within one instruction of it.
+    uchar program[] = { 0xE8, 0x18, 0x90, 0xFC }; // INX; CLC; BCC -4
+    cpu_load(&cpu, program, sizeof(program));
+    cpu_reset(&cpu);
+    scheduler_set_handler(&scheduler, SCHEDULER_EVENT_DMA, test_scheduler_record_cpu, &cpu);
+    scheduler_schedule(&scheduler, SCHEDULER_EVENT_DMA, cpu.cycles + 1000);
+    cpu_run_for_cycles(&cpu, 5000);
+    assert(cpu.memory[0x0000] < 3);
+    assert(cpu.reg_y > 0 && cpu.reg_y < cpu.reg_x);
+    assert(scheduler.dispatched == 4);
+    cpu_free_memory(&cpu);
+    printf("PASSED: test_scheduler_orders_reschedules_and_cancels\n");
+}
+
+void test_nes_nmi_and_apu_irq()
+{
+    static uchar image[ROM_HEADER_SIZE + 2 * ROM_PRG_BANK_SIZE + ROM_CHR_BANK_SIZE];
+    size_t size = test_make_cartridge(image, 0, 2, 0x4000);
+    uchar* prg = image + ROM_HEADER_SIZE;
+    uchar main[] = { 0x58, 0x18, 0x90, 0xFD };             // CLI; loop: CLC; BCC loop
+    uchar nmi[] = { 0xE8, 0x40 };                          // INX; RTI
+    uchar irq[] = { 0xAD, 0x15, 0x40, 0xC8, 0x08, 0x28, 0x40 }; // LDA $4015; INY; PHP; PLP; RTI
+    memcpy(prg, main, sizeof(main));
+    memcpy(prg + 0x1000, nmi, sizeof(nmi));
+    memcpy(prg + 0x2000, irq, sizeof(irq));
+    prg[0x7FFA] = 0x00; prg[0x7FFB] = 0x90;
+    prg[0x7FFC] = 0x00; prg[0x7FFD] = 0x80;
+    prg[0x7FFE] = 0x00; prg[0x7FFF] = 0xA0;
+
+    ROM_ERROR error;
+    NES* nes = nes_create(image, size, &error);
+    assert(nes != NULL);
+    CPU* cpu = &nes->cpu;
+    cpu_write_memory(cpu, 0x2000, 0x80);
+    cpu_write_memory(cpu, 0x4017, 0x00);
+
+    for (int i = 0; i < 10; i++) assert(nes_run_frame(nes));
+    // One NMI per vblank, and one frame IRQ per 29830 cycles acknowledged
+    // through $4015, each returning to the loop with I clear again.
+    assert(cpu->reg_x == 9 || cpu->reg_x == 10);
+    assert(cpu->reg_y == 9 || cpu->reg_y == 10);
+    // nes_run_frame returns right as the NMI is taken.
+    assert(cpu->pc == 0x9000);
+    assert(cpu->reg_sp == 0xFA);
+    assert(!(cpu->memory[0x01FB] & FLAG_INTERRUPT_DISABLE));
+    nes_destroy(nes);
+    printf("PASSED: test_nes_nmi_and_apu_irq\n");
+}
+
+static NES* test_make_spinning_nes(uchar* image, bool idle)
+{
+    size_t size = test_make_cartridge(image, 0, 2, 0x4000);
+    uchar* prg = image + ROM_HEADER_SIZE;
+    // SEI; wait: BIT $2002; BPL wait; INY; JMP wait
+    uchar main[] = { 0x78, 0x2C, 0x02, 0x20, 0x10, 0xFB, 0xC8, 0x4C, 0x01, 0x80 };
+    uchar nmi[] = { 0xE8, 0x40 };                                           // INX; RTI
+    memcpy(prg, main, sizeof(main));
+    memcpy(prg + 0x1000, nmi, sizeof(nmi));
+    prg[0x7FFA] = 0x00; prg[0x7FFB] = 0x90;
+    prg[0x7FFC] = 0x00; prg[0x7FFD] = 0x80;
+
+    ROM_ERROR error;
+    NES* nes = nes_create(image, size, &error);
+    assert(nes != NULL);
+    assert(nes_set_idle_skip(nes, idle));
+    cpu_write_memory(&nes->cpu, 0x2000, 0x80);
+    cpu_write_memory(&nes->cpu, 0x2001, 0x18);
+    return nes;
+}
+
+void test_idle_skip_matches_full_run()
+{
+    static uchar image[2][ROM_HEADER_SIZE + 2 * ROM_PRG_BANK_SIZE + ROM_CHR_BANK_SIZE];
+    NES* full = test_make_spinning_nes(image[0], false);
+    NES* fast = test_make_spinning_nes(image[1], true);
+    for (int i = 0; i < 20; i++) {
+	assert(nes_run_frame(full));
+	assert(nes_run_frame(fast));
+	assert(full->cpu.cycles == fast->cpu.cycles);
+	assert(full->cpu.pc == fast->cpu.pc);
+	assert(full->cpu.reg_x == fast->cpu.reg_x && full->cpu.reg_y == fast->cpu.reg_y);
+	assert(full->cpu.status == fast->cpu.status);
+	assert(full->ppu.status == fast->ppu.status);
+    }
+    assert(memcmp(full->ppu.framebuffer, fast->ppu.framebuffer, sizeof(full->ppu.framebuffer)) == 0);
+    assert(fast->cpu.reg_x >= 19 && fast->cpu.reg_y >= 18);
+    // Most of every frame is spent waiting on $2002.
+    assert(fast->idle->skipped_cycles > 20 * 29780 / 2);
+    nes_destroy(full);
+    nes_destroy(fast);
+
+    // A loop that counts is never idle; JMP * is, up to the end of the run.
+    CPU plain = make_cpu();
+    CPU cpu = make_cpu();
+    IDLE_DETECTOR* detector = idle_create();
+    cpu.idle = detector;
+    uchar program[] = { 0xE8, 0xD0, 0xFD, 0x4C, 0x03, 0x80 }; // INX; BNE -3; JMP *
+    cpu_load(&plain, program, sizeof(program));
+    cpu_load(&cpu, program, sizeof(program));
+    cpu_reset(&plain);
+    cpu_reset(&cpu);
+    cpu_run_for_cycles(&plain, 10000);
+    cpu_run_for_cycles(&cpu, 10000);
+    assert(cpu.reg_x == 0 && cpu.pc == 0x8003);
+    assert(cpu.cycles == plain.cycles);
+    assert(detector->skips == 1);
+    idle_destroy(detector);
+    cpu_free_memory(&plain);
+    cpu_free_memory(&cpu);
+    printf("PASSED: test_idle_skip_matches_full_run\n");
+}
+
+static void test_pool_count(void* ctx, size_t index, int worker)
+{
+    uchar* runs = ctx;
+    // A few slow tasks at the front leave worker 0 behind, so others steal.
+    if (index < 8) {
+	volatile uint64_t spin = 0;
+	for (int i = 0; i < 200000; i++) spin = spin + (uint64_t)i;
+    }
+    runs[index * 2] = runs[index * 2] + 1;
+    runs[index * 2 + 1] = (uchar)worker;
+}
+
+void test_pool_runs_every_task_once()
+{
+    static uchar runs[10000 * 2];
+    POOL_STATS stats;
+    assert(pool_default_workers() >= 1);
+    assert(pool_run(4, 10000, test_pool_count, runs, &stats));
+    assert(stats.workers == 4);
+    for (int i = 0; i < 10000; i++) assert(runs[i * 2] == 1 && runs[i * 2 + 1] < 4);
+    assert(stats.max_executed >= 10000 / 4 && stats.min_executed <= 10000 / 4);
+
+    // More workers than tasks, and no tasks at all.
+    memset(runs, 0, sizeof(runs));
+    assert(pool_run(8, 3, test_pool_count, runs, &stats));
+    assert(stats.workers == 3);
+    assert(runs[0] == 1 && runs[2] == 1 && runs[4] == 1 && runs[6] == 0);
+    assert(pool_run(4, 0, test_pool_count, runs, NULL));
+    printf("PASSED: test_pool_runs_every_task_once\n");
+}
+
+void test_cpu_arena_recycles_dirty_pages()
+{
+    assert(offsetof(CPU, blocks) == 64);
+    CPU_ARENA* arena = cpu_arena_create(2);
+    assert(arena != NULL);
+    CPU* a = cpu_arena_acquire(arena);
+    CPU* b = cpu_arena_acquire(arena);
+    assert(a != NULL && b != NULL && a != b && a->memory != b->memory);
+    assert((uintptr_t)a % 64 == 0 && (uintptr_t)b % 64 == 0);
+    assert(cpu_arena_acquire(arena) == NULL);
+
+    uchar program[] = { 0xA9, 0x55, 0x48, 0x00 }; // LDA #$55; PHA; BRK
+    cpu_load(a, program, sizeof(program));
+    cpu_write_memory(a, 0x0234, 0x07);
+    cpu_reset(a);
+    cpu_run(a);
+    assert(a->reg_a == 0x55 && cpu_peek_memory(a, 0x01FD) == 0x55);
+    assert(cpu_peek_memory(b, 0x8000) == 0);
+
+    // Program, vector, stack and $0234: four pages to clear, not 256.
+    cpu_arena_release(arena, a);
+    assert(arena->pages_cleared == 4);
+    CPU* again = cpu_arena_acquire(arena);
+    assert(again == a);
+    assert(again->reg_a == 0 && again->cycles == 0 && again->pc == 0 && !again->halted);
+    for (int i = 0; i < MEMORY_SIZE; i++) assert(again->memory[i] == 0);
+    // Writing after a recycle marks the page again.
+    cpu_write_memory(again, 0x0234, 0x01);
+    assert(again->bus.dirty[0] == 1ull << 2);
+
+    cpu_arena_release(arena, again);
+    cpu_arena_release(arena, b);
+    assert(arena->pages_cleared == 5);
+    cpu_arena_destroy(arena);
+    printf("PASSED: test_cpu_arena_recycles_dirty_pages\n");
+}
+
+void test_cpu_image_copy_on_write()
+{
+    static uchar image[CPU_IMAGE_SIZE];
+    uchar program[] = { 0xA9, 0x55, 0x48, 0xE8, 0x00 }; // LDA #$55; PHA; INX; BRK
+    assert(cpu_build_image(image, program, sizeof(program)));
+    // Programs stop short of the reset vector instead of running under it.
+    static uchar longest[CPU_PROGRAM_MAX + 1];
+    memset(longest, 0xEA, sizeof(longest));
+    assert(cpu_build_image(image, longest, CPU_PROGRAM_MAX));
+    assert(image[0xFFFB - 0x8000] == 0xEA && image[0xFFFC - 0x8000] == 0x00 && image[0xFFFD - 0x8000] == 0x80);
+    assert(!cpu_build_image(image, longest, sizeof(longest)));
+    CPU loaded = make_cpu();
+    assert(!cpu_load(&loaded, longest, sizeof(longest)));
+    assert(cpu_read_memory(&loaded, 0x8000) == 0x00);
+    assert(cpu_load(&loaded, longest, CPU_PROGRAM_MAX));
+    assert(cpu_read_memory(&loaded, 0xFFFB) == 0xEA && cpu_read_memory_ushort(&loaded, 0xFFFC) == 0x8000);
+    cpu_free_memory(&loaded);
+    assert(cpu_build_image(image, program, sizeof(program)));
+    CPU_ARENA* arena = cpu_arena_create(2);
+    CPU* a = cpu_arena_acquire(arena);
+    CPU* b = cpu_arena_acquire(arena);
+    CPU plain = make_cpu();
+    cpu_load(&plain, program, sizeof(program));
+    cpu_map_image(a, image);
+    cpu_map_image(b, image);
+    cpu_reset(&plain);
+    cpu_reset(a);
+    cpu_reset(b);
+    cpu_run(&plain);
+    cpu_run(a);
+    cpu_run(b);
+    assert(a->reg_x == plain.reg_x && a->pc == plain.pc && a->cycles == plain.cycles);
+    // Both read their code straight from the image; only the stack is theirs.
+    assert(a->bus.read_fast[0x80] == image && b->bus.read_fast[0x80] == image);
+    assert(a->bus.dirty[0] == 1ull << 1 && a->bus.dirty[2] == 0 && a->bus.dirty[3] == 0);
+
+    // The first write gives a a private copy of the page.
+    cpu_write_memory(a, 0x8001, 0x77);
+    assert(cpu_read_memory(a, 0x8001) == 0x77 && cpu_read_memory(a, 0x8000) == 0xA9);
+    assert(cpu_read_memory(b, 0x8001) == 0x55 && image[1] == 0x55);
+    assert(a->bus.dirty[2] == 1ull << 0 && a->bus.page[0x81].copy_on_write);
+    cpu_reset(a);
+    cpu_run(a);
+    assert(a->reg_a == 0x77 && b->reg_a == 0x55);
+
+    cpu_arena_release(arena, a);
+    cpu_arena_release(arena, b);
+    assert(arena->pages_cleared == 3);
+    cpu_arena_destroy(arena);
+    cpu_free_memory(&plain);
+    printf("PASSED: test_cpu_image_copy_on_write\n");
+}
+
+void test_savestate_incremental_and_serialized()
+{
+    CPU cpu = make_cpu();
+    uchar program[] = { 0xA9, 0x55, 0x48, 0xE8, 0x00 }; // LDA #$55; PHA; INX; BRK
+    cpu_load(&cpu, program, sizeof(program));
+    cpu_reset(&cpu);
+    cpu_run(&cpu);
+    cpu_write_memory(&cpu, 0x0300, 0x42);
+
+    SAVESTATE* state = savestate_create();
+    savestate_capture(state, &cpu);
+    assert(state->pages_copied == BUS_PAGE_COUNT);
+    cpu_write_memory(&cpu, 0x0301, 0x43);
+    cpu_write_memory(&cpu, 0x0302, 0x44);
+    savestate_capture(state, &cpu);
+    assert(state->pages_copied == 1);
+    assert(savestate_put(state, SAVESTATE_TAG('T', 'E', 'S', 'T'), "abc", 3));
+
+    // Only the page written since goes back.
+    cpu_write_memory(&cpu, 0x0500, 0x99);
+    cpu.reg_x = 0x10;
+    cpu.cycles = cpu.cycles + 1000;
+    savestate_restore(state, &cpu);
+    assert(state->pages_copied == 1);
+    assert(cpu_read_memory(&cpu, 0x0500) == 0 && cpu_read_memory(&cpu, 0x0302) == 0x44);
+    assert(cpu.reg_x == 1 && cpu.reg_a == 0x55 && cpu.halted);
+
+    // Through a buffer and a file into another CPU.
+    size_t size = savestate_write(state, NULL, 0);
+    uchar* buffer = malloc(size);
+    assert(savestate_write(state, buffer, size) == size);
+    SAVESTATE* copy = savestate_create();
+    assert(!savestate_read(copy, buffer, size - 1));
+    assert(savestate_read(copy, buffer, size));
+    const char* path = "/tmp/quick_nes_test_state.bin";
+    assert(savestate_save_file(copy, path));
+    assert(savestate_load_file(copy, path));
+    remove(path);
+    assert(memcmp(savestate_find(copy, SAVESTATE_TAG('T', 'E', 'S', 'T'), 3), "abc", 3) == 0);
+    assert(savestate_find(copy, SAVESTATE_TAG('T', 'E', 'S', 'T'), 4) == NULL);
+    buffer[4] = SAVESTATE_VERSION + 1;
+    assert(!savestate_read(copy, buffer, size));
+    free(buffer);
+
+    CPU other = make_cpu();
+    savestate_restore(copy, &other);
+    assert(copy->pages_copied == BUS_PAGE_COUNT);
+    assert(memcmp(other.memory, cpu.memory, MEMORY_SIZE) == 0);
+    assert(other.pc == cpu.pc && other.cycles == cpu.cycles && cpu_get_status(&other) == cpu_get_status(&cpu));
+    savestate_destroy(copy);
+    savestate_destroy(state);
+    cpu_free_memory(&cpu);
+    cpu_free_memory(&other);
+    printf("PASSED: test_savestate_incremental_and_serialized\n");
+}
+
+void test_nes_savestate_replays_identically()
+{
+    static uchar image[ROM_HEADER_SIZE + 2 * ROM_PRG_BANK_SIZE + ROM_CHR_BANK_SIZE];
+    NES* nes = test_make_spinning_nes(image, false);
+    for (int i = 0; i < 5; i++) assert(nes_run_frame(nes));
+    SAVESTATE* state = savestate_create();
+    assert(nes_save_state(nes, state));
+
+    static uchar framebuffer[PPU_HEIGHT][PPU_WIDTH];
+    for (int i = 0; i < 3; i++) assert(nes_run_frame(nes));
+    memcpy(framebuffer, nes->ppu.framebuffer, sizeof(framebuffer));
+    CPU after = nes->cpu;
+    uint64_t frame = nes->ppu.frame;
+
+    for (int round = 0; round < 2; round++) {
+	assert(nes_load_state(nes, state));
+	for (int i = 0; i < 3; i++) assert(nes_run_frame(nes));
+	assert(nes->cpu.cycles == after.cycles && nes->cpu.pc == after.pc);
+	assert(nes->cpu.reg_x == after.reg_x && nes->cpu.reg_y == after.reg_y);
+	assert(nes->ppu.frame == frame);
+	assert(memcmp(framebuffer, nes->ppu.framebuffer, sizeof(framebuffer)) == 0);
+    }
+    // The stack is the only RAM the program writes.
+    assert(nes_save_state(nes, state));
+    assert(nes_run_frame(nes));
+    assert(nes_save_state(nes, state));
+    assert(state->pages_copied <= 1);
+
+    static uchar other_image[ROM_HEADER_SIZE + 4 * ROM_PRG_BANK_SIZE + ROM_CHR_BANK_SIZE];
+    ROM_ERROR error;
+    NES* other = nes_create(other_image, test_make_cartridge(other_image, 2, 4, 0x4000), &error);
+    assert(other != NULL);
+    assert(!nes_load_state(other, state));
+    nes_destroy(other);
+    savestate_destroy(state);
+    nes_destroy(nes);
+    printf("PASSED: test_nes_savestate_replays_identically\n");
+}
+
+void test_rewind_steps_back_frame_by_frame()
+{
+    static uchar image[ROM_HEADER_SIZE + 2 * ROM_PRG_BANK_SIZE + ROM_CHR_BANK_SIZE];
+    NES* nes = test_make_spinning_nes(image, false);
+    SAVESTATE* state = savestate_create();
+    REWIND* rewind = rewind_create(1 << 20, 64);
+    assert(rewind != NULL && !rewind_pop(rewind, state));
+
+    uint64_t cycles[40];
+    uchar reg_x[40];
+    for (int i = 0; i < 40; i++) {
+	assert(nes_run_frame(nes));
+	// Something new in RAM every frame, a page further each time.
+	cpu_write_memory(&nes->cpu, (ushort)(0x0200 + i * 37), (uchar)(i + 1));
+	assert(nes_save_state(nes, state));
+	assert(rewind_push(rewind, state));
+	cycles[i] = nes->cpu.cycles;
+	reg_x[i] = nes->cpu.reg_x;
+    }
+    assert(rewind_depth(rewind) == 40);
+    // Consecutive frames of this program differ in a few hundred bytes.
+    assert(rewind_used(rewind) < 39 * 256);
+
+    for (int i = 39; i >= 20; i--) {
+	assert(rewind_pop(rewind, state));
+	assert(nes_load_state(nes, state));
+	assert(nes->cpu.cycles == cycles[i] && nes->cpu.reg_x == reg_x[i]);
+	assert(cpu_read_memory(&nes->cpu, (ushort)(0x0200 + i * 37)) == (uchar)(i + 1));
+	if (i < 39) assert(cpu_read_memory(&nes->cpu, (ushort)(0x0200 + (i + 1) * 37)) == 0);
+    }
+    // Running on from a rewound frame matches the first time through.
+    assert(nes_run_frame(nes));
+    assert(nes->cpu.cycles == cycles[21] && nes->cpu.reg_x == reg_x[21]);
+    rewind_destroy(rewind);
+
+    // A small ring keeps the newest frames and drops the oldest.
+    rewind = rewind_create(256, 1000);
+    for (int i = 0; i < 100; i++) {
+	cpu_write_memory(&nes->cpu, 0x0400, (uchar)i);
+	savestate_capture(state, &nes->cpu);
+	assert(rewind_push(rewind, state));
+    }
+    assert(rewind->dropped > 0 && rewind_depth(rewind) < 100 && rewind_used(rewind) <= 256);
+    for (int i = 99; rewind_pop(rewind, state); i--) {
+	savestate_restore(state, &nes->cpu);
+	assert(cpu_read_memory(&nes->cpu, 0x0400) == (uchar)i);
+    }
+    rewind_destroy(rewind);
+    savestate_destroy(state);
+    nes_destroy(nes);
+    printf("PASSED: test_rewind_steps_back_frame_by_frame\n");
+}
+
+// Each NMI reads controller 1 and, while A is held, moves sprite 0 (kept
+// in zero page) right by doubling its x, then DMAs zero page to OAM.
+static NES* test_make_input_nes(uchar* image)
+{
+    size_t size = test_make_cartridge(image, 0, 2, 0x4000);
+    uchar* prg = image + ROM_HEADER_SIZE;
+    uchar main[] = { 0x78, 0x4C, 0x01, 0x80 };                              // SEI; wait: JMP wait
+    // LDA $4016; AND #1; BEQ dma; ASL $03; dma: ASL $4014 (writes 0, DMA from page 0); RTI
+    uchar nmi[] = { 0xAD, 0x16, 0x40, 0x29, 0x01, 0xF0, 0x02, 0x06, 0x03, 0x0E, 0x14, 0x40, 0x40 };
+    memcpy(prg, main, sizeof(main));
+    memcpy(prg + 0x1000, nmi, sizeof(nmi));
+    prg[0x7FFA] = 0x00; prg[0x7FFB] = 0x90;
+    prg[0x7FFC] = 0x00; prg[0x7FFD] = 0x80;
+
+    ROM_ERROR error;
+    NES* nes = nes_create(image, size, &error);
+    assert(nes != NULL);
+    for (int i = 0; i < 256; i++) cpu_write_memory(&nes->cpu, (ushort)i, 0xFF);
+    uchar sprite[] = { 50, 0, 0, 8 };
+    for (int i = 0; i < 4; i++) cpu_write_memory(&nes->cpu, (ushort)i, sprite[i]);
+    cpu_write_memory(&nes->cpu, 0x2006, 0x3F);
+    cpu_write_memory(&nes->cpu, 0x2006, 0x11);
+    cpu_write_memory(&nes->cpu, 0x2007, 0x21);
+    cpu_write_memory(&nes->cpu, 0x2000, 0x80);
+    cpu_write_memory(&nes->cpu, 0x2001, 0x1E);
+    cpu_write_memory(&nes->cpu, 0x4016, 0x01);   // strobe held high: every read returns A
+    return nes;
+}
+
+void test_runahead_shows_future_frames()
+{
+    static uchar image[ROM_HEADER_SIZE + 2 * ROM_PRG_BANK_SIZE + ROM_CHR_BANK_SIZE];
+    static uchar expected[PPU_HEIGHT][PPU_WIDTH];
+    static uchar first[PPU_HEIGHT][PPU_WIDTH];
+    const uchar held[] = { 0, 0, 0, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+    const int count = sizeof(held);
+    const int ahead = 2;
+
+    for (int mode = 0; mode < 2; mode++) {
+	NES* nes = test_make_input_nes(image);
+	RUNAHEAD* runahead = runahead_create(nes, ahead, mode == 1);
+	assert(runahead != NULL && (runahead->shadow != NULL) == (mode == 1));
+	int changes = 0;
+	for (int t = 0; t < count; t++) {
+	    uchar buttons[2] = { held[t] ? NES_BUTTON_A : 0, 0 };
+	    if (t == 0 || held[t] != held[t - 1]) changes = changes + 1;
+	    assert(runahead_frame(runahead, buttons));
+
+	    // A plain console given the same input, and then the current
+	    // input for `ahead` more frames, shows the same frame.
+	    NES* plain = test_make_input_nes(image);
+	    for (int i = 0; i <= t + ahead; i++) {
+		nes_set_buttons(plain, 0, held[i <= t ? i : t] ? NES_BUTTON_A : 0);
+		assert(nes_run_frame(plain));
+		if (i == t) {
+		    // The real console is where it would be without run-ahead.
+		    assert(nes->cpu.cycles == plain->cpu.cycles && nes->ppu.frame == plain->ppu.frame);
+		    assert(cpu_read_memory(&nes->cpu, 0x0003) == cpu_read_memory(&plain->cpu, 0x0003));
+		}
+	    }
+	    memcpy(expected, plain->ppu.framebuffer, sizeof(expected));
+	    nes_destroy(plain);
+	    assert(memcmp(runahead_view(runahead)->framebuffer, expected, sizeof(expected)) == 0);
+	    if (t == 0) memcpy(first, expected, sizeof(first));
+	}
+	// The input did show: the sprite moved.
+	assert(memcmp(first, expected, sizeof(first)) != 0);
+	// A second instance only reloads when the input changes.
+	assert(runahead->states_loaded == (uint64_t)(mode == 1 ? changes : count));
+	runahead_destroy(runahead);
+	nes_destroy(nes);
+    }
+    printf("PASSED: test_runahead_shows_future_frames\n");
+}
+
+static uint32_t test_random(uint32_t* seed)
+{
+    *seed = *seed ^ *seed << 13;
+    *seed = *seed ^ *seed >> 17;
+    *seed = *seed ^ *seed << 5;
+    return *seed;
+}
+
+// Every lane gets the same program but its own registers and zero page, so
+// lanes branch apart; random ASLs also rewrite the program in some lanes.
+static void test_lockstep_setup(CPU* cpu, const uchar* program, size_t length, uint32_t seed)
+{
+    cpu_load(cpu, (uchar*)program, length);
+    cpu_reset(cpu);
+    for (int i = 0; i < 0x100; i++) cpu_write_memory(cpu, (ushort)i, (uchar)test_random(&seed));
+    cpu->reg_a = (uchar)test_random(&seed);
+    cpu->reg_x = (uchar)test_random(&seed);
+    cpu->reg_y = (uchar)test_random(&seed);
+    cpu_set_status(cpu, (uchar)(test_random(&seed) & 0xCB) | 0x20);
+}
+
+static void test_lockstep_matches(LOCKSTEP* lockstep, const uchar* program, size_t length, uint32_t seed, uint64_t budget)
+{
+    for (int lane = 0; lane < lockstep->lanes; lane++) {
+	CPU reference = make_cpu();
+	test_lockstep_setup(&reference, program, length, seed + (uint32_t)lane * 7919);
+	if (budget == 0) cpu_run(&reference); else cpu_run_for_cycles(&reference, budget);
+	CPU* cpu = lockstep_cpu(lockstep, lane);
+	assert(cpu->reg_a == reference.reg_a && cpu->reg_x == reference.reg_x && cpu->reg_y == reference.reg_y);
+	assert(cpu->reg_sp == reference.reg_sp && cpu->status == reference.status && cpu->pc == reference.pc);
+	assert(cpu->cycles == reference.cycles && cpu->halted == reference.halted);
+	assert(memcmp(cpu->memory, reference.memory, MEMORY_SIZE) == 0);
+	cpu_free_memory(&reference);
+    }
+}
+
+void test_lockstep_matches_cpu_run()
+{
+    uchar opcodes[256];
+    int opcode_count = 0;
+    for (int op = 0; op < 256; op++) {
+	if (cpu_get_instruction_set((uchar)op)->handler != NULL) opcodes[opcode_count++] = (uchar)op;
+    }
+
+    // Random programs of every implemented opcode, cut off by a budget.
+    const LOCKSTEP_KERNEL kernels[] = { LOCKSTEP_KERNEL_SCALAR, LOCKSTEP_KERNEL_SSE2, LOCKSTEP_KERNEL_AVX2 };
+    uint32_t seed = 0x1234567;
+    for (int round = 0; round < 200; round++) {
+	uchar program[96];
+	for (size_t i = 0; i < sizeof(program); i++) program[i] = (uchar)test_random(&seed);
+	for (size_t i = 0; i < sizeof(program); i += 3) program[i] = opcodes[test_random(&seed) % opcode_count];
+	uint32_t lane_seed = test_random(&seed);
+	for (int k = 0; k < 3; k++) {
+	    LOCKSTEP* lockstep = lockstep_create(LOCKSTEP_LANES - (round % 4));
+	    assert(lockstep != NULL);
+	    if (!lockstep_set_kernel(lockstep, kernels[k])) {
+		lockstep_destroy(lockstep);
+		continue;
+	    }
+	    for (int lane = 0; lane < lockstep->lanes; lane++) {
+		test_lockstep_setup(lockstep_cpu(lockstep, lane), program, sizeof(program), lane_seed + (uint32_t)lane * 7919);
+	    }
+	    lockstep_run_for_cycles(lockstep, 3000);
+	    test_lockstep_matches(lockstep, program, sizeof(program), lane_seed, 3000);
+	    lockstep_destroy(lockstep);
+	}
+    }
+
+    // A loop whose trip count depends on each lane's zero page: the lanes
+    // split at the BNE and meet again at the BRK.
+    // loop: INX; LDA $00,X; ADC #$03; ASL $20,X; BIT $10; LDA $00,X; BNE loop; BRK
+    uchar loop[] = { 0xE8, 0xB5, 0x00, 0x69, 0x03, 0x16, 0x20, 0x24, 0x10, 0xB5, 0x00, 0xD0, 0xF2, 0x00 };
+    LOCKSTEP* lockstep = lockstep_create(LOCKSTEP_LANES);
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+	test_lockstep_setup(lockstep_cpu(lockstep, lane), loop, sizeof(loop), 99 + (uint32_t)lane * 7919);
+    }
+    lockstep_run(lockstep);
+    test_lockstep_matches(lockstep, loop, sizeof(loop), 99, 0);
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) assert(lockstep_cpu(lockstep, lane)->halted);
+    // Lanes waiting on each other still share most issues.
+    assert(lockstep->executed > lockstep->issued * 2);
+    lockstep_destroy(lockstep);
+    printf("PASSED: test_lockstep_matches_cpu_run\n");
+}
+
+void test_fuzz_oracle_agrees_with_cpu()
+{
+    FUZZER* fuzzer = fuzz_create();
+    assert(fuzzer != NULL);
+
+    // A=$50, P clear; ADC #$50 overflows into the sign bit, then BRK.
+    uchar overflow[] = { 0x50, 0x00, 0x00, 0xFF, 0x00, 0x69, 0x50, 0x00 };
+    assert(fuzz_run(fuzzer, overflow, sizeof(overflow)));
+    assert(fuzzer->cpu.reg_a == 0xA0);
+    assert((fuzzer->cpu.status & FLAG_OVERFLOW) != 0);
+    assert((fuzzer->cpu.status & FLAG_NEGATIVE) != 0);
+    assert(fuzzer->covered > 0 && fuzzer->opcode_hits[0x69] == 1);
+
+    // Resets only clear what the last input wrote.
+    uint64_t seed = 0x9E3779B97F4A7C15ull;
+    uchar input[FUZZ_INPUT_MAX];
+    for (int i = 0; i < 4000; i++) {
+	size_t size = fuzz_generate(&seed, input);
+	if (i & 1) size = fuzz_mutate(&seed, input, size);
+	if (!fuzz_run(fuzzer, input, size)) {
+	    printf("%s at $%04X (%02X): expected %X, got %X\n", fuzzer->failure.check,
+		   fuzzer->failure.pc, fuzzer->failure.opcode, fuzzer->failure.expected, fuzzer->failure.actual);
+	    assert(false);
+	}
+    }
+    assert(fuzzer->executions == 4001);
+    assert(fuzzer->mode_hits[ADDRESS_INDIRECT_Y] > 0 && fuzzer->mode_hits[ADDRESS_RELATIVE] > 0);
+
+    // Inputs run only straight through in between must not leave the
+    // oracle's copy of memory behind for the next stepped one.
+    fuzzer->step_period = 4;
+    uint64_t instructions = fuzzer->instructions;
+    for (int i = 0; i < 4000; i++) {
+	size_t size = fuzz_generate(&seed, input);
+	if (i & 1) size = fuzz_mutate(&seed, input, size);
+	if (!fuzz_run(fuzzer, input, size)) {
+	    printf("%s at $%04X (%02X): expected %X, got %X\n", fuzzer->failure.check,
+		   fuzzer->failure.pc, fuzzer->failure.opcode, fuzzer->failure.expected, fuzzer->failure.actual);
+	    assert(false);
+	}
+	bool stepped = fuzzer->executions % 4 == 0;
+	assert(stepped || fuzzer->instructions == instructions);
+	instructions = fuzzer->instructions;
+    }
+
+    fuzz_destroy(fuzzer);
+    printf("PASSED: test_fuzz_oracle_agrees_with_cpu\n");
+}
+
+void test_conform_parses_and_runs_vectors()
+{
+    // LDA #$80 at $1234; ADC $10 overflowing with carry in; then a case
+    // whose expected A is wrong. Unknown keys are skipped.
+    const char vectors[] =
+	"[\n"
+	" {\"name\": \"a9 80 00\", \"initial\": {\"pc\": 4660, \"s\": 253, \"a\": 1, \"x\": 0, \"y\": 0, \"p\": 38,\n"
+	"   \"ram\": [[4660, 169], [4661, 128]]}, \"final\": {\"pc\": 4662, \"s\": 253, \"a\": 128, \"x\": 0,\n"
+	"   \"y\": 0, \"p\": 164, \"ram\": [[4660, 169], [4661, 128]]}, \"cycles\": [[4660, 169, \"read\"], [4661, 128, \"read\"]]},\n"
+	" {\"name\": \"65 10\", \"note\": {\"x\": [1, {\"y\": \"]\"}]}, \"initial\": {\"pc\": 512, \"s\": 0, \"a\": 127, \"x\": 9,\n"
+	"   \"y\": 9, \"p\": 37, \"ram\": [[512, 101], [513, 16], [16, 0]]}, \"final\": {\"pc\": 514, \"s\": 0, \"a\": 128,\n"
+	"   \"x\": 9, \"y\": 9, \"p\": 228, \"ram\": [[16, 0]]}, \"cycles\": [[512, 101, \"read\"], [513, 16, \"read\"], [16, 0, \"read\"]]},\n"
+	" {\"name\": \"wrong\", \"initial\": {\"pc\": 0, \"s\": 0, \"a\": 0, \"x\": 0, \"y\": 0, \"p\": 0, \"ram\": [[0, 232]]},\n"
+	"   \"final\": {\"pc\": 1, \"s\": 0, \"a\": 5, \"x\": 1, \"y\": 0, \"p\": 0, \"ram\": []}, \"cycles\": [[0, 232, \"read\"], [1, 0, \"read\"]]}\n"
+	"]\n";
+
+    CONFORM_PARSER parser;
+    CONFORM_CASE test;
+    conform_parser_init(&parser, vectors, sizeof(vectors) - 1);
+    assert(conform_next_case(&parser, &test));
+    assert(strcmp(test.name, "a9 80 00") == 0);
+    assert(test.initial.pc == 4660 && test.initial.ram_count == 2 && test.final.a == 128);
+    assert(test.cycle_count == 2 && !test.cycle_write[1]);
+
+    CPU cpu = make_cpu();
+    CONFORM_RESULT result;
+    conform_run_file(&cpu, vectors, sizeof(vectors) - 1, &result);
+    assert(!result.parse_error);
+    assert(result.cases == 3 && result.passed == 2);
+    assert(strcmp(result.first_failure, "wrong") == 0 && strcmp(result.first_check, "a") == 0);
+
+    // A truncated file stops with an error rather than a short count.
+    conform_run_file(&cpu, vectors, sizeof(vectors) / 2, &result);
+    assert(result.parse_error && result.cases == 1);
+
+    cpu_free_memory(&cpu);
+    printf("PASSED: test_conform_parses_and_runs_vectors\n");
+}
+
+void test_statehash_tracks_pages_and_finds_divergence()
+{
+    // Every kernel hashes a page the same way.
+    uchar page[BUS_PAGE_SIZE];
+    uint64_t seed = 0x2545F4914F6CDD1Dull;
+    for (int i = 0; i < BUS_PAGE_SIZE; i++) {
+	seed = seed ^ seed << 13;
+	seed = seed ^ seed >> 7;
+	seed = seed ^ seed << 17;
+	page[i] = (uchar)seed;
+    }
+    STATEHASH kernels;
+    statehash_init(&kernels);
+    for (STATEHASH_KERNEL kernel = STATEHASH_KERNEL_AUTO; kernel <= STATEHASH_KERNEL_AVX2; kernel++) {
+	if (!statehash_set_kernel(&kernels, kernel)) continue;
+	assert(kernels.page_hash(page) == statehash_page(page));
+    }
+    uint64_t before = statehash_page(page);
+    page[200] = page[200] ^ 1;
+    assert(statehash_page(page) != before);
+
+    // loop: INX; ASL $10; PHA; PLA; JMP loop
+    uchar program[] = { 0xE8, 0x06, 0x10, 0x48, 0x68, 0x4C, 0x00, 0x80 };
+    CPU a = make_cpu();
+    CPU b = make_cpu();
+    CPU* cpus[2] = { &a, &b };
+    for (int i = 0; i < 2; i++) {
+	cpu_load(cpus[i], program, sizeof(program));
+	cpu_reset(cpus[i]);
+	cpu_write_memory(cpus[i], 0x0010, 0x81);
+    }
+
+    STATEHASH_CHECKER checker;
+    statehash_checker_init(&checker);
+    for (int frame = 0; frame < 20; frame++) {
+	if (frame == 12) cpu_write_memory(&b, 0x0345, 0x01);
+	cpu_run_for_cycles(&a, 1000);
+	cpu_run_for_cycles(&b, 1000);
+	bool same = statehash_check(&checker, &a, &b);
+	assert(same == (frame < 12));
+	// Only the zero page and the stack change from frame to frame.
+	if (frame > 0 && frame != 12) assert(checker.a.pages_hashed == 2);
+	for (int p = 0; p < BUS_PAGE_COUNT; p++) assert(checker.a.pages[p] == statehash_page(a.memory + p * BUS_PAGE_SIZE));
+    }
+    assert(checker.diverged && checker.diverged_frame == 12 && checker.diverged_page == 3);
+
+    // Registers alone count too.
+    statehash_checker_init(&checker);
+    b.memory[0x0345] = 0;
+    bus_mark_unhashed(&b.bus, NULL);
+    b.reg_y = a.reg_y ^ 1;
+    assert(!statehash_check(&checker, &a, &b) && checker.diverged_page == BUS_PAGE_COUNT);
+
+    cpu_free_memory(&a);
+    cpu_free_memory(&b);
+    printf("PASSED: test_statehash_tracks_pages_and_finds_divergence\n");
+}
+
+#if CPU_CDL
+void test_cdl_logs_code_and_cfg_finds_blocks()
+{
+    // LDA #1; ASL $8006 (doubles the next operand); LDA #8; JSR $8010;
+    // JMP ($9000), through a table of $8020 and $8030 of which only the
+    // first is taken. $8010: AND #$0F; BEQ over LDA #$FF; RTS.
+    // $8020: INX; JMP $8100. $8030: INY; BRK. $8100: INY; BRK.
+    static uchar program[0x1004];
+    static const uchar main_code[] = {0xA9, 0x01, 0x0E, 0x06, 0x80, 0xA9, 0x08, 0x20, 0x10, 0x80, 0x6C, 0x00, 0x90, 0x00};
+    static const uchar subroutine[] = {0x29, 0x0F, 0xF0, 0x02, 0xA9, 0xFF, 0x60};
+    memcpy(program, main_code, sizeof(main_code));
+    memcpy(program + 0x10, subroutine, sizeof(subroutine));
+    memcpy(program + 0x20, (uchar[]){0xE8, 0x4C, 0x00, 0x81}, 4);
+    memcpy(program + 0x30, (uchar[]){0xC8, 0x00}, 2);
+    memcpy(program + 0x100, (uchar[]){0xC8, 0x00}, 2);
+    memcpy(program + 0x1000, (uchar[]){0x20, 0x80, 0x30, 0x80}, 4);
+
+    // The plain interpreter and the block cache log the same bytes.
+    CDL* logs[2];
+    for (int run = 0; run < 2; run++) {
+	CPU cpu = make_cpu();
+	if (run == 1) cpu.blocks = block_cache_create();
+	cpu_load(&cpu, program, sizeof(program));
+	cpu_reset(&cpu);
+	logs[run] = cdl_create();
+	cpu.cdl = logs[run];
+	cpu_run(&cpu);
+	assert(cpu.reg_a == 0x00 && cpu.reg_x == 1 && cpu.reg_y == 1);
+	if (cpu.blocks != NULL) block_cache_destroy(cpu.blocks);
+	cpu_free_memory(&cpu);
+    }
+    assert(memcmp(logs[0]->bits, logs[1]->bits, sizeof(logs[0]->bits)) == 0);
+    CDL* cdl = logs[0];
+    assert(cdl_count(cdl, CDL_OPCODE) == 12 && cdl_count(cdl, CDL_OPERAND) == 12);
+    assert(cdl_test(cdl, CDL_OPCODE, 0x8005) && !cdl_test(cdl, CDL_OPCODE, 0x8014) && cdl_test(cdl, CDL_OPCODE, 0x8101));
+    assert(cdl_test(cdl, CDL_OPERAND, 0x800C) && !cdl_test(cdl, CDL_OPERAND, 0x8005));
+    assert(cdl_test(cdl, CDL_READ, 0x9000) && cdl_test(cdl, CDL_READ, 0x9001) && !cdl_test(cdl, CDL_READ, 0x9002));
+    // Only immediate operands read as data; addresses and branch offsets do not.
+    assert(cdl_test(cdl, CDL_READ, 0x8001) && !cdl_test(cdl, CDL_READ, 0x8003) && !cdl_test(cdl, CDL_READ, 0x8004));
+    assert(!cdl_test(cdl, CDL_READ, 0x8008) && !cdl_test(cdl, CDL_READ, 0x8013) && !cdl_test(cdl, CDL_READ, 0x8022));
+    assert(cdl_test(cdl, CDL_WRITE, 0x8006) && !cdl_test(cdl, CDL_WRITE, 0x8005));
+
+    const char* path = "/tmp/quick_nes_test.cdl";
+    CDL* loaded = cdl_create();
+    assert(cdl_save(cdl, path) && cdl_load(loaded, path));
+    assert(memcmp(loaded->bits, cdl->bits, sizeof(cdl->bits)) == 0);
+    remove(path);
+    cdl_destroy(loaded);
+    cdl_destroy(logs[1]);
+
+    // The analyzer sees the patched program, as it is left in memory.
+    CPU cpu = make_cpu();
+    cpu_load(&cpu, program, sizeof(program));
+    cpu_write_memory(&cpu, 0x8006, 0x10);
+    CFG* cfg = cfg_analyze(&cpu, cdl);
+    assert(cfg != NULL && cfg->block_count == 8);
+    const CFG_BLOCK* block = cfg_find_block(cfg, 0x8006);
+    assert(block->start == 0x8000 && block->instructions == 4 && block->end == CFG_END_CALL && block->modified);
+    assert(block->successors[0] == 0x8010 && block->successors[1] == 0x800A);
+    block = cfg_find_block(cfg, 0x8012);
+    assert(block->end == CFG_END_BRANCH && block->successors[0] == 0x8016 && block->successors[1] == 0x8014);
+    block = cfg_find_block(cfg, 0x8014);
+    assert(block->start == 0x8014 && block->end == CFG_END_FALLTHROUGH && !block->executed);
+    assert(cfg_find_block(cfg, 0x800A)->end == CFG_END_INDIRECT);
+    assert(cfg_find_block(cfg, 0x800D) == NULL);
+
+    // The second table entry was never taken, but its target is code.
+    assert(cfg->table_count == 1 && cfg->tables[0].addr == 0x9000 && cfg->tables[0].entries == 2 && !cfg->tables[0].rts);
+    block = cfg_find_block(cfg, 0x8030);
+    assert(block != NULL && !block->executed && block->end == CFG_END_STOP);
+
+    assert(cfg->modified_count == 1 && cfg->modified[0].start == 0x8006 && cfg->modified[0].length == 1);
+    assert(!cfg_is_safe(cfg, 0x8010) && cfg_is_safe(cfg, 0x8100) && !cfg_is_safe(cfg, 0x9000));
+    cfg_destroy(cfg);
+
+    // Without a log only the reset vector is followed: the indirect jump
+    // ends the walk, and a writable page is never safe.
+    cfg = cfg_analyze(&cpu, NULL);
+    assert(cfg->block_count == 5 && cfg->table_count == 0 && cfg_find_block(cfg, 0x8020) == NULL);
+    assert(!cfg_is_safe(cfg, 0x8000));
+    cfg_destroy(cfg);
+    cdl_destroy(cdl);
+    cpu_free_memory(&cpu);
+    printf("PASSED: test_cdl_logs_code_and_cfg_finds_blocks\n");
+}
+#endif
+
 void test_all()
 {
     test_0xa9_lda_immediate_load_data();
@@ -128,6 +1666,45 @@ void test_all()
     test_0x69_adc_immediate_carry_through();
 	test_0x0a_asl_accumulator();
 	test_0x0a_asl_accumulator_carry();
+    test_0x65_adc_zeropage();
+    test_0x4c_0x6c_jmp();
+    test_cycles_page_cross_and_branch();
+    test_bus_mirrors_and_io();
+    test_block_cache_matches_interpreter();
+    test_block_cache_self_modifying_code();
+    test_block_cache_code_patched_through_mirror();
+    test_lazy_flags_status_is_exact();
+#if CPU_TRACE
+    test_tracer_nestest_export();
+#endif
+#if CPU_PROFILE
+    test_profiler_counts_and_collapsed_stacks();
+#endif
+    test_rom_open_ines_and_nes2();
+    test_mapper_mmc1_and_uxrom_bank_switching();
+    test_mapper_mmc3_banks_and_irq();
+    test_ppu_renders_background_and_sprites();
+    test_ppu_decoders_agree();
+    test_ppu_background_cache_follows_writes();
+    test_apu_length_counters_and_frame_irq();
+    test_apu_streams_pulse_to_wav();
+    test_scheduler_orders_reschedules_and_cancels();
+    test_nes_nmi_and_apu_irq();
+    test_idle_skip_matches_full_run();
+    test_pool_runs_every_task_once();
+    test_cpu_arena_recycles_dirty_pages();
+    test_cpu_image_copy_on_write();
+    test_savestate_incremental_and_serialized();
+    test_nes_savestate_replays_identically();
+    test_rewind_steps_back_frame_by_frame();
+    test_runahead_shows_future_frames();
+    test_lockstep_matches_cpu_run();
+    test_fuzz_oracle_agrees_with_cpu();
+    test_conform_parses_and_runs_vectors();
+    test_statehash_tracks_pages_and_finds_divergence();
+#if CPU_CDL
+    test_cdl_logs_code_and_cfg_finds_blocks();
+#endif
 }
 
 
@@ -21,6 +21,72 @@ void test_0x0a_asl_accumulator();
 
 void test_0x0a_asl_accumulator_carry();
 
+void test_0x65_adc_zeropage();
+
+void test_0x4c_0x6c_jmp();
+
+void test_cycles_page_cross_and_branch();
+
+void test_bus_mirrors_and_io();
+
+void test_block_cache_matches_interpreter();
+
+void test_block_cache_self_modifying_code();
+
+void test_block_cache_code_patched_through_mirror();
+
+void test_lazy_flags_status_is_exact();
+
+void test_tracer_nestest_export();
+
+void test_profiler_counts_and_collapsed_stacks();
+
+void test_rom_open_ines_and_nes2();
+
+void test_mapper_mmc1_and_uxrom_bank_switching();
+
+void test_mapper_mmc3_banks_and_irq();
+
+void test_ppu_renders_background_and_sprites();
+
+void test_ppu_decoders_agree();
+
+void test_ppu_background_cache_follows_writes();
+
+void test_apu_length_counters_and_frame_irq();
+
+void test_apu_streams_pulse_to_wav();
+
+void test_scheduler_orders_reschedules_and_cancels();
+
+void test_nes_nmi_and_apu_irq();
+
+void test_idle_skip_matches_full_run();
+
+void test_pool_runs_every_task_once();
+
+void test_cpu_arena_recycles_dirty_pages();
+
+void test_cpu_image_copy_on_write();
+
+void test_savestate_incremental_and_serialized();
+
+void test_nes_savestate_replays_identically();
+
+void test_rewind_steps_back_frame_by_frame();
+
+void test_runahead_shows_future_frames();
+
+void test_lockstep_matches_cpu_run();
+
+void test_fuzz_oracle_agrees_with_cpu();
+
+void test_conform_parses_and_runs_vectors();
+
+void test_statehash_tracks_pages_and_finds_divergence();
+
+void test_cdl_logs_code_and_cfg_finds_blocks();
+
 void test_all();
 
 #endif // TESTS_H_
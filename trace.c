@@ -0,0 +1,205 @@
+#include "trace.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+_Static_assert(sizeof(TRACE_RECORD) == 24, "trace records are written to disk as is");
+_Static_assert(sizeof(TRACE_FILE_HEADER) == 32, "trace header is written to disk as is");
+
+static uint64_t trace_round_capacity(uint64_t capacity)
+{
+    uint64_t rounded = 1;
+    while (rounded < capacity) rounded = rounded << 1;
+    return rounded;
+}
+
+static TRACE_FILE_HEADER trace_make_header(uint64_t capacity, uint64_t head)
+{
+    TRACE_FILE_HEADER header = {
+	.version = TRACE_VERSION,
+	.record_size = sizeof(TRACE_RECORD),
+	.capacity = capacity,
+	.head = head
+    };
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    return header;
+}
+
+TRACER* tracer_create(uint64_t capacity)
+{
+    TRACER* tracer = malloc(sizeof(TRACER));
+    if (tracer == NULL) return NULL;
+    *tracer = (TRACER){ .capacity = trace_round_capacity(capacity), .active = true, .fd = -1 };
+    tracer->records = malloc(tracer->capacity * sizeof(TRACE_RECORD));
+    if (tracer->records == NULL) {
+	free(tracer);
+	return NULL;
+    }
+    return tracer;
+}
+
+TRACER* tracer_open_file(const char* path, uint64_t capacity)
+{
+    TRACER* tracer = malloc(sizeof(TRACER));
+    if (tracer == NULL) return NULL;
+    *tracer = (TRACER){ .capacity = trace_round_capacity(capacity), .active = true, .fd = -1 };
+    tracer->map_size = sizeof(TRACE_FILE_HEADER) + tracer->capacity * sizeof(TRACE_RECORD);
+
+    tracer->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (tracer->fd < 0 || ftruncate(tracer->fd, (off_t)tracer->map_size) != 0) goto fail;
+    void* map = mmap(NULL, tracer->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, tracer->fd, 0);
+    if (map == MAP_FAILED) goto fail;
+
+    tracer->header = map;
+    *tracer->header = trace_make_header(tracer->capacity, 0);
+    tracer->records = (TRACE_RECORD*)(tracer->header + 1);
+    return tracer;
+
+fail:
+    if (tracer->fd >= 0) close(tracer->fd);
+    free(tracer);
+    return NULL;
+}
+
+void tracer_flush(TRACER* tracer)
+{
+    if (tracer->header == NULL) return;
+    tracer->header->head = tracer->head;
+    msync(tracer->header, tracer->map_size, MS_ASYNC);
+}
+
+void tracer_destroy(TRACER* tracer)
+{
+    if (tracer == NULL) return;
+    if (tracer->header != NULL) {
+	tracer->header->head = tracer->head;
+	munmap(tracer->header, tracer->map_size);
+	close(tracer->fd);
+    } else {
+	free(tracer->records);
+    }
+    free(tracer);
+}
+
+bool tracer_save(TRACER* tracer, const char* path)
+{
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) return false;
+    TRACE_FILE_HEADER header = trace_make_header(tracer->capacity, tracer->head);
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+	&& fwrite(tracer->records, sizeof(TRACE_RECORD), tracer->capacity, file) == tracer->capacity;
+    return fclose(file) == 0 && ok;
+}
+
+void tracer_record(TRACER* tracer, CPU* cpu)
+{
+    if (!tracer->active) return;
+
+    TRACE_RECORD* record = &tracer->records[tracer->head & (tracer->capacity - 1)];
+    tracer->head = tracer->head + 1;
+
+    uchar op_code = cpu_peek_memory(cpu, cpu->pc);
+    const INSTRUCTION_SET* instruction_set = cpu_get_instruction_set(op_code);
+    uchar length = instruction_set->handler == NULL ? 1 : instruction_set->bytes;
+
+    record->cycles = cpu->cycles;
+    record->pc = cpu->pc;
+    record->bytes[0] = op_code;
+    record->bytes[1] = length > 1 ? cpu_peek_memory(cpu, cpu->pc + 1) : 0;
+    record->bytes[2] = length > 2 ? cpu_peek_memory(cpu, cpu->pc + 2) : 0;
+    record->length = length;
+    record->reg_a = cpu->reg_a;
+    record->reg_x = cpu->reg_x;
+    record->reg_y = cpu->reg_y;
+    record->status = cpu_get_status(cpu);
+    record->reg_sp = cpu->reg_sp;
+}
+
+static void trace_format_operand(const TRACE_RECORD* record, ADDRESS_MODE mode, char* out, size_t size)
+{
+    ushort word = (ushort)(record->bytes[1] | (record->bytes[2] << 8));
+    switch (mode) {
+    case ADDRESS_ACCUMULATOR: snprintf(out, size, "A"); break;
+    case ADDRESS_IMMEDIATE: snprintf(out, size, "#$%02X", record->bytes[1]); break;
+    case ADDRESS_ZEROPAGE: snprintf(out, size, "$%02X", record->bytes[1]); break;
+    case ADDRESS_ZEROPAGE_X: snprintf(out, size, "$%02X,X", record->bytes[1]); break;
+    case ADDRESS_ZEROPAGE_Y: snprintf(out, size, "$%02X,Y", record->bytes[1]); break;
+    case ADDRESS_ABSOLUTE: {
+	// JMP indirect is decoded as absolute; its handler reads the pointer.
+	snprintf(out, size, record->bytes[0] == 0x6C ? "($%04X)" : "$%04X", word);
+    } break;
+    case ADDRESS_ABSOLUTE_X: snprintf(out, size, "$%04X,X", word); break;
+    case ADDRESS_ABSOLUTE_Y: snprintf(out, size, "$%04X,Y", word); break;
+    case ADDRESS_INDIRECT_X: snprintf(out, size, "($%02X,X)", record->bytes[1]); break;
+    case ADDRESS_INDIRECT_Y: snprintf(out, size, "($%02X),Y", record->bytes[1]); break;
+    case ADDRESS_RELATIVE: {
+	ushort target = (ushort)(record->pc + 2 + (signed char)record->bytes[1]);
+	snprintf(out, size, "$%04X", target);
+    } break;
+    default: out[0] = '\0'; break;
+    }
+}
+
+void trace_format_record(const TRACE_RECORD* record, char* line, size_t size, bool with_ppu)
+{
+    const INSTRUCTION_SET* instruction_set = cpu_get_instruction_set(record->bytes[0]);
+    char hex[9] = "";
+    char operand[16] = "";
+    char disassembly[40];
+    char ppu[24] = "";
+
+    int hex_length = 0;
+    for (int i = 0; i < record->length && i < 3; i++) {
+	hex_length += snprintf(hex + hex_length, sizeof(hex) - (size_t)hex_length, i == 0 ? "%02X" : " %02X", record->bytes[i]);
+    }
+    trace_format_operand(record, instruction_set->mode, operand, sizeof(operand));
+    if (instruction_set->name != NULL) {
+	snprintf(disassembly, sizeof(disassembly), "%s%s%s", instruction_set->name, operand[0] ? " " : "", operand);
+    } else {
+	snprintf(disassembly, sizeof(disassembly), ".DB $%02X", record->bytes[0]);
+    }
+    if (with_ppu) {
+	// The PPU runs three dots per CPU cycle, 341 dots per scanline and
+	// 262 scanlines per frame from power on.
+	uint64_t dots = record->cycles * 3;
+	snprintf(ppu, sizeof(ppu), "PPU:%3u,%3u ", (unsigned)((dots / 341) % 262), (unsigned)(dots % 341));
+    }
+
+    snprintf(line, size, "%04X  %-8s  %-32sA:%02X X:%02X Y:%02X P:%02X SP:%02X %sCYC:%llu",
+	     record->pc, hex, disassembly, record->reg_a, record->reg_x, record->reg_y,
+	     record->status, record->reg_sp, ppu, (unsigned long long)record->cycles);
+}
+
+bool trace_export_log(const char* path, FILE* out, bool with_ppu)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size < (off_t)sizeof(TRACE_FILE_HEADER)) {
+	close(fd);
+	return false;
+    }
+    void* map = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    const TRACE_FILE_HEADER* header = map;
+    const TRACE_RECORD* records = (const TRACE_RECORD*)(header + 1);
+    bool ok = memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) == 0
+	&& header->record_size == sizeof(TRACE_RECORD)
+	&& header->capacity != 0
+	&& (header->capacity & (header->capacity - 1)) == 0
+	&& sizeof(TRACE_FILE_HEADER) + header->capacity * sizeof(TRACE_RECORD) <= (uint64_t)size;
+
+    if (ok) {
+	uint64_t first = header->head > header->capacity ? header->head - header->capacity : 0;
+	char line[128];
+	for (uint64_t i = first; i < header->head; i++) {
+	    trace_format_record(&records[i & (header->capacity - 1)], line, sizeof(line), with_ppu);
+	    fprintf(out, "%s\n", line);
+	}
+    }
+    munmap(map, (size_t)size);
+    return ok;
+}
@@ -0,0 +1,67 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include "cpu.h"
+#include <stdio.h>
+
+#define TRACE_MAGIC "QNTRACE1"
+#define TRACE_VERSION 1
+
+// CPU state right before an instruction executes, as nestest logs it.
+typedef struct TRACE_RECORD {
+    uint64_t cycles;
+    ushort pc;
+    uchar bytes[3];
+    uchar length;
+    uchar reg_a;
+    uchar reg_x;
+    uchar reg_y;
+    uchar status;
+    uchar reg_sp;
+    uchar reserved[3];
+} TRACE_RECORD;
+
+// Trace files are this header followed by `capacity` records used as a
+// ring: record i lives at index i % capacity, so when head > capacity the
+// oldest kept record is head - capacity.
+typedef struct TRACE_FILE_HEADER {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;
+    uint64_t head;
+} TRACE_FILE_HEADER;
+
+typedef struct TRACER {
+    TRACE_RECORD* records;
+    uint64_t capacity;           // power of two
+    uint64_t head;               // records written so far
+    bool active;                 // recording can be paused without detaching
+    TRACE_FILE_HEADER* header;   // set when the ring lives in an mmap'd file
+    size_t map_size;
+    int fd;
+} TRACER;
+
+// Ring buffer in memory. capacity is rounded up to a power of two.
+TRACER* tracer_create(uint64_t capacity);
+
+// Ring buffer inside an mmap'd trace file, written back by the kernel.
+TRACER* tracer_open_file(const char* path, uint64_t capacity);
+
+void tracer_flush(TRACER* tracer);
+
+void tracer_destroy(TRACER* tracer);
+
+// Writes an in-memory ring out in the trace file format.
+bool tracer_save(TRACER* tracer, const char* path);
+
+void tracer_record(TRACER* tracer, CPU* cpu);
+
+// Converts a trace file to nestest.log style text. The PPU column is
+// derived from the cycle count; "= value" memory annotations are not
+// recorded and are left out.
+bool trace_export_log(const char* path, FILE* out, bool with_ppu);
+
+void trace_format_record(const TRACE_RECORD* record, char* line, size_t size, bool with_ppu);
+
+#endif // TRACE_H_
@@ -0,0 +1,28 @@
+#include "trace.h"
+#include <string.h>
+
+int main(int argc, char** argv)
+{
+    bool with_ppu = true;
+    const char* path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+	if (strcmp(argv[i], "--no-ppu") == 0) {
+	    with_ppu = false;
+	} else if (path == NULL) {
+	    path = argv[i];
+	} else {
+	    path = NULL;
+	    break;
+	}
+    }
+    if (path == NULL) {
+	fprintf(stderr, "usage: quick_nes_trace2log [--no-ppu] TRACE_FILE > trace.log\n");
+	return 2;
+    }
+    if (!trace_export_log(path, stdout, with_ppu)) {
+	fprintf(stderr, "ERROR: %s is not a readable trace file\n", path);
+	return 1;
+    }
+    return 0;
+}